@@ -0,0 +1,128 @@
+#include <thingsboard.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mock_http.h"
+
+#define BENCH_HOST      "127.0.0.1"
+#define BENCH_PORT      18082
+#define BENCH_TOKEN     "BENCHMARK_TOKEN"
+#define BENCH_THRESHOLD 1024
+
+static double now_sec(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A single live sample, too small to be worth compressing
+static char* shape_sample(int seed)
+{
+    char* buf = malloc(256);
+    snprintf(buf, 256, "{\"temperature\":%.1f,\"humidity\":%.1f,\"pressure\":%d,\"battery\":%d,\"rssi\":%d,\"door\":%s}",
+             20 + seed % 70 / 10.0, 40 + seed % 30 / 10.0, 1000 + seed % 25, 80 + seed % 20, -60 - seed % 30, seed % 2 ? "true" : "false");
+    return buf;
+}
+
+// Historical upload: a batch of timestamped samples with the same keys and slowly changing values
+static char* shape_history(int seed)
+{
+    size_t cap = 64 * 1024;
+    char* buf = malloc(cap);
+    size_t len = 0;
+    long long ts = 1700000000000LL + seed * 60000LL;
+
+    buf[len++] = '[';
+    for (int i = 0; i < 200; i++){
+        len += snprintf(buf + len, cap - len, "%s{\"ts\":%lld,\"values\":{\"temperature\":%.2f,\"humidity\":%.2f,\"pressure\":%d,\"battery\":%d}}",
+                        i ? "," : "", ts + i * 1000LL, 21.5 + (i % 13) * 0.07, 45.0 + (i % 7) * 0.11, 1013 - i % 3, 97 - i / 50);
+    }
+    buf[len++] = ']';
+    buf[len] = '\0';
+
+    return buf;
+}
+
+// One reading of many sensors, the keys repeat in every message but not inside one
+static char* shape_wide(int seed)
+{
+    size_t cap = 16 * 1024;
+    char* buf = malloc(cap);
+    size_t len = 0;
+
+    buf[len++] = '{';
+    for (int i = 0; i < 150; i++)
+        len += snprintf(buf + len, cap - len, "%s\"sensor_%03d_value\":%.3f", i ? "," : "", i, (seed * 31 + i * 17) % 1000 / 7.0);
+    buf[len++] = '}';
+    buf[len] = '\0';
+
+    return buf;
+}
+
+static void run(const char* shape, char* (*make)(int), const char* mode, int level, int messages)
+{
+    char** payloads = malloc(messages * sizeof(char*));
+    long raw = 0;
+    for (int i = 0; i < messages; i++){
+        payloads[i] = make(i);
+        raw += strlen(payloads[i]);
+    }
+
+    thingsboard_ctx* ctx = thingsboard_init(USE_HTTP);
+    thingsboard_connect(ctx, BENCH_HOST, BENCH_PORT, BENCH_TOKEN);
+    if (level > 0) thingsboard_compression_set(ctx, BENCH_THRESHOLD, level);
+
+    long wire = mock_http_bytes();
+    double cpu = now_sec(CLOCK_THREAD_CPUTIME_ID);
+    double wall = now_sec(CLOCK_MONOTONIC);
+    for (int i = 0; i < messages; i++){
+        if (thingsboard_telemetry_send(ctx, payloads[i], NULL) != THINGSBOARD_SUCCESS){
+            fprintf(stderr, "%s/%s: send %d failed\n", shape, mode, i);
+            break;
+        }
+    }
+    wall = now_sec(CLOCK_MONOTONIC) - wall;
+    cpu = now_sec(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    wire = mock_http_bytes() - wire;
+
+    thingsboard_disconnect(ctx);
+    thingsboard_cleanup(ctx);
+
+    double mb = raw / 1e6;
+    printf("%-8s %-6s %7ld B/msg  %7ld B/msg on wire  %6.1f%%  %8.1f ms CPU/MB  %8.0f msgs/sec\n",
+           shape, mode, raw / messages, wire / messages, 100.0 * wire / raw, cpu * 1000 / mb, messages / wall);
+
+    for (int i = 0; i < messages; i++) free(payloads[i]);
+    free(payloads);
+}
+
+int main(int argc, char** argv)
+{
+    int messages = argc > 1 ? atoi(argv[1]) : 2000;
+
+    if (mock_http_start(BENCH_PORT) != 0){
+        fprintf(stderr, "Failed to start the HTTP stand-in on port %d\n", BENCH_PORT);
+        return 1;
+    }
+
+    // Bytes on wire count the request headers too, which is what a metered link bills
+    const struct { const char* name; char* (*make)(int); } shapes[] = {
+        { "sample", shape_sample },
+        { "history", shape_history },
+        { "wide", shape_wide },
+    };
+    const struct { const char* name; int level; } modes[] = {
+        { "off", 0 }, { "gzip1", 1 }, { "gzip6", 6 }, { "gzip9", 9 },
+    };
+
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++)
+        for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+            run(shapes[s].name, shapes[s].make, modes[m].name, modes[m].level, messages);
+
+    mock_http_stop();
+
+    return 0;
+}
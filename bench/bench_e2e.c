@@ -0,0 +1,307 @@
+#include <thingsboard.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mock_http.h"
+#include "mock_mqtt.h"
+
+#define BENCH_HOST      "127.0.0.1"
+#define BENCH_HTTP_PORT 18082
+#define BENCH_MQTT_PORT 11883
+#define BENCH_TOKEN     "BENCHMARK_TOKEN"
+#define BENCH_DATA      "{\"temperature\":50,\"humidity\":40}"
+#define BENCH_KEYS      "{\"clientKeys\":\"mode\",\"sharedKeys\":\"fw\"}"
+// How long a single exchange may take before it counts as failed
+#define BENCH_TIMEOUT_MS 5000
+
+// Latencies of one measured operation
+struct bench_series {
+    long long* ns;
+    long count;
+    long failed;
+    double elapsed;
+};
+
+// Completion of the one asynchronous operation in flight
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static int done;
+static int done_ok;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void complete(int ok)
+{
+    pthread_mutex_lock(&done_lock);
+    done = 1;
+    done_ok = ok;
+    pthread_cond_signal(&done_cond);
+    pthread_mutex_unlock(&done_lock);
+}
+
+static void arm(void)
+{
+    pthread_mutex_lock(&done_lock);
+    done = 0;
+    pthread_mutex_unlock(&done_lock);
+}
+
+// Returns 1 when the operation completed successfully in time
+static int wait_done(void)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += BENCH_TIMEOUT_MS / 1000;
+
+    pthread_mutex_lock(&done_lock);
+    while (!done && pthread_cond_timedwait(&done_cond, &done_lock, &deadline) == 0);
+    int ok = done && done_ok;
+    pthread_mutex_unlock(&done_lock);
+
+    return ok;
+}
+
+static void on_sent(thingsboard_ctx* ctx, thingsboard_code code)
+{
+    complete(code == THINGSBOARD_SUCCESS);
+}
+
+static void on_response(thingsboard_ctx* ctx, char* json)
+{
+    complete(json != NULL);
+}
+
+static int cmp_ns(const void* a, const void* b)
+{
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+static long long percentile(struct bench_series* series, int pct)
+{
+    if (series->count == 0) return 0;
+
+    long i = (series->count * pct + 99) / 100 - 1;
+    return series->ns[i < 0 ? 0 : i];
+}
+
+// Writes the series as a JSON object member, latencies in microseconds
+static void report(const char* name, struct bench_series* series, int last)
+{
+    qsort(series->ns, series->count, sizeof(long long), cmp_ns);
+
+    long long total = 0;
+    for (long i = 0; i < series->count; i++) total += series->ns[i];
+
+    printf("\"%s\":{\"count\":%ld,\"failed\":%ld,\"per_sec\":%.0f,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}%s",
+           name, series->count, series->failed,
+           series->elapsed > 0 ? series->count / series->elapsed : 0,
+           series->count ? total / 1e3 / series->count : 0,
+           percentile(series, 50) / 1e3, percentile(series, 99) / 1e3,
+           series->count ? series->ns[series->count - 1] / 1e3 : 0,
+           last ? "" : ",");
+}
+
+static void series_init(struct bench_series* series, long n)
+{
+    series->ns = (long long*)calloc(n, sizeof(long long));
+    series->count = 0;
+    series->failed = 0;
+    series->elapsed = 0;
+}
+
+static void series_add(struct bench_series* series, long long start, int ok)
+{
+    if (ok) series->ns[series->count++] = now_ns() - start;
+    else series->failed++;
+}
+
+static long rss_bytes(void)
+{
+    long pages = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) return 0;
+    long size;
+    if (fscanf(statm, "%ld %ld", &size, &pages) != 2) pages = 0;
+    fclose(statm);
+
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+// MQTT connects in the background, the benchmark starts once the CONNACK is in
+static int wait_connected(thingsboard_ctx* ctx)
+{
+    for (int i = 0; i < BENCH_TIMEOUT_MS; i++){
+        if (thingsboard_state_get(ctx) == THINGSBOARD_CONNECTED) return 0;
+        usleep(1000);
+    }
+
+    return -1;
+}
+
+static thingsboard_ctx* open_ctx(DC_API api)
+{
+    thingsboard_ctx* ctx = thingsboard_init(api);
+    if (ctx == NULL) return NULL;
+
+    int port = api == USE_MQTT ? BENCH_MQTT_PORT : BENCH_HTTP_PORT;
+    if (thingsboard_connect(ctx, BENCH_HOST, port, BENCH_TOKEN) != THINGSBOARD_SUCCESS || wait_connected(ctx) != 0){
+        thingsboard_cleanup(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+static void close_ctx(thingsboard_ctx* ctx)
+{
+    thingsboard_disconnect(ctx);
+    thingsboard_cleanup(ctx);
+}
+
+// Each synchronous send is timed on its own, the whole run gives the rate
+static void bench_telemetry(thingsboard_ctx* ctx, struct bench_series* series, long messages)
+{
+    long long begin = now_ns();
+    for (long i = 0; i < messages; i++){
+        long long start = now_ns();
+        series_add(series, start, thingsboard_telemetry_send(ctx, BENCH_DATA, NULL) == THINGSBOARD_SUCCESS);
+    }
+    series->elapsed = (now_ns() - begin) / 1e9;
+}
+
+// One message at a time, timed until the transport reports it delivered
+static void bench_telemetry_acked(thingsboard_ctx* ctx, struct bench_series* series, long messages)
+{
+    long long begin = now_ns();
+    for (long i = 0; i < messages; i++){
+        arm();
+        long long start = now_ns();
+        thingsboard_code res = thingsboard_telemetry_send_async(ctx, BENCH_DATA, NULL, on_sent);
+        series_add(series, start, (res == THINGSBOARD_SUCCESS || res == THINGSBOARD_BUSY) && wait_done());
+    }
+    series->elapsed = (now_ns() - begin) / 1e9;
+}
+
+static void bench_attributes(thingsboard_ctx* ctx, struct bench_series* series, long requests)
+{
+    long long begin = now_ns();
+    for (long i = 0; i < requests; i++){
+        arm();
+        long long start = now_ns();
+        thingsboard_code res = thingsboard_attributes_request(ctx, (int)i + 1, BENCH_KEYS, on_response);
+        series_add(series, start, res == THINGSBOARD_SUCCESS && wait_done());
+    }
+    series->elapsed = (now_ns() - begin) / 1e9;
+}
+
+static void bench_rpc(thingsboard_ctx* ctx, struct bench_series* series, long requests)
+{
+    long long begin = now_ns();
+    for (long i = 0; i < requests; i++){
+        arm();
+        long long start = now_ns();
+        thingsboard_code res = thingsboard_rpc_send(ctx, (int)i + 1, "ping", "{}", on_response);
+        series_add(series, start, res == THINGSBOARD_SUCCESS && wait_done());
+    }
+    series->elapsed = (now_ns() - begin) / 1e9;
+}
+
+// Resident memory added by contexts that are connected and idle
+static long bench_memory(DC_API api, int contexts)
+{
+    thingsboard_ctx** ctxs = (thingsboard_ctx**)calloc(contexts, sizeof(thingsboard_ctx*));
+    if (ctxs == NULL) return -1;
+
+    long before = rss_bytes();
+    int opened = 0;
+    for (; opened < contexts; opened++){
+        ctxs[opened] = open_ctx(api);
+        if (ctxs[opened] == NULL) break;
+    }
+    long after = rss_bytes();
+
+    for (int i = 0; i < opened; i++) close_ctx(ctxs[i]);
+    free(ctxs);
+
+    return opened == contexts ? (after - before) / contexts : -1;
+}
+
+static int run(DC_API api, long messages, long requests, int contexts)
+{
+    thingsboard_ctx* ctx = open_ctx(api);
+    if (ctx == NULL){
+        fprintf(stderr, "Could not connect to the %s stand-in\n", api == USE_MQTT ? "MQTT" : "HTTP");
+        return -1;
+    }
+
+    struct bench_series telemetry, acked, attributes, rpc;
+    series_init(&telemetry, messages);
+    series_init(&acked, requests);
+    series_init(&attributes, requests);
+    series_init(&rpc, requests);
+
+    bench_telemetry(ctx, &telemetry, messages);
+    // QoS 1 completes on PUBACK, HTTP on the response
+    if (api == USE_MQTT) thingsboard_qos_set(ctx, THINGSBOARD_CLASS_TELEMETRY, 1);
+    bench_telemetry_acked(ctx, &acked, requests);
+    bench_attributes(ctx, &attributes, requests);
+    bench_rpc(ctx, &rpc, requests);
+
+    close_ctx(ctx);
+
+    long per_context = bench_memory(api, contexts);
+
+    printf("{\"bench\":\"e2e\",\"transport\":\"%s\",", api == USE_MQTT ? "mqtt" : "http");
+    report("telemetry", &telemetry, 0);
+    report("telemetry_acked", &acked, 0);
+    report("attributes_request", &attributes, 0);
+    report("rpc", &rpc, 0);
+    printf("\"memory\":{\"contexts\":%d,\"bytes_per_context\":%ld}}\n", contexts, per_context);
+    fflush(stdout);
+
+    free(telemetry.ns);
+    free(acked.ns);
+    free(attributes.ns);
+    free(rpc.ns);
+
+    return telemetry.failed || acked.failed || attributes.failed || rpc.failed || per_context < 0 ? -1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+    long messages = argc > 1 ? atol(argv[1]) : 20000;
+    long requests = argc > 2 ? atol(argv[2]) : 1000;
+    int contexts = argc > 3 ? atoi(argv[3]) : 100;
+
+    if (messages <= 0 || requests <= 0 || contexts <= 0){
+        fprintf(stderr, "usage: %s [messages] [requests] [contexts]\n", argv[0]);
+        return 1;
+    }
+
+    if (mock_http_start(BENCH_HTTP_PORT) != 0 || mock_mqtt_start(BENCH_MQTT_PORT) != 0){
+        fprintf(stderr, "Failed to start the stand-ins on ports %d and %d\n", BENCH_HTTP_PORT, BENCH_MQTT_PORT);
+        return 1;
+    }
+
+    // One JSON object per transport and line, a failed exchange makes the exit status non-zero
+    int res = 0;
+    res |= run(USE_MQTT, messages, requests, contexts);
+    res |= run(USE_HTTP, messages, requests, contexts);
+
+    mock_mqtt_stop();
+    mock_http_stop();
+
+    return res ? 1 : 0;
+}
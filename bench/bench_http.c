@@ -0,0 +1,113 @@
+#include <thingsboard.h>
+#include <curl/curl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mock_http.h"
+
+#define BENCH_HOST  "127.0.0.1"
+#define BENCH_PORT  18080
+#define BENCH_TOKEN "BENCHMARK_TOKEN"
+#define BENCH_DATA  "{\"temperature\":50,\"humidity\":40}"
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Reproduces the previous transport: duplicate the context handle, send, destroy it
+static int send_duphandle(CURL* base, char* data)
+{
+    CURL* http = curl_easy_duphandle(base);
+
+    char url[128];
+    snprintf(url, sizeof(url), "http://%s:%d/api/v1/%s/telemetry", BENCH_HOST, BENCH_PORT, BENCH_TOKEN);
+
+    struct curl_slist *headers = NULL;
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+
+    curl_easy_setopt(http, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(http, CURLOPT_URL, url);
+    curl_easy_setopt(http, CURLOPT_POSTFIELDS, data);
+
+    int res = curl_easy_perform(http);
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(http);
+
+    return res;
+}
+
+static atomic_long async_done;
+static atomic_long async_failed;
+
+static void on_sent(thingsboard_ctx* ctx, thingsboard_code code)
+{
+    if (code != THINGSBOARD_SUCCESS) atomic_fetch_add(&async_failed, 1);
+    atomic_fetch_add(&async_done, 1);
+}
+
+static void report(const char* name, long messages, double elapsed, long connections)
+{
+    printf("%-12s %8ld msgs  %8.3f s  %10.0f msgs/sec  %6ld connections\n",
+           name, messages, elapsed, messages / elapsed, connections);
+}
+
+int main(int argc, char** argv)
+{
+    long messages = argc > 1 ? atol(argv[1]) : 5000;
+
+    if (mock_http_start(BENCH_PORT) != 0){
+        fprintf(stderr, "Failed to start the HTTP stand-in on port %d\n", BENCH_PORT);
+        return 1;
+    }
+
+    // Before: one fresh handle (and TCP connection) per message
+    CURL* base = curl_easy_init();
+    long conns = mock_http_connections();
+    double start = now_sec();
+    for (long i = 0; i < messages; i++){
+        if (send_duphandle(base, BENCH_DATA) != CURLE_OK){
+            fprintf(stderr, "duphandle send %ld failed\n", i);
+            break;
+        }
+    }
+    report("duphandle", messages, now_sec() - start, mock_http_connections() - conns);
+    curl_easy_cleanup(base);
+
+    // After: the SDK's persistent keep-alive handle
+    thingsboard_ctx* ctx = thingsboard_init(USE_HTTP);
+    thingsboard_connect(ctx, BENCH_HOST, BENCH_PORT, BENCH_TOKEN);
+    conns = mock_http_connections();
+    start = now_sec();
+    for (long i = 0; i < messages; i++){
+        if (thingsboard_telemetry_send(ctx, BENCH_DATA, NULL) != THINGSBOARD_SUCCESS){
+            fprintf(stderr, "keep-alive send %ld failed\n", i);
+            break;
+        }
+    }
+    report("keep-alive", messages, now_sec() - start, mock_http_connections() - conns);
+
+    // Async: the caller only queues, the I/O thread keeps many requests in flight
+    conns = mock_http_connections();
+    start = now_sec();
+    for (long i = 0; i < messages; i++){
+        while (thingsboard_telemetry_send_async(ctx, BENCH_DATA, NULL, on_sent) == THINGSBOARD_BUSY)
+            usleep(50);
+    }
+    while (atomic_load(&async_done) < messages) usleep(100);
+    report("async", messages, now_sec() - start, mock_http_connections() - conns);
+    if (atomic_load(&async_failed)) fprintf(stderr, "%ld async sends failed\n", atomic_load(&async_failed));
+
+    thingsboard_disconnect(ctx);
+    thingsboard_cleanup(ctx);
+
+    mock_http_stop();
+
+    return 0;
+}
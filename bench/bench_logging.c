@@ -0,0 +1,73 @@
+#include <thingsboard.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mock_http.h"
+
+#define BENCH_HOST  "127.0.0.1"
+#define BENCH_PORT  18081
+#define BENCH_TOKEN "BENCHMARK_TOKEN"
+#define BENCH_DATA  "{\"temperature\":50,\"humidity\":40}"
+
+static atomic_long logged;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Counts instead of writing so the benchmark measures the SDK, not syslog
+static void counting_sink(thingsboard_log_level level, thingsboard_log_module module, const char* message)
+{
+    atomic_fetch_add(&logged, 1);
+}
+
+static void run(const char* name, thingsboard_log_level level, long messages)
+{
+    thingsboard_log_level_set(level);
+
+    // The level must be set before init so the HTTP handle picks up tracing
+    thingsboard_ctx* ctx = thingsboard_init(USE_HTTP);
+    thingsboard_connect(ctx, BENCH_HOST, BENCH_PORT, BENCH_TOKEN);
+
+    long before = atomic_load(&logged);
+    unsigned long dropped = thingsboard_log_dropped();
+    double start = now_sec();
+    for (long i = 0; i < messages; i++){
+        if (thingsboard_telemetry_send(ctx, BENCH_DATA, NULL) != THINGSBOARD_SUCCESS){
+            fprintf(stderr, "%s: send %ld failed\n", name, i);
+            break;
+        }
+    }
+    double elapsed = now_sec() - start;
+
+    thingsboard_disconnect(ctx);
+    thingsboard_cleanup(ctx);
+
+    printf("%-8s %8ld msgs  %8.3f s  %10.0f msgs/sec  %8ld logged  %6lu dropped\n",
+           name, messages, elapsed, messages / elapsed, atomic_load(&logged) - before, thingsboard_log_dropped() - dropped);
+}
+
+int main(int argc, char** argv)
+{
+    long messages = argc > 1 ? atol(argv[1]) : 5000;
+
+    if (mock_http_start(BENCH_PORT) != 0){
+        fprintf(stderr, "Failed to start the HTTP stand-in on port %d\n", BENCH_PORT);
+        return 1;
+    }
+
+    thingsboard_log_sink_set(counting_sink);
+
+    run("off", THINGSBOARD_LOG_OFF, messages);
+    run("info", THINGSBOARD_LOG_INFO, messages);
+    run("debug", THINGSBOARD_LOG_DEBUG, messages);
+
+    mock_http_stop();
+
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include <thingsboard.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mock_mqtt.h"
+
+#define BENCH_HOST  "127.0.0.1"
+#define BENCH_PORT  11884
+#define BENCH_TOKEN "BENCHMARK_TOKEN"
+#define BENCH_DATA  "{\"temperature\":50,\"humidity\":40}"
+#define BENCH_SLOTS 65536
+// How long the stand-in may take to see every message once the producers are done
+#define BENCH_TIMEOUT_MS 30000
+
+struct producer {
+    thingsboard_ctx* ctx;
+    long messages;
+    long failed;
+    pthread_t thread;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A full submission queue is retried, the producers then run at the rate the sender thread drains
+static void* produce(void* arg)
+{
+    struct producer* producer = (struct producer*)arg;
+
+    for (long i = 0; i < producer->messages; i++){
+        thingsboard_code res;
+        while ((res = thingsboard_telemetry_send(producer->ctx, BENCH_DATA, NULL)) == THINGSBOARD_BUSY) sched_yield();
+        if (res != THINGSBOARD_SUCCESS) producer->failed++;
+    }
+
+    return NULL;
+}
+
+static int wait_connected(thingsboard_ctx* ctx)
+{
+    for (int i = 0; i < BENCH_TIMEOUT_MS; i++){
+        if (thingsboard_state_get(ctx) == THINGSBOARD_CONNECTED) return 0;
+        usleep(1000);
+    }
+
+    return -1;
+}
+
+static int wait_published(long expected)
+{
+    for (int i = 0; i < BENCH_TIMEOUT_MS; i++){
+        if (mock_mqtt_publishes() >= expected) return 0;
+        usleep(1000);
+    }
+
+    return -1;
+}
+
+// Without a submission queue the producers call into mosquitto themselves
+static int run(int threads, long messages, int queued)
+{
+    thingsboard_ctx* ctx = thingsboard_init(USE_MQTT);
+    if (ctx == NULL) return -1;
+
+    if ((queued && thingsboard_submission_configure(ctx, BENCH_SLOTS) != THINGSBOARD_SUCCESS) ||
+        thingsboard_connect(ctx, BENCH_HOST, BENCH_PORT, BENCH_TOKEN) != THINGSBOARD_SUCCESS || wait_connected(ctx) != 0){
+        fprintf(stderr, "Could not connect to the MQTT stand-in\n");
+        thingsboard_cleanup(ctx);
+        return -1;
+    }
+
+    struct producer* producers = (struct producer*)calloc(threads, sizeof(struct producer));
+    if (producers == NULL){
+        thingsboard_cleanup(ctx);
+        return -1;
+    }
+
+    long total = messages / threads * threads;
+    long before = mock_mqtt_publishes();
+    double start = now_sec();
+
+    for (int i = 0; i < threads; i++){
+        producers[i].ctx = ctx;
+        producers[i].messages = messages / threads;
+        pthread_create(&producers[i].thread, NULL, produce, &producers[i]);
+    }
+
+    long failed = 0;
+    for (int i = 0; i < threads; i++){
+        pthread_join(producers[i].thread, NULL);
+        failed += producers[i].failed;
+    }
+    double submitted = now_sec() - start;
+
+    int lost = wait_published(before + total - failed) != 0;
+    double delivered = now_sec() - start;
+
+    thingsboard_disconnect(ctx);
+    thingsboard_cleanup(ctx);
+    free(producers);
+
+    printf("{\"bench\":\"submit\",\"mode\":\"%s\",\"threads\":%d,\"messages\":%ld,\"failed\":%ld,\"lost\":%d,"
+           "\"submit_per_sec\":%.0f,\"delivered_per_sec\":%.0f}\n",
+           queued ? "submission" : "direct", threads, total, failed, lost, total / submitted, total / delivered);
+    fflush(stdout);
+
+    return failed || lost ? -1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+    long messages = argc > 1 ? atol(argv[1]) : 400000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+
+    if (messages <= 0 || max_threads <= 0){
+        fprintf(stderr, "usage: %s [messages] [threads]\n", argv[0]);
+        return 1;
+    }
+
+    if (mock_mqtt_start(BENCH_PORT) != 0){
+        fprintf(stderr, "Failed to start the MQTT stand-in on port %d\n", BENCH_PORT);
+        return 1;
+    }
+
+    // One JSON object per mode and thread count, the same total split over more producers each time
+    int res = 0;
+    for (int threads = 1; threads <= max_threads; threads *= 2){
+        res |= run(threads, messages, 0);
+        res |= run(threads, messages, 1);
+    }
+
+    mock_mqtt_stop();
+
+    return res ? 1 : 0;
+}
@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include "mock_http.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static int listen_fd = -1;
+static pthread_t accept_thread;
+static atomic_long requests;
+static atomic_long connections;
+static atomic_long bytes;
+
+// Answers of the device API calls that return data, anything else gets an empty body
+static const char* mock_http_route(const char* request)
+{
+    const char* path = strchr(request, ' ');
+    if (path == NULL) return "";
+
+    const char* end = strpbrk(++path, " ?");
+    const char* last = end ? end : path + strlen(path);
+    while (last > path && last[-1] != '/') last--;
+
+    if (strncmp(request, "GET ", 4) == 0 && strncmp(last, "attributes", 10) == 0 && last + 10 == end)
+        return MOCK_HTTP_ATTRIBUTES;
+    if (strncmp(request, "POST ", 5) == 0 && strncmp(last, "rpc", 3) == 0 && last + 3 == end)
+        return MOCK_HTTP_RPC;
+
+    return "";
+}
+
+// Reads one request (headers + body) and answers it, returns 0 when the connection should stay open
+static int mock_http_serve_one(int fd, char* buf, size_t cap, size_t* len)
+{
+    char* end = NULL;
+
+    while ((end = memmem(buf, *len, "\r\n\r\n", 4)) == NULL){
+        if (*len == cap) return -1;
+        ssize_t n = read(fd, buf + *len, cap - *len);
+        if (n <= 0) return -1;
+        *len += n;
+    }
+
+    size_t header_len = (end - buf) + 4;
+    size_t body_len = 0;
+    int close_conn = 0;
+
+    for (char* line = buf; line < end; line = strstr(line, "\r\n") + 2){
+        if (strncasecmp(line, "Content-Length:", 15) == 0) body_len = strtoul(line + 15, NULL, 10);
+        else if (strncasecmp(line, "Connection: close", 17) == 0) close_conn = 1;
+    }
+
+    while (*len < header_len + body_len){
+        if (header_len + body_len > cap) return -1;
+        ssize_t n = read(fd, buf + *len, cap - *len);
+        if (n <= 0) return -1;
+        *len += n;
+    }
+
+    const char* body = mock_http_route(buf);
+    char reply[256];
+    int reply_len = snprintf(reply, sizeof(reply), "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n%s", strlen(body), body);
+    if (write(fd, reply, reply_len) < 0) return -1;
+    atomic_fetch_add(&requests, 1);
+    atomic_fetch_add(&bytes, header_len + body_len);
+
+    memmove(buf, buf + header_len + body_len, *len - header_len - body_len);
+    *len -= header_len + body_len;
+
+    return close_conn ? -1 : 0;
+}
+
+static void* mock_http_connection(void* arg)
+{
+    int fd = (int)(long)arg;
+    size_t cap = 1 << 20;
+    size_t len = 0;
+    char* buf = malloc(cap);
+
+    while (buf && mock_http_serve_one(fd, buf, cap, &len) == 0);
+
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+static void* mock_http_accept(void* arg)
+{
+    while (1){
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) break;
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        atomic_fetch_add(&connections, 1);
+
+        pthread_t thread;
+        pthread_create(&thread, NULL, mock_http_connection, (void*)(long)fd);
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+int mock_http_start(int port)
+{
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) return -1;
+
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 128) < 0){
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    atomic_store(&requests, 0);
+    atomic_store(&connections, 0);
+    atomic_store(&bytes, 0);
+
+    return pthread_create(&accept_thread, NULL, mock_http_accept, NULL) == 0 ? 0 : -1;
+}
+
+void mock_http_stop(void)
+{
+    if (listen_fd < 0) return;
+
+    shutdown(listen_fd, SHUT_RDWR);
+    close(listen_fd);
+    pthread_join(accept_thread, NULL);
+    listen_fd = -1;
+}
+
+long mock_http_requests(void)
+{
+    return atomic_load(&requests);
+}
+
+long mock_http_connections(void)
+{
+    return atomic_load(&connections);
+}
+
+long mock_http_bytes(void)
+{
+    return atomic_load(&bytes);
+}
@@ -0,0 +1,35 @@
+#ifndef _MOCK_HTTP_H_
+#define _MOCK_HTTP_H_
+    // Bodies of attribute requests (GET .../attributes) and client-side RPC calls (POST .../rpc)
+    #define MOCK_HTTP_ATTRIBUTES "{\"client\":{\"mode\":\"eco\"},\"shared\":{\"fw\":\"1.0\"}}"
+    #define MOCK_HTTP_RPC        "{\"result\":\"ok\"}"
+
+    /*
+    * Minimal local HTTP/1.1 stand-in for the ThingsBoard device API
+    *
+    * @param port - The port to listen on (127.0.0.1)
+    * @return On success: 0, On failure: -1
+    * @note Every request is answered with 200 OK and keep-alive is honoured, attribute requests and RPC calls get a fixed body, the rest an empty one
+    */
+    int mock_http_start(int port);
+
+    /*
+    * Stops the stand-in and closes the listening socket
+    */
+    void mock_http_stop(void);
+
+    /*
+    * @return The number of requests served since start
+    */
+    long mock_http_requests(void);
+
+    /*
+    * @return The number of TCP connections accepted since start
+    */
+    long mock_http_connections(void);
+
+    /*
+    * @return The number of request bytes (headers and bodies) received since start
+    */
+    long mock_http_bytes(void);
+#endif
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include "mock_mqtt.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MOCK_MQTT_MAX_PACKET (1 << 20)
+
+static int listen_fd = -1;
+static pthread_t accept_thread;
+static atomic_long publishes;
+static atomic_long connections;
+static atomic_long bytes;
+
+// Payloads published on v1/devices/me/telemetry, kept for the tests to inspect
+static pthread_mutex_t telemetry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct { unsigned char* data; size_t len; }* telemetry;
+static long telemetry_count;
+static long telemetry_cap;
+
+static void mock_mqtt_keep(const unsigned char* payload, size_t len)
+{
+    pthread_mutex_lock(&telemetry_lock);
+
+    if (telemetry_count == telemetry_cap){
+        long cap = telemetry_cap ? telemetry_cap * 2 : 64;
+        void* grown = realloc(telemetry, cap * sizeof(*telemetry));
+        if (grown == NULL) goto end;
+        telemetry = grown;
+        telemetry_cap = cap;
+    }
+
+    unsigned char* data = malloc(len ? len : 1);
+    if (data == NULL) goto end;
+    memcpy(data, payload, len);
+    telemetry[telemetry_count].data = data;
+    telemetry[telemetry_count++].len = len;
+
+end:
+    pthread_mutex_unlock(&telemetry_lock);
+}
+
+static int mock_mqtt_read(int fd, unsigned char* buf, size_t len)
+{
+    while (len > 0){
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// Writes a packet of type with an acknowledgement of packet id
+static int mock_mqtt_ack(int fd, unsigned char type, const unsigned char* id)
+{
+    unsigned char ack[4] = { type, 2, id[0], id[1] };
+
+    return write(fd, ack, sizeof(ack)) == sizeof(ack) ? 0 : -1;
+}
+
+// Publishes payload at QoS 0 on prefix followed by the request id that ends topic
+static int mock_mqtt_answer(int fd, const char* prefix, const char* id, size_t id_len, const char* payload)
+{
+    size_t prefix_len = strlen(prefix);
+    size_t topic_len = prefix_len + id_len;
+    size_t payload_len = strlen(payload);
+    size_t remaining = 2 + topic_len + payload_len;
+
+    unsigned char* packet = malloc(remaining + 5);
+    if (packet == NULL) return -1;
+
+    size_t len = 0;
+    packet[len++] = 0x30;
+    size_t left = remaining;
+    do {
+        unsigned char digit = left % 128;
+        left /= 128;
+        packet[len++] = left ? digit | 0x80 : digit;
+    } while (left);
+
+    packet[len++] = topic_len >> 8;
+    packet[len++] = topic_len & 0xFF;
+    memcpy(packet + len, prefix, prefix_len);
+    memcpy(packet + len + prefix_len, id, id_len);
+    len += topic_len;
+    memcpy(packet + len, payload, payload_len);
+    len += payload_len;
+
+    int res = write(fd, packet, len) == (ssize_t)len ? 0 : -1;
+    free(packet);
+
+    return res;
+}
+
+static int mock_mqtt_publish(int fd, unsigned char flags, unsigned char* body, size_t len)
+{
+    if (len < 2) return -1;
+
+    size_t topic_len = (body[0] << 8) | body[1];
+    if (2 + topic_len > len) return -1;
+
+    const char* topic = (const char*)body + 2;
+    int qos = (flags >> 1) & 3;
+    size_t payload_off = 2 + topic_len + (qos > 0 ? 2 : 0);
+    if (payload_off > len) return -1;
+
+    static const char telemetry_topic[] = "v1/devices/me/telemetry";
+    if (topic_len == sizeof(telemetry_topic) - 1 && memcmp(topic, telemetry_topic, topic_len) == 0)
+        mock_mqtt_keep(body + payload_off, len - payload_off);
+    atomic_fetch_add(&publishes, 1);
+
+    if (qos > 0 && mock_mqtt_ack(fd, qos == 1 ? 0x40 : 0x50, body + 2 + topic_len) != 0) return -1;
+
+    static const char attributes[] = "v1/devices/me/attributes/request/";
+    static const char rpc[] = "v1/devices/me/rpc/request/";
+
+    if (topic_len > sizeof(attributes) - 1 && memcmp(topic, attributes, sizeof(attributes) - 1) == 0)
+        return mock_mqtt_answer(fd, "v1/devices/me/attributes/response/", topic + sizeof(attributes) - 1, topic_len - (sizeof(attributes) - 1), MOCK_MQTT_ATTRIBUTES);
+    if (topic_len > sizeof(rpc) - 1 && memcmp(topic, rpc, sizeof(rpc) - 1) == 0)
+        return mock_mqtt_answer(fd, "v1/devices/me/rpc/response/", topic + sizeof(rpc) - 1, topic_len - (sizeof(rpc) - 1), MOCK_MQTT_RPC);
+
+    return 0;
+}
+
+static int mock_mqtt_subscribe(int fd, unsigned char* body, size_t len)
+{
+    if (len < 2) return -1;
+
+    unsigned char ack[4 + 256];
+    size_t count = 0;
+
+    for (size_t i = 2; i + 2 <= len && count < 256;){
+        size_t filter_len = (body[i] << 8) | body[i + 1];
+        i += 2 + filter_len;
+        if (i >= len) return -1;
+        ack[4 + count++] = body[i++] & 3;
+    }
+
+    ack[0] = 0x90;
+    ack[1] = 2 + count;
+    ack[2] = body[0];
+    ack[3] = body[1];
+
+    return write(fd, ack, 4 + count) == (ssize_t)(4 + count) ? 0 : -1;
+}
+
+// Reads one packet and answers it, returns 0 while the connection should stay open
+static int mock_mqtt_serve_one(int fd, unsigned char* buf)
+{
+    unsigned char header;
+    if (mock_mqtt_read(fd, &header, 1) != 0) return -1;
+
+    size_t len = 0;
+    int shift = 0;
+    for (;; shift += 7){
+        unsigned char digit;
+        if (shift > 21 || mock_mqtt_read(fd, &digit, 1) != 0) return -1;
+        len |= (size_t)(digit & 0x7F) << shift;
+        if (!(digit & 0x80)) break;
+    }
+
+    if (len > MOCK_MQTT_MAX_PACKET || mock_mqtt_read(fd, buf, len) != 0) return -1;
+    atomic_fetch_add(&bytes, 2 + shift / 7 + len);
+
+    static const unsigned char connack[] = { 0x20, 2, 0, 0 };
+    static const unsigned char pingresp[] = { 0xD0, 0 };
+
+    switch (header >> 4){
+        case 1:
+            return write(fd, connack, sizeof(connack)) == sizeof(connack) ? 0 : -1;
+        case 3:
+            return mock_mqtt_publish(fd, header & 0x0F, buf, len);
+        case 6:
+            return len >= 2 ? mock_mqtt_ack(fd, 0x70, buf) : -1;
+        case 8:
+            return mock_mqtt_subscribe(fd, buf, len);
+        case 10:
+            return len >= 2 ? mock_mqtt_ack(fd, 0xB0, buf) : -1;
+        case 12:
+            return write(fd, pingresp, sizeof(pingresp)) == sizeof(pingresp) ? 0 : -1;
+        case 14:
+            return -1;
+        default:
+            // Acknowledgements of publishes the stand-in never sends above QoS 0
+            return 0;
+    }
+}
+
+static void* mock_mqtt_connection(void* arg)
+{
+    int fd = (int)(long)arg;
+    unsigned char* buf = malloc(MOCK_MQTT_MAX_PACKET);
+
+    while (buf && mock_mqtt_serve_one(fd, buf) == 0);
+
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+static void* mock_mqtt_accept(void* arg)
+{
+    while (1){
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) break;
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        atomic_fetch_add(&connections, 1);
+
+        pthread_t thread;
+        pthread_create(&thread, NULL, mock_mqtt_connection, (void*)(long)fd);
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+int mock_mqtt_start(int port)
+{
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) return -1;
+
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 128) < 0){
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    atomic_store(&publishes, 0);
+    atomic_store(&connections, 0);
+    atomic_store(&bytes, 0);
+
+    pthread_mutex_lock(&telemetry_lock);
+    for (long i = 0; i < telemetry_count; i++) free(telemetry[i].data);
+    telemetry_count = 0;
+    pthread_mutex_unlock(&telemetry_lock);
+
+    return pthread_create(&accept_thread, NULL, mock_mqtt_accept, NULL) == 0 ? 0 : -1;
+}
+
+void mock_mqtt_stop(void)
+{
+    if (listen_fd < 0) return;
+
+    shutdown(listen_fd, SHUT_RDWR);
+    close(listen_fd);
+    pthread_join(accept_thread, NULL);
+    listen_fd = -1;
+}
+
+long mock_mqtt_publishes(void)
+{
+    return atomic_load(&publishes);
+}
+
+long mock_mqtt_connections(void)
+{
+    return atomic_load(&connections);
+}
+
+long mock_mqtt_bytes(void)
+{
+    return atomic_load(&bytes);
+}
+
+long mock_mqtt_telemetry(long n, void* out, size_t cap)
+{
+    long len = -1;
+
+    pthread_mutex_lock(&telemetry_lock);
+    if (n >= 0 && n < telemetry_count){
+        len = (long)telemetry[n].len;
+        memcpy(out, telemetry[n].data, telemetry[n].len < cap ? telemetry[n].len : cap);
+    }
+    pthread_mutex_unlock(&telemetry_lock);
+
+    return len;
+}
@@ -0,0 +1,47 @@
+#include <stddef.h>
+
+#ifndef _MOCK_MQTT_H_
+#define _MOCK_MQTT_H_
+    // Payloads published back on v1/devices/me/attributes/response/N and v1/devices/me/rpc/response/N
+    #define MOCK_MQTT_ATTRIBUTES "{\"client\":{\"mode\":\"eco\"},\"shared\":{\"fw\":\"1.0\"}}"
+    #define MOCK_MQTT_RPC        "{\"result\":\"ok\"}"
+
+    /*
+    * Minimal local MQTT 3.1.1 stand-in for the ThingsBoard device topics
+    *
+    * @param port - The port to listen on (127.0.0.1)
+    * @return On success: 0, On failure: -1
+    * @note Any CONNECT is accepted, QoS 1 and 2 publishes are acknowledged and subscriptions granted as asked
+    * @note Attribute requests and client-side RPC calls are answered at QoS 0 on their response topic, nothing else is routed
+    */
+    int mock_mqtt_start(int port);
+
+    /*
+    * Stops the stand-in and closes the listening socket
+    */
+    void mock_mqtt_stop(void);
+
+    /*
+    * @return The number of PUBLISH packets received since start
+    */
+    long mock_mqtt_publishes(void);
+
+    /*
+    * @return The number of TCP connections accepted since start
+    */
+    long mock_mqtt_connections(void);
+
+    /*
+    * @return The number of bytes received since start
+    */
+    long mock_mqtt_bytes(void);
+
+    /*
+    * Copies the payload of the n-th PUBLISH received on v1/devices/me/telemetry since start
+    *
+    * @param n - The index of the message, counting from 0
+    * @param out - Receives up to cap bytes of the payload
+    * @return The payload length, -1 when fewer messages were received
+    */
+    long mock_mqtt_telemetry(long n, void* out, size_t cap);
+#endif
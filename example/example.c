@@ -4,7 +4,7 @@
 
 void on_response(thingsboard_ctx* ctx, char* resp)
 {
-    printf("Attribute request response:  %s\n", resp);
+    printf("Attribute request response:  %s\n", resp ? resp : "(timed out)");
 }
 
 void on_update(thingsboard_ctx* ctx, char* resp)
@@ -21,7 +21,7 @@ void on_rpc_update(thingsboard_ctx* ctx, char* resp, int req_id)
 
 void on_rpc_response(thingsboard_ctx* ctx, char* resp)
 {
-    printf("RPC send response:  %s\n", resp);
+    printf("RPC send response:  %s\n", resp ? resp : "(timed out)");
 }
 
 volatile sig_atomic_t running = 1;
@@ -45,6 +45,14 @@ int main(void)
     int res = thingsboard_telemetry_send(ctx, "{\"temperature\":50}", NULL);
     printf("Published telemetry. Return: %d\n", res);
 
+    thingsboard_telemetry_begin(ctx);
+    thingsboard_telemetry_add_double(ctx, "temperature", 21.5);
+    thingsboard_telemetry_add_int(ctx, "uptime", 3600);
+    thingsboard_telemetry_add_bool(ctx, "online", 1);
+    thingsboard_telemetry_add_string(ctx, "firmware", "1.0.2");
+    res = thingsboard_telemetry_end(ctx);
+    printf("Published built telemetry. Return: %d\n", res);
+
     res = thingsboard_attributes_publish(ctx, "{\"temperature\":50}");
     printf("Published attributes. Return: %d\n", res);
 
@@ -1,5 +1,8 @@
 #ifndef _THINGSBOARD_H
 #define _THINGSBOARD_H
+    #include <stdbool.h>
+    #include <stddef.h>
+
     // Defines the Thingsboard APIs
     typedef enum DC_API {
         USE_MQTT,
@@ -12,11 +15,212 @@
         THINGSBOARD_UNAUTHORIZED  = 1,
         THINGSBOARD_BAD_REQUEST   = 2,
         THINGSBOARD_UNKNOWN_ERROR = 3,
+        THINGSBOARD_BUSY          = 4,
+        THINGSBOARD_CODES         = 5,
     } thingsboard_code;
 
+    // Log levels, a module logs messages at or below its level
+    typedef enum thingsboard_log_level {
+        THINGSBOARD_LOG_OFF     = 0,
+        THINGSBOARD_LOG_ERROR   = 1,
+        THINGSBOARD_LOG_WARNING = 2,
+        THINGSBOARD_LOG_INFO    = 3,
+        THINGSBOARD_LOG_DEBUG   = 4,
+    } thingsboard_log_level;
+
+    // SDK modules that can be filtered separately
+    typedef enum thingsboard_log_module {
+        THINGSBOARD_LOG_CORE    = 0,
+        THINGSBOARD_LOG_HTTP    = 1,
+        THINGSBOARD_LOG_MQTT    = 2,
+        THINGSBOARD_LOG_MODULES = 3,
+    } thingsboard_log_module;
+
+    // What a send does when the outbound queue is full
+    typedef enum thingsboard_overflow {
+        THINGSBOARD_OVERFLOW_BLOCK       = 0,
+        THINGSBOARD_OVERFLOW_DROP_OLDEST = 1,
+        THINGSBOARD_OVERFLOW_DROP_NEWEST = 2,
+        THINGSBOARD_OVERFLOW_EVERY_NTH   = 3,
+    } thingsboard_overflow;
+
+    // Counters of the outbound queue, sizes include the per-message header
+    typedef struct thingsboard_outbound_stats {
+        unsigned long accepted;
+        unsigned long forwarded;
+        unsigned long dropped_oldest;
+        unsigned long dropped_newest;
+        unsigned long timeouts;
+        int messages;
+        int high_water_messages;
+        size_t bytes;
+        size_t high_water_bytes;
+    } thingsboard_outbound_stats;
+
+    // Outgoing messages that can be given their own MQTT QoS
+    typedef enum thingsboard_message_class {
+        THINGSBOARD_CLASS_TELEMETRY  = 0,
+        THINGSBOARD_CLASS_ATTRIBUTES = 1,
+        THINGSBOARD_CLASS_RPC        = 2,
+        THINGSBOARD_CLASSES          = 3,
+    } thingsboard_message_class;
+
+    // Encoding of MQTT payloads, it has to match the transport payload type of the device profile
+    typedef enum thingsboard_payload_format {
+        THINGSBOARD_PAYLOAD_JSON     = 0,
+        THINGSBOARD_PAYLOAD_PROTOBUF = 1,
+    } thingsboard_payload_format;
+
+    // Types a field of a Protobuf telemetry or attributes schema can have
+    typedef enum thingsboard_proto_type {
+        THINGSBOARD_PROTO_DOUBLE = 0,
+        THINGSBOARD_PROTO_FLOAT  = 1,
+        THINGSBOARD_PROTO_INT32  = 2,
+        THINGSBOARD_PROTO_INT64  = 3,
+        THINGSBOARD_PROTO_UINT32 = 4,
+        THINGSBOARD_PROTO_UINT64 = 5,
+        THINGSBOARD_PROTO_SINT32 = 6,
+        THINGSBOARD_PROTO_SINT64 = 7,
+        THINGSBOARD_PROTO_BOOL   = 8,
+        THINGSBOARD_PROTO_STRING = 9,
+        // A nested message whose keys map through the same schema, for the values of {"ts","values"} samples
+        THINGSBOARD_PROTO_MESSAGE = 10,
+    } thingsboard_proto_type;
+
+    // Acknowledgement counters of QoS 1 and 2 publishes
+    typedef struct thingsboard_publish_stats {
+        unsigned long published;
+        unsigned long acknowledged;
+        // Still unacknowledged when the context disconnected
+        unsigned long abandoned;
+        // Publishes turned away with THINGSBOARD_BUSY because the window stayed full
+        unsigned long window_full;
+        int inflight;
+        int high_water_inflight;
+        long long ack_latency_avg_us;
+        long long ack_latency_max_us;
+    } thingsboard_publish_stats;
+
+    // Counters of the telemetry deadband filter
+    typedef struct thingsboard_filter_stats {
+        // Values looked at, and those dropped because they stayed within their deadband
+        unsigned long values;
+        unsigned long values_suppressed;
+        // Messages not sent at all because none of their values changed
+        unsigned long messages_suppressed;
+        // Payload bytes kept off the link
+        unsigned long long bytes_suppressed;
+        // Keys whose last sent value is remembered
+        int keys;
+    } thingsboard_filter_stats;
+
+    // Public calls timed by the built-in statistics
+    typedef enum thingsboard_operation {
+        // thingsboard_telemetry_send, _send_async and _end, until the call returns
+        THINGSBOARD_OP_TELEMETRY          = 0,
+        THINGSBOARD_OP_ATTRIBUTES_PUBLISH = 1,
+        // Requests are timed until their response arrives, one that runs out of time counts as THINGSBOARD_UNKNOWN_ERROR
+        THINGSBOARD_OP_ATTRIBUTES_REQUEST = 2,
+        THINGSBOARD_OP_RPC_SEND           = 3,
+        THINGSBOARD_OP_RPC_REPLY          = 4,
+        THINGSBOARD_OP_CLAIM              = 5,
+        THINGSBOARD_OP_PROVISION          = 6,
+        THINGSBOARD_OPS                   = 7,
+    } thingsboard_operation;
+
+    // Calls and latency of one operation, percentiles are within 12.5% and never above the maximum
+    typedef struct thingsboard_op_stats {
+        unsigned long long calls;
+        // Calls by the thingsboard_code they completed with
+        unsigned long long results[THINGSBOARD_CODES];
+        long long latency_avg_us;
+        long long latency_p50_us;
+        long long latency_p90_us;
+        long long latency_p99_us;
+        long long latency_p999_us;
+        long long latency_max_us;
+    } thingsboard_op_stats;
+
+    // Statistics of a context since thingsboard_init
+    typedef struct thingsboard_stats {
+        thingsboard_op_stats ops[THINGSBOARD_OPS];
+        // Payloads written and read by the transport, HTTP counts request and response bodies
+        unsigned long long bytes_out;
+        unsigned long long bytes_in;
+        unsigned long long messages_out;
+        unsigned long long messages_in;
+        // Reconnect attempts of the MQTT connection
+        unsigned long reconnects;
+        // Queue depths when the snapshot was taken
+        int outbound_messages;
+        size_t outbound_bytes;
+        int submitted_messages;
+        long stored_records;
+        int inflight;
+        int pending_requests;
+        int async_outstanding;
+    } thingsboard_stats;
+
+    // Connection states reported by thingsboard_state_get and the state callback
+    typedef enum thingsboard_connection_state {
+        THINGSBOARD_DISCONNECTED = 0,
+        THINGSBOARD_CONNECTING   = 1,
+        THINGSBOARD_CONNECTED    = 2,
+        // The connection dropped, the next attempt is waiting out its backoff
+        THINGSBOARD_RECONNECTING = 3,
+    } thingsboard_connection_state;
+
+    // Scopes of the attributes kept by the attribute cache
+    typedef enum thingsboard_attr_scope {
+        THINGSBOARD_ATTR_CLIENT = 0,
+        THINGSBOARD_ATTR_SHARED = 1,
+    } thingsboard_attr_scope;
+
     // The Thingsboard context
     typedef struct thingsboard_ctx thingsboard_ctx;
 
+    // Payloads reach callbacks NUL terminated and are only valid until the callback returns, callbacks taking len also get their length
+
+    /*
+    * Sets the log level of every module
+    *
+    * @param level - The log level (default THINGSBOARD_LOG_WARNING)
+    * @note Messages are written to a lock-free ring buffer and handed to the sink by a background thread
+    * @note THINGSBOARD_LOG_DEBUG also traces HTTP exchanges, it only applies to contexts initialized afterwards
+    */
+    void thingsboard_log_level_set(thingsboard_log_level level);
+
+    /*
+    * Sets the log level of a single module
+    *
+    * @param module - The module
+    * @param level - The log level
+    */
+    void thingsboard_log_module_level_set(thingsboard_log_module module, thingsboard_log_level level);
+
+    /*
+    * Replaces the log sink
+    *
+    * @param sink - The function called from the logging thread for every message, NULL restores syslog
+    * @note The message does not carry the "[Thingsboard ...]" module prefix
+    */
+    void thingsboard_log_sink_set(void (*sink)(thingsboard_log_level level, thingsboard_log_module module, const char* message));
+
+    /*
+    * @return The number of messages dropped because the ring buffer was full
+    */
+    unsigned long thingsboard_log_dropped(void);
+
+    /*
+    * Sets how many network threads the contexts of the process share
+    *
+    * @param threads - The number of MQTT threads and of HTTP I/O threads (default 1 each, at most 16)
+    * @return thingsboard_code - The return code
+    * @note Contexts go to the least loaded thread when they connect, threads already running are kept
+    * @note Library initialization and the DNS and TLS session caches are shared by every context regardless
+    */
+    thingsboard_code thingsboard_runtime_threads_set(int threads);
+
     /*
     * Initializes the Thingsboard context
     *
@@ -52,6 +256,35 @@
     */
     void thingsboard_cleanup(thingsboard_ctx* ctx);
 
+    /*
+    * @param ctx - The Thingsboard context
+    * @return The current connection state, THINGSBOARD_DISCONNECTED when ctx is NULL
+    * @note On HTTP API the context is THINGSBOARD_CONNECTED between thingsboard_connect and thingsboard_disconnect
+    */
+    thingsboard_connection_state thingsboard_state_get(thingsboard_ctx* ctx);
+
+    /*
+    * Sets the function called on every connection state change
+    *
+    * @param ctx - The Thingsboard context
+    * @param on_state - The callback, reason is the mosquitto error or CONNACK code behind the change (0 otherwise), NULL to remove it
+    * @return thingsboard_code - The return code
+    * @note On MQTT API the callback runs on the network thread, it must not block or call thingsboard_disconnect
+    */
+    thingsboard_code thingsboard_state_callback_set(thingsboard_ctx* ctx, void (*on_state)(thingsboard_ctx* ctx, thingsboard_connection_state state, int reason));
+
+    /*
+    * Sets how long a lost MQTT connection waits before each reconnect attempt
+    *
+    * @param ctx - The Thingsboard context
+    * @param min_ms - The delay of the first attempt (default 1000)
+    * @param max_ms - The cap the delay doubles up to (default 60000)
+    * @return thingsboard_code - The return code
+    * @note Every delay is picked at random between min_ms and the current cap, so devices that lost the server together do not return together
+    * @note Subscriptions are restored on reconnect, QoS 1 and 2 publishes and outstanding attribute and RPC requests are sent again
+    */
+    thingsboard_code thingsboard_reconnect_backoff_set(thingsboard_ctx* ctx, int min_ms, int max_ms);
+
     /*
     * Sends a telemetry message to the Thingsboard server
     *
@@ -63,9 +296,389 @@
     * @note The default topic is: "v1/devices/me/telemetry"
     * @note The telemetry data should be in JSON format
     * @note Example: "{\"temperature\":50}"
+    * @note Safe to call from several threads at once with the default topic only while a submission queue is set, see thingsboard_submission_configure
     */
     thingsboard_code thingsboard_telemetry_send(thingsboard_ctx* ctx, char* telemetry_data, char* topic);
 
+    /*
+    * Sends a telemetry message without waiting for the Thingsboard server
+    *
+    * @param ctx - The Thingsboard context
+    * @param telemetry_data - The telemetry data, copied before the function returns
+    * @param topic - The telemetry topic (only used on MQTT API)
+    * @param on_sent - The callback function to call when the message is delivered or has failed (can be NULL)
+    * @return thingsboard_code - The return code
+    * @note On HTTP API the request is performed by a shared I/O thread, on_sent is called from that thread
+    * @note THINGSBOARD_BUSY is returned when the outstanding request limit is reached, on_sent is not called then
+    * @note Outstanding requests are given up to 5 seconds to finish on disconnect
+    */
+    thingsboard_code thingsboard_telemetry_send_async(thingsboard_ctx* ctx, char* telemetry_data, char* topic, void (*on_sent)(thingsboard_ctx* ctx, thingsboard_code code));
+
+    /*
+    * Sets the limit of outstanding asynchronous requests
+    *
+    * @param ctx - The Thingsboard context
+    * @param max_outstanding - The maximum number of queued and in-flight requests (default 64)
+    * @return thingsboard_code - The return code
+    * @note The limit applies to this context alone, the I/O thread it runs on is shared with other contexts
+    */
+    thingsboard_code thingsboard_async_limit_set(thingsboard_ctx* ctx, int max_outstanding);
+
+    /*
+    * Gzips telemetry bodies from a given size on (HTTP API only)
+    *
+    * @param ctx - The Thingsboard context
+    * @param threshold - The smallest body in bytes that is compressed, 0 turns compression off (default)
+    * @param level - The zlib level, 1 (fastest) to 9 (smallest)
+    * @return thingsboard_code - The return code
+    * @note Bodies are sent with "Content-Encoding: gzip", the server or a proxy in front of it has to accept that
+    * @note Small bodies gain little, a threshold around 1 KB suits batched and historical uploads
+    */
+    thingsboard_code thingsboard_compression_set(thingsboard_ctx* ctx, size_t threshold, int level);
+
+    /*
+    * Sets the MQTT QoS of a class of messages
+    *
+    * @param ctx - The Thingsboard context
+    * @param cls - Telemetry, attributes or RPC replies, gateway messages included
+    * @param qos - 0 (default), 1 or 2
+    * @return thingsboard_code - The return code
+    * @note QoS 1 and 2 publishes hold a slot of the in-flight window until the broker acknowledges them
+    * @note With QoS 1 or 2 the on_sent of thingsboard_telemetry_send_async is called from the network thread on acknowledgement
+    */
+    thingsboard_code thingsboard_qos_set(thingsboard_ctx* ctx, thingsboard_message_class cls, int qos);
+
+    /*
+    * Sets how many QoS 1 and 2 publishes may await their acknowledgement at once
+    *
+    * @param ctx - The Thingsboard context
+    * @param max_inflight - The window size (default 20)
+    * @return thingsboard_code - The return code
+    * @note A full window makes synchronous sends wait up to the request timeout and asynchronous ones return THINGSBOARD_BUSY
+    * @note Sends from callbacks and gateway messages never wait, they get THINGSBOARD_BUSY right away
+    */
+    thingsboard_code thingsboard_inflight_window_set(thingsboard_ctx* ctx, int max_inflight);
+
+    /*
+    * Copies the acknowledgement counters and latencies of the QoS 1 and 2 publishes
+    *
+    * @param ctx - The Thingsboard context
+    * @param stats - Receives the counters
+    * @return thingsboard_code - The return code
+    */
+    thingsboard_code thingsboard_publish_stats_get(thingsboard_ctx* ctx, thingsboard_publish_stats* stats);
+
+    /*
+    * Selects the MQTT payload encoding
+    *
+    * @param ctx - The Thingsboard context
+    * @param format - THINGSBOARD_PAYLOAD_JSON (default) or THINGSBOARD_PAYLOAD_PROTOBUF
+    * @return thingsboard_code - The return code
+    * @note With Protobuf, telemetry and attributes are encoded by the schemas given to thingsboard_proto_field_set and RPC replies as the payload field of the default RpcResponseMsg
+    * @note Attribute updates and RPC requests are decoded and still reach their callbacks as JSON
+    * @note A JSON array is published as one message per sample, {"ts":...,"values":{...}} samples need the "ts" and "values" fields described at thingsboard_proto_field_set
+    * @note Switching to Protobuf with batching or the persistent queue enabled fails with THINGSBOARD_BAD_REQUEST when the telemetry schema lacks those fields
+    * @note Attribute requests, client-side RPC and gateway messages stay JSON only
+    */
+    thingsboard_code thingsboard_payload_format_set(thingsboard_ctx* ctx, thingsboard_payload_format format);
+
+    /*
+    * Maps a key to a field of the Protobuf message of a device profile
+    *
+    * @param ctx - The Thingsboard context
+    * @param cls - THINGSBOARD_CLASS_TELEMETRY or THINGSBOARD_CLASS_ATTRIBUTES
+    * @param key - The key used in JSON payloads and with the thingsboard_telemetry_add_* functions
+    * @param number - The field number in the profile's .proto schema
+    * @param type - The field type in the profile's .proto schema
+    * @return thingsboard_code - The return code
+    * @note Values are converted to the field type when they fit it exactly, a key without a field makes the message fail with THINGSBOARD_BAD_REQUEST
+    * @note Timestamped samples need "ts" mapped to an INT64 field and "values" to a THINGSBOARD_PROTO_MESSAGE field, as in message { int64 ts = 1; Values values = 2; }
+    * @note The keys of the nested message map through the same schema, once "values" is mapped plain samples are wrapped and stamped with the client time
+    * @note Repeated fields and nested messages other than "values" are not supported
+    */
+    thingsboard_code thingsboard_proto_field_set(thingsboard_ctx* ctx, thingsboard_message_class cls, const char* key, int number, thingsboard_proto_type type);
+
+    /*
+    * Sends telemetry values only when they changed by more than a deadband or were not sent for too long
+    *
+    * @param ctx - The Thingsboard context
+    * @param key - The telemetry key the rule is for, NULL sets the default of every key without a rule of its own
+    * @param absolute - The change a number must exceed to be sent, 0 for none
+    * @param percent - The change a number must exceed to be sent, in percent of the last sent value, 0 for none
+    * @param max_silence_ms - Sends a value anyway once its key was not sent for this long, 0 never does
+    * @return thingsboard_code - The return code
+    * @note The wider of the two bands applies, with neither a number is sent on any change; booleans and strings are sent when they change
+    * @note Applies to thingsboard_telemetry_send and thingsboard_telemetry_send_async without a topic, on flat objects and on {"ts":..,"values":{..}}; arrays and nested values always pass
+    * @note Unchanged keys are left out of the message, a message left empty is not sent and reported as THINGSBOARD_SUCCESS
+    * @note Heartbeats go out with the next sample of the key, the filter has no timer of its own; Protobuf records of the typed builder are not filtered
+    */
+    thingsboard_code thingsboard_filter_configure(thingsboard_ctx* ctx, const char* key, double absolute, double percent, int max_silence_ms);
+
+    /*
+    * Turns the telemetry filter off and forgets every rule and last sent value
+    *
+    * @param ctx - The Thingsboard context
+    * @return thingsboard_code - The return code
+    */
+    thingsboard_code thingsboard_filter_disable(thingsboard_ctx* ctx);
+
+    /*
+    * Copies the counters of the telemetry filter
+    *
+    * @param ctx - The Thingsboard context
+    * @param stats - Receives the counters
+    * @return thingsboard_code - The return code
+    */
+    thingsboard_code thingsboard_filter_stats_get(thingsboard_ctx* ctx, thingsboard_filter_stats* stats);
+
+    /*
+    * Puts a bounded in-memory queue and a sender thread between the caller and the transport
+    *
+    * @param ctx - The Thingsboard context
+    * @param max_bytes - The size of the preallocated queue, 0 disables the queue after draining it
+    * @param max_messages - The maximum number of queued messages (0 for no limit)
+    * @param policy - What a send does when the queue is full
+    * @param param - The block timeout in ms for THINGSBOARD_OVERFLOW_BLOCK, N for THINGSBOARD_OVERFLOW_EVERY_NTH
+    * @return thingsboard_code - The return code
+    * @note Covers telemetry and attributes sent to the default topics, other calls go straight to the transport
+    * @note A message the policy turns away returns THINGSBOARD_BUSY, one larger than the queue THINGSBOARD_BAD_REQUEST
+    * @note THINGSBOARD_OVERFLOW_EVERY_NTH lets every Nth message in while the queue is full, dropping the oldest for it
+    * @note While the queue is enabled the sender thread owns the telemetry batch and flushes it on time
+    * @note The queue is drained on disconnect, messages sent while disconnected wait for the next connect
+    */
+    thingsboard_code thingsboard_outbound_configure(thingsboard_ctx* ctx, size_t max_bytes, int max_messages, thingsboard_overflow policy, int param);
+
+    /*
+    * Puts a lock-free submission queue between any number of application threads and the sender thread
+    *
+    * @param ctx - The Thingsboard context
+    * @param max_messages - The number of slots, rounded up to a power of two; 0 disables the queue after draining it
+    * @return thingsboard_code - The return code, THINGSBOARD_BAD_REQUEST while an outbound queue is set
+    * @note While it is set thingsboard_telemetry_send and thingsboard_attributes_publish to the default topics may be called from many threads at once
+    * @note A send copies the message into a free slot without taking a lock and returns THINGSBOARD_BUSY when every slot is taken
+    * @note The sender thread applies the deadband filter, owns the telemetry batch and is the only one using the transport for these messages
+    * @note thingsboard_submission_configure itself, connect, disconnect and the other configure calls must not run concurrently with the sends
+    */
+    thingsboard_code thingsboard_submission_configure(thingsboard_ctx* ctx, int max_messages);
+
+    /*
+    * Reads the counters of the outbound queue
+    *
+    * @param ctx - The Thingsboard context
+    * @param stats - Receives the counters
+    * @return thingsboard_code - The return code, THINGSBOARD_BAD_REQUEST without a queue
+    */
+    thingsboard_code thingsboard_outbound_stats_get(thingsboard_ctx* ctx, thingsboard_outbound_stats* stats);
+
+    /*
+    * Takes a snapshot of the context's statistics
+    *
+    * @param ctx - The Thingsboard context
+    * @param stats - Receives the counters, latencies and queue depths
+    * @return thingsboard_code - The return code
+    * @note Recording is always on, every thread adds to counters of its own without taking a lock
+    */
+    thingsboard_code thingsboard_stats_get(thingsboard_ctx* ctx, thingsboard_stats* stats);
+
+    /*
+    * Writes the context's statistics in the Prometheus text exposition format
+    *
+    * @param ctx - The Thingsboard context
+    * @param labels - Added to every series to tell contexts apart, e.g. device="pump-1", or NULL
+    * @param buf - Receives the NUL terminated text, may be NULL to learn the length
+    * @param size - The size of buf
+    * @return The length of the whole text, it was cut short when that is size or more; -1 when ctx is NULL
+    * @note Latencies are histograms with power of two buckets from 16 us to 33.5 s
+    */
+    long thingsboard_stats_prometheus(thingsboard_ctx* ctx, const char* labels, char* buf, size_t size);
+
+    /*
+    * Connects a child device through this context acting as a gateway
+    *
+    * @param ctx - The Thingsboard context, connected with the gateway device's token
+    * @param device - The child device name
+    * @param type - The device profile used when ThingsBoard creates the device, NULL for "default"
+    * @param on_rpc - Called with the RPC data {"id":...,"method":...,"params":...} sent to the device, may be NULL
+    * @param on_attributes - Called with the shared attributes updated for the device, may be NULL
+    * @return thingsboard_code - The return code
+    * @note Only the MQTT API has gateway topics, HTTP contexts get THINGSBOARD_BAD_REQUEST
+    * @note Connecting a device again replaces its callbacks
+    * @note Callbacks run on the MQTT network thread
+    */
+    thingsboard_code thingsboard_gateway_connect(thingsboard_ctx* ctx, const char* device, const char* type,
+        void (*on_rpc)(thingsboard_ctx* ctx, const char* device, const char* json, size_t len, int req_id),
+        void (*on_attributes)(thingsboard_ctx* ctx, const char* device, const char* json, size_t len));
+
+    /*
+    * Disconnects a child device, its pending samples are published first
+    *
+    * @param ctx - The Thingsboard context
+    * @param device - The child device name
+    * @return thingsboard_code - The return code, THINGSBOARD_BAD_REQUEST for a device that is not connected
+    */
+    thingsboard_code thingsboard_gateway_disconnect(thingsboard_ctx* ctx, const char* device);
+
+    /*
+    * Sends telemetry of a connected child device
+    *
+    * @param ctx - The Thingsboard context
+    * @param device - The child device name
+    * @param values - The telemetry values as a JSON object, e.g. "{\"temperature\":50}"
+    * @return thingsboard_code - The return code
+    * @note Samples are stamped with the client time and, with gateway batching enabled, samples of all
+    *       devices are published together in one v1/gateway/telemetry message
+    * @note A sample that is already {"ts":...,"values":{...}}, or an array of them, keeps its own timestamps
+    */
+    thingsboard_code thingsboard_gateway_telemetry_send(thingsboard_ctx* ctx, const char* device, const char* values);
+
+    /*
+    * Publishes client attributes of a child device
+    *
+    * @param ctx - The Thingsboard context
+    * @param device - The child device name
+    * @param attributes - The attributes as a JSON object
+    * @return thingsboard_code - The return code
+    */
+    thingsboard_code thingsboard_gateway_attributes_publish(thingsboard_ctx* ctx, const char* device, const char* attributes);
+
+    /*
+    * Replies to an RPC a child device received
+    *
+    * @param ctx - The Thingsboard context
+    * @param device - The child device name
+    * @param request_id - The id the on_rpc callback was given
+    * @param response - The response as JSON
+    * @return thingsboard_code - The return code
+    */
+    thingsboard_code thingsboard_gateway_rpc_reply(thingsboard_ctx* ctx, const char* device, int request_id, const char* response);
+
+    /*
+    * Batches child device telemetry into shared gateway messages
+    *
+    * @param ctx - The Thingsboard context
+    * @param max_bytes - The message size that triggers publishing, 0 publishes every sample on its own (default)
+    * @param max_age_ms - The age of the oldest sample that triggers publishing (0 for no limit)
+    * @return thingsboard_code - The return code of publishing the pending samples
+    * @note The age threshold is checked on every send and in thingsboard_loop_forever
+    * @note With Protobuf payloads each sample is published as a message of its own, the telemetry schema needs "ts" and "values" fields or THINGSBOARD_BAD_REQUEST is returned
+    */
+    thingsboard_code thingsboard_gateway_batch_configure(thingsboard_ctx* ctx, int max_bytes, int max_age_ms);
+
+    /*
+    * Publishes all batched child device telemetry now
+    *
+    * @param ctx - The Thingsboard context
+    * @return thingsboard_code - The return code
+    */
+    thingsboard_code thingsboard_gateway_flush(thingsboard_ctx* ctx);
+
+    /*
+    * Enables client-side batching of telemetry sent to the default topic
+    *
+    * @param ctx - The Thingsboard context
+    * @param max_bytes - The maximum payload size, the batch is flushed before it would grow past it
+    * @param max_count - The number of samples that triggers a flush (0 for no limit)
+    * @param max_age_ms - The age of the oldest sample that triggers a flush (0 for no limit)
+    * @return thingsboard_code - The return code of flushing the previous batch
+    * @note A max_bytes of 0 disables batching, pending samples are flushed first
+    * @note Each sample is stamped with the client time and sent as [{"ts":...,"values":{...}}, ...]
+    * @note A sample that is already {"ts":...,"values":{...}}, or an array of them, keeps its own timestamps
+    * @note The age threshold is checked on every send and in thingsboard_loop_forever
+    */
+    thingsboard_code thingsboard_batch_configure(thingsboard_ctx* ctx, int max_bytes, int max_count, int max_age_ms);
+
+    /*
+    * Starts a telemetry record in the context's builder
+    *
+    * @param ctx - The Thingsboard context
+    * @return thingsboard_code - The return code
+    * @note Values are added with the thingsboard_telemetry_add_* functions and the record is sent by thingsboard_telemetry_end
+    * @note The builder's buffer is kept by the context, a record costs no allocation once it has grown large enough
+    * @note An unfinished record is discarded
+    */
+    thingsboard_code thingsboard_telemetry_begin(thingsboard_ctx* ctx);
+
+    /*
+    * Adds a value to the record started by thingsboard_telemetry_begin
+    *
+    * @param ctx - The Thingsboard context
+    * @param key - The telemetry key, escaped as needed
+    * @param value - The value
+    * @return thingsboard_code - The return code
+    * @note THINGSBOARD_BAD_REQUEST is returned when no record has been started
+    */
+    thingsboard_code thingsboard_telemetry_add_int(thingsboard_ctx* ctx, const char* key, long long value);
+    thingsboard_code thingsboard_telemetry_add_double(thingsboard_ctx* ctx, const char* key, double value);
+    thingsboard_code thingsboard_telemetry_add_bool(thingsboard_ctx* ctx, const char* key, int value);
+    thingsboard_code thingsboard_telemetry_add_string(thingsboard_ctx* ctx, const char* key, const char* value);
+
+    /*
+    * Finishes the record and sends it like thingsboard_telemetry_send to the default topic
+    *
+    * @param ctx - The Thingsboard context
+    * @return thingsboard_code - The return code
+    * @note The record goes through the batch when batching is enabled
+    */
+    thingsboard_code thingsboard_telemetry_end(thingsboard_ctx* ctx);
+
+    /*
+    * Finishes the record and publishes it as attributes instead
+    *
+    * @param ctx - The Thingsboard context
+    * @return thingsboard_code - The return code
+    */
+    thingsboard_code thingsboard_attributes_end(thingsboard_ctx* ctx);
+
+    /*
+    * Sends all batched telemetry samples now
+    *
+    * @param ctx - The Thingsboard context
+    * @return thingsboard_code - The return code
+    * @note The batch is emptied even if sending fails, with a queue configured it is queued instead
+    * @note May be called while the sender thread of an outbound or submission queue owns the batch, the two take turns on it
+    */
+    thingsboard_code thingsboard_batch_flush(thingsboard_ctx* ctx);
+
+    /*
+    * Enables a persistent outbound queue for telemetry and attributes that cannot be delivered
+    *
+    * @param ctx - The Thingsboard context
+    * @param dir - The directory holding the queue's segment files, created when missing
+    * @param max_bytes - The disk space the queue may take, the oldest records are dropped past it
+    * @return thingsboard_code - The return code
+    * @note A NULL dir or a max_bytes of 0 disables the queue, the files are kept for the next run
+    * @note Records left by a previous run are recovered, records failing their CRC check are discarded
+    * @note Only sends to the default topics are queued, a queued send returns THINGSBOARD_SUCCESS
+    * @note The queue is replayed in bursts after each successful send and in thingsboard_loop_forever
+    * @note Replayed telemetry keeps the time it was queued at
+    * @note With Protobuf payloads the telemetry schema needs "ts" and "values" fields or THINGSBOARD_BAD_REQUEST is returned
+    */
+    thingsboard_code thingsboard_queue_configure(thingsboard_ctx* ctx, const char* dir, long max_bytes);
+
+    /*
+    * Returns the number of queued records not sent yet
+    *
+    * @param ctx - The Thingsboard context
+    * @return The number of records, 0 without a queue
+    */
+    long thingsboard_queue_depth(thingsboard_ctx* ctx);
+
+    /*
+    * Returns the time the oldest unsent record was queued at
+    *
+    * @param ctx - The Thingsboard context
+    * @return Milliseconds since the epoch, 0 when the queue is empty
+    */
+    long long thingsboard_queue_oldest(thingsboard_ctx* ctx);
+
+    /*
+    * Returns the number of records dropped because the queue was full
+    *
+    * @param ctx - The Thingsboard context
+    * @return The number of records
+    */
+    unsigned long thingsboard_queue_dropped(thingsboard_ctx* ctx);
+
     /*
     * Sends an attributes request to the Thingsboard server
     *
@@ -76,9 +689,22 @@
     * @return thingsboard_code - The return code
     * @note The attribute data should be in JSON format
     * @note Example "{\"sharedKeys\":\"yourAttribute,otherAttribute\"}"
+    * @note On MQTT API the function returns once the request is published, many requests can be outstanding at once
+    * @note On MQTT API on_response is called from the network thread, or with NULL json when no response came in time
+    * @note On MQTT API THINGSBOARD_BAD_REQUEST is returned when request_id is already outstanding
     */
     thingsboard_code thingsboard_attributes_request(thingsboard_ctx* ctx, int request_id, char* attribute_data, void (*on_response)(thingsboard_ctx* ctx, char* json));
     
+    /*
+    * Sets how long requests wait for their response
+    *
+    * @param ctx - The Thingsboard context
+    * @param timeout_ms - The timeout in milliseconds (default 10000)
+    * @return thingsboard_code - The return code
+    * @note Applies to attribute requests and RPC calls, expired ones are completed by thingsboard_loop_forever and on disconnect
+    */
+    thingsboard_code thingsboard_request_timeout_set(thingsboard_ctx* ctx, int timeout_ms);
+
     /*
     * Publishes attributes to the Thingsboard server
     *
@@ -107,10 +733,63 @@
     * @return thingsboard_code - The return code
     * @note This function should be called when the subscription is no longer needed
     * @note This function should be called before the client is disconnected
-    * @note The function will wait for the timeout (only on HTTP API) to receive the last message before unsubscribing
+    * @note On HTTP API the long-poll in flight is interrupted, the function returns once it has ended
     */
     thingsboard_code thingsboard_attributes_unsubscribe(thingsboard_ctx* ctx);
 
+    /*
+    * Reads a number from the attribute cache
+    *
+    * @param ctx - The Thingsboard context
+    * @param scope - THINGSBOARD_ATTR_CLIENT or THINGSBOARD_ATTR_SHARED
+    * @param key - The attribute key
+    * @param value - Receives the value
+    * @return thingsboard_code - The return code
+    * @note The cache holds the shared attributes of updates and of request responses, and the client attributes of responses and of thingsboard_attributes_publish
+    * @note THINGSBOARD_BAD_REQUEST is returned when the key is not cached or holds another type, thingsboard_attr_get_int also when the number is not a whole one
+    */
+    thingsboard_code thingsboard_attr_get_int(thingsboard_ctx* ctx, thingsboard_attr_scope scope, const char* key, long long* value);
+    thingsboard_code thingsboard_attr_get_double(thingsboard_ctx* ctx, thingsboard_attr_scope scope, const char* key, double* value);
+    thingsboard_code thingsboard_attr_get_bool(thingsboard_ctx* ctx, thingsboard_attr_scope scope, const char* key, bool* value);
+
+    /*
+    * Copies a string from the attribute cache
+    *
+    * @param ctx - The Thingsboard context
+    * @param scope - THINGSBOARD_ATTR_CLIENT or THINGSBOARD_ATTR_SHARED
+    * @param key - The attribute key
+    * @param buf - Receives the NUL terminated string
+    * @param size - The size of buf
+    * @return thingsboard_code - The return code
+    * @note Object and array values are copied as JSON
+    * @note THINGSBOARD_BAD_REQUEST is returned when the key is not cached, holds another type or does not fit, buf then holds as much as fits
+    */
+    thingsboard_code thingsboard_attr_get_string(thingsboard_ctx* ctx, thingsboard_attr_scope scope, const char* key, char* buf, size_t size);
+
+    /*
+    * Sets the callback called when a cached attribute changes
+    *
+    * @param ctx - The Thingsboard context
+    * @param scope - THINGSBOARD_ATTR_CLIENT or THINGSBOARD_ATTR_SHARED
+    * @param key - The attribute key, NULL for every key of the scope without a callback of its own
+    * @param on_change - Called with the new value as JSON, or NULL json when the attribute was deleted; NULL removes the callback
+    * @return thingsboard_code - The return code
+    * @note Called on the thread that delivered the change, once per key that changed; values equal to the cached ones are not reported
+    */
+    thingsboard_code thingsboard_attr_callback_set(thingsboard_ctx* ctx, thingsboard_attr_scope scope, const char* key, void (*on_change)(thingsboard_ctx* ctx, thingsboard_attr_scope scope, const char* key, const char* json, size_t len));
+
+    /*
+    * Lets attribute requests be answered from the cache
+    *
+    * @param ctx - The Thingsboard context
+    * @param max_age_ms - How old a cached value may be to answer a request, 0 only trusts values kept current by the subscription (default)
+    * @return thingsboard_code - The return code
+    * @note While an MQTT attribute subscription is up, shared values that arrived since it started are always current
+    * @note A request answered from the cache calls on_response before thingsboard_attributes_request returns, on the calling thread
+    * @note Requests without clientKeys or sharedKeys, and requests with any key that is not fresh, go to the server
+    */
+    thingsboard_code thingsboard_attr_cache_max_age_set(thingsboard_ctx* ctx, int max_age_ms);
+
     /*
     * Subscribes to the Thingsboard RPC updates
     *
@@ -128,7 +807,7 @@
     * @return thingsboard_code - The return code
     * @note This function should be called when the subscription is no longer needed
     * @note This function should be called before the client is disconnected
-    * @note The function will wait for the timeout (only on HTTP API) to receive the last message before unsubscribing
+    * @note On HTTP API the long-poll in flight is interrupted, the function returns once it has ended
     */
     thingsboard_code thingsboard_rpc_unsubscribe(thingsboard_ctx* ctx);
 
@@ -156,6 +835,9 @@
     * @return thingsboard_code - The return code
     * @note The parameters should be in the following format
     * @note Example "param:value"
+    * @note On MQTT API the function returns once the request is published, many calls can be in flight at once
+    * @note On MQTT API rpc_on_response is called from the network thread, or with NULL json when no response came in time
+    * @note On MQTT API THINGSBOARD_BAD_REQUEST is returned when request_id is already in flight
     */
     thingsboard_code thingsboard_rpc_send(thingsboard_ctx* ctx, int request_id, char* method, char* params, void (*rpc_on_response)(thingsboard_ctx* ctx, char* json));
     
@@ -187,6 +869,8 @@
     * @param ctx - The Thingsboard context
     * @return thingsboard_code - The return code
     * @note This function should be called in a loop to keep the connection alive
+    * @note On MQTT API it returns after at most 3 seconds, on HTTP API once all subscriptions have ended
+    * @note Either way it returns early when the context is disconnected
     */
     thingsboard_code thingsboard_loop_forever(thingsboard_ctx* ctx);
 #endif
\ No newline at end of file
@@ -3,18 +3,34 @@
 
 #ifndef _THINGSBOARD_HTTP_API_H
 #define _THINGSBOARD_HTTP_API_H
-    int thingsboard_telemetry_send_HTTP(CURL* ctx, char* telemetry_data, char* endpoint, char* host, int port, char* token);
+    struct response {
+        char *response;
+        size_t size;
+    };
 
-    char* thingsboard_attributes_request_HTTP(CURL* ctx, int request_id, char* attribute_data, char* host, int port, char* token);
-    void* thingsboard_attributes_subscribe_HTTP(void* args);
+    struct curl_slist* thingsboard_HTTP_setup(CURL* http, struct curl_slist* headers);
+    // The headers of a gzipped JSON body
+    struct curl_slist* thingsboard_HTTP_gzip_headers(void);
+    size_t thingsboard_HTTP_on_response(void* data, size_t size, size_t nmemb, void* clientp);
+    // Adds the bodies of the transfer that just finished on http to the statistics of ctx
+    void thingsboard_HTTP_count(thingsboard_ctx* ctx, CURL* http, CURLcode res);
+
+    int thingsboard_HTTP_endpoints_build(thingsboard_ctx* ctx);
+    void thingsboard_HTTP_endpoints_free(thingsboard_ctx* ctx);
+
+    int thingsboard_telemetry_send_HTTP(thingsboard_ctx* ctx, char* telemetry_data, char* url);
+    int thingsboard_telemetry_send_HTTP_async(thingsboard_ctx* ctx, char* telemetry_data, char* url, void (*on_sent)(thingsboard_ctx* ctx, thingsboard_code code));
+
+    char* thingsboard_attributes_request_HTTP(thingsboard_ctx* ctx, int request_id, char* attribute_data);
+    int thingsboard_attributes_subscribe_HTTP(thingsboard_ctx* ctx, int timeout);
     void thingsboard_attributes_unsubscribe_HTTP(thingsboard_ctx* ctx);
 
-    void* thingsboard_rpc_subscribe_HTTP(void* args);
+    int thingsboard_rpc_subscribe_HTTP(thingsboard_ctx* ctx, int timeout);
     void thingsboard_rpc_unsubscribe_HTTP(thingsboard_ctx* ctx);
-    int thingsboard_rpc_reply_HTTP(CURL* ctx, int request_id, char* response, char* host, int port, char* token);
-    char* thingsboard_rpc_send_HTTP(CURL* ctx, int request_id, char* method, char* params, char* host, int port, char* token);
+    int thingsboard_rpc_reply_HTTP(thingsboard_ctx* ctx, int request_id, char* response);
+    char* thingsboard_rpc_send_HTTP(thingsboard_ctx* ctx, int request_id, char* method, char* params);
 
-    int thingsboard_device_claim_HTTP(CURL* ctx, char* secret, int duration, char* host, int port, char* token);
+    int thingsboard_device_claim_HTTP(thingsboard_ctx* ctx, char* secret, int duration);
 
-    int thingsboard_provision_device_HTTP(CURL* ctx, char* provisionDeviceKey, char* provisionDeviceSecret, char* host, int port, char* token);
+    int thingsboard_provision_device_HTTP(thingsboard_ctx* ctx, char* provisionDeviceKey, char* provisionDeviceSecret);
 #endif
\ No newline at end of file
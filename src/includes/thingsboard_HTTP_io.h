@@ -0,0 +1,96 @@
+#include <curl/curl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <thingsboard.h>
+#include "thingsboard_HTTP_api.h"
+
+#ifndef _THINGSBOARD_HTTP_IO_H_
+#define _THINGSBOARD_HTTP_IO_H_
+    // The default cap on queued + in-flight requests of one context
+    #define THINGSBOARD_HTTP_IO_MAX_OUTSTANDING 64
+    // Retry delays of a failing long-poll, doubled on every consecutive failure
+    #define THINGSBOARD_HTTP_POLL_BACKOFF_MIN 500
+    #define THINGSBOARD_HTTP_POLL_BACKOFF_MAX 30000
+
+    typedef struct thingsboard_HTTP_io thingsboard_HTTP_io;
+    typedef struct thingsboard_HTTP_request thingsboard_HTTP_request;
+
+    // A request owned by the I/O engine from submit until its on_done returns 0
+    struct thingsboard_HTTP_request {
+        thingsboard_HTTP_request* next;
+        thingsboard_ctx* ctx;
+        CURL* http;
+        const char* url;
+        char* body;
+        // Set when body may be gzipped under the context's threshold, body_len is its length once it was
+        bool compress;
+        size_t body_len;
+        struct response chunk;
+        // HTTP status of the last completed transfer, 0 when none was received
+        long status;
+        // Delay before a re-armed request goes out again, 0 re-arms immediately
+        int retry_ms;
+        long long due_ms;
+        // When set, the request is aborted as soon as the flag turns false and the engine is woken
+        const atomic_bool* wanted;
+        int (*on_done)(thingsboard_HTTP_request* req, thingsboard_code code);
+        void* cb;
+    };
+
+    /*
+    * Starts an I/O thread driving a curl_multi engine
+    *
+    * @param max_outstanding - The maximum number of queued + in-flight requests
+    * @return On success: the engine, On failure: NULL
+    */
+    thingsboard_HTTP_io* thingsboard_HTTP_io_start(int max_outstanding);
+
+    /*
+    * Stops the I/O thread
+    *
+    * @param io - The I/O engine
+    * @param drain_ms - How long outstanding requests may still complete before they are aborted
+    * @note Aborted requests complete with THINGSBOARD_UNKNOWN_ERROR
+    */
+    void thingsboard_HTTP_io_stop(thingsboard_HTTP_io* io, int drain_ms);
+
+    /*
+    * Registers a context using the engine, its connection limits grow with every one
+    *
+    * @param io - The I/O engine
+    */
+    void thingsboard_HTTP_io_attach(thingsboard_HTTP_io* io);
+
+    /*
+    * Takes a context off the engine without stopping it
+    *
+    * @param io - The I/O engine
+    * @param ctx - The context
+    * @param drain_ms - How long the requests of ctx may still complete before they are aborted
+    * @note Must not be called from the I/O thread, aborted requests complete with THINGSBOARD_UNKNOWN_ERROR
+    */
+    void thingsboard_HTTP_io_detach(thingsboard_HTTP_io* io, thingsboard_ctx* ctx, int drain_ms);
+
+    /*
+    * Hands a request to the I/O thread without waiting for the network
+    *
+    * @param io - The I/O engine
+    * @param req - The request, body must be heap allocated and is freed by the engine, url must outlive the request
+    * @return On success: 0, When the engine's or req->ctx's outstanding cap is reached: -1 (the request is not taken)
+    * @note on_done runs on the I/O thread, returning 1 re-arms the same request after req->retry_ms
+    */
+    int thingsboard_HTTP_io_submit(thingsboard_HTTP_io* io, thingsboard_HTTP_request* req);
+
+    /*
+    * Wakes the I/O thread so it notices requests that are no longer wanted
+    *
+    * @param io - The I/O engine
+    * @note Aborted requests complete with THINGSBOARD_UNKNOWN_ERROR and are not re-armed
+    */
+    void thingsboard_HTTP_io_wakeup(thingsboard_HTTP_io* io);
+
+    /*
+    * Maps a transfer result and HTTP status to a thingsboard_code
+    */
+    thingsboard_code thingsboard_HTTP_code(CURLcode res, long status);
+#endif
@@ -1,19 +1,71 @@
+#include <stdbool.h>
 #include <mosquitto.h>
+#include <thingsboard.h>
+#include "thingsboard_MQTT_loop.h"
 
 #ifndef _THINGSBOARD_MQTT_API_H_
 #define _THINGSBOARD_MQTT_API_H_
-    int thingsboard_telemetry_send_MQTT(struct mosquitto* ctx, char* telemetry_data, char* topic);
+    #define THINGSBOARD_TOPIC_TELEMETRY            "v1/devices/me/telemetry"
+    #define THINGSBOARD_TOPIC_ATTRIBUTES           "v1/devices/me/attributes"
+    #define THINGSBOARD_TOPIC_ATTRIBUTES_REQUEST   "v1/devices/me/attributes/request/"
+    #define THINGSBOARD_TOPIC_ATTRIBUTES_RESPONSE  "v1/devices/me/attributes/response/"
+    #define THINGSBOARD_TOPIC_RPC_REQUEST          "v1/devices/me/rpc/request/"
+    #define THINGSBOARD_TOPIC_RPC_RESPONSE         "v1/devices/me/rpc/response/"
+    #define THINGSBOARD_TOPIC_CLAIM                "v1/devices/me/claim"
 
-    int thingsboard_attributes_request_MQTT(struct mosquitto* ctx, int request_id, char* attribute_data);
+    // Large enough for any fixed prefix above followed by a request id
+    #define THINGSBOARD_TOPIC_MAX 64
+
+    // Default delays between reconnect attempts
+    #define THINGSBOARD_RECONNECT_MIN_MS 1000
+    #define THINGSBOARD_RECONNECT_MAX_MS 60000
+
+    // Stack room for Protobuf messages converted from JSON
+    #define THINGSBOARD_PROTO_STACK 512
+
+    // Backs off reconnect attempts and reports the connection state, attached together with the client
+    extern const thingsboard_MQTT_hooks thingsboard_MQTT_supervisor;
+
+    /*
+    * Publishes with the QoS configured for the message class
+    *
+    * @param on_sent - Called once the message is out (QoS 0) or acknowledged (QoS 1 and 2), not called on failure
+    * @param wait - Whether a full in-flight window may be waited on for up to the request timeout, never on a network thread
+    * @return 0 on success, THINGSBOARD_BUSY when the window stayed full, 2 or 3 on failure
+    */
+    int thingsboard_publish_MQTT(thingsboard_ctx* ctx, thingsboard_message_class cls, const char* topic, const char* payload, size_t len,
+        void (*on_sent)(thingsboard_ctx* ctx, thingsboard_code code), bool wait);
+
+    /*
+    * Publishes a JSON payload, converted to Protobuf first when the context uses that format
+    *
+    * @return As thingsboard_publish_MQTT, 2 when the payload does not fit the class's schema
+    */
+    int thingsboard_publish_payload_MQTT(thingsboard_ctx* ctx, thingsboard_message_class cls, const char* topic, const char* json,
+        void (*on_sent)(thingsboard_ctx* ctx, thingsboard_code code), bool wait);
+
+    int thingsboard_telemetry_send_MQTT(thingsboard_ctx* ctx, char* telemetry_data, char* topic);
+
+    void on_MQTT_message(struct mosquitto* mqtt, void* obj, const struct mosquitto_message* msg);
+    void on_MQTT_connect(struct mosquitto* mqtt, void* obj, int rc);
+    // Completes QoS 1 and 2 publishes tracked in the in-flight window
+    void on_MQTT_publish(struct mosquitto* mqtt, void* obj, int mid);
+
+    int thingsboard_attributes_request_MQTT(thingsboard_ctx* ctx, int request_id, char* attribute_data, void (*on_response)(thingsboard_ctx* ctx, char* json));
     int thingsboard_attributes_subscribe_MQTT(thingsboard_ctx* ctx);
     void thingsboard_attributes_unsubscribe_MQTT(thingsboard_ctx* ctx);
 
     int thingsboard_rpc_subscribe_MQTT(thingsboard_ctx* ctx);
     void thingsboard_rpc_unsubscribe_MQTT(thingsboard_ctx* ctx);
-    int thingsboard_rpc_reply_MQTT(struct mosquitto* ctx, int request_id, char* response);
-    int thingsboard_rpc_send_MQTT(struct mosquitto* ctx, int request_id, char* method, char* params);
+    int thingsboard_rpc_reply_MQTT(thingsboard_ctx* ctx, int request_id, char* response);
+    int thingsboard_rpc_send_MQTT(thingsboard_ctx* ctx, int request_id, char* method, char* params, void (*rpc_on_response)(thingsboard_ctx* ctx, char* json));
+
+    // Completes every attribute and RPC request past its deadline with a NULL response
+    void thingsboard_requests_expire_MQTT(thingsboard_ctx* ctx, long long now_ms);
+    // The earliest deadline of all outstanding requests, 0 when there are none
+    long long thingsboard_requests_deadline_MQTT(thingsboard_ctx* ctx);
 
-    int thingsboard_device_claim_MQTT(struct mosquitto* ctx, char* secret, int duration);
+    int thingsboard_device_claim_MQTT(thingsboard_ctx* ctx, char* secret, int duration);
 
-    int thingsboard_provision_device_MQTT(struct mosquitto* ctx, char* provisionDeviceKey, char* provisionDeviceSecret, char* token);
+    int thingsboard_provision_device_MQTT(thingsboard_ctx* ctx, char* provisionDeviceKey, char* provisionDeviceSecret, char* token);
 #endif
\ No newline at end of file
@@ -0,0 +1,40 @@
+#include <stdbool.h>
+#include <mosquitto.h>
+
+#ifndef _THINGSBOARD_MQTT_LOOP_H_
+#define _THINGSBOARD_MQTT_LOOP_H_
+    // Delay before a lost connection is re-established when the client has no on_lost hook
+    #define THINGSBOARD_MQTT_RECONNECT_MS 1000
+    // Longest sleep of the network thread, bounds how late a partially written publish is resumed
+    #define THINGSBOARD_MQTT_LOOP_WAIT_MS 250
+
+    typedef struct thingsboard_MQTT_loop thingsboard_MQTT_loop;
+
+    // Called on the network thread without the loop lock, attaching and detaching from them is allowed
+    typedef struct thingsboard_MQTT_hooks {
+        // The connection dropped or a reconnect attempt failed, returns how long to wait before the next attempt
+        long (*on_lost)(void* obj, int rc);
+        // A reconnect attempt is about to start
+        void (*on_retry)(void* obj);
+    } thingsboard_MQTT_hooks;
+
+    /*
+    * Starts a network thread that drives any number of mosquitto clients with one poll()
+    *
+    * @return On success: the loop, On failure: NULL
+    * @note Publishing threads write to the socket themselves, the loop reads, resumes partial writes, keeps alive and reconnects
+    */
+    thingsboard_MQTT_loop* thingsboard_MQTT_loop_start(void);
+
+    // Stops the thread, every client must have been detached; from a callback of the loop the thread winds down on its own
+    void thingsboard_MQTT_loop_stop(thingsboard_MQTT_loop* loop);
+
+    // The client has to be connecting already, hooks may be NULL and must outlive the attachment, returns 0 on success
+    int thingsboard_MQTT_loop_attach(thingsboard_MQTT_loop* loop, struct mosquitto* mqtt, const thingsboard_MQTT_hooks* hooks, void* obj);
+
+    // Once this returns the loop no longer touches the client, may be called from the client's own callbacks
+    void thingsboard_MQTT_loop_detach(thingsboard_MQTT_loop* loop, struct mosquitto* mqtt);
+
+    // True on a network thread, where waiting for an acknowledgement would stop it from ever arriving
+    bool thingsboard_MQTT_loop_current(void);
+#endif
@@ -0,0 +1,75 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <thingsboard.h>
+#include "thingsboard_json.h"
+
+#ifndef _THINGSBOARD_ATTRS_H_
+#define _THINGSBOARD_ATTRS_H_
+    #define THINGSBOARD_ATTRS_SCOPES 2
+
+    typedef void (*thingsboard_attrs_fn)(thingsboard_ctx* ctx, thingsboard_attr_scope scope, const char* key, const char* value, size_t len);
+
+    struct thingsboard_attrs_entry {
+        // NULL marks a free slot, keys are never removed so a callback set before the value arrives keeps its slot
+        char* key;
+        uint64_t hash;
+        unsigned char scope;
+        // False until a value arrives and after the attribute was deleted
+        bool present;
+        int kind;
+        double number;
+        // The value as JSON, and the text of string values
+        char* json;
+        char* text;
+        // Generation of the cache the value was received in, and when
+        unsigned generation;
+        long long updated_ms;
+        thingsboard_attrs_fn on_change;
+    };
+
+    // Client and shared attributes of a device, written by the transport threads and read by the application
+    typedef struct thingsboard_attrs {
+        pthread_mutex_t lock;
+        struct thingsboard_attrs_entry* slots;
+        size_t cap;
+        int count;
+        // Bumped whenever pushed updates may have been missed, older values are only as fresh as max_age_ms allows
+        unsigned generation;
+        // Shared attribute updates are pushed to the cache as they happen
+        bool live;
+        long max_age_ms;
+        thingsboard_attrs_fn on_change[THINGSBOARD_ATTRS_SCOPES];
+    } thingsboard_attrs;
+
+    thingsboard_attrs* thingsboard_attrs_new(void);
+    void thingsboard_attrs_free(thingsboard_attrs* attrs);
+
+    // The subscription to shared attribute updates started or lapsed
+    void thingsboard_attrs_live(thingsboard_attrs* attrs, bool live);
+    void thingsboard_attrs_max_age(thingsboard_attrs* attrs, long max_age_ms);
+
+    // Sets the callback of key, or of every key of scope when key is NULL; returns -1 when memory ran out
+    int thingsboard_attrs_callback(thingsboard_attrs* attrs, thingsboard_attr_scope scope, const char* key, thingsboard_attrs_fn on_change);
+
+    /*
+    * Merges attributes into the cache and calls the change callbacks of the keys whose value differs
+    *
+    * @return The number of keys that changed, -1 when json is not an object
+    * @note update takes a pushed update of shared attributes, {"deleted":[..]} removes keys
+    * @note response takes the {"client":{..},"shared":{..}} answer to a request, published the client attributes sent by the device
+    * @note Callbacks run on the calling thread once the cache is unlocked
+    */
+    int thingsboard_attrs_update(thingsboard_attrs* attrs, thingsboard_ctx* ctx, const char* json, size_t len);
+    int thingsboard_attrs_response(thingsboard_attrs* attrs, thingsboard_ctx* ctx, const char* json, size_t len);
+    int thingsboard_attrs_published(thingsboard_attrs* attrs, thingsboard_ctx* ctx, const char* json);
+
+    // Answers an attributes request from the cache into the reused writer *reply, NULL unless every requested key is fresh
+    const char* thingsboard_attrs_serve(thingsboard_attrs* attrs, const char* request, thingsboard_json** reply);
+
+    // Return 0 when the key holds a value of the asked type, -1 otherwise; strings that do not fit size are truncated and fail
+    int thingsboard_attrs_get_double(thingsboard_attrs* attrs, thingsboard_attr_scope scope, const char* key, double* value);
+    int thingsboard_attrs_get_bool(thingsboard_attrs* attrs, thingsboard_attr_scope scope, const char* key, bool* value);
+    int thingsboard_attrs_get_string(thingsboard_attrs* attrs, thingsboard_attr_scope scope, const char* key, char* buf, size_t size);
+#endif
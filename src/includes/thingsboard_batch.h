@@ -0,0 +1,40 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef _THINGSBOARD_BATCH_H_
+#define _THINGSBOARD_BATCH_H_
+    // Collects timestamped samples into one [{"ts":...,"values":{...}}, ...] payload
+    typedef struct thingsboard_batch {
+        char* buf;
+        size_t len;
+        size_t cap;
+        int count;
+        long long first_ms;
+        size_t max_bytes;
+        int max_count;
+        int max_age_ms;
+    } thingsboard_batch;
+
+    thingsboard_batch* thingsboard_batch_new(size_t max_bytes, int max_count, int max_age_ms);
+    void thingsboard_batch_free(thingsboard_batch* batch);
+
+    // Trims a sample to what joins a [{"ts":...,"values":...}, ...] array: the elements of an array are spliced in,
+    // a {"ts":...} sample keeps its own timestamp; returns true when it still needs the {"ts":...,"values":} wrapper
+    bool thingsboard_batch_shape(const char** data, size_t* len);
+
+    // Returns 0 when the sample was added, -1 when it does not fit and the batch must be flushed first
+    int thingsboard_batch_append(thingsboard_batch* batch, long long ts, const char* values, size_t len);
+
+    // True when the count threshold is reached or the first sample was added max_age_ms ago
+    bool thingsboard_batch_due(thingsboard_batch* batch, long long now_ms);
+
+    // The wall clock time at which the age threshold is reached, 0 when nothing is waiting on it
+    long long thingsboard_batch_deadline(thingsboard_batch* batch);
+
+    // Closes the array and returns the payload, valid until the next reset
+    char* thingsboard_batch_payload(thingsboard_batch* batch);
+    void thingsboard_batch_reset(thingsboard_batch* batch);
+
+    // Wall clock time in milliseconds, as used by Thingsboard timestamps
+    long long thingsboard_time_ms(void);
+#endif
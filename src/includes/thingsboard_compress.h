@@ -0,0 +1,24 @@
+#include <stddef.h>
+
+#ifndef _THINGSBOARD_COMPRESS_H_
+#define _THINGSBOARD_COMPRESS_H_
+    // zlib's own speed/ratio trade-off, good enough for repetitive JSON
+    #define THINGSBOARD_COMPRESS_LEVEL 6
+
+    // One deflate stream reset between bodies, so its window and hash tables are allocated once; not thread safe
+    typedef struct thingsboard_compressor thingsboard_compressor;
+
+    thingsboard_compressor* thingsboard_compressor_new(void);
+    void thingsboard_compressor_free(thingsboard_compressor* comp);
+
+    /*
+    * Gzips data into the compressor's buffer
+    *
+    * @param comp - The compressor
+    * @param level - The zlib level 1-9 this body is compressed with
+    * @param out - Set to the compressed bytes, valid until the next call
+    * @param out_len - Set to their length
+    * @return 0 on success, -1 on failure
+    */
+    int thingsboard_compress(thingsboard_compressor* comp, int level, const char* data, size_t len, const char** out, size_t* out_len);
+#endif
@@ -0,0 +1,74 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <thingsboard.h>
+
+#ifndef _THINGSBOARD_FILTER_H_
+#define _THINGSBOARD_FILTER_H_
+    // Keys remembered at most, values of further keys are always sent
+    #define THINGSBOARD_FILTER_KEYS_MAX 4096
+
+    // Outcomes of thingsboard_filter_apply
+    #define THINGSBOARD_FILTER_PASS       0
+    #define THINGSBOARD_FILTER_REDUCED    1
+    #define THINGSBOARD_FILTER_SUPPRESSED 2
+
+    struct thingsboard_filter_rule {
+        double absolute;
+        double percent;
+        long max_silence_ms;
+    };
+
+    struct thingsboard_filter_entry {
+        // NULL marks a free slot
+        char* key;
+        uint64_t hash;
+        struct thingsboard_filter_rule rule;
+        // The key has a rule of its own instead of the default one
+        bool ruled;
+        // A value has been sent since the filter was last rearmed
+        bool sent;
+        unsigned char kind;
+        // Last sent number or boolean, strings are compared by hash
+        double last;
+        uint64_t last_hash;
+        long long sent_ms;
+    };
+
+    // Last sent value per telemetry key, safe to use from any thread
+    typedef struct thingsboard_filter {
+        pthread_mutex_t lock;
+        // Checked before parsing, so a disabled filter costs nothing
+        atomic_bool enabled;
+        struct thingsboard_filter_entry* slots;
+        size_t cap;
+        int count;
+        struct thingsboard_filter_rule rule;
+        thingsboard_filter_stats stats;
+    } thingsboard_filter;
+
+    thingsboard_filter* thingsboard_filter_new(void);
+    void thingsboard_filter_free(thingsboard_filter* filter);
+
+    // Sets the rule of key, or the default of every key without one when key is NULL; returns -1 when memory ran out
+    int thingsboard_filter_rule_set(thingsboard_filter* filter, const char* key, double absolute, double percent, long max_silence_ms);
+
+    // Forgets every key and rule, nothing is filtered until a rule is set again
+    void thingsboard_filter_forget(thingsboard_filter* filter);
+
+    // Lets the next value of every key through, used when sent values may not have arrived
+    void thingsboard_filter_rearm(thingsboard_filter* filter);
+
+    /*
+    * Drops the values of a flat telemetry object, or of the values of {"ts":..,"values":{..}}, that stayed within their deadband
+    *
+    * @return THINGSBOARD_FILTER_PASS to send json as is, THINGSBOARD_FILTER_SUPPRESSED when nothing is left to send,
+    *         THINGSBOARD_FILTER_REDUCED when *out holds the changed values, to be released with free()
+    * @note Arrays, nested objects and null always pass, as does anything that is not JSON
+    */
+    int thingsboard_filter_apply(thingsboard_filter* filter, const char* json, char** out);
+
+    void thingsboard_filter_counters(thingsboard_filter* filter, thingsboard_filter_stats* stats);
+#endif
@@ -0,0 +1,73 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <thingsboard.h>
+
+#ifndef _THINGSBOARD_GATEWAY_H_
+#define _THINGSBOARD_GATEWAY_H_
+    #define THINGSBOARD_TOPIC_GATEWAY_CONNECT    "v1/gateway/connect"
+    #define THINGSBOARD_TOPIC_GATEWAY_DISCONNECT "v1/gateway/disconnect"
+    #define THINGSBOARD_TOPIC_GATEWAY_TELEMETRY  "v1/gateway/telemetry"
+    #define THINGSBOARD_TOPIC_GATEWAY_ATTRIBUTES "v1/gateway/attributes"
+    #define THINGSBOARD_TOPIC_GATEWAY_RPC        "v1/gateway/rpc"
+
+    // Table size the device registry starts with, it doubles whenever it gets half full
+    #define THINGSBOARD_GATEWAY_INITIAL 64
+
+    typedef void (*thingsboard_gateway_rpc_fn)(thingsboard_ctx* ctx, const char* device, const char* json, size_t len, int req_id);
+    typedef void (*thingsboard_gateway_attributes_fn)(thingsboard_ctx* ctx, const char* device, const char* json, size_t len);
+
+    struct thingsboard_gateway_device {
+        char* name;
+        uint64_t hash;
+        thingsboard_gateway_rpc_fn on_rpc;
+        thingsboard_gateway_attributes_fn on_attributes;
+        // Pending samples as "[{...},{...}", closed when the gateway message is written
+        char* samples;
+        size_t len;
+        size_t cap;
+        bool dirty;
+    };
+
+    // Child devices of a gateway context keyed by name, safe to use from the caller and the transport thread
+    typedef struct thingsboard_gateway {
+        pthread_mutex_t lock;
+        struct thingsboard_gateway_device** slots;
+        size_t cap;
+        size_t count;
+        // Devices with pending samples in the order they got their first one
+        struct thingsboard_gateway_device** dirty;
+        size_t dirty_count;
+        size_t dirty_cap;
+        size_t pending_bytes;
+        long long first_ms;
+        // 0 publishes every sample on its own
+        size_t max_bytes;
+        int max_age_ms;
+        bool subscribed;
+        struct thingsboard_json* writer;
+    } thingsboard_gateway;
+
+    thingsboard_gateway* thingsboard_gateway_new(void);
+    void thingsboard_gateway_free(thingsboard_gateway* gateway);
+
+    // The wall clock time at which pending samples have to be published, 0 when nothing is waiting
+    long long thingsboard_gateway_deadline(thingsboard_gateway* gateway);
+
+    int thingsboard_gateway_connect_MQTT(thingsboard_ctx* ctx, const char* device, const char* type, thingsboard_gateway_rpc_fn on_rpc, thingsboard_gateway_attributes_fn on_attributes);
+    int thingsboard_gateway_disconnect_MQTT(thingsboard_ctx* ctx, const char* device);
+    int thingsboard_gateway_telemetry_MQTT(thingsboard_ctx* ctx, const char* device, const char* values);
+    int thingsboard_gateway_attributes_MQTT(thingsboard_ctx* ctx, const char* device, const char* attributes);
+    int thingsboard_gateway_rpc_reply_MQTT(thingsboard_ctx* ctx, const char* device, int request_id, const char* response);
+
+    // Publishes every pending sample as one gateway telemetry message
+    int thingsboard_gateway_flush_MQTT(thingsboard_ctx* ctx);
+
+    // Renews the gateway subscriptions after a reconnect, a no-op until a device was connected
+    void thingsboard_gateway_resubscribe_MQTT(thingsboard_ctx* ctx);
+
+    // Route handlers for v1/gateway/rpc and v1/gateway/attributes
+    void thingsboard_gateway_on_rpc_MQTT(thingsboard_ctx* ctx, int id, const char* payload, size_t len);
+    void thingsboard_gateway_on_attributes_MQTT(thingsboard_ctx* ctx, int id, const char* payload, size_t len);
+#endif
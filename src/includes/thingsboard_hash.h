@@ -0,0 +1,23 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _THINGSBOARD_HASH_H_
+#define _THINGSBOARD_HASH_H_
+    // FNV-1a of len bytes, salt keeps equal strings of different kinds apart
+    static inline uint64_t thingsboard_hash_bytes(const char* data, size_t len, uint64_t salt)
+    {
+        uint64_t hash = 14695981039346656037ull ^ salt;
+        for (size_t i = 0; i < len; i++){
+            hash ^= (unsigned char)data[i];
+            hash *= 1099511628211ull;
+        }
+
+        return hash;
+    }
+
+    // Home slot of key in a power of two table: Fibonacci hashing keeps the top log2(cap) bits of the product
+    static inline size_t thingsboard_hash_slot(size_t cap, uint64_t key)
+    {
+        return (size_t)((key * 11400714819323198485ull) >> (64 - __builtin_ctzll(cap)));
+    }
+#endif
@@ -0,0 +1,72 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <thingsboard.h>
+
+#ifndef _THINGSBOARD_INFLIGHT_H_
+#define _THINGSBOARD_INFLIGHT_H_
+    // Unacknowledged QoS 1 and 2 publishes allowed unless thingsboard_inflight_window says otherwise, mosquitto's own default
+    #define THINGSBOARD_INFLIGHT_WINDOW 20
+
+    typedef void (*thingsboard_inflight_fn)(thingsboard_ctx* ctx, thingsboard_code code);
+
+    struct thingsboard_inflight_entry {
+        int mid;
+        bool used;
+        thingsboard_inflight_fn cb;
+        long long sent_us;
+    };
+
+    // An acknowledgement that overtook its publish call, claimable by the calls holding a ticket up to ticket
+    struct thingsboard_inflight_early {
+        int mid;
+        long long ticket;
+    };
+
+    // Publishes awaiting their PUBACK keyed by message id, safe to use from the caller and the network thread
+    typedef struct thingsboard_inflight {
+        pthread_mutex_t lock;
+        pthread_cond_t space;
+        struct thingsboard_inflight_entry* slots;
+        size_t cap;
+        int count;
+        int window;
+        // Tickets of the publish calls between reserve and track or cancel, they have not learned their message id yet
+        long long* open;
+        int publishing;
+        int open_cap;
+        long long tickets;
+        // Unknown ids acknowledged while a call was open, kept until claimed or no call that could own them is left
+        struct thingsboard_inflight_early* early;
+        int early_count;
+        int early_cap;
+        thingsboard_publish_stats stats;
+        long long latency_total_us;
+    } thingsboard_inflight;
+
+    thingsboard_inflight* thingsboard_inflight_new(int window);
+    void thingsboard_inflight_free(thingsboard_inflight* inflight);
+
+    // Returns 0 on success, -1 when memory ran out
+    int thingsboard_inflight_window(thingsboard_inflight* inflight, int window);
+
+    // Takes a slot of the window for a publish, waiting up to wait_ms; returns -1 when the window stayed full or memory ran out
+    int thingsboard_inflight_reserve(thingsboard_inflight* inflight, long wait_ms, long long* ticket);
+
+    // Gives the slot of ticket back when the publish failed
+    void thingsboard_inflight_cancel(thingsboard_inflight* inflight, long long ticket);
+
+    // Turns the slot of ticket into a tracked message, returns 1 when its acknowledgement already arrived
+    int thingsboard_inflight_track(thingsboard_inflight* inflight, long long ticket, int mid, thingsboard_inflight_fn cb);
+
+    // Completes a message and hands back its callback, returns -1 when mid is not tracked
+    int thingsboard_inflight_ack(thingsboard_inflight* inflight, int mid, thingsboard_inflight_fn* cb);
+
+    // Waits up to wait_ms for every tracked message to be acknowledged, returns how many are left
+    int thingsboard_inflight_drain(thingsboard_inflight* inflight, long wait_ms);
+
+    // Removes one message that will not be acknowledged any more, returns -1 when there is none
+    int thingsboard_inflight_abandon(thingsboard_inflight* inflight, thingsboard_inflight_fn* cb);
+
+    void thingsboard_inflight_stats(thingsboard_inflight* inflight, thingsboard_publish_stats* stats);
+#endif
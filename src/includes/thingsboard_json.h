@@ -0,0 +1,53 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef _THINGSBOARD_JSON_H_
+#define _THINGSBOARD_JSON_H_
+    // Buffer a writer starts with, it doubles whenever a value does not fit
+    #define THINGSBOARD_JSON_INITIAL 256
+
+    // Streams compact JSON into a buffer that is kept between documents
+    typedef struct thingsboard_json {
+        char* buf;
+        size_t len;
+        size_t cap;
+        // A value was written at this level, the next one needs a ','
+        bool comma;
+        // Set when memory ran out, the document is lost until the next reset
+        bool failed;
+    } thingsboard_json;
+
+    thingsboard_json* thingsboard_json_new(void);
+    void thingsboard_json_free(thingsboard_json* json);
+
+    // Empties the buffer, keeping its memory for the next document
+    void thingsboard_json_reset(thingsboard_json* json);
+
+    // Resets the writer kept in *json, creating it on first use, NULL when that fails
+    thingsboard_json* thingsboard_json_reuse(thingsboard_json** json);
+
+    void thingsboard_json_object_begin(thingsboard_json* json);
+    void thingsboard_json_object_end(thingsboard_json* json);
+    void thingsboard_json_array_begin(thingsboard_json* json);
+    void thingsboard_json_array_end(thingsboard_json* json);
+    void thingsboard_json_key(thingsboard_json* json, const char* key);
+    // For keys and strings that are not NUL terminated, such as ones decoded from a binary payload
+    void thingsboard_json_key_n(thingsboard_json* json, const char* key, size_t len);
+    void thingsboard_json_string_n(thingsboard_json* json, const char* value, size_t len);
+
+    void thingsboard_json_int(thingsboard_json* json, long long value);
+    // Written with the fewest digits that read back as the same double, NaN and infinities become null
+    void thingsboard_json_double(thingsboard_json* json, double value);
+    void thingsboard_json_bool(thingsboard_json* json, bool value);
+    // NULL is written as null
+    void thingsboard_json_string(thingsboard_json* json, const char* value);
+    // Copies an already encoded value, such as caller supplied JSON, as is
+    void thingsboard_json_raw(thingsboard_json* json, const char* value, size_t len);
+
+    // The NUL terminated document, NULL when memory ran out while writing it
+    const char* thingsboard_json_result(thingsboard_json* json);
+
+    // Request bodies shared by the MQTT and HTTP transports, written into the reused writer *json
+    const char* thingsboard_provision_json(thingsboard_json** json, const char* key, const char* secret, const char* token);
+    const char* thingsboard_claim_json(thingsboard_json** json, const char* secret, int duration);
+#endif
@@ -0,0 +1,22 @@
+#include <stdatomic.h>
+#include <thingsboard.h>
+
+#ifndef _THINGSBOARD_LOG_H_
+#define _THINGSBOARD_LOG_H_
+    // Per-module levels, read with a relaxed load on every log statement
+    extern atomic_int thingsboard_log_levels[THINGSBOARD_LOG_MODULES];
+
+    #define thingsboard_log_enabled(level, module) \
+        ((int)(level) <= atomic_load_explicit(&thingsboard_log_levels[module], memory_order_relaxed))
+
+    // Formats only when the level is enabled, so disabled statements cost one load and a compare
+    #define THINGSBOARD_LOG(level, module, ...) \
+        do { if (thingsboard_log_enabled(level, module)) thingsboard_log_write(level, module, __VA_ARGS__); } while (0)
+
+    void thingsboard_log_write(thingsboard_log_level level, thingsboard_log_module module, const char* fmt, ...)
+        __attribute__((format(printf, 3, 4)));
+
+    // Reference counted, the first context starts the logging thread and the last one drains and stops it
+    void thingsboard_log_start(void);
+    void thingsboard_log_stop(void);
+#endif
@@ -0,0 +1,70 @@
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <thingsboard.h>
+
+#ifndef _THINGSBOARD_METRICS_H_
+#define _THINGSBOARD_METRICS_H_
+    // Threads are spread over this many shards, more threads than shards share them
+    #define THINGSBOARD_METRICS_SHARDS 8
+    // Latencies are bucketed HDR style: 2^SUB_BITS linear buckets per power of two, within 12.5% of the value
+    #define THINGSBOARD_METRICS_SUB_BITS 3
+    // Latencies from 2^MAX_EXP us (about 67 s) up share the top bucket, the maximum is still exact
+    #define THINGSBOARD_METRICS_MAX_EXP 26
+    #define THINGSBOARD_METRICS_BUCKETS ((THINGSBOARD_METRICS_MAX_EXP - THINGSBOARD_METRICS_SUB_BITS + 1) << THINGSBOARD_METRICS_SUB_BITS)
+
+    struct thingsboard_metrics_op {
+        // Completed calls per returned thingsboard_code
+        atomic_ullong results[THINGSBOARD_CODES];
+        atomic_ullong sum_us;
+        atomic_llong max_us;
+        atomic_ullong buckets[THINGSBOARD_METRICS_BUCKETS];
+    };
+
+    // Written by the threads that map to it only, with relaxed atomics so a snapshot can be taken at any time
+    struct thingsboard_metrics_shard {
+        struct thingsboard_metrics_op ops[THINGSBOARD_OPS];
+        atomic_ullong bytes_out;
+        atomic_ullong bytes_in;
+        atomic_ullong messages_out;
+        atomic_ullong messages_in;
+        atomic_ulong reconnects;
+    };
+
+    // Counters and latency histograms of a context, recording never takes a lock
+    typedef struct thingsboard_metrics {
+        // Allocated by the first thread recording into them, so idle contexts stay small
+        struct thingsboard_metrics_shard* _Atomic shards[THINGSBOARD_METRICS_SHARDS];
+    } thingsboard_metrics;
+
+    thingsboard_metrics* thingsboard_metrics_new(void);
+    void thingsboard_metrics_free(thingsboard_metrics* metrics);
+
+    // Monotonic time an operation started at
+    static inline long long thingsboard_metrics_now_us(void)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    }
+
+    // Records an operation started at start_us that ended with res, and hands res back
+    int thingsboard_metrics_done(thingsboard_metrics* metrics, thingsboard_operation op, long long start_us, int res);
+
+    // Payload bytes of one message the transport wrote or read
+    void thingsboard_metrics_sent(thingsboard_metrics* metrics, size_t bytes);
+    void thingsboard_metrics_received(thingsboard_metrics* metrics, size_t bytes);
+    void thingsboard_metrics_reconnect(thingsboard_metrics* metrics);
+
+    // Fills the counters and latencies of stats, the queue depths are left to the caller
+    void thingsboard_metrics_snapshot(thingsboard_metrics* metrics, thingsboard_stats* stats);
+
+    /*
+    * Writes the metrics and the queue depths of stats in the Prometheus text format
+    *
+    * @param labels - Added to every series, e.g. device="pump-1", or NULL
+    * @return The length of the whole text, it was cut short when that is size or more
+    */
+    size_t thingsboard_metrics_prometheus(thingsboard_metrics* metrics, const thingsboard_stats* stats, const char* labels, char* buf, size_t size);
+#endif
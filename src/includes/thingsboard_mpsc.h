@@ -0,0 +1,38 @@
+#include <stddef.h>
+
+#ifndef _THINGSBOARD_MPSC_H_
+#define _THINGSBOARD_MPSC_H_
+    typedef struct thingsboard_mpsc thingsboard_mpsc;
+
+    /*
+    * Allocates a bounded queue any number of threads may push to and one thread pops from
+    *
+    * @param max_messages - The number of slots, rounded up to a power of two
+    * @return On success: the queue, On failure: NULL
+    * @note Pushing never takes a lock, a producer only locks to wake the consumer when it is asleep
+    */
+    thingsboard_mpsc* thingsboard_mpsc_new(int max_messages);
+    // Frees the messages still queued as well, no thread may be using the queue
+    void thingsboard_mpsc_free(thingsboard_mpsc* queue);
+
+    // kind and ts are kept with the message for the consumer
+    // Returns 0 when the message was queued, 1 when every slot is taken, -1 when it could not be copied
+    int thingsboard_mpsc_push(thingsboard_mpsc* queue, int kind, long long ts, const char* data, size_t len);
+
+    /*
+    * Takes the oldest message, waiting up to wait_ms for one; from one thread at a time only
+    *
+    * @param queue - The queue
+    * @param buf - A heap buffer grown as needed, receives the message NUL terminated
+    * @param cap - The size of buf
+    * @return 1 when a message was taken, 0 when the wait ran out, -1 when the queue is closed and empty
+    */
+    int thingsboard_mpsc_pop(thingsboard_mpsc* queue, int* kind, long long* ts, char** buf, size_t* cap, long wait_ms);
+
+    // Wakes the consumer, pop drains what is left and then returns -1; open lets it run again
+    void thingsboard_mpsc_close(thingsboard_mpsc* queue);
+    void thingsboard_mpsc_open(thingsboard_mpsc* queue);
+
+    // Messages pushed and not popped yet, exact only while no thread is pushing
+    int thingsboard_mpsc_depth(thingsboard_mpsc* queue);
+#endif
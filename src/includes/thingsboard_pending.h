@@ -0,0 +1,47 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#ifndef _THINGSBOARD_PENDING_H_
+#define _THINGSBOARD_PENDING_H_
+    // How long a request waits for its response unless thingsboard_request_timeout_set says otherwise
+    #define THINGSBOARD_REQUEST_TIMEOUT_MS 10000
+
+    // Table size a pending table starts with, it doubles whenever it gets half full
+    #define THINGSBOARD_PENDING_INITIAL 64
+
+    struct thingsboard_pending_entry {
+        int id;
+        bool used;
+        void* cb;
+        long long deadline_ms;
+        // When the request was added, for its round trip time
+        long long sent_us;
+    };
+
+    // Outstanding requests keyed by request id, safe to use from the caller and the transport thread
+    typedef struct thingsboard_pending {
+        pthread_mutex_t lock;
+        struct thingsboard_pending_entry* slots;
+        size_t cap;
+        size_t count;
+    } thingsboard_pending;
+
+    thingsboard_pending* thingsboard_pending_new(void);
+    void thingsboard_pending_free(thingsboard_pending* pending);
+
+    // Returns 0 when added, -1 when the id is already outstanding or memory ran out
+    int thingsboard_pending_add(thingsboard_pending* pending, int id, void* cb, long long deadline_ms);
+
+    // Removes the request and hands back its callback and when it was sent, returns -1 when the id is not outstanding
+    int thingsboard_pending_take(thingsboard_pending* pending, int id, void** cb, long long* sent_us);
+
+    // Removes one request whose deadline has passed, returns -1 when there is none; walks the table, O(cap)
+    int thingsboard_pending_take_expired(thingsboard_pending* pending, long long now_ms, int* id, void** cb, long long* sent_us);
+
+    // The number of outstanding requests
+    int thingsboard_pending_count(thingsboard_pending* pending);
+
+    // The earliest deadline of all outstanding requests, 0 when there are none; walks the table, O(cap)
+    long long thingsboard_pending_deadline(thingsboard_pending* pending);
+#endif
@@ -0,0 +1,83 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <thingsboard.h>
+#include "thingsboard_json.h"
+
+#ifndef _THINGSBOARD_PROTO_H_
+#define _THINGSBOARD_PROTO_H_
+    // Telemetry and attributes each have a schema, indexed by thingsboard_message_class
+    #define THINGSBOARD_PROTO_SCHEMAS 2
+
+    // Field numbers of ThingsBoard's default RPC schemas and of its transport messages
+    #define THINGSBOARD_PROTO_RPC_METHOD          1
+    #define THINGSBOARD_PROTO_RPC_REQUEST_ID      2
+    #define THINGSBOARD_PROTO_RPC_PARAMS          3
+    #define THINGSBOARD_PROTO_RPC_RESPONSE        1
+
+    // Writes a protobuf message into a buffer that is kept between messages
+    typedef struct thingsboard_proto {
+        unsigned char* buf;
+        size_t len;
+        size_t cap;
+        // buf is the caller's storage until a field outgrows it
+        bool owned;
+        // Set when memory ran out, the message is lost until the next reset
+        bool failed;
+        // A value had no field in the schema, the message cannot be sent as is
+        bool incomplete;
+    } thingsboard_proto;
+
+    struct thingsboard_proto_field {
+        char* key;
+        int number;
+        thingsboard_proto_type type;
+    };
+
+    // Maps JSON keys to the fields of the message configured in the device profile, the nested "values" message shares it
+    typedef struct thingsboard_proto_schema {
+        struct thingsboard_proto_field* fields;
+        int count;
+        int cap;
+    } thingsboard_proto_schema;
+
+    // A value as the application handed it, converted to the field's type when written
+    typedef struct thingsboard_proto_value {
+        enum { THINGSBOARD_PROTO_VALUE_INT, THINGSBOARD_PROTO_VALUE_DOUBLE, THINGSBOARD_PROTO_VALUE_BOOL, THINGSBOARD_PROTO_VALUE_STRING } kind;
+        long long i;
+        double d;
+        const char* s;
+        size_t len;
+    } thingsboard_proto_value;
+
+    // storage may be NULL, a stack buffer lets small messages be written without allocating
+    void thingsboard_proto_init(thingsboard_proto* proto, void* storage, size_t cap);
+    void thingsboard_proto_release(thingsboard_proto* proto);
+    void thingsboard_proto_reset(thingsboard_proto* proto);
+
+    // Adds or replaces the field of key, returns 0 on success, -1 when memory ran out
+    int thingsboard_proto_schema_set(thingsboard_proto_schema** schema, const char* key, int number, thingsboard_proto_type type);
+    const struct thingsboard_proto_field* thingsboard_proto_schema_find(const thingsboard_proto_schema* schema, const char* key);
+    void thingsboard_proto_schema_free(thingsboard_proto_schema* schema);
+
+    void thingsboard_proto_bytes(thingsboard_proto* proto, int number, const char* data, size_t len);
+
+    // Writes value as field, returns -1 when it does not fit the field's type
+    int thingsboard_proto_put(thingsboard_proto* proto, const struct thingsboard_proto_field* field, const thingsboard_proto_value* value);
+
+    // The THINGSBOARD_PROTO_MESSAGE field named "values", NULL when the schema sends samples flat
+    const struct thingsboard_proto_field* thingsboard_proto_values_field(const thingsboard_proto_schema* schema);
+
+    // Writes the {"ts","values"} wrapper around an encoded sample, returns -1 when the schema has no values field
+    int thingsboard_proto_wrap(thingsboard_proto* proto, const thingsboard_proto_schema* schema, long long ts, const thingsboard_proto* values);
+
+    // Encodes a JSON object, or every object of a JSON array, by schema as length-delimited messages stamped with now when they carry no ts
+    // Returns how many were written, -1 on malformed JSON, values that do not fit their field or keys missing from the schema
+    int thingsboard_proto_from_json(thingsboard_proto* proto, const thingsboard_proto_schema* schema, const char* json, long long now);
+
+    // Walks the messages thingsboard_proto_from_json wrote, returns NULL after the last one
+    const char* thingsboard_proto_delimited(const thingsboard_proto* proto, size_t* off, size_t* len);
+
+    // Decoders of the messages ThingsBoard sends to Protobuf devices, written into the reused writer *json as the JSON API would deliver them
+    const char* thingsboard_proto_attributes_json(thingsboard_json** json, const char* data, size_t len, size_t* out_len);
+    const char* thingsboard_proto_rpc_json(thingsboard_json** json, const char* data, size_t len, size_t* out_len);
+#endif
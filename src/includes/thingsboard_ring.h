@@ -0,0 +1,40 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <thingsboard.h>
+
+#ifndef _THINGSBOARD_RING_H_
+#define _THINGSBOARD_RING_H_
+    typedef struct thingsboard_ring thingsboard_ring;
+
+    /*
+    * Allocates a ring holding up to max_bytes of messages, headers included
+    *
+    * @param max_bytes - The size of the preallocated buffer
+    * @param max_messages - The maximum number of buffered messages (0 for no limit)
+    * @param policy - What a push does when the ring is full
+    * @param param - The block timeout in ms for THINGSBOARD_OVERFLOW_BLOCK, N for THINGSBOARD_OVERFLOW_EVERY_NTH
+    * @return On success: the ring, On failure: NULL
+    */
+    thingsboard_ring* thingsboard_ring_new(size_t max_bytes, int max_messages, thingsboard_overflow policy, int param);
+    void thingsboard_ring_free(thingsboard_ring* ring);
+
+    // kind and ts are kept with the message for the consumer
+    // Returns 0 when the message was buffered, 1 when the policy rejected it, -1 when it can never fit
+    int thingsboard_ring_push(thingsboard_ring* ring, int kind, long long ts, const char* data, size_t len);
+
+    /*
+    * Takes the oldest message, waiting up to wait_ms for one
+    *
+    * @param ring - The ring
+    * @param buf - A heap buffer grown as needed, receives the message NUL terminated
+    * @param cap - The size of buf
+    * @return 1 when a message was taken, 0 when the wait ran out, -1 when the ring is closed and empty
+    */
+    int thingsboard_ring_pop(thingsboard_ring* ring, int* kind, long long* ts, char** buf, size_t* cap, long wait_ms);
+
+    // Wakes the consumer, pop drains what is left and then returns -1; open lets it run again
+    void thingsboard_ring_close(thingsboard_ring* ring);
+    void thingsboard_ring_open(thingsboard_ring* ring);
+
+    void thingsboard_ring_stats(thingsboard_ring* ring, thingsboard_outbound_stats* stats);
+#endif
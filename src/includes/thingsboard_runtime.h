@@ -0,0 +1,31 @@
+#include <curl/curl.h>
+#include <mosquitto.h>
+#include <thingsboard.h>
+#include "thingsboard_HTTP_io.h"
+#include "thingsboard_MQTT_loop.h"
+
+#ifndef _THINGSBOARD_RUNTIME_H_
+#define _THINGSBOARD_RUNTIME_H_
+    // Network threads per transport unless thingsboard_runtime_threads_set says otherwise
+    #define THINGSBOARD_RUNTIME_THREADS 1
+    #define THINGSBOARD_RUNTIME_THREADS_MAX 16
+    // Cap on queued + in-flight requests of a shared I/O engine, contexts are still held to their own limit
+    #define THINGSBOARD_RUNTIME_IO_MAX_OUTSTANDING 4096
+
+    // Reference counted per API, the first context initializes the library and the last one cleans it up
+    int thingsboard_runtime_acquire(int API);
+    void thingsboard_runtime_release(int API);
+
+    // The DNS and TLS session caches shared by every curl handle, NULL while no HTTP context exists
+    CURLSH* thingsboard_runtime_share(void);
+
+    // Hands out the least loaded shared I/O engine, started on first use
+    thingsboard_HTTP_io* thingsboard_runtime_io_acquire(void);
+
+    // Lets the requests of ctx finish for up to drain_ms, aborts the rest and stops the engine when nobody uses it
+    void thingsboard_runtime_io_release(thingsboard_HTTP_io* io, thingsboard_ctx* ctx, int drain_ms);
+
+    // Puts a connecting client on the least loaded shared network thread
+    thingsboard_MQTT_loop* thingsboard_runtime_mqtt_attach(struct mosquitto* mqtt, const thingsboard_MQTT_hooks* hooks, void* obj);
+    void thingsboard_runtime_mqtt_detach(thingsboard_MQTT_loop* loop, struct mosquitto* mqtt);
+#endif
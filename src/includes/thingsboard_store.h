@@ -0,0 +1,58 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _THINGSBOARD_STORE_H_
+#define _THINGSBOARD_STORE_H_
+    // Kinds of queued records, telemetry records are merged into one array per burst
+    #define THINGSBOARD_STORE_TELEMETRY  0
+    #define THINGSBOARD_STORE_ATTRIBUTES 1
+
+    // Limits of one replay burst
+    #define THINGSBOARD_STORE_BURST_BYTES   (64 * 1024)
+    #define THINGSBOARD_STORE_BURST_RECORDS 256
+
+    // Bursts sent by one thingsboard_loop_forever call
+    #define THINGSBOARD_STORE_REPLAY_BURSTS 16
+
+    // Bounds of the size of one segment file, a store is split into at least two
+    #define THINGSBOARD_STORE_SEGMENT_MIN (64 * 1024)
+    #define THINGSBOARD_STORE_SEGMENT_MAX (4 * 1024 * 1024)
+
+    typedef struct thingsboard_store thingsboard_store;
+
+    /*
+    * Opens the queue kept in dir, recovering every intact record left by a previous run
+    *
+    * @param dir - The directory holding the segment files, created when missing
+    * @param max_bytes - The disk space the segments may take together
+    * @return On success: the store, On failure: NULL
+    */
+    thingsboard_store* thingsboard_store_open(const char* dir, size_t max_bytes);
+    void thingsboard_store_close(thingsboard_store* store);
+
+    // Returns 0 when the record was queued, -1 when it can never fit or the disk failed
+    // When the store is full the oldest segment is dropped to make room
+    int thingsboard_store_append(thingsboard_store* store, int kind, long long ts, const char* data, size_t len);
+
+    // The number of queued records and the timestamp of the oldest one (0 when empty)
+    long thingsboard_store_depth(thingsboard_store* store);
+    long long thingsboard_store_oldest(thingsboard_store* store);
+    unsigned long thingsboard_store_dropped(thingsboard_store* store);
+
+    /*
+    * Builds the next replay burst from the oldest records
+    *
+    * @param store - The store
+    * @param kind - Receives the kind of the burst
+    * @param count - Receives the number of records in the burst
+    * @return The payload, valid until thingsboard_store_release, NULL when the store is empty or a burst is out
+    * @note Telemetry is sent as [{"ts":...,"values":{...}}, ...] so replayed samples keep their original time
+    */
+    const char* thingsboard_store_burst(thingsboard_store* store, int* kind, int* count);
+
+    // Ends the burst, the first sent records are removed from the queue
+    void thingsboard_store_release(thingsboard_store* store, int sent);
+
+    uint32_t thingsboard_crc32(const void* data, size_t len, uint32_t crc);
+#endif
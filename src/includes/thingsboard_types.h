@@ -1,32 +1,126 @@
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <thingsboard.h>
+#include "thingsboard_proto.h"
 
 #ifndef _THINGSBOARD_TYPES_H_
 #define _THINGSBOARD_TYPES_H_
-    #define LOGGING_ENABLED
-
     typedef struct thingsboard_ctx {
         int API;
         void* mqtt;
+        // Shared network thread driving mqtt, NULL while not connected
+        void* mqtt_loop;
         void* http;
+        void* http_headers;
+        // Telemetry bodies of at least compress_threshold bytes are gzipped, 0 sends everything as is
+        atomic_size_t compress_threshold;
+        atomic_int compress_level;
+        // Compressor of the synchronous handle, guarded by http_lock and created on first use
+        struct thingsboard_compressor* compressor;
+        void* http_headers_gzip;
+        // Shared I/O engine taken on the first asynchronous request, the context is held to http_io_max requests on it
+        void* http_io;
+        int http_io_max;
+        atomic_int http_io_outstanding;
+        // Set while the context is detaching, the engine then aborts its remaining requests
+        atomic_bool http_io_cancelled;
+        // Deadband filter in front of the telemetry send paths, created by the first thingsboard_filter_configure
+        struct thingsboard_filter* _Atomic filter;
+        // Telemetry batch, appended to and flushed under batch_lock by whichever thread sends
+        struct thingsboard_batch* batch;
+        pthread_mutex_t batch_lock;
+        // When the batch reaches its age threshold, 0 when empty, read by the loops without taking the lock
+        atomic_llong batch_deadline;
+        // Bounded queue drained by the sender thread, NULL when sends go straight to the transport
+        struct thingsboard_ring* outbound;
+        // Lock-free queue drained by the sender thread instead, for sends from many threads at once
+        struct thingsboard_mpsc* submissions;
+        pthread_t sender;
+        bool sender_running;
+        // On-disk queue of records that could not be delivered, NULL when disabled
+        struct thingsboard_store* store;
+        // Typed telemetry builder, allocated by the first thingsboard_telemetry_begin
+        struct thingsboard_json* builder;
+        // Scratch writer for the SDK's own outbound messages, held under writer_lock until the message is sent
+        struct thingsboard_json* writer;
+        pthread_mutex_t writer_lock;
+        // Last known client and shared attributes, kept current by the subscription paths
+        struct thingsboard_attrs* attrs;
+        // Call latencies and transport counters, see thingsboard_stats_get
+        struct thingsboard_metrics* metrics;
+        // Attribute and RPC requests awaiting their MQTT response, keyed by request id
+        struct thingsboard_pending* attributes_pending;
+        struct thingsboard_pending* rpc_pending;
+        int request_timeout_ms;
+        // QoS per thingsboard_message_class, and the QoS 1 and 2 publishes awaiting their PUBACK
+        int qos[THINGSBOARD_CLASSES];
+        struct thingsboard_inflight* inflight;
+        // thingsboard_payload_format of the MQTT payloads
+        int payload_format;
+        struct thingsboard_proto_schema* proto_schema[THINGSBOARD_PROTO_SCHEMAS];
+        // The typed builder encodes every value for both schemas, the call finishing the record picks one
+        thingsboard_proto proto_record[THINGSBOARD_PROTO_SCHEMAS];
+        bool proto_open;
+        // Decoded attribute updates and RPC requests, used on the network thread only
+        struct thingsboard_json* proto_decoded;
+        // Child devices published through the v1/gateway topics
+        struct thingsboard_gateway* gateway;
+        // HTTP endpoints built once in thingsboard_connect
+        char* url_telemetry;
+        char* url_attributes;
+        char* url_attributes_updates;
+        char* url_rpc;
+        char* url_claim;
+        char* url_provision;
+        // Scratch URL and query of the synchronous requests, guarded by http_lock like the handle
+        char* url_buf;
+        size_t url_rpc_len;
+        void* attributes_curlu;
+        // HTTP long-polls re-armed by the I/O engine, NULL when not polling
+        char* url_attributes_poll;
+        char* url_rpc_poll;
+        void* _Atomic attributes_poll;
+        void* _Atomic rpc_poll;
         char* host;
         int port;
         char* token;
-        bool attributes_subscribed;
-        bool rpc_subscribed;
-        bool attributes_sub_cleaned;
-        bool rpc_sub_cleaned;
-        void (*on_response)(struct thingsboard_ctx* ctx, char* json);
+        // Written and read from the transport threads, every change is followed by thingsboard_ctx_notify
+        atomic_bool attributes_subscribed;
+        atomic_bool rpc_subscribed;
+        atomic_bool attributes_sub_cleaned;
+        atomic_bool rpc_sub_cleaned;
+        // thingsboard_connection_state, changed through thingsboard_ctx_state
+        atomic_int state;
+        void (*on_state)(struct thingsboard_ctx* ctx, thingsboard_connection_state state, int reason);
+        // Reconnect delays, attempts since the last successful CONNACK and the jitter seed belong to the network thread
+        atomic_int backoff_min_ms;
+        atomic_int backoff_max_ms;
+        int reconnect_attempts;
+        unsigned int backoff_seed;
+        pthread_mutex_t lock;
+        pthread_cond_t changed;
+        // Serializes the synchronous requests on the http handle
+        pthread_mutex_t http_lock;
         void (*on_update)(struct thingsboard_ctx* ctx, char* json);
         void (*rpc_on_subscribe)(struct thingsboard_ctx* ctx, char* json, int req_id);
-        void (*rpc_on_response)(struct thingsboard_ctx* ctx, char* json);
     } thingsboard_ctx;
 
-    struct args {
-        thingsboard_ctx* ctx;
-        char* host;
-        int port;
-        char* token;
-        int timeout; 
-        void* cb;
-    };
+    // Wakes everything waiting on the context for a flag or the batch to change
+    static inline void thingsboard_ctx_notify(thingsboard_ctx* ctx)
+    {
+        pthread_mutex_lock(&ctx->lock);
+        pthread_cond_broadcast(&ctx->changed);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    // Moves the context to state and tells the application when that is a change
+    static inline void thingsboard_ctx_state(thingsboard_ctx* ctx, thingsboard_connection_state state, int reason)
+    {
+        if (atomic_exchange(&ctx->state, state) == (int)state) return;
+
+        if (ctx->on_state) ctx->on_state(ctx, state, reason);
+        thingsboard_ctx_notify(ctx);
+    }
 #endif
\ No newline at end of file
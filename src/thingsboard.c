@@ -2,173 +2,1277 @@
 #include <cjson/cJSON.h>
 #include <string.h>
 #include <errno.h>
-#include <syslog.h>
 #include <stdlib.h>
-#include <pthread.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
 
 #include "thingsboard.h"
 #include "thingsboard_types.h"
 #include "thingsboard_MQTT_api.h"
+#include "thingsboard_MQTT_loop.h"
 #include "thingsboard_HTTP_api.h"
+#include "thingsboard_HTTP_io.h"
+#include "thingsboard_runtime.h"
+#include "thingsboard_batch.h"
+#include "thingsboard_store.h"
+#include "thingsboard_ring.h"
+#include "thingsboard_mpsc.h"
+#include "thingsboard_gateway.h"
+#include "thingsboard_pending.h"
+#include "thingsboard_inflight.h"
+#include "thingsboard_json.h"
+#include "thingsboard_compress.h"
+#include "thingsboard_filter.h"
+#include "thingsboard_attrs.h"
+#include "thingsboard_metrics.h"
+#include "thingsboard_log.h"
+
+// Blocks until flag is set, whoever sets it calls thingsboard_ctx_notify
+static void thingsboard_wait(thingsboard_ctx* ctx, atomic_bool* flag)
+{
+    pthread_mutex_lock(&ctx->lock);
+    while (!atomic_load(flag))
+        pthread_cond_wait(&ctx->changed, &ctx->lock);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// Sleeps for up to wait_ms or until notified, the caller holds ctx->lock
+static void thingsboard_wait_ms(thingsboard_ctx* ctx, long wait_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += wait_ms / 1000;
+    deadline.tv_nsec += (wait_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_cond_timedwait(&ctx->changed, &ctx->lock, &deadline);
+}
+
+// Shortens wait_ms so a loop wakes up at a wall clock deadline, a deadline of 0 means there is none
+static long thingsboard_wait_until(long long deadline, long wait_ms)
+{
+    if (deadline == 0) return wait_ms;
+
+    long long left = deadline - thingsboard_time_ms();
+    if (left < 0) left = 0;
+
+    return left < wait_ms ? (long)left : wait_ms;
+}
+
+// Sends to the default topics go through the sender thread, which then owns the telemetry batch
+static bool thingsboard_sender_queued(thingsboard_ctx* ctx)
+{
+    return ctx->outbound != NULL || ctx->submissions != NULL;
+}
+
+// How long a loop may sleep before the batch has to be flushed, with a queue the sender thread flushes it
+static long thingsboard_batch_wait_ms(thingsboard_ctx* ctx, long wait_ms)
+{
+    return thingsboard_wait_until(!thingsboard_sender_queued(ctx) ? atomic_load(&ctx->batch_deadline) : 0, wait_ms);
+}
+
+static bool thingsboard_batch_due_here(thingsboard_ctx* ctx)
+{
+    long long deadline = atomic_load(&ctx->batch_deadline);
+
+    return !thingsboard_sender_queued(ctx) && deadline != 0 && deadline <= thingsboard_time_ms();
+}
+
+// Sends and empties the batch, the caller holds batch_lock
+static thingsboard_code thingsboard_batch_send(thingsboard_ctx* ctx);
+
+static void thingsboard_sender_start(thingsboard_ctx* ctx);
+static void thingsboard_sender_stop(thingsboard_ctx* ctx);
+static bool thingsboard_telemetry_filter(thingsboard_ctx* ctx, char** telemetry_data, char** reduced);
+
+thingsboard_ctx* thingsboard_init(DC_API API)
+{
+    thingsboard_ctx* ctx = (thingsboard_ctx*)malloc(sizeof(thingsboard_ctx));
+    if (ctx == NULL) return NULL;
+
+    thingsboard_log_start();
+
+    ctx->http = NULL;
+    ctx->http_headers = NULL;
+    ctx->http_io = NULL;
+    ctx->http_io_max = THINGSBOARD_HTTP_IO_MAX_OUTSTANDING;
+    atomic_init(&ctx->http_io_outstanding, 0);
+    atomic_init(&ctx->http_io_cancelled, false);
+    ctx->filter = NULL;
+    ctx->batch = NULL;
+    ctx->outbound = NULL;
+    ctx->submissions = NULL;
+    ctx->sender_running = false;
+    ctx->store = NULL;
+    ctx->builder = NULL;
+    ctx->writer = NULL;
+    ctx->attrs = NULL;
+    ctx->metrics = NULL;
+    ctx->attributes_pending = NULL;
+    ctx->rpc_pending = NULL;
+    ctx->gateway = NULL;
+    ctx->request_timeout_ms = THINGSBOARD_REQUEST_TIMEOUT_MS;
+    for (int i = 0; i < THINGSBOARD_CLASSES; i++) ctx->qos[i] = 0;
+    ctx->inflight = NULL;
+    ctx->payload_format = THINGSBOARD_PAYLOAD_JSON;
+    for (int i = 0; i < THINGSBOARD_PROTO_SCHEMAS; i++){
+        ctx->proto_schema[i] = NULL;
+        thingsboard_proto_init(&ctx->proto_record[i], NULL, 0);
+    }
+    ctx->proto_open = false;
+    ctx->proto_decoded = NULL;
+    ctx->compress_threshold = 0;
+    ctx->compress_level = THINGSBOARD_COMPRESS_LEVEL;
+    ctx->compressor = NULL;
+    ctx->http_headers_gzip = NULL;
+    ctx->url_telemetry = NULL;
+    ctx->url_attributes = NULL;
+    ctx->url_attributes_updates = NULL;
+    ctx->url_rpc = NULL;
+    ctx->url_claim = NULL;
+    ctx->url_provision = NULL;
+    ctx->url_buf = NULL;
+    ctx->url_rpc_len = 0;
+    ctx->attributes_curlu = NULL;
+    ctx->url_attributes_poll = NULL;
+    ctx->url_rpc_poll = NULL;
+    ctx->attributes_poll = NULL;
+    ctx->rpc_poll = NULL;
+    ctx->mqtt = NULL;
+    ctx->mqtt_loop = NULL;
+    ctx->API = API;
+    ctx->attributes_subscribed = false;
+    ctx->rpc_subscribed = false;
+    ctx->attributes_sub_cleaned = false;
+    ctx->rpc_sub_cleaned = false;
+    ctx->state = THINGSBOARD_DISCONNECTED;
+    ctx->on_state = NULL;
+    ctx->backoff_min_ms = THINGSBOARD_RECONNECT_MIN_MS;
+    ctx->backoff_max_ms = THINGSBOARD_RECONNECT_MAX_MS;
+    ctx->reconnect_attempts = 0;
+    ctx->backoff_seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)ctx;
+
+    // Waits are measured on the monotonic clock so wall clock jumps cannot stretch them
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->changed, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_mutex_init(&ctx->http_lock, NULL);
+    pthread_mutex_init(&ctx->writer_lock, NULL);
+    pthread_mutex_init(&ctx->batch_lock, NULL);
+    atomic_init(&ctx->batch_deadline, 0);
+
+    if (thingsboard_runtime_acquire(API) != 0){
+        pthread_cond_destroy(&ctx->changed);
+        pthread_mutex_destroy(&ctx->lock);
+        pthread_mutex_destroy(&ctx->http_lock);
+        pthread_mutex_destroy(&ctx->writer_lock);
+        pthread_mutex_destroy(&ctx->batch_lock);
+        thingsboard_log_stop();
+        free(ctx);
+        return NULL;
+    }
+
+    ctx->attrs = thingsboard_attrs_new();
+    ctx->metrics = thingsboard_metrics_new();
+    bool failed = ctx->attrs == NULL || ctx->metrics == NULL;
+
+    if (API == USE_MQTT){
+        ctx->mqtt = mosquitto_new(NULL, true, ctx);
+        ctx->attributes_pending = thingsboard_pending_new();
+        ctx->rpc_pending = thingsboard_pending_new();
+        ctx->gateway = thingsboard_gateway_new();
+        ctx->inflight = thingsboard_inflight_new(THINGSBOARD_INFLIGHT_WINDOW);
+        failed = failed || ctx->mqtt == NULL || ctx->attributes_pending == NULL || ctx->rpc_pending == NULL
+            || ctx->gateway == NULL || ctx->inflight == NULL;
+    }
+    else if (API == USE_HTTP){
+        // One long-lived handle per context keeps its TCP connection alive between requests
+        ctx->http = curl_easy_init();
+        failed = failed || ctx->http == NULL;
+    }
+
+    // Every member is set by now, cleanup frees whatever was allocated
+    if (failed){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_CORE, "Failed to allocate the context");
+        thingsboard_cleanup(ctx);
+        return NULL;
+    }
+
+    if (API == USE_MQTT){
+        mosquitto_connect_callback_set(ctx->mqtt, on_MQTT_connect);
+        mosquitto_message_callback_set(ctx->mqtt, on_MQTT_message);
+        mosquitto_publish_callback_set(ctx->mqtt, on_MQTT_publish);
+        mosquitto_max_inflight_messages_set(ctx->mqtt, THINGSBOARD_INFLIGHT_WINDOW);
+    }
+    else if (API == USE_HTTP)
+        ctx->http_headers = thingsboard_HTTP_setup(ctx->http, NULL);
+
+    return ctx;
+}
+
+void thingsboard_cleanup(thingsboard_ctx* ctx)
+{
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Cleaning up");
+    thingsboard_sender_stop(ctx);
+
+    // The transport threads call back into the context, they let go of it before anything is freed
+    if (ctx->API == USE_MQTT){
+        thingsboard_runtime_mqtt_detach(ctx->mqtt_loop, ctx->mqtt);
+        ctx->mqtt_loop = NULL;
+        mosquitto_disconnect(ctx->mqtt);
+    }
+    else if (ctx->API == USE_HTTP){
+        // Aborted long-polls see they are no longer wanted
+        ctx->attributes_subscribed = false;
+        ctx->rpc_subscribed = false;
+        thingsboard_runtime_io_release(ctx->http_io, ctx, 0);
+        ctx->http_io = NULL;
+    }
+
+    thingsboard_ring_free(ctx->outbound);
+    thingsboard_mpsc_free(ctx->submissions);
+    thingsboard_batch_free(ctx->batch);
+    thingsboard_store_close(ctx->store);
+    thingsboard_json_free(ctx->builder);
+    thingsboard_filter_free(ctx->filter);
+    thingsboard_attrs_free(ctx->attrs);
+    thingsboard_json_free(ctx->writer);
+    if (ctx->API == USE_MQTT){
+        // Mosquitto cleanup, the library itself stays up for the other contexts
+        mosquitto_destroy(ctx->mqtt);
+        thingsboard_pending_free(ctx->attributes_pending);
+        thingsboard_pending_free(ctx->rpc_pending);
+        thingsboard_gateway_free(ctx->gateway);
+        thingsboard_inflight_free(ctx->inflight);
+        for (int i = 0; i < THINGSBOARD_PROTO_SCHEMAS; i++){
+            thingsboard_proto_schema_free(ctx->proto_schema[i]);
+            thingsboard_proto_release(&ctx->proto_record[i]);
+        }
+        thingsboard_json_free(ctx->proto_decoded);
+    }
+    else if (ctx->API == USE_HTTP){
+        // Curl cleanup
+        curl_easy_cleanup(ctx->http);
+        curl_slist_free_all(ctx->http_headers);
+        curl_slist_free_all(ctx->http_headers_gzip);
+        thingsboard_compressor_free(ctx->compressor);
+        thingsboard_HTTP_endpoints_free(ctx);
+    }
+    // Aborted transfers still report to the statistics while the transport shuts down
+    thingsboard_metrics_free(ctx->metrics);
+    thingsboard_runtime_release(ctx->API);
+    pthread_cond_destroy(&ctx->changed);
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_mutex_destroy(&ctx->http_lock);
+    pthread_mutex_destroy(&ctx->writer_lock);
+    pthread_mutex_destroy(&ctx->batch_lock);
+    free(ctx);
+
+    thingsboard_log_stop();
+}
+
+// The address is looked up once here, reconnects from the shared network thread then never wait for DNS
+static const char* thingsboard_resolve(const char* host, char* addr, size_t addr_len)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* res = NULL;
+
+    if (getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL) return host;
+
+    int rc = getnameinfo(res->ai_addr, res->ai_addrlen, addr, (socklen_t)addr_len, NULL, 0, NI_NUMERICHOST);
+    freeaddrinfo(res);
+
+    return rc == 0 ? addr : host;
+}
+
+thingsboard_code thingsboard_connect(thingsboard_ctx* ctx, char* host, int port, char* token)
+{
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Connecting to %s:%d", host, port);
+
+    if (ctx == NULL){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_CORE, "Failed to connect: ctx is NULL");
+        return THINGSBOARD_UNKNOWN_ERROR;
+    }
+
+    if (ctx->API == USE_MQTT){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Using MQTT API");
+        int res = mosquitto_username_pw_set(ctx->mqtt, token, NULL);
+        if (res != MOSQ_ERR_SUCCESS){
+            THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_CORE, "Failed to set username and password: %s", mosquitto_strerror(res));
+            return THINGSBOARD_UNKNOWN_ERROR;   
+        }
+        // Set before the CONNACK can arrive on the network thread
+        ctx->reconnect_attempts = 0;
+        thingsboard_ctx_state(ctx, THINGSBOARD_CONNECTING, 0);
+        char addr[NI_MAXHOST];
+        res = mosquitto_connect_async(ctx->mqtt, thingsboard_resolve(host, addr, sizeof(addr)), port, 60);
+        if (res != MOSQ_ERR_SUCCESS){
+            THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_CORE, "Failed to connect: %s", mosquitto_strerror(res));
+            thingsboard_ctx_state(ctx, THINGSBOARD_DISCONNECTED, res);
+            return THINGSBOARD_UNKNOWN_ERROR;
+        }
+        // Contexts share a few network threads instead of running one each, the thread also reconnects with backoff
+        if (ctx->mqtt_loop == NULL)
+            ctx->mqtt_loop = thingsboard_runtime_mqtt_attach(ctx->mqtt, &thingsboard_MQTT_supervisor, ctx);
+        if (ctx->mqtt_loop == NULL){
+            THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_CORE, "Failed to start the MQTT network thread");
+            thingsboard_ctx_state(ctx, THINGSBOARD_DISCONNECTED, 0);
+            return THINGSBOARD_UNKNOWN_ERROR;
+        }
+        THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "MQTT connected to %s:%d", host, port);
+    }
+    else if (ctx->API == USE_HTTP)
+        THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Using HTTP API");
+
+    ctx->host = host;
+    ctx->token = token;
+    ctx->port = port;
+
+    if (ctx->API == USE_HTTP && thingsboard_HTTP_endpoints_build(ctx) != 0){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_CORE, "Failed to build HTTP endpoints");
+        return THINGSBOARD_UNKNOWN_ERROR;
+    }
+    // Requests are independent, HTTP has no connection to lose
+    if (ctx->API == USE_HTTP) thingsboard_ctx_state(ctx, THINGSBOARD_CONNECTED, 0);
+
+    // Messages queued while disconnected go out now
+    thingsboard_sender_start(ctx);
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_disconnect(thingsboard_ctx* ctx)
+{
+    if (ctx == NULL) return THINGSBOARD_UNKNOWN_ERROR;
+
+    ctx->attributes_subscribed = false;
+    ctx->rpc_subscribed = false;
+    thingsboard_ctx_notify(ctx);
+    if (ctx->attrs != NULL) thingsboard_attrs_live(ctx->attrs, false);
+
+    // Queued messages and pending samples go out while the transport is still up
+    thingsboard_sender_stop(ctx);
+    thingsboard_batch_flush(ctx);
+
+    if (ctx->API == USE_MQTT){
+        thingsboard_gateway_flush_MQTT(ctx);
+        // Acknowledgements still come in while the network thread drives the client, on that thread nothing would read them
+        thingsboard_inflight_drain(ctx->inflight, thingsboard_MQTT_loop_current() ? 0 : 5000);
+        thingsboard_runtime_mqtt_detach(ctx->mqtt_loop, ctx->mqtt);
+        ctx->mqtt_loop = NULL;
+
+        thingsboard_inflight_fn on_sent;
+        bool abandoned = false;
+        while (thingsboard_inflight_abandon(ctx->inflight, &on_sent) == 0){
+            abandoned = true;
+            if (on_sent) on_sent(ctx, THINGSBOARD_UNKNOWN_ERROR);
+        }
+        // The filter took the abandoned values as sent
+        if (abandoned && ctx->filter != NULL) thingsboard_filter_rearm(ctx->filter);
+        // Nothing can answer outstanding requests any more
+        thingsboard_requests_expire_MQTT(ctx, LLONG_MAX);
+        int res = mosquitto_disconnect(ctx->mqtt);
+        if (res == MOSQ_ERR_INVAL) return THINGSBOARD_UNKNOWN_ERROR;
+    } else if (ctx->API == USE_HTTP){
+        thingsboard_runtime_io_release(ctx->http_io, ctx, 5000);
+        ctx->http_io = NULL;
+        curl_easy_reset(ctx->http);
+        ctx->http_headers = thingsboard_HTTP_setup(ctx->http, ctx->http_headers);
+    }
+
+    thingsboard_ctx_state(ctx, THINGSBOARD_DISCONNECTED, 0);
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Disconnected");
+
+    return THINGSBOARD_SUCCESS;
+}
+
+static thingsboard_code thingsboard_telemetry_transmit(thingsboard_ctx* ctx, char* telemetry_data, char* topic)
+{
+    switch(ctx->API){
+        case USE_MQTT:
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Sending telemetry data via MQTT");
+            if (topic == NULL) topic = "v1/devices/me/telemetry";
+            return thingsboard_telemetry_send_MQTT(ctx, telemetry_data, topic);
+        case USE_HTTP:
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Sending telemetry data via HTTP");
+            return thingsboard_telemetry_send_HTTP(ctx, telemetry_data, ctx->url_telemetry);
+        default:
+            return THINGSBOARD_UNKNOWN_ERROR;
+    }
+}
+
+static thingsboard_code thingsboard_attributes_transmit(thingsboard_ctx* ctx, char* attribute_data)
+{
+    switch(ctx->API)
+    {
+        case USE_MQTT:
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Publishing attributes via MQTT");
+            return thingsboard_publish_payload_MQTT(ctx, THINGSBOARD_CLASS_ATTRIBUTES, THINGSBOARD_TOPIC_ATTRIBUTES, attribute_data, NULL, true);
+        case USE_HTTP:
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Publishing attributes via HTTP");
+            return thingsboard_telemetry_send_HTTP(ctx, attribute_data, ctx->url_attributes);
+        default:
+            return THINGSBOARD_UNKNOWN_ERROR;
+    }
+}
+
+// A record the server rejected would fail the same way on every replay
+static bool thingsboard_retryable(thingsboard_code res)
+{
+    return res != THINGSBOARD_SUCCESS && res != THINGSBOARD_BAD_REQUEST;
+}
+
+// Sends queued records in bursts until the queue is empty, a burst fails or max_bursts went out
+static void thingsboard_store_replay(thingsboard_ctx* ctx, int max_bursts)
+{
+    const char* burst;
+    int kind, count;
+
+    while (max_bursts-- > 0 && (burst = thingsboard_store_burst(ctx->store, &kind, &count)) != NULL){
+        thingsboard_code res = kind == THINGSBOARD_STORE_TELEMETRY
+            ? thingsboard_telemetry_transmit(ctx, (char*)burst, NULL)
+            : thingsboard_attributes_transmit(ctx, (char*)burst);
+
+        if (thingsboard_retryable(res)){
+            thingsboard_store_release(ctx->store, 0);
+            return;
+        }
+
+        if (res != THINGSBOARD_SUCCESS)
+            THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_CORE, "Dropping %d queued records rejected by the server", count);
+        else
+            THINGSBOARD_LOG(THINGSBOARD_LOG_DEBUG, THINGSBOARD_LOG_CORE, "Replayed %d queued records", count);
+
+        thingsboard_store_release(ctx->store, count);
+    }
+}
+
+// Sends to the default topic, with a queue configured undeliverable records are kept for a later replay
+static thingsboard_code thingsboard_deliver(thingsboard_ctx* ctx, int kind, char* data)
+{
+    thingsboard_code res = kind == THINGSBOARD_STORE_TELEMETRY
+        ? thingsboard_telemetry_transmit(ctx, data, NULL)
+        : thingsboard_attributes_transmit(ctx, data);
+
+    if (ctx->store == NULL) return res;
+
+    // The transport is up again, the backlog follows one burst per send
+    if (res == THINGSBOARD_SUCCESS){
+        thingsboard_store_replay(ctx, 1);
+        return res;
+    }
+
+    if (!thingsboard_retryable(res) || thingsboard_store_append(ctx->store, kind, thingsboard_time_ms(), data, strlen(data)) != 0)
+        return res;
+
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Delivery failed, record queued");
+
+    return THINGSBOARD_SUCCESS;
+}
+
+static thingsboard_code thingsboard_telemetry_batch(thingsboard_ctx* ctx, char* telemetry_data, long long now)
+{
+    thingsboard_batch* batch = ctx->batch;
+    thingsboard_code res = THINGSBOARD_SUCCESS;
+    size_t len = strlen(telemetry_data);
+
+    pthread_mutex_lock(&ctx->batch_lock);
+
+    if (thingsboard_batch_append(batch, now, telemetry_data, len) != 0){
+        res = thingsboard_batch_send(ctx);
+
+        // A sample larger than the whole batch goes out on its own
+        if (thingsboard_batch_append(batch, now, telemetry_data, len) != 0){
+            thingsboard_code single = thingsboard_deliver(ctx, THINGSBOARD_STORE_TELEMETRY, telemetry_data);
+            pthread_mutex_unlock(&ctx->batch_lock);
+            return res != THINGSBOARD_SUCCESS ? res : single;
+        }
+    }
+
+    if (thingsboard_batch_due(batch, thingsboard_time_ms()))
+        res = thingsboard_batch_send(ctx);
+
+    atomic_store(&ctx->batch_deadline, thingsboard_batch_deadline(batch));
+    pthread_mutex_unlock(&ctx->batch_lock);
+
+    return res;
+}
+
+// Flushes the batch once it reached its count or age threshold
+static void thingsboard_batch_flush_due(thingsboard_ctx* ctx)
+{
+    if (ctx->batch == NULL) return;
+
+    pthread_mutex_lock(&ctx->batch_lock);
+    if (thingsboard_batch_due(ctx->batch, thingsboard_time_ms())) thingsboard_batch_send(ctx);
+    pthread_mutex_unlock(&ctx->batch_lock);
+}
+
+// Takes the next message from whichever queue feeds the sender thread
+static int thingsboard_sender_pop(thingsboard_ctx* ctx, int* kind, long long* ts, char** buf, size_t* cap, long wait_ms)
+{
+    if (ctx->submissions != NULL) return thingsboard_mpsc_pop(ctx->submissions, kind, ts, buf, cap, wait_ms);
+
+    return thingsboard_ring_pop(ctx->outbound, kind, ts, buf, cap, wait_ms);
+}
+
+// Batched samples keep the time they were queued at
+static void thingsboard_sender_forward(thingsboard_ctx* ctx, int kind, char* data, long long ts)
+{
+    if (kind != THINGSBOARD_STORE_TELEMETRY){
+        thingsboard_deliver(ctx, kind, data);
+        return;
+    }
+
+    // Submitted telemetry is filtered here rather than on the application's threads
+    char* reduced = NULL;
+    if (ctx->submissions != NULL && !thingsboard_telemetry_filter(ctx, &data, &reduced)) return;
+
+    thingsboard_code res = ctx->batch ? thingsboard_telemetry_batch(ctx, data, ts) : thingsboard_deliver(ctx, kind, data);
+    free(reduced);
+
+    // Values the filter let through are recorded as sent, whichever queue they came from
+    if (res != THINGSBOARD_SUCCESS && ctx->filter != NULL) thingsboard_filter_rearm(ctx->filter);
+}
+
+static void* thingsboard_sender_run(void* arg)
+{
+    thingsboard_ctx* ctx = (thingsboard_ctx*)arg;
+    char* buf = NULL;
+    size_t cap = 0;
+    long long ts;
+    int kind;
+
+    while (1){
+        long wait_ms = thingsboard_wait_until(atomic_load(&ctx->batch_deadline), 1000);
+        int res = thingsboard_sender_pop(ctx, &kind, &ts, &buf, &cap, wait_ms);
+        if (res < 0) break;
+        if (res > 0) thingsboard_sender_forward(ctx, kind, buf, ts);
+
+        thingsboard_batch_flush_due(ctx);
+    }
+
+    thingsboard_batch_flush(ctx);
+    free(buf);
+
+    return NULL;
+}
+
+static void thingsboard_sender_start(thingsboard_ctx* ctx)
+{
+    if (!thingsboard_sender_queued(ctx) || ctx->sender_running) return;
+
+    ctx->sender_running = pthread_create(&ctx->sender, NULL, thingsboard_sender_run, ctx) == 0;
+    if (!ctx->sender_running)
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_CORE, "Failed to start the outbound sender thread");
+}
+
+// Returns once everything queued went to the transport, messages sent afterwards wait for the next start
+static void thingsboard_sender_stop(thingsboard_ctx* ctx)
+{
+    if (!ctx->sender_running) return;
+
+    if (ctx->submissions != NULL){
+        thingsboard_mpsc_close(ctx->submissions);
+        pthread_join(ctx->sender, NULL);
+        thingsboard_mpsc_open(ctx->submissions);
+    }
+    else {
+        thingsboard_ring_close(ctx->outbound);
+        pthread_join(ctx->sender, NULL);
+        thingsboard_ring_open(ctx->outbound);
+    }
+    ctx->sender_running = false;
+}
+
+static thingsboard_code thingsboard_enqueue(thingsboard_ctx* ctx, int kind, char* data)
+{
+    switch (thingsboard_ring_push(ctx->outbound, kind, thingsboard_time_ms(), data, strlen(data))){
+        case 0:
+            return THINGSBOARD_SUCCESS;
+        case 1:
+            THINGSBOARD_LOG(THINGSBOARD_LOG_DEBUG, THINGSBOARD_LOG_CORE, "Outbound queue full, message dropped");
+            return THINGSBOARD_BUSY;
+        default:
+            THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_CORE, "Message larger than the outbound queue");
+            return THINGSBOARD_BAD_REQUEST;
+    }
+}
+
+// Hands the message to the sender thread without taking a lock
+static thingsboard_code thingsboard_submit(thingsboard_ctx* ctx, int kind, char* data)
+{
+    switch (thingsboard_mpsc_push(ctx->submissions, kind, thingsboard_time_ms(), data, strlen(data))){
+        case 0:
+            return THINGSBOARD_SUCCESS;
+        case 1:
+            THINGSBOARD_LOG(THINGSBOARD_LOG_DEBUG, THINGSBOARD_LOG_CORE, "Submission queue full, message dropped");
+            return THINGSBOARD_BUSY;
+        default:
+            return THINGSBOARD_UNKNOWN_ERROR;
+    }
+}
+
+// Leaves out the values that stayed within their deadband, returns false when none is left
+static bool thingsboard_telemetry_filter(thingsboard_ctx* ctx, char** telemetry_data, char** reduced)
+{
+    *reduced = NULL;
+
+    thingsboard_filter* filter = ctx->filter;
+    if (filter == NULL) return true;
+
+    switch (thingsboard_filter_apply(filter, *telemetry_data, reduced)){
+        case THINGSBOARD_FILTER_SUPPRESSED:
+            THINGSBOARD_LOG(THINGSBOARD_LOG_DEBUG, THINGSBOARD_LOG_CORE, "Telemetry unchanged, message not sent");
+            return false;
+        case THINGSBOARD_FILTER_REDUCED:
+            *telemetry_data = *reduced;
+            return true;
+        default:
+            return true;
+    }
+}
+
+static thingsboard_code thingsboard_telemetry_route(thingsboard_ctx* ctx, char* telemetry_data, char* topic)
+{
+    if (ctx->outbound != NULL && topic == NULL)
+        return thingsboard_enqueue(ctx, THINGSBOARD_STORE_TELEMETRY, telemetry_data);
+
+    if (ctx->batch != NULL && topic == NULL)
+        return thingsboard_telemetry_batch(ctx, telemetry_data, thingsboard_time_ms());
+
+    if (topic == NULL) return thingsboard_deliver(ctx, THINGSBOARD_STORE_TELEMETRY, telemetry_data);
+
+    return thingsboard_telemetry_transmit(ctx, telemetry_data, topic);
+}
+
+static thingsboard_code thingsboard_telemetry_submit(thingsboard_ctx* ctx, char* telemetry_data, char* topic)
+{
+    if (topic != NULL) return thingsboard_telemetry_route(ctx, telemetry_data, topic);
+    if (ctx->submissions != NULL) return thingsboard_submit(ctx, THINGSBOARD_STORE_TELEMETRY, telemetry_data);
+
+    char* reduced;
+    if (!thingsboard_telemetry_filter(ctx, &telemetry_data, &reduced)) return THINGSBOARD_SUCCESS;
+
+    thingsboard_code res = thingsboard_telemetry_route(ctx, telemetry_data, topic);
+    free(reduced);
+
+    // Values that did not get through must not hold back the next ones
+    if (res != THINGSBOARD_SUCCESS && ctx->filter != NULL) thingsboard_filter_rearm(ctx->filter);
+
+    return res;
+}
+
+thingsboard_code thingsboard_telemetry_send(thingsboard_ctx* ctx, char* telemetry_data, char* topic)
+{
+    if (ctx == NULL || telemetry_data == NULL) return THINGSBOARD_UNKNOWN_ERROR;
+
+    long long start = thingsboard_metrics_now_us();
+
+    return thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_TELEMETRY, start, thingsboard_telemetry_submit(ctx, telemetry_data, topic));
+}
+
+// Batches and replayed bursts are {"ts","values"} samples, with Protobuf the telemetry schema has to be able to carry them
+static bool thingsboard_samples_encodable(thingsboard_ctx* ctx, int format)
+{
+    const thingsboard_proto_schema* schema = ctx->proto_schema[THINGSBOARD_CLASS_TELEMETRY];
+    if (format != THINGSBOARD_PAYLOAD_PROTOBUF || (thingsboard_proto_values_field(schema) != NULL && thingsboard_proto_schema_find(schema, "ts") != NULL))
+        return true;
+
+    THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_CORE, "Batching and the persistent queue need \"ts\" and \"values\" fields in the Protobuf telemetry schema");
+
+    return false;
+}
+
+thingsboard_code thingsboard_batch_configure(thingsboard_ctx* ctx, int max_bytes, int max_count, int max_age_ms)
+{
+    if (ctx == NULL || max_bytes < 0 || max_count < 0 || max_age_ms < 0) return THINGSBOARD_BAD_REQUEST;
+    if (max_bytes > 0 && !thingsboard_samples_encodable(ctx, ctx->payload_format)) return THINGSBOARD_BAD_REQUEST;
+
+    // The sender thread must not hold on to the old batch
+    bool sending = ctx->sender_running;
+    thingsboard_sender_stop(ctx);
+
+    pthread_mutex_lock(&ctx->batch_lock);
+    thingsboard_code res = thingsboard_batch_send(ctx);
+    thingsboard_batch_free(ctx->batch);
+    ctx->batch = NULL;
+
+    if (max_bytes > 0){
+        ctx->batch = thingsboard_batch_new(max_bytes, max_count, max_age_ms);
+        if (ctx->batch == NULL) res = THINGSBOARD_UNKNOWN_ERROR;
+        else THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Telemetry batching enabled: %d bytes, %d samples, %d ms", max_bytes, max_count, max_age_ms);
+    }
+    pthread_mutex_unlock(&ctx->batch_lock);
+
+    if (sending) thingsboard_sender_start(ctx);
+
+    return res;
+}
+
+static thingsboard_code thingsboard_batch_send(thingsboard_ctx* ctx)
+{
+    if (ctx->batch == NULL || ctx->batch->count == 0) return THINGSBOARD_SUCCESS;
+
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Flushing %d batched samples", ctx->batch->count);
+
+    thingsboard_code res = thingsboard_deliver(ctx, THINGSBOARD_STORE_TELEMETRY, thingsboard_batch_payload(ctx->batch));
+    thingsboard_batch_reset(ctx->batch);
+    atomic_store(&ctx->batch_deadline, 0);
+
+    return res;
+}
+
+// The sender thread appends to the batch and flushes it at the same time, both hold batch_lock
+thingsboard_code thingsboard_batch_flush(thingsboard_ctx* ctx)
+{
+    if (ctx == NULL) return THINGSBOARD_UNKNOWN_ERROR;
+
+    pthread_mutex_lock(&ctx->batch_lock);
+    thingsboard_code res = thingsboard_batch_send(ctx);
+    pthread_mutex_unlock(&ctx->batch_lock);
+
+    return res;
+}
+
+thingsboard_code thingsboard_queue_configure(thingsboard_ctx* ctx, const char* dir, long max_bytes)
+{
+    if (ctx == NULL || max_bytes < 0) return THINGSBOARD_BAD_REQUEST;
+    if (dir != NULL && max_bytes > 0 && !thingsboard_samples_encodable(ctx, ctx->payload_format)) return THINGSBOARD_BAD_REQUEST;
+
+    bool sending = ctx->sender_running;
+    thingsboard_sender_stop(ctx);
+
+    thingsboard_store_close(ctx->store);
+    ctx->store = NULL;
+
+    thingsboard_code res = THINGSBOARD_SUCCESS;
+
+    if (dir != NULL && max_bytes > 0){
+        ctx->store = thingsboard_store_open(dir, (size_t)max_bytes);
+        if (ctx->store == NULL){
+            THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_CORE, "Failed to open the persistent queue in %s: %s", dir, strerror(errno));
+            res = THINGSBOARD_UNKNOWN_ERROR;
+        }
+        else THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Persistent queue enabled in %s: %ld bytes, %ld records recovered", dir, max_bytes, thingsboard_store_depth(ctx->store));
+    }
+
+    if (sending) thingsboard_sender_start(ctx);
+
+    return res;
+}
+
+thingsboard_code thingsboard_outbound_configure(thingsboard_ctx* ctx, size_t max_bytes, int max_messages, thingsboard_overflow policy, int param)
+{
+    if (ctx == NULL || max_messages < 0 || param < 0) return THINGSBOARD_BAD_REQUEST;
+    if (ctx->submissions != NULL && max_bytes > 0) return THINGSBOARD_BAD_REQUEST;
+    if (policy < THINGSBOARD_OVERFLOW_BLOCK || policy > THINGSBOARD_OVERFLOW_EVERY_NTH) return THINGSBOARD_BAD_REQUEST;
+
+    // Whatever the old queue holds goes to the transport first
+    thingsboard_sender_stop(ctx);
+    thingsboard_ring_free(ctx->outbound);
+    ctx->outbound = NULL;
+
+    if (max_bytes == 0) return THINGSBOARD_SUCCESS;
+
+    ctx->outbound = thingsboard_ring_new(max_bytes, max_messages, policy, param);
+    if (ctx->outbound == NULL) return THINGSBOARD_UNKNOWN_ERROR;
+
+    thingsboard_sender_start(ctx);
+    if (!ctx->sender_running){
+        thingsboard_ring_free(ctx->outbound);
+        ctx->outbound = NULL;
+        return THINGSBOARD_UNKNOWN_ERROR;
+    }
+
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Outbound queue enabled: %zu bytes, %d messages, policy %d", max_bytes, max_messages, policy);
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_submission_configure(thingsboard_ctx* ctx, int max_messages)
+{
+    if (ctx == NULL || max_messages < 0) return THINGSBOARD_BAD_REQUEST;
+    if (ctx->outbound != NULL && max_messages > 0) return THINGSBOARD_BAD_REQUEST;
+
+    // Whatever the old queue holds goes to the transport first
+    thingsboard_sender_stop(ctx);
+    thingsboard_mpsc_free(ctx->submissions);
+    ctx->submissions = NULL;
+
+    if (max_messages == 0) return THINGSBOARD_SUCCESS;
+
+    ctx->submissions = thingsboard_mpsc_new(max_messages);
+    if (ctx->submissions == NULL) return THINGSBOARD_UNKNOWN_ERROR;
+
+    thingsboard_sender_start(ctx);
+    if (!ctx->sender_running){
+        thingsboard_mpsc_free(ctx->submissions);
+        ctx->submissions = NULL;
+        return THINGSBOARD_UNKNOWN_ERROR;
+    }
+
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Submission queue enabled: %d messages", max_messages);
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_outbound_stats_get(thingsboard_ctx* ctx, thingsboard_outbound_stats* stats)
+{
+    if (ctx == NULL || stats == NULL || ctx->outbound == NULL) return THINGSBOARD_BAD_REQUEST;
+
+    thingsboard_ring_stats(ctx->outbound, stats);
+
+    return THINGSBOARD_SUCCESS;
+}
+
+// The queue depths as they are now
+static void thingsboard_stats_queues(thingsboard_ctx* ctx, thingsboard_stats* stats)
+{
+    if (ctx->outbound != NULL){
+        thingsboard_outbound_stats outbound;
+        thingsboard_ring_stats(ctx->outbound, &outbound);
+        stats->outbound_messages = outbound.messages;
+        stats->outbound_bytes = outbound.bytes;
+    }
+
+    if (ctx->submissions != NULL) stats->submitted_messages = thingsboard_mpsc_depth(ctx->submissions);
+
+    if (ctx->inflight != NULL){
+        thingsboard_publish_stats publish;
+        thingsboard_inflight_stats(ctx->inflight, &publish);
+        stats->inflight = publish.inflight;
+    }
+
+    stats->stored_records = thingsboard_store_depth(ctx->store);
+    stats->pending_requests = thingsboard_pending_count(ctx->attributes_pending) + thingsboard_pending_count(ctx->rpc_pending);
+    stats->async_outstanding = ctx->http_io_outstanding;
+}
+
+thingsboard_code thingsboard_stats_get(thingsboard_ctx* ctx, thingsboard_stats* stats)
+{
+    if (ctx == NULL || stats == NULL) return THINGSBOARD_BAD_REQUEST;
+
+    thingsboard_metrics_snapshot(ctx->metrics, stats);
+    thingsboard_stats_queues(ctx, stats);
+
+    return THINGSBOARD_SUCCESS;
+}
+
+long thingsboard_stats_prometheus(thingsboard_ctx* ctx, const char* labels, char* buf, size_t size)
+{
+    if (ctx == NULL) return -1;
+
+    thingsboard_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    thingsboard_stats_queues(ctx, &stats);
+
+    return (long)thingsboard_metrics_prometheus(ctx->metrics, &stats, labels, buf, size);
+}
+
+long thingsboard_queue_depth(thingsboard_ctx* ctx)
+{
+    return ctx ? thingsboard_store_depth(ctx->store) : 0;
+}
+
+long long thingsboard_queue_oldest(thingsboard_ctx* ctx)
+{
+    return ctx ? thingsboard_store_oldest(ctx->store) : 0;
+}
+
+unsigned long thingsboard_queue_dropped(thingsboard_ctx* ctx)
+{
+    return ctx ? thingsboard_store_dropped(ctx->store) : 0;
+}
+
+thingsboard_code thingsboard_telemetry_begin(thingsboard_ctx* ctx)
+{
+    if (ctx == NULL) return THINGSBOARD_UNKNOWN_ERROR;
+
+    if (ctx->payload_format == THINGSBOARD_PAYLOAD_PROTOBUF){
+        for (int i = 0; i < THINGSBOARD_PROTO_SCHEMAS; i++) thingsboard_proto_reset(&ctx->proto_record[i]);
+        ctx->proto_open = true;
+        return THINGSBOARD_SUCCESS;
+    }
+
+    if (ctx->builder == NULL){
+        ctx->builder = thingsboard_json_new();
+        if (ctx->builder == NULL) return THINGSBOARD_UNKNOWN_ERROR;
+    }
+
+    thingsboard_json_reset(ctx->builder);
+    thingsboard_json_object_begin(ctx->builder);
+
+    return THINGSBOARD_SUCCESS;
+}
+
+// A record is open from thingsboard_telemetry_begin until it is finished, which empties the builder
+static thingsboard_json* thingsboard_builder(thingsboard_ctx* ctx, const char* key)
+{
+    if (ctx == NULL || key == NULL || ctx->builder == NULL || ctx->builder->len == 0) return NULL;
+
+    thingsboard_json_key(ctx->builder, key);
+
+    return ctx->builder;
+}
+
+// Encodes the value into the record of every schema that knows the key, one that does not can no longer be finished
+static thingsboard_code thingsboard_record_put(thingsboard_ctx* ctx, const char* key, const thingsboard_proto_value* value)
+{
+    if (key == NULL || !ctx->proto_open) return THINGSBOARD_BAD_REQUEST;
+
+    bool known = false;
+    for (int i = 0; i < THINGSBOARD_PROTO_SCHEMAS; i++){
+        const struct thingsboard_proto_field* field = thingsboard_proto_schema_find(ctx->proto_schema[i], key);
+
+        if (field == NULL || thingsboard_proto_put(&ctx->proto_record[i], field, value) != 0) ctx->proto_record[i].incomplete = true;
+        else known = true;
+    }
+
+    return known ? THINGSBOARD_SUCCESS : THINGSBOARD_BAD_REQUEST;
+}
+
+// Whether the typed builder encodes Protobuf records instead of JSON documents
+static inline bool thingsboard_record_proto(thingsboard_ctx* ctx)
+{
+    return ctx != NULL && ctx->payload_format == THINGSBOARD_PAYLOAD_PROTOBUF;
+}
+
+thingsboard_code thingsboard_telemetry_add_int(thingsboard_ctx* ctx, const char* key, long long value)
+{
+    if (thingsboard_record_proto(ctx))
+        return thingsboard_record_put(ctx, key, &(thingsboard_proto_value){ .kind = THINGSBOARD_PROTO_VALUE_INT, .i = value });
+
+    thingsboard_json* json = thingsboard_builder(ctx, key);
+    if (json == NULL) return THINGSBOARD_BAD_REQUEST;
+
+    thingsboard_json_int(json, value);
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_telemetry_add_double(thingsboard_ctx* ctx, const char* key, double value)
+{
+    if (thingsboard_record_proto(ctx))
+        return thingsboard_record_put(ctx, key, &(thingsboard_proto_value){ .kind = THINGSBOARD_PROTO_VALUE_DOUBLE, .d = value });
+
+    thingsboard_json* json = thingsboard_builder(ctx, key);
+    if (json == NULL) return THINGSBOARD_BAD_REQUEST;
+
+    thingsboard_json_double(json, value);
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_telemetry_add_bool(thingsboard_ctx* ctx, const char* key, int value)
+{
+    if (thingsboard_record_proto(ctx))
+        return thingsboard_record_put(ctx, key, &(thingsboard_proto_value){ .kind = THINGSBOARD_PROTO_VALUE_BOOL, .i = value != 0 });
+
+    thingsboard_json* json = thingsboard_builder(ctx, key);
+    if (json == NULL) return THINGSBOARD_BAD_REQUEST;
+
+    thingsboard_json_bool(json, value != 0);
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_telemetry_add_string(thingsboard_ctx* ctx, const char* key, const char* value)
+{
+    if (thingsboard_record_proto(ctx)){
+        if (value == NULL) return THINGSBOARD_SUCCESS;
+        return thingsboard_record_put(ctx, key, &(thingsboard_proto_value){ .kind = THINGSBOARD_PROTO_VALUE_STRING, .s = value, .len = strlen(value) });
+    }
+
+    thingsboard_json* json = thingsboard_builder(ctx, key);
+    if (json == NULL) return THINGSBOARD_BAD_REQUEST;
+
+    thingsboard_json_string(json, value);
+
+    return THINGSBOARD_SUCCESS;
+}
+
+// Closes the open record and hands out the document, valid until the next thingsboard_telemetry_begin
+static thingsboard_code thingsboard_builder_finish(thingsboard_ctx* ctx, char** record)
+{
+    if (ctx == NULL || ctx->builder == NULL || ctx->builder->len == 0) return THINGSBOARD_BAD_REQUEST;
+
+    thingsboard_json_object_end(ctx->builder);
+    *record = (char*)thingsboard_json_result(ctx->builder);
+
+    ctx->builder->len = 0;
 
-thingsboard_ctx* thingsboard_init(DC_API API)
+    return *record ? THINGSBOARD_SUCCESS : THINGSBOARD_UNKNOWN_ERROR;
+}
+
+// Publishes the record encoded for the schema of cls straight to the transport, the JSON queues cannot carry it
+static thingsboard_code thingsboard_record_send(thingsboard_ctx* ctx, thingsboard_message_class cls, const char* topic)
 {
-    #ifdef LOGGING_ENABLED
-        openlog("thingsboard", LOG_PID, LOG_USER);
-    #endif
+    if (!ctx->proto_open) return THINGSBOARD_BAD_REQUEST;
+    ctx->proto_open = false;
+
+    thingsboard_proto* record = &ctx->proto_record[cls];
+    if (record->failed) return THINGSBOARD_UNKNOWN_ERROR;
+    if (record->incomplete){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_CORE, "Record does not fit the Protobuf schema of %s", topic);
+        return THINGSBOARD_BAD_REQUEST;
+    }
 
-    thingsboard_ctx* ctx = (thingsboard_ctx*)malloc(sizeof(thingsboard_ctx));
-    if (ctx == NULL) return NULL;
+    if (thingsboard_proto_values_field(ctx->proto_schema[cls]) == NULL)
+        return thingsboard_publish_MQTT(ctx, cls, topic, (const char*)record->buf, record->len, NULL, true);
 
-    ctx->http = NULL;
-    ctx->mqtt = NULL;
-    ctx->API = API;
-    ctx->attributes_subscribed = false;
-    ctx->rpc_subscribed = false;
-    ctx->attributes_sub_cleaned = false;
-    ctx->rpc_sub_cleaned = false;
+    // The schema takes {"ts","values"} samples, the record becomes the values of one stamped now
+    unsigned char storage[THINGSBOARD_PROTO_STACK];
+    thingsboard_proto sample;
+    thingsboard_proto_init(&sample, storage, sizeof(storage));
 
-    if (API == USE_MQTT){
-        mosquitto_lib_init();
+    int res = thingsboard_proto_wrap(&sample, ctx->proto_schema[cls], thingsboard_time_ms(), record) == 0
+        ? thingsboard_publish_MQTT(ctx, cls, topic, (const char*)sample.buf, sample.len, NULL, true)
+        : THINGSBOARD_UNKNOWN_ERROR;
+    thingsboard_proto_release(&sample);
 
-        ctx->mqtt = mosquitto_new(NULL, true, ctx);
+    return res;
+}
+
+thingsboard_code thingsboard_telemetry_end(thingsboard_ctx* ctx)
+{
+    if (thingsboard_record_proto(ctx)){
+        long long start = thingsboard_metrics_now_us();
+        return thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_TELEMETRY, start, thingsboard_record_send(ctx, THINGSBOARD_CLASS_TELEMETRY, THINGSBOARD_TOPIC_TELEMETRY));
     }
-    else if (API == USE_HTTP) ctx->http = curl_easy_init();
-    else return NULL;
 
-    return ctx;
+    char* record = NULL;
+    thingsboard_code res = thingsboard_builder_finish(ctx, &record);
+    if (res != THINGSBOARD_SUCCESS) return res;
+
+    return thingsboard_telemetry_send(ctx, record, NULL);
 }
 
-void thingsboard_cleanup(thingsboard_ctx* ctx)
+thingsboard_code thingsboard_attributes_end(thingsboard_ctx* ctx)
 {
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard] Cleaning up");
-        closelog();
-    #endif
-    if (ctx->API == USE_MQTT){
-        // Mosquitto cleanup
-        mosquitto_disconnect(ctx->mqtt);
-        mosquitto_destroy(ctx->mqtt);
-        mosquitto_lib_cleanup();
-    }
-    else if (ctx->API == USE_HTTP){
-        // Curl cleanup
-        curl_easy_cleanup(ctx->http);
+    if (thingsboard_record_proto(ctx)){
+        long long start = thingsboard_metrics_now_us();
+        return thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_ATTRIBUTES_PUBLISH, start, thingsboard_record_send(ctx, THINGSBOARD_CLASS_ATTRIBUTES, THINGSBOARD_TOPIC_ATTRIBUTES));
     }
-    free(ctx);
+
+    char* record = NULL;
+    thingsboard_code res = thingsboard_builder_finish(ctx, &record);
+    if (res != THINGSBOARD_SUCCESS) return res;
+
+    return thingsboard_attributes_publish(ctx, record);
 }
 
-thingsboard_code thingsboard_connect(thingsboard_ctx* ctx, char* host, int port, char* token)
+static thingsboard_code thingsboard_telemetry_submit_async(thingsboard_ctx* ctx, char* telemetry_data, char* topic, void (*on_sent)(thingsboard_ctx* ctx, thingsboard_code code))
 {
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard] Connecting to %s:%d", host, port);
-    #endif
+    // A message the filter drops entirely completes right away
+    char* reduced = NULL;
+    if (topic == NULL && !thingsboard_telemetry_filter(ctx, &telemetry_data, &reduced)){
+        if (on_sent) on_sent(ctx, THINGSBOARD_SUCCESS);
+        return THINGSBOARD_SUCCESS;
+    }
 
-    if (ctx == NULL){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard] Failed to connect: ctx is NULL");
-        #endif
-        return THINGSBOARD_UNKNOWN_ERROR;
+    thingsboard_code res;
+    switch(ctx->API){
+        case USE_MQTT:
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Sending telemetry data via MQTT");
+            // QoS 0 completes as soon as the message is written, QoS 1 and 2 when the broker acknowledges it
+            if (topic == NULL) topic = "v1/devices/me/telemetry";
+            res = thingsboard_publish_payload_MQTT(ctx, THINGSBOARD_CLASS_TELEMETRY, topic, telemetry_data, on_sent, false);
+            if (res != THINGSBOARD_SUCCESS && res != THINGSBOARD_BUSY && on_sent) on_sent(ctx, res);
+            break;
+        case USE_HTTP:
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Queueing telemetry data via HTTP");
+            res = thingsboard_telemetry_send_HTTP_async(ctx, telemetry_data, ctx->url_telemetry, on_sent);
+            break;
+        default:
+            res = THINGSBOARD_UNKNOWN_ERROR;
     }
 
-    if (ctx->API == USE_MQTT){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_INFO, "[Thingsboard] Using MQTT API");
-        #endif
-        int res = mosquitto_username_pw_set(ctx->mqtt, token, NULL);
-        if (res != MOSQ_ERR_SUCCESS){
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_ERR, "[Thingsboard] Failed to set username and password: %s", mosquitto_strerror(res));
-            #endif
-            return THINGSBOARD_UNKNOWN_ERROR;   
-        }
-        res = mosquitto_connect_async(ctx->mqtt, host, port, 60);
-        if (res != MOSQ_ERR_SUCCESS){
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_ERR, "[Thingsboard] Failed to connect: %s", mosquitto_strerror(res));
-            #endif
-            return THINGSBOARD_UNKNOWN_ERROR;
+    // A message the filter passed whole was recorded as sent too, failures reported later through on_sent rearm where they are reported
+    if (res != THINGSBOARD_SUCCESS && ctx->filter != NULL) thingsboard_filter_rearm(ctx->filter);
+    // Both transports copy the payload before returning
+    free(reduced);
+
+    return res;
+}
+
+thingsboard_code thingsboard_telemetry_send_async(thingsboard_ctx* ctx, char* telemetry_data, char* topic, void (*on_sent)(thingsboard_ctx* ctx, thingsboard_code code))
+{
+    if (ctx == NULL || telemetry_data == NULL) return THINGSBOARD_UNKNOWN_ERROR;
+
+    long long start = thingsboard_metrics_now_us();
+
+    return thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_TELEMETRY, start, thingsboard_telemetry_submit_async(ctx, telemetry_data, topic, on_sent));
+}
+
+thingsboard_code thingsboard_async_limit_set(thingsboard_ctx* ctx, int max_outstanding)
+{
+    if (ctx == NULL || max_outstanding <= 0) return THINGSBOARD_BAD_REQUEST;
+
+    ctx->http_io_max = max_outstanding;
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_connection_state thingsboard_state_get(thingsboard_ctx* ctx)
+{
+    if (ctx == NULL) return THINGSBOARD_DISCONNECTED;
+
+    return (thingsboard_connection_state)ctx->state;
+}
+
+thingsboard_code thingsboard_state_callback_set(thingsboard_ctx* ctx, void (*on_state)(thingsboard_ctx* ctx, thingsboard_connection_state state, int reason))
+{
+    if (ctx == NULL) return THINGSBOARD_BAD_REQUEST;
+
+    ctx->on_state = on_state;
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_reconnect_backoff_set(thingsboard_ctx* ctx, int min_ms, int max_ms)
+{
+    if (ctx == NULL || ctx->API != USE_MQTT || min_ms <= 0 || max_ms < min_ms) return THINGSBOARD_BAD_REQUEST;
+
+    // Picked up by the next attempt
+    ctx->backoff_min_ms = min_ms;
+    ctx->backoff_max_ms = max_ms;
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_compression_set(thingsboard_ctx* ctx, size_t threshold, int level)
+{
+    if (ctx == NULL || ctx->API != USE_HTTP || level < 1 || level > 9) return THINGSBOARD_BAD_REQUEST;
+
+    ctx->compress_level = level;
+    ctx->compress_threshold = threshold;
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_payload_format_set(thingsboard_ctx* ctx, thingsboard_payload_format format)
+{
+    if (ctx == NULL || ctx->API != USE_MQTT) return THINGSBOARD_BAD_REQUEST;
+    if (format != THINGSBOARD_PAYLOAD_JSON && format != THINGSBOARD_PAYLOAD_PROTOBUF) return THINGSBOARD_BAD_REQUEST;
+
+    if ((ctx->batch != NULL || ctx->store != NULL) && !thingsboard_samples_encodable(ctx, format)) return THINGSBOARD_BAD_REQUEST;
+
+    ctx->payload_format = format;
+    // A record begun in the other format cannot be finished in this one
+    ctx->proto_open = false;
+    if (ctx->builder != NULL) ctx->builder->len = 0;
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_proto_field_set(thingsboard_ctx* ctx, thingsboard_message_class cls, const char* key, int number, thingsboard_proto_type type)
+{
+    if (ctx == NULL || ctx->API != USE_MQTT || key == NULL) return THINGSBOARD_BAD_REQUEST;
+    if (cls != THINGSBOARD_CLASS_TELEMETRY && cls != THINGSBOARD_CLASS_ATTRIBUTES) return THINGSBOARD_BAD_REQUEST;
+    if (type < THINGSBOARD_PROTO_DOUBLE || type > THINGSBOARD_PROTO_MESSAGE) return THINGSBOARD_BAD_REQUEST;
+    // The range protobuf allows, without the numbers it reserves for itself
+    if (number < 1 || number > 536870911 || (number >= 19000 && number <= 19999)) return THINGSBOARD_BAD_REQUEST;
+
+    if (thingsboard_proto_schema_set(&ctx->proto_schema[cls], key, number, type) != 0) return THINGSBOARD_UNKNOWN_ERROR;
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_qos_set(thingsboard_ctx* ctx, thingsboard_message_class cls, int qos)
+{
+    if (ctx == NULL || ctx->API != USE_MQTT || cls < 0 || cls >= THINGSBOARD_CLASSES || qos < 0 || qos > 2) return THINGSBOARD_BAD_REQUEST;
+
+    ctx->qos[cls] = qos;
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_filter_configure(thingsboard_ctx* ctx, const char* key, double absolute, double percent, int max_silence_ms)
+{
+    if (ctx == NULL || absolute < 0 || percent < 0 || max_silence_ms < 0) return THINGSBOARD_BAD_REQUEST;
+
+    thingsboard_filter* filter = ctx->filter;
+    if (filter == NULL){
+        filter = thingsboard_filter_new();
+        if (filter == NULL) return THINGSBOARD_UNKNOWN_ERROR;
+
+        // Another thread may have configured the filter meanwhile
+        thingsboard_filter* expected = NULL;
+        if (!atomic_compare_exchange_strong(&ctx->filter, &expected, filter)){
+            thingsboard_filter_free(filter);
+            filter = expected;
         }
-        mosquitto_loop_start(ctx->mqtt);
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_INFO, "[Thingsboard] MQTT connected to %s:%d", host, port);
-        #endif
     }
-    else if (ctx->API == USE_HTTP)
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_INFO, "[Thingsboard] Using HTTP API");
-        #endif
 
-    ctx->host = host;
-    ctx->token = token;
-    ctx->port = port;
+    if (thingsboard_filter_rule_set(filter, key, absolute, percent, max_silence_ms) != 0) return THINGSBOARD_UNKNOWN_ERROR;
 
     return THINGSBOARD_SUCCESS;
 }
 
-thingsboard_code thingsboard_disconnect(thingsboard_ctx* ctx)
+thingsboard_code thingsboard_filter_disable(thingsboard_ctx* ctx)
 {
-    if (ctx == NULL) return THINGSBOARD_UNKNOWN_ERROR;
+    if (ctx == NULL) return THINGSBOARD_BAD_REQUEST;
 
-    ctx->attributes_subscribed = false;
-    ctx->rpc_subscribed = false;
+    if (ctx->filter != NULL) thingsboard_filter_forget(ctx->filter);
 
-    if (ctx->API == USE_MQTT){
-        mosquitto_loop_stop(ctx->mqtt, true);
-        int res = mosquitto_disconnect(ctx->mqtt);
-        if (res == MOSQ_ERR_INVAL) return THINGSBOARD_UNKNOWN_ERROR;
-    } else if (ctx->API == USE_HTTP){
-        curl_easy_reset(ctx->http);
-    }
+    return THINGSBOARD_SUCCESS;
+}
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard] Disconnected");
-    #endif
+thingsboard_code thingsboard_filter_stats_get(thingsboard_ctx* ctx, thingsboard_filter_stats* stats)
+{
+    if (ctx == NULL || stats == NULL) return THINGSBOARD_BAD_REQUEST;
+
+    if (ctx->filter != NULL) thingsboard_filter_counters(ctx->filter, stats);
+    else memset(stats, 0, sizeof(*stats));
 
     return THINGSBOARD_SUCCESS;
 }
 
-thingsboard_code thingsboard_telemetry_send(thingsboard_ctx* ctx, char* telemetry_data, char* topic)
+thingsboard_code thingsboard_inflight_window_set(thingsboard_ctx* ctx, int max_inflight)
 {
-    if (ctx == NULL || telemetry_data == NULL) return THINGSBOARD_UNKNOWN_ERROR;
+    if (ctx == NULL || ctx->API != USE_MQTT || max_inflight <= 0) return THINGSBOARD_BAD_REQUEST;
 
-    switch(ctx->API){
-        case USE_MQTT:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Sending telemetry data via MQTT");
-            #endif
-            if (topic == NULL) topic = "v1/devices/me/telemetry";
-            return thingsboard_telemetry_send_MQTT(ctx->mqtt, telemetry_data, topic);
-        case USE_HTTP:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Sending telemetry data via HTTP");
-            #endif
-            return thingsboard_telemetry_send_HTTP(ctx->http, telemetry_data, "telemetry", ctx->host, ctx->port, ctx->token);
-        default:
-            return THINGSBOARD_UNKNOWN_ERROR;
-    }
+    if (thingsboard_inflight_window(ctx->inflight, max_inflight) != 0) return THINGSBOARD_UNKNOWN_ERROR;
+    // mosquitto holds back anything past its own limit, so both windows are kept the same
+    mosquitto_max_inflight_messages_set(ctx->mqtt, max_inflight);
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_publish_stats_get(thingsboard_ctx* ctx, thingsboard_publish_stats* stats)
+{
+    if (ctx == NULL || stats == NULL || ctx->API != USE_MQTT) return THINGSBOARD_BAD_REQUEST;
+
+    thingsboard_inflight_stats(ctx->inflight, stats);
+
+    return THINGSBOARD_SUCCESS;
 }
 
 thingsboard_code thingsboard_attributes_publish(thingsboard_ctx* ctx, char* attribute_data)
 {
     if (ctx == NULL || attribute_data == NULL) return THINGSBOARD_UNKNOWN_ERROR;
 
-    switch(ctx->API)
-    {
-        case USE_MQTT:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Publishing attributes via MQTT");
-            #endif
-            return thingsboard_telemetry_send_MQTT(ctx->mqtt, attribute_data, "v1/devices/me/attributes");
-        case USE_HTTP:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Publishing attributes via HTTP");
-            #endif
-            return thingsboard_telemetry_send_HTTP(ctx->http, attribute_data, "attributes", ctx->host, ctx->port, ctx->token);
-        default:
-            return THINGSBOARD_UNKNOWN_ERROR;
-    }
+    long long start = thingsboard_metrics_now_us();
+    thingsboard_code res;
+    if (ctx->submissions != NULL) res = thingsboard_submit(ctx, THINGSBOARD_STORE_ATTRIBUTES, attribute_data);
+    else if (ctx->outbound != NULL) res = thingsboard_enqueue(ctx, THINGSBOARD_STORE_ATTRIBUTES, attribute_data);
+    else res = thingsboard_deliver(ctx, THINGSBOARD_STORE_ATTRIBUTES, attribute_data);
+
+    // The device is the source of its client attributes, what it publishes is their current value
+    if (res == THINGSBOARD_SUCCESS && ctx->attrs != NULL) thingsboard_attrs_published(ctx->attrs, ctx, attribute_data);
+
+    return thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_ATTRIBUTES_PUBLISH, start, res);
 }
 
 thingsboard_code thingsboard_attributes_request(thingsboard_ctx* ctx, int request_id, char* attribute_data, void (*on_response)(thingsboard_ctx* ctx, char* json))
@@ -176,30 +1280,39 @@ thingsboard_code thingsboard_attributes_request(thingsboard_ctx* ctx, int reques
     if (ctx == NULL || attribute_data == NULL) return THINGSBOARD_UNKNOWN_ERROR;
 
     thingsboard_code res = THINGSBOARD_SUCCESS;
-    ctx->on_response = on_response;
+    long long start = thingsboard_metrics_now_us();
+
+    // Answered locally when every requested key is known to be current
+    if (ctx->attrs != NULL){
+        thingsboard_json* reply = NULL;
+        const char* cached = thingsboard_attrs_serve(ctx->attrs, attribute_data, &reply);
+        if (cached != NULL){
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Attributes request %d answered from the cache", request_id);
+            thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_ATTRIBUTES_REQUEST, start, THINGSBOARD_SUCCESS);
+            if (on_response) on_response(ctx, (char*)cached);
+        }
+        thingsboard_json_free(reply);
+        if (cached != NULL) return THINGSBOARD_SUCCESS;
+    }
 
     switch(ctx->API)
     {
         case USE_MQTT:{
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Requesting attributes via MQTT");
-            #endif
-            res = thingsboard_attributes_request_MQTT(ctx->mqtt, request_id, attribute_data);
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Requesting attributes via MQTT");
+            res = thingsboard_attributes_request_MQTT(ctx, request_id, attribute_data, on_response);
+            // A request that went out is timed until its response or deadline
+            if (res != THINGSBOARD_SUCCESS) thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_ATTRIBUTES_REQUEST, start, res);
             break;
         }
         case USE_HTTP:{
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Requesting attributes via HTTP");
-            #endif
-            char* resp = thingsboard_attributes_request_HTTP(ctx->http, request_id, attribute_data, ctx->host, ctx->port, ctx->token);
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Requesting attributes via HTTP");
+            char* resp = thingsboard_attributes_request_HTTP(ctx, request_id, attribute_data);
+            thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_ATTRIBUTES_REQUEST, start, resp != NULL ? THINGSBOARD_SUCCESS : THINGSBOARD_UNKNOWN_ERROR);
 
             if (resp != NULL){
-                if (ctx->on_response)
-                {
-                    char* tmp = strdup(resp);
-                    ctx->on_response(ctx, tmp);
-                    free(tmp);
-                }
+                if (ctx->attrs != NULL) thingsboard_attrs_response(ctx->attrs, ctx, resp, strlen(resp));
+                if (on_response)
+                    on_response(ctx, resp);
                 res = THINGSBOARD_SUCCESS;
             } else res = THINGSBOARD_UNKNOWN_ERROR;
 
@@ -213,21 +1326,26 @@ thingsboard_code thingsboard_attributes_request(thingsboard_ctx* ctx, int reques
     return res;
 }
 
+thingsboard_code thingsboard_request_timeout_set(thingsboard_ctx* ctx, int timeout_ms)
+{
+    if (ctx == NULL || timeout_ms <= 0) return THINGSBOARD_BAD_REQUEST;
+
+    ctx->request_timeout_ms = timeout_ms;
+
+    return THINGSBOARD_SUCCESS;
+}
+
 thingsboard_code thingsboard_attributes_unsubscribe(thingsboard_ctx* ctx)
 {
     switch(ctx->API)
     {
         case USE_MQTT:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Unsubscribing from attributes via MQTT");
-            #endif
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Unsubscribing from attributes via MQTT");
 
             thingsboard_attributes_unsubscribe_MQTT(ctx);
             break;
         case USE_HTTP:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Unsubscribing from attributes via HTTP");
-            #endif
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Unsubscribing from attributes via HTTP");
 
             thingsboard_attributes_unsubscribe_HTTP(ctx);
             break;
@@ -235,9 +1353,7 @@ thingsboard_code thingsboard_attributes_unsubscribe(thingsboard_ctx* ctx)
             return THINGSBOARD_UNKNOWN_ERROR;
     }
 
-    while(!ctx->attributes_sub_cleaned){
-        sleep(1);
-    }
+    thingsboard_wait(ctx, &ctx->attributes_sub_cleaned);
 
     return THINGSBOARD_SUCCESS;
 }
@@ -254,29 +1370,17 @@ thingsboard_code thingsboard_attributes_subscribe(thingsboard_ctx* ctx, int time
     switch(ctx->API)
     {
         case USE_MQTT:{
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Subscribing to attributes via MQTT");
-            #endif
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Subscribing to attributes via MQTT");
             res = thingsboard_attributes_subscribe_MQTT(ctx);
             break;
         }
         case USE_HTTP:{
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Subscribing to attributes via HTTP");
-            #endif
-            pthread_t thread;
-
-            struct args* args = (struct args*)malloc(sizeof(struct args));
-            args->ctx = ctx;
-            args->host = ctx->host;
-            args->port = ctx->port;
-            args->token = ctx->token;
-            args->timeout = timeout;
-            args->cb = on_update;
-
-            pthread_create(&thread, NULL, thingsboard_attributes_subscribe_HTTP, args);
-            pthread_detach(thread);
-
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Subscribing to attributes via HTTP");
+            res = thingsboard_attributes_subscribe_HTTP(ctx, timeout);
+            if (res != THINGSBOARD_SUCCESS){
+                ctx->attributes_subscribed = false;
+                ctx->attributes_sub_cleaned = true;
+            }
             break;
         }
         default:
@@ -286,6 +1390,65 @@ thingsboard_code thingsboard_attributes_subscribe(thingsboard_ctx* ctx, int time
     return res;
 }
 
+thingsboard_code thingsboard_attr_get_int(thingsboard_ctx* ctx, thingsboard_attr_scope scope, const char* key, long long* value)
+{
+    double number;
+    thingsboard_code res = thingsboard_attr_get_double(ctx, scope, key, &number);
+    if (res != THINGSBOARD_SUCCESS) return res;
+
+    // Whole numbers within the range a double holds exactly
+    if (number != (double)(long long)number || number < -9007199254740992.0 || number > 9007199254740992.0) return THINGSBOARD_BAD_REQUEST;
+
+    *value = (long long)number;
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_attr_get_double(thingsboard_ctx* ctx, thingsboard_attr_scope scope, const char* key, double* value)
+{
+    if (ctx == NULL || ctx->attrs == NULL || key == NULL || value == NULL || (unsigned)scope >= THINGSBOARD_ATTRS_SCOPES) return THINGSBOARD_BAD_REQUEST;
+
+    if (thingsboard_attrs_get_double(ctx->attrs, scope, key, value) != 0) return THINGSBOARD_BAD_REQUEST;
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_attr_get_bool(thingsboard_ctx* ctx, thingsboard_attr_scope scope, const char* key, bool* value)
+{
+    if (ctx == NULL || ctx->attrs == NULL || key == NULL || value == NULL || (unsigned)scope >= THINGSBOARD_ATTRS_SCOPES) return THINGSBOARD_BAD_REQUEST;
+
+    if (thingsboard_attrs_get_bool(ctx->attrs, scope, key, value) != 0) return THINGSBOARD_BAD_REQUEST;
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_attr_get_string(thingsboard_ctx* ctx, thingsboard_attr_scope scope, const char* key, char* buf, size_t size)
+{
+    if (ctx == NULL || ctx->attrs == NULL || key == NULL || buf == NULL || (unsigned)scope >= THINGSBOARD_ATTRS_SCOPES) return THINGSBOARD_BAD_REQUEST;
+
+    if (thingsboard_attrs_get_string(ctx->attrs, scope, key, buf, size) != 0) return THINGSBOARD_BAD_REQUEST;
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_attr_callback_set(thingsboard_ctx* ctx, thingsboard_attr_scope scope, const char* key, void (*on_change)(thingsboard_ctx* ctx, thingsboard_attr_scope scope, const char* key, const char* json, size_t len))
+{
+    if (ctx == NULL || ctx->attrs == NULL || (unsigned)scope >= THINGSBOARD_ATTRS_SCOPES) return THINGSBOARD_BAD_REQUEST;
+
+    if (thingsboard_attrs_callback(ctx->attrs, scope, key, on_change) != 0) return THINGSBOARD_UNKNOWN_ERROR;
+
+    return THINGSBOARD_SUCCESS;
+}
+
+thingsboard_code thingsboard_attr_cache_max_age_set(thingsboard_ctx* ctx, int max_age_ms)
+{
+    if (ctx == NULL || ctx->attrs == NULL || max_age_ms < 0) return THINGSBOARD_BAD_REQUEST;
+
+    thingsboard_attrs_max_age(ctx->attrs, max_age_ms);
+
+    return THINGSBOARD_SUCCESS;
+}
+
 thingsboard_code thingsboard_rpc_unsubscribe(thingsboard_ctx* ctx)
 {
     if (ctx == NULL) return THINGSBOARD_UNKNOWN_ERROR;
@@ -293,24 +1456,18 @@ thingsboard_code thingsboard_rpc_unsubscribe(thingsboard_ctx* ctx)
     switch(ctx->API)
     {
         case USE_MQTT:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Unsubscribing from RPC via MQTT");
-            #endif
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Unsubscribing from RPC via MQTT");
             thingsboard_rpc_unsubscribe_MQTT(ctx);
             break;
         case USE_HTTP:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Unsubscribing from RPC via HTTP");
-            #endif
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Unsubscribing from RPC via HTTP");
             thingsboard_rpc_unsubscribe_HTTP(ctx);
             break;
         default:
             return THINGSBOARD_UNKNOWN_ERROR;
     }
 
-    while(!ctx->rpc_sub_cleaned){
-        sleep(1);
-    }
+    thingsboard_wait(ctx, &ctx->rpc_sub_cleaned);
 
     return THINGSBOARD_SUCCESS;
 }
@@ -327,30 +1484,17 @@ thingsboard_code thingsboard_rpc_subscribe(thingsboard_ctx* ctx, int timeout, vo
     switch(ctx->API)
     {
         case USE_MQTT:{
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Subscribing to RPC via MQTT");
-            #endif
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Subscribing to RPC via MQTT");
             res = thingsboard_rpc_subscribe_MQTT(ctx);
             break;
         }
         case USE_HTTP:{
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Subscribing to RPC via HTTP");
-            #endif
-
-            pthread_t thread;
-
-            struct args* args = (struct args*)malloc(sizeof(struct args));
-            args->ctx = ctx;
-            args->host = ctx->host;
-            args->port = ctx->port;
-            args->token = ctx->token;
-            args->timeout = timeout;
-            args->cb = rpc_on_subscribe;
-
-            pthread_create(&thread, NULL, thingsboard_rpc_subscribe_HTTP, args);
-            pthread_detach(thread);
-            
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Subscribing to RPC via HTTP");
+            res = thingsboard_rpc_subscribe_HTTP(ctx, timeout);
+            if (res != THINGSBOARD_SUCCESS){
+                ctx->rpc_subscribed = false;
+                ctx->rpc_sub_cleaned = true;
+            }
             break;
         }
         default:
@@ -364,18 +1508,16 @@ thingsboard_code thingsboard_rpc_reply(thingsboard_ctx* ctx, int request_id, cha
 {
     if (ctx == NULL) return THINGSBOARD_UNKNOWN_ERROR;
 
+    long long start = thingsboard_metrics_now_us();
+
     switch(ctx->API)
     {
         case USE_MQTT:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Replying to RPC via MQTT");
-            #endif
-            return thingsboard_rpc_reply_MQTT(ctx->mqtt, request_id, response);
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Replying to RPC via MQTT");
+            return thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_RPC_REPLY, start, thingsboard_rpc_reply_MQTT(ctx, request_id, response));
         case USE_HTTP:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Replying to RPC via HTTP");
-            #endif
-            return thingsboard_rpc_reply_HTTP(ctx->http, request_id, response, ctx->host, ctx->port, ctx->token);
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Replying to RPC via HTTP");
+            return thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_RPC_REPLY, start, thingsboard_rpc_reply_HTTP(ctx, request_id, response));
         default:
             return THINGSBOARD_UNKNOWN_ERROR;
     }
@@ -385,32 +1527,28 @@ thingsboard_code thingsboard_rpc_send(thingsboard_ctx* ctx, int request_id, char
 {
     if (ctx == NULL || method == NULL || params == NULL) return THINGSBOARD_UNKNOWN_ERROR;
 
-    ctx->rpc_on_response = rpc_on_response;
+    long long start = thingsboard_metrics_now_us();
 
     switch(ctx->API)
     {
-        case USE_MQTT:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Sending RPC via MQTT");
-            #endif
-            return thingsboard_rpc_send_MQTT(ctx->mqtt, request_id, method, params);
+        case USE_MQTT:{
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Sending RPC via MQTT");
+            // A request that went out is timed until its response or deadline
+            thingsboard_code res = thingsboard_rpc_send_MQTT(ctx, request_id, method, params, rpc_on_response);
+            if (res != THINGSBOARD_SUCCESS) thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_RPC_SEND, start, res);
+            return res;
+        }
         case USE_HTTP:{
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Sending RPC via HTTP");
-            #endif
-            char* resp = thingsboard_rpc_send_HTTP(ctx->http, request_id, method, params, ctx->host, ctx->port, ctx->token);
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Sending RPC via HTTP");
+            char* resp = thingsboard_rpc_send_HTTP(ctx, request_id, method, params);
+            thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_RPC_SEND, start, resp != NULL ? THINGSBOARD_SUCCESS : THINGSBOARD_UNKNOWN_ERROR);
 
             if (resp != NULL){
-                if (ctx->rpc_on_response)
-                {
-                    char* tmp = strdup(resp);
-                    ctx->rpc_on_response(ctx, tmp);
-                    free(tmp);
-                    free(resp);
-                }
+                if (rpc_on_response)
+                    rpc_on_response(ctx, resp);
+                free(resp);
                 return THINGSBOARD_SUCCESS;
             } 
-            free(resp);
 
             return THINGSBOARD_UNKNOWN_ERROR;
         }
@@ -423,18 +1561,16 @@ thingsboard_code thingsboard_provision_device(thingsboard_ctx* ctx, char* provis
 {
     if (ctx == NULL || provisionDeviceKey == NULL || provisionDeviceSecret == NULL) return THINGSBOARD_UNKNOWN_ERROR;
 
+    long long start = thingsboard_metrics_now_us();
+
     switch(ctx->API)
     {
         case USE_MQTT:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Provisioning device via MQTT");
-            #endif
-            return thingsboard_provision_device_MQTT(ctx->mqtt, provisionDeviceKey, provisionDeviceSecret, ctx->token);
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Provisioning device via MQTT");
+            return thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_PROVISION, start, thingsboard_provision_device_MQTT(ctx, provisionDeviceKey, provisionDeviceSecret, ctx->token));
         case USE_HTTP:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Provisioning device via HTTP");
-            #endif
-            return thingsboard_provision_device_HTTP(ctx->http, provisionDeviceKey, provisionDeviceSecret, ctx->host, ctx->port, ctx->token);
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Provisioning device via HTTP");
+            return thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_PROVISION, start, thingsboard_provision_device_HTTP(ctx, provisionDeviceKey, provisionDeviceSecret));
         default:
             return THINGSBOARD_UNKNOWN_ERROR;
     }
@@ -444,40 +1580,134 @@ thingsboard_code thingsboard_device_claim(thingsboard_ctx* ctx, char* secret, in
 {
     if (ctx == NULL) return THINGSBOARD_UNKNOWN_ERROR;
 
+    long long start = thingsboard_metrics_now_us();
+
     switch(ctx->API)
     {
         case USE_MQTT:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Claiming device via MQTT");
-            #endif
-            return thingsboard_device_claim_MQTT(ctx->mqtt, secret, duration);
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Claiming device via MQTT");
+            return thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_CLAIM, start, thingsboard_device_claim_MQTT(ctx, secret, duration));
         case USE_HTTP:
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard] Claiming device via HTTP");
-            #endif
-            return thingsboard_device_claim_HTTP(ctx->http, secret, duration, ctx->host, ctx->port, ctx->token);
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Claiming device via HTTP");
+            return thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_CLAIM, start, thingsboard_device_claim_HTTP(ctx, secret, duration));
         default:
             return THINGSBOARD_UNKNOWN_ERROR;
     }
 }
 
+thingsboard_code thingsboard_gateway_connect(thingsboard_ctx* ctx, const char* device, const char* type,
+    void (*on_rpc)(thingsboard_ctx* ctx, const char* device, const char* json, size_t len, int req_id),
+    void (*on_attributes)(thingsboard_ctx* ctx, const char* device, const char* json, size_t len))
+{
+    if (ctx == NULL || device == NULL || ctx->API != USE_MQTT) return THINGSBOARD_BAD_REQUEST;
+
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Connecting gateway device %s", device);
+
+    return thingsboard_gateway_connect_MQTT(ctx, device, type, on_rpc, on_attributes);
+}
+
+thingsboard_code thingsboard_gateway_disconnect(thingsboard_ctx* ctx, const char* device)
+{
+    if (ctx == NULL || device == NULL || ctx->API != USE_MQTT) return THINGSBOARD_BAD_REQUEST;
+
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_CORE, "Disconnecting gateway device %s", device);
+
+    return thingsboard_gateway_disconnect_MQTT(ctx, device);
+}
+
+thingsboard_code thingsboard_gateway_telemetry_send(thingsboard_ctx* ctx, const char* device, const char* values)
+{
+    if (ctx == NULL || device == NULL || values == NULL || ctx->API != USE_MQTT) return THINGSBOARD_BAD_REQUEST;
+
+    return thingsboard_gateway_telemetry_MQTT(ctx, device, values);
+}
+
+thingsboard_code thingsboard_gateway_attributes_publish(thingsboard_ctx* ctx, const char* device, const char* attributes)
+{
+    if (ctx == NULL || device == NULL || attributes == NULL || ctx->API != USE_MQTT) return THINGSBOARD_BAD_REQUEST;
+
+    return thingsboard_gateway_attributes_MQTT(ctx, device, attributes);
+}
+
+thingsboard_code thingsboard_gateway_rpc_reply(thingsboard_ctx* ctx, const char* device, int request_id, const char* response)
+{
+    if (ctx == NULL || device == NULL || response == NULL || ctx->API != USE_MQTT) return THINGSBOARD_BAD_REQUEST;
+
+    return thingsboard_gateway_rpc_reply_MQTT(ctx, device, request_id, response);
+}
+
+thingsboard_code thingsboard_gateway_batch_configure(thingsboard_ctx* ctx, int max_bytes, int max_age_ms)
+{
+    if (ctx == NULL || ctx->gateway == NULL || max_bytes < 0 || max_age_ms < 0) return THINGSBOARD_BAD_REQUEST;
+
+    thingsboard_code res = thingsboard_gateway_flush_MQTT(ctx);
+
+    pthread_mutex_lock(&ctx->gateway->lock);
+    ctx->gateway->max_bytes = max_bytes;
+    ctx->gateway->max_age_ms = max_age_ms;
+    pthread_mutex_unlock(&ctx->gateway->lock);
+
+    // The loop has to learn about the new deadline
+    thingsboard_ctx_notify(ctx);
+
+    return res;
+}
+
+thingsboard_code thingsboard_gateway_flush(thingsboard_ctx* ctx)
+{
+    if (ctx == NULL || ctx->API != USE_MQTT) return THINGSBOARD_BAD_REQUEST;
+
+    return thingsboard_gateway_flush_MQTT(ctx);
+}
+
 thingsboard_code thingsboard_loop_forever(thingsboard_ctx* ctx)
 {
     if (ctx == NULL) return THINGSBOARD_UNKNOWN_ERROR;
 
     switch (ctx->API)
     {
-        case USE_MQTT:
-            sleep(3);
+        case USE_MQTT:{
+            // Returns early when the context is disconnected, a subscription changes or a request runs out of time
+            long wait_ms = thingsboard_wait_until(thingsboard_requests_deadline_MQTT(ctx), thingsboard_batch_wait_ms(ctx, 3000));
+            wait_ms = thingsboard_wait_until(thingsboard_gateway_deadline(ctx->gateway), wait_ms);
+
+            pthread_mutex_lock(&ctx->lock);
+            if (wait_ms > 0) thingsboard_wait_ms(ctx, wait_ms);
+            pthread_mutex_unlock(&ctx->lock);
+
+            thingsboard_requests_expire_MQTT(ctx, thingsboard_time_ms());
+
+            long long gateway_due = thingsboard_gateway_deadline(ctx->gateway);
+            if (gateway_due && gateway_due <= thingsboard_time_ms()) thingsboard_gateway_flush_MQTT(ctx);
+
+            if (thingsboard_batch_due_here(ctx)) thingsboard_batch_flush_due(ctx);
+            if (ctx->store) thingsboard_store_replay(ctx, THINGSBOARD_STORE_REPLAY_BURSTS);
             break;
+        }
         case USE_HTTP:
-            while(1){
-                if ((ctx->attributes_subscribed && !ctx->attributes_sub_cleaned) | (ctx->rpc_subscribed && !ctx->rpc_sub_cleaned))
-                {
-                    sleep(3);
+            pthread_mutex_lock(&ctx->lock);
+            while ((ctx->attributes_subscribed && !ctx->attributes_sub_cleaned) || (ctx->rpc_subscribed && !ctx->rpc_sub_cleaned)){
+                if (thingsboard_batch_due_here(ctx)){
+                    pthread_mutex_unlock(&ctx->lock);
+                    thingsboard_batch_flush_due(ctx);
+                    pthread_mutex_lock(&ctx->lock);
+                    continue;
+                }
+
+                // Only a pending batch or a queued backlog needs a timed wake-up, the long-polls notify when they end
+                bool backlog = thingsboard_store_depth(ctx->store) > 0;
+                thingsboard_wait_ms(ctx, thingsboard_batch_wait_ms(ctx, backlog ? 5000 : 60000));
+
+                if (backlog){
+                    pthread_mutex_unlock(&ctx->lock);
+                    thingsboard_store_replay(ctx, THINGSBOARD_STORE_REPLAY_BURSTS);
+                    pthread_mutex_lock(&ctx->lock);
                 }
-                else break;
             }
+            pthread_mutex_unlock(&ctx->lock);
+
+            if (thingsboard_batch_due_here(ctx)) thingsboard_batch_flush_due(ctx);
+            if (ctx->store) thingsboard_store_replay(ctx, THINGSBOARD_STORE_REPLAY_BURSTS);
             break;
         default:
             return THINGSBOARD_UNKNOWN_ERROR;
@@ -1,59 +1,312 @@
 #define _DEFAULT_SOURCE
 #include "thingsboard_HTTP_api.h"
+#include "thingsboard_HTTP_io.h"
+#include "thingsboard_runtime.h"
 #include "thingsboard_types.h"
+#include "thingsboard_attrs.h"
+#include "thingsboard_log.h"
+#include "thingsboard_json.h"
+#include "thingsboard_compress.h"
+#include "thingsboard_filter.h"
+#include "thingsboard_metrics.h"
 #include <cjson/cJSON.h>
 #include <stdlib.h>
 #include <string.h>
-#include <syslog.h>
 #include <unistd.h>
-#include <pthread.h>
 
-struct response {
-  char *response;
-  size_t size;
-};
+static size_t on_discard(void* data, size_t size, size_t nmemb, void* clientp)
+{
+    return size * nmemb;
+}
 
-// http://$THINGSBOARD_HOST_NAME/api/v1/$ACCESS_TOKEN/telemetry
-int thingsboard_telemetry_send_HTTP(CURL* ctx, char* telemetry_data, char* endpoint, char* host, int port, char* token)
+static int thingsboard_HTTP_trace(CURL* http, curl_infotype type, char* data, size_t size, void* clientp)
 {
-    if (ctx == NULL) return 2;
+    if (type != CURLINFO_TEXT && type != CURLINFO_HEADER_IN && type != CURLINFO_HEADER_OUT) return 0;
 
-    CURL* http = curl_easy_duphandle(ctx);
+    while (size > 0 && (data[size - 1] == '\n' || data[size - 1] == '\r')) size--;
 
-    size_t size = strlen(host) + strlen(token) + strlen(endpoint) + 25;
-    char* url = (char*)malloc(size);
-    snprintf(url, size, "http://%s:%d/api/v1/%s/%s", host, port, token, endpoint);
+    THINGSBOARD_LOG(THINGSBOARD_LOG_DEBUG, THINGSBOARD_LOG_HTTP, "%c %.*s",
+        type == CURLINFO_HEADER_OUT ? '>' : type == CURLINFO_HEADER_IN ? '<' : '*', (int)size, data);
+
+    return 0;
+}
 
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+// Options shared by every request made on the long-lived per-context handle, headers are created on first use
+struct curl_slist* thingsboard_HTTP_setup(CURL* http, struct curl_slist* headers)
+{
+    if (http == NULL) return headers;
+
+    if (headers == NULL)
+        headers = curl_slist_append(headers, "Content-Type: application/json");
 
     curl_easy_setopt(http, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(http, CURLOPT_URL, url);
-    curl_easy_setopt(http, CURLOPT_POSTFIELDS, telemetry_data);
-    #ifdef LOGGING_ENABLED
+    // DNS answers and TLS sessions are reused across every context of the process
+    if (thingsboard_runtime_share() != NULL)
+        curl_easy_setopt(http, CURLOPT_SHARE, thingsboard_runtime_share());
+    curl_easy_setopt(http, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(http, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(http, CURLOPT_TCP_KEEPIDLE, 60L);
+    curl_easy_setopt(http, CURLOPT_TCP_KEEPINTVL, 30L);
+    curl_easy_setopt(http, CURLOPT_TCP_NODELAY, 1L);
+    // Traces go through the logger instead of stderr, and only when debugging HTTP
+    if (thingsboard_log_enabled(THINGSBOARD_LOG_DEBUG, THINGSBOARD_LOG_HTTP)){
+        curl_easy_setopt(http, CURLOPT_DEBUGFUNCTION, thingsboard_HTTP_trace);
         curl_easy_setopt(http, CURLOPT_VERBOSE, 1L);
-    #endif
+    }
+
+    return headers;
+}
+
+struct curl_slist* thingsboard_HTTP_gzip_headers(void)
+{
+    struct curl_slist* headers = curl_slist_append(NULL, "Content-Type: application/json");
+    struct curl_slist* gzip = headers ? curl_slist_append(headers, "Content-Encoding: gzip") : NULL;
+
+    if (gzip == NULL) curl_slist_free_all(headers);
+
+    return gzip;
+}
+
+/*
+* Performs a request on the persistent handle so the TCP connection is reused.
+* Every option that differs between requests is set here, so nothing leaks
+* from one call into the next. A NULL body issues a GET, a NULL chunk discards the reply,
+* a body_len of -1 sends body up to its NUL.
+*/
+static CURLcode thingsboard_HTTP_perform(CURL* http, char* url, CURLU* curlu, char* body, long body_len, struct response* chunk)
+{
+    curl_easy_setopt(http, CURLOPT_CURLU, curlu);
+    curl_easy_setopt(http, CURLOPT_URL, url);
+
+    if (body != NULL){
+        curl_easy_setopt(http, CURLOPT_POSTFIELDSIZE, body_len);
+        curl_easy_setopt(http, CURLOPT_POSTFIELDS, body);
+    }
+    else curl_easy_setopt(http, CURLOPT_HTTPGET, 1L);
+
+    if (chunk != NULL){
+        curl_easy_setopt(http, CURLOPT_WRITEFUNCTION, thingsboard_HTTP_on_response);
+        curl_easy_setopt(http, CURLOPT_WRITEDATA, (void*)chunk);
+    } else {
+        curl_easy_setopt(http, CURLOPT_WRITEFUNCTION, on_discard);
+        curl_easy_setopt(http, CURLOPT_WRITEDATA, NULL);
+    }
+
+    return curl_easy_perform(http);
+}
+
+void thingsboard_HTTP_count(thingsboard_ctx* ctx, CURL* http, CURLcode res)
+{
+    if (res != CURLE_OK) return;
+
+    curl_off_t sent = 0, received = 0;
+    curl_easy_getinfo(http, CURLINFO_SIZE_UPLOAD_T, &sent);
+    curl_easy_getinfo(http, CURLINFO_SIZE_DOWNLOAD_T, &received);
+
+    thingsboard_metrics_sent(ctx->metrics, (size_t)sent);
+    if (received > 0) thingsboard_metrics_received(ctx->metrics, (size_t)received);
+}
+
+// The HTTP status of the transfer just performed on http, 0 when it did not complete
+static long thingsboard_HTTP_status(CURL* http, CURLcode res)
+{
+    long status = 0;
+    if (res == CURLE_OK) curl_easy_getinfo(http, CURLINFO_RESPONSE_CODE, &status);
+
+    return status;
+}
 
-    int res = curl_easy_perform(http);
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(http);
-    free(url);
+// Maps the outcome of a synchronous request like the I/O engine does, a reply outside 2xx is a failure too
+static thingsboard_code thingsboard_HTTP_result(const char* what, CURLcode res, long status)
+{
+    thingsboard_code code = thingsboard_HTTP_code(res, status);
+
+    if (res != CURLE_OK)
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_HTTP, "%s failed: %s", what, curl_easy_strerror(res));
+    else if (code != THINGSBOARD_SUCCESS)
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_HTTP, "%s failed: HTTP %ld", what, status);
+
+    return code;
+}
+
+// The context's handle is shared by the caller and the outbound sender thread
+static thingsboard_code thingsboard_HTTP_perform_ctx(thingsboard_ctx* ctx, const char* what, char* url, CURLU* curlu, char* body, struct response* chunk)
+{
+    pthread_mutex_lock(&ctx->http_lock);
+    CURLcode res = thingsboard_HTTP_perform(ctx->http, url, curlu, body, -1L, chunk);
+    long status = thingsboard_HTTP_status(ctx->http, res);
+    thingsboard_HTTP_count(ctx, ctx->http, res);
+    pthread_mutex_unlock(&ctx->http_lock);
+
+    return thingsboard_HTTP_result(what, res, status);
+}
+
+static char* thingsboard_HTTP_url(thingsboard_ctx* ctx, char* path, int with_token)
+{
+    size_t size = strlen(ctx->host) + strlen(ctx->token) + strlen(path) + 32;
+    char* url = (char*)malloc(size);
+    if (url == NULL) return NULL;
+
+    if (with_token) snprintf(url, size, "http://%s:%d/api/v1/%s/%s", ctx->host, ctx->port, ctx->token, path);
+    else snprintf(url, size, "http://%s:%d/api/v1/%s", ctx->host, ctx->port, path);
+
+    return url;
+}
+
+void thingsboard_HTTP_endpoints_free(thingsboard_ctx* ctx)
+{
+    free(ctx->url_telemetry);
+    free(ctx->url_attributes);
+    free(ctx->url_attributes_updates);
+    free(ctx->url_rpc);
+    free(ctx->url_claim);
+    free(ctx->url_provision);
+    free(ctx->url_buf);
+    free(ctx->url_attributes_poll);
+    free(ctx->url_rpc_poll);
+    curl_url_cleanup(ctx->attributes_curlu);
+
+    ctx->url_telemetry = ctx->url_attributes = ctx->url_attributes_updates = NULL;
+    ctx->url_rpc = ctx->url_claim = ctx->url_provision = ctx->url_buf = NULL;
+    ctx->url_attributes_poll = ctx->url_rpc_poll = NULL;
+    ctx->attributes_curlu = NULL;
+}
 
-    if (res != CURLE_OK){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard HTTP] Telemetry send failed: %s", curl_easy_strerror(res));
-        #endif
+// Builds every fixed endpoint once so requests only format what changes between them
+int thingsboard_HTTP_endpoints_build(thingsboard_ctx* ctx)
+{
+    thingsboard_HTTP_endpoints_free(ctx);
+
+    ctx->url_telemetry = thingsboard_HTTP_url(ctx, "telemetry", 1);
+    ctx->url_attributes = thingsboard_HTTP_url(ctx, "attributes", 1);
+    ctx->url_attributes_updates = thingsboard_HTTP_url(ctx, "attributes/updates", 1);
+    ctx->url_rpc = thingsboard_HTTP_url(ctx, "rpc", 1);
+    ctx->url_claim = thingsboard_HTTP_url(ctx, "claim", 1);
+    ctx->url_provision = thingsboard_HTTP_url(ctx, "provision", 0);
+
+    // RPC replies append "/<request id>" to the RPC endpoint kept at the start of this buffer
+    if (ctx->url_rpc != NULL){
+        ctx->url_rpc_len = strlen(ctx->url_rpc);
+        ctx->url_buf = (char*)malloc(ctx->url_rpc_len + 16);
+        if (ctx->url_buf != NULL) memcpy(ctx->url_buf, ctx->url_rpc, ctx->url_rpc_len + 1);
+    }
+
+    ctx->attributes_curlu = curl_url();
+    if (ctx->attributes_curlu != NULL && ctx->url_attributes != NULL)
+        curl_url_set(ctx->attributes_curlu, CURLUPART_URL, ctx->url_attributes, 0);
+
+    if (!ctx->url_telemetry || !ctx->url_attributes || !ctx->url_attributes_updates || !ctx->url_rpc ||
+        !ctx->url_claim || !ctx->url_provision || !ctx->url_buf || !ctx->attributes_curlu){
+        thingsboard_HTTP_endpoints_free(ctx);
         return 3;
     }
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard HTTP] Telemetry sent");
-    #endif
+    return 0;
+}
+
+// http://$THINGSBOARD_HOST_NAME/api/v1/$ACCESS_TOKEN/telemetry
+// Falls back to the plain body when there is nothing to compress with
+static thingsboard_code thingsboard_HTTP_post_gzip(thingsboard_ctx* ctx, char* url, char* body, size_t len)
+{
+    pthread_mutex_lock(&ctx->http_lock);
+
+    if (ctx->compressor == NULL) ctx->compressor = thingsboard_compressor_new();
+    if (ctx->http_headers_gzip == NULL) ctx->http_headers_gzip = thingsboard_HTTP_gzip_headers();
+
+    const char* packed;
+    size_t packed_len;
+    CURLcode res;
+
+    if (ctx->compressor != NULL && ctx->http_headers_gzip != NULL &&
+        thingsboard_compress(ctx->compressor, ctx->compress_level, body, len, &packed, &packed_len) == 0){
+        curl_easy_setopt(ctx->http, CURLOPT_HTTPHEADER, ctx->http_headers_gzip);
+        res = thingsboard_HTTP_perform(ctx->http, url, NULL, (char*)packed, (long)packed_len, NULL);
+        curl_easy_setopt(ctx->http, CURLOPT_HTTPHEADER, ctx->http_headers);
+    }
+    else res = thingsboard_HTTP_perform(ctx->http, url, NULL, body, -1L, NULL);
+
+    long status = thingsboard_HTTP_status(ctx->http, res);
+    thingsboard_HTTP_count(ctx, ctx->http, res);
+    pthread_mutex_unlock(&ctx->http_lock);
+
+    return thingsboard_HTTP_result("Telemetry send", res, status);
+}
+
+int thingsboard_telemetry_send_HTTP(thingsboard_ctx* ctx, char* telemetry_data, char* url)
+{
+    if (ctx == NULL || ctx->http == NULL || url == NULL) return 2;
+
+    size_t len = strlen(telemetry_data);
+    size_t threshold = ctx->compress_threshold;
+    thingsboard_code res = threshold > 0 && len >= threshold ? thingsboard_HTTP_post_gzip(ctx, url, telemetry_data, len)
+        : thingsboard_HTTP_perform_ctx(ctx, "Telemetry send", url, NULL, telemetry_data, NULL);
+
+    // A rejected body is not delivered, the caller keeps or drops it by the code
+    if (res != THINGSBOARD_SUCCESS) return res;
+
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_HTTP, "Telemetry sent");
 
     return 0;
 }
 
-static int on_response(void* data, size_t size, size_t nmemb, void* clientp)
+// A context takes one of the shared I/O engines on first use
+static thingsboard_HTTP_io* thingsboard_HTTP_io_ctx(thingsboard_ctx* ctx)
+{
+    if (ctx->http_io == NULL)
+        ctx->http_io = thingsboard_runtime_io_acquire();
+
+    return ctx->http_io;
+}
+
+static int thingsboard_telemetry_sent_HTTP(thingsboard_HTTP_request* req, thingsboard_code code)
+{
+    void (*on_sent)(thingsboard_ctx* ctx, thingsboard_code code) = req->cb;
+
+    if (code != THINGSBOARD_SUCCESS){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_HTTP, "Async telemetry send failed: %d", code);
+        // The filter took these values as sent when the request was queued
+        if (req->ctx->filter != NULL) thingsboard_filter_rearm(req->ctx->filter);
+    }
+
+    if (on_sent)
+        on_sent(req->ctx, code);
+
+    return 0;
+}
+
+int thingsboard_telemetry_send_HTTP_async(thingsboard_ctx* ctx, char* telemetry_data, char* url, void (*on_sent)(thingsboard_ctx* ctx, thingsboard_code code))
+{
+    if (ctx == NULL || url == NULL) return THINGSBOARD_UNKNOWN_ERROR;
+
+    if (thingsboard_HTTP_io_ctx(ctx) == NULL) return THINGSBOARD_UNKNOWN_ERROR;
+
+    thingsboard_HTTP_request* req = (thingsboard_HTTP_request*)calloc(1, sizeof(thingsboard_HTTP_request));
+    if (req == NULL) return THINGSBOARD_UNKNOWN_ERROR;
+
+    req->url = url;
+    req->body = strdup(telemetry_data);
+    req->ctx = ctx;
+    req->on_done = thingsboard_telemetry_sent_HTTP;
+    req->cb = on_sent;
+    // Compressed on the I/O thread, off the caller's path
+    req->compress = true;
+
+    if (req->body == NULL){
+        free(req);
+        return THINGSBOARD_UNKNOWN_ERROR;
+    }
+
+    if (thingsboard_HTTP_io_submit(ctx->http_io, req) != 0){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_HTTP, "Async telemetry dropped: too many outstanding requests");
+        free(req->body);
+        free(req);
+        return THINGSBOARD_BUSY;
+    }
+
+    return THINGSBOARD_SUCCESS;
+}
+
+size_t thingsboard_HTTP_on_response(void* data, size_t size, size_t nmemb, void* clientp)
 {
     size_t realsize = size * nmemb;
     struct response* mem = (struct response*)clientp;
@@ -70,11 +323,9 @@ static int on_response(void* data, size_t size, size_t nmemb, void* clientp)
     return realsize;
 }
 
-char* thingsboard_attributes_request_HTTP(CURL* ctx, int request_id, char* attribute_data, char* host, int port, char* token)
+char* thingsboard_attributes_request_HTTP(thingsboard_ctx* ctx, int request_id, char* attribute_data)
 {
-    if (ctx == NULL) return NULL;
-
-    CURL* http = curl_easy_duphandle(ctx);
+    if (ctx == NULL || ctx->http == NULL || ctx->attributes_curlu == NULL) return NULL;
 
     cJSON* object = cJSON_Parse(attribute_data);
     if (object == NULL || cJSON_IsInvalid(object)){
@@ -82,27 +333,17 @@ char* thingsboard_attributes_request_HTTP(CURL* ctx, int request_id, char* attri
         return NULL;
     }
 
-    size_t size = strlen(host) + strlen(token) + 38;
-    char* url = (char*)malloc(size);
-    snprintf(url, size, "http://%s:%d/api/v1/%s/attributes", host, port, token);
-
-    CURLU* curlu = curl_url();
-    curl_url_set(curlu, CURLUPART_URL, url, 0);
-
     struct response chunk = {0};
 
-    struct curl_slist *headers = NULL;
-
-    curl_easy_setopt(http, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(http, CURLOPT_WRITEFUNCTION, on_response);
-    curl_easy_setopt(http, CURLOPT_WRITEDATA, (void*)&chunk);
-    #ifdef LOGGING_ENABLED
-        curl_easy_setopt(http, CURLOPT_VERBOSE, 1L);
-    #endif
-
     cJSON* clientKeys = cJSON_GetObjectItem(object, "clientKeys");
     cJSON* sharedKeys = cJSON_GetObjectItem(object, "sharedKeys");
 
+    // The cached handle already holds the endpoint, only the query changes per request; it is shared like the handle
+    pthread_mutex_lock(&ctx->http_lock);
+
+    CURLU* curlu = ctx->attributes_curlu;
+    curl_url_set(curlu, CURLUPART_QUERY, NULL, 0);
+
     if (clientKeys != NULL){
         size_t clientKeysSize = strlen(clientKeys->valuestring) + 12;
         char clientKeysQ[clientKeysSize];
@@ -121,426 +362,278 @@ char* thingsboard_attributes_request_HTTP(CURL* ctx, int request_id, char* attri
         curl_url_set(curlu, CURLUPART_QUERY, sharedKeysQ, CURLU_APPENDQUERY | CURLU_URLENCODE);
     }
 
-    curl_easy_setopt(http, CURLOPT_CURLU, curlu);
-
-    int res = curl_easy_perform(http);
+    CURLcode res = thingsboard_HTTP_perform(ctx->http, NULL, curlu, NULL, -1L, &chunk);
+    long status = thingsboard_HTTP_status(ctx->http, res);
+    thingsboard_HTTP_count(ctx, ctx->http, res);
+    pthread_mutex_unlock(&ctx->http_lock);
 
-    free(url);
     cJSON_Delete(object);
-    curl_slist_free_all(headers);
-    curl_url_cleanup(curlu);
-    curl_easy_cleanup(http);
-
-    if (res!= CURLE_OK){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard HTTP] Attributes request failed: %s", curl_easy_strerror(res));
-        #endif
+
+    if (thingsboard_HTTP_result("Attributes request", res, status) != THINGSBOARD_SUCCESS){
+        free(chunk.response);
         return NULL;
     }
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard HTTP] Attributes request sent");
-    #endif
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_HTTP, "Attributes request sent");
 
     return chunk.response;
 }
 
-void thingsboard_attributes_unsubscribe_HTTP(thingsboard_ctx* ctx)
-{
-    if (ctx == NULL) return;
-
-    ctx->attributes_subscribed = false;
-}
-
-void* thingsboard_attributes_subscribe_HTTP(void* args)
+// Server-side timeouts and delivered updates re-arm the poll at once, only failures back off
+static int thingsboard_HTTP_poll_rearm(thingsboard_HTTP_request* req, thingsboard_code code, const char* what)
 {
-    struct args* arguments = (struct args*)args;
+    if (code == THINGSBOARD_SUCCESS || req->status == 408){
+        req->retry_ms = 0;
+        return 1;
+    }
 
-    thingsboard_ctx* ctx = arguments->ctx;
-    void (*on_update)(thingsboard_ctx* ctx, char* json) = arguments->cb;
-    char* host = arguments->host;
-    int port = arguments->port;
-    char* token = arguments->token;
-    int timeout = arguments->timeout;
+    if (code == THINGSBOARD_UNAUTHORIZED){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_HTTP, "%s subscribe failed: unauthorized", what);
+        return 0;
+    }
 
-    if (ctx == NULL || ctx->http == NULL){ free(args); return NULL; }
+    req->retry_ms = req->retry_ms > 0 ? req->retry_ms * 2 : THINGSBOARD_HTTP_POLL_BACKOFF_MIN;
+    if (req->retry_ms > THINGSBOARD_HTTP_POLL_BACKOFF_MAX) req->retry_ms = THINGSBOARD_HTTP_POLL_BACKOFF_MAX;
 
-    CURL* http = curl_easy_duphandle(ctx->http);
+    THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_HTTP, "%s poll failed (HTTP %ld), retrying in %d ms", what, req->status, req->retry_ms);
 
-    size_t size = strlen(host) + strlen(token) + 45;
-    char* url = (char*)malloc(size);
-    snprintf(url, size, "http://%s:%d/api/v1/%s/attributes/updates", host, port, token);
+    return 1;
+}
 
-    CURLU* curlu = curl_url();
+static thingsboard_HTTP_request* thingsboard_HTTP_poll(thingsboard_ctx* ctx, const char* url, int timeout, char** poll_url, atomic_bool* wanted, int (*on_done)(thingsboard_HTTP_request* req, thingsboard_code code))
+{
+    if (thingsboard_HTTP_io_ctx(ctx) == NULL) return NULL;
 
-    curl_url_set(curlu, CURLUPART_URL, url, 0);
+    size_t size = strlen(url) + strlen("?timeout=") + 12;
+    char* full = (char*)realloc(*poll_url, size);
+    if (full == NULL) return NULL;
+    snprintf(full, size, "%s?timeout=%d", url, timeout);
+    *poll_url = full;
 
-    struct response chunk = { 0 };
+    thingsboard_HTTP_request* req = (thingsboard_HTTP_request*)calloc(1, sizeof(thingsboard_HTTP_request));
+    if (req == NULL) return NULL;
 
-    curl_easy_setopt(http, CURLOPT_WRITEFUNCTION, on_response);
-    curl_easy_setopt(http, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(http, CURLOPT_WRITEDATA, (void*)&chunk);
-    #ifdef LOGGING_ENABLED
-        curl_easy_setopt(http, CURLOPT_VERBOSE, 1L);
-    #endif
-    size_t timeoutSize = strlen("timeout=") + 10;
-    char timeoutQ[timeoutSize];
-    snprintf(timeoutQ, timeoutSize, "timeout=%d", timeout);
+    req->url = full;
+    req->ctx = ctx;
+    req->wanted = wanted;
+    req->on_done = on_done;
 
-    curl_url_set(curlu, CURLUPART_QUERY, timeoutQ, CURLU_APPENDQUERY | CURLU_URLENCODE);
-    curl_easy_setopt(http, CURLOPT_CURLU, curlu);
+    return req;
+}
 
-    int res = 0;
+static int thingsboard_attributes_polled_HTTP(thingsboard_HTTP_request* req, thingsboard_code code)
+{
+    thingsboard_ctx* ctx = req->ctx;
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard HTTP] Subscribing to attributes updates");
-    #endif
-    
-    char* prev = NULL;
+    if (!ctx->attributes_subscribed) goto done;
 
-    while(ctx->attributes_subscribed){
-        res = curl_easy_perform(http);
-        if (res != CURLE_OK || res == CURLE_OPERATION_TIMEOUTED || chunk.response == NULL){
-            break;
-        }
+    if (code == THINGSBOARD_SUCCESS && req->chunk.response != NULL){
+        // The endpoint may hand back the same state again, only responses that change a key are reported
+        int changed = ctx->attrs ? thingsboard_attrs_update(ctx->attrs, ctx, req->chunk.response, req->chunk.size) : -1;
+        if (changed != 0){
+            THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_HTTP, "Attributes update received");
 
-        if (prev != NULL){
-            if (strcmp(prev, chunk.response) == 0){
-                goto loop_end;
-            }
-            free(prev);
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard HTTP] Attributes update received");
-            #endif
+            if (ctx->on_update)
+                ctx->on_update(ctx, req->chunk.response);
         }
-
-        prev = strdup(chunk.response);
-        if (on_update)
-            on_update(ctx, chunk.response);
-
-        loop_end:
-        free(chunk.response);
-        chunk.response = NULL;
-        chunk.size = 0;
-        sleep(3);
     }
 
-    free(url);
-    free(prev);
-    free(args);
-    free(chunk.response);
-    curl_url_cleanup(curlu);
-    curl_easy_cleanup(http);
-    ctx->attributes_sub_cleaned = true;
-
-    if (res != CURLE_OK){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard HTTP] Attributes subscribe failed: %s", curl_easy_strerror(res));
-        #endif
-        return NULL;
-    }
+    if (ctx->attributes_subscribed && thingsboard_HTTP_poll_rearm(req, code, "Attributes")) return 1;
+
+    done:
+        ctx->attributes_poll = NULL;
+        ctx->attributes_sub_cleaned = true;
+        thingsboard_ctx_notify(ctx);
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard HTTP] Attributes subscribe success");
-    #endif
+        THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_HTTP, "Attributes subscription ended");
 
-    return NULL;
+        return 0;
 }
 
-void thingsboard_rpc_unsubscribe_HTTP(thingsboard_ctx* ctx)
+void thingsboard_attributes_unsubscribe_HTTP(thingsboard_ctx* ctx)
 {
     if (ctx == NULL) return;
 
-    ctx->rpc_subscribed = false;
+    ctx->attributes_subscribed = false;
+
+    // Interrupts the long-poll in flight instead of letting it run into its timeout
+    thingsboard_HTTP_io_wakeup(ctx->http_io);
 }
 
-void* thingsboard_rpc_subscribe_HTTP(void* args)
+int thingsboard_attributes_subscribe_HTTP(thingsboard_ctx* ctx, int timeout)
 {
-    struct args* arguments = (struct args*)args;
-
-    thingsboard_ctx* ctx = arguments->ctx;
-    void (*on_rpc)(thingsboard_ctx* ctx, char* json, int req_id) = arguments->cb;
-    char* host = arguments->host;
-    int port = arguments->port;
-    char* token = arguments->token;
-    int timeout = arguments->timeout;
-
-    if (ctx == NULL || ctx->http == NULL){ free(args); return NULL; }
-
-    CURL* http = curl_easy_duphandle(ctx->http);
+    if (ctx == NULL || ctx->url_attributes_updates == NULL) return 2;
 
-    size_t size = strlen(host) + strlen(token) + 38;
-    char* url = (char*)malloc(size);
-    snprintf(url, size, "http://%s:%d/api/v1/%s/rpc", host, port, token);
+    // A poll that is still armed picks up the new callback on its next completion
+    if (ctx->attributes_poll != NULL) return 0;
 
-    CURLU* curlu = curl_url();
-    curl_url_set(curlu, CURLUPART_URL, url, 0);
+    thingsboard_HTTP_request* req = thingsboard_HTTP_poll(ctx, ctx->url_attributes_updates, timeout, &ctx->url_attributes_poll, &ctx->attributes_subscribed, thingsboard_attributes_polled_HTTP);
+    if (req == NULL) return 3;
 
-    struct response chunk = { 0 };
+    ctx->attributes_poll = req;
+    if (thingsboard_HTTP_io_submit(ctx->http_io, req) != 0){
+        ctx->attributes_poll = NULL;
+        free(req);
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_HTTP, "Attributes subscribe failed: too many outstanding requests");
+        return 3;
+    }
 
-    curl_easy_setopt(http, CURLOPT_WRITEFUNCTION, on_response);
-    curl_easy_setopt(http, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(http, CURLOPT_WRITEDATA, (void*)&chunk);
-    #ifdef LOGGING_ENABLED
-        curl_easy_setopt(http, CURLOPT_VERBOSE, 1L);
-    #endif
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_HTTP, "Subscribing to attributes updates");
 
-    size_t timeoutSize = strlen("timeout=") + 10;
-    char timeoutQ[timeoutSize];
-    snprintf(timeoutQ, timeoutSize, "timeout=%d", timeout);
+    return 0;
+}
 
-    curl_url_set(curlu, CURLUPART_QUERY, timeoutQ, CURLU_APPENDQUERY | CURLU_URLENCODE);
+static int thingsboard_rpc_polled_HTTP(thingsboard_HTTP_request* req, thingsboard_code code)
+{
+    thingsboard_ctx* ctx = req->ctx;
 
-    curl_easy_setopt(http, CURLOPT_CURLU, curlu);
+    if (!ctx->rpc_subscribed) goto done;
 
-    int res = 0;
+    if (code == THINGSBOARD_SUCCESS && req->chunk.response != NULL){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_HTTP, "RPC update received");
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard HTTP] Subscribing to RPC updates");
-    #endif
+        cJSON* json = cJSON_Parse(req->chunk.response);
+        cJSON* id = json ? cJSON_GetObjectItem(json, "id") : NULL;
 
-    while(ctx->rpc_subscribed){
-        res = curl_easy_perform(http);
-        if (res != CURLE_OK || res == CURLE_OPERATION_TIMEOUTED || chunk.response == NULL){ 
-            break;
-        }
+        if (id != NULL && !cJSON_IsInvalid(id) && ctx->rpc_on_subscribe)
+            ctx->rpc_on_subscribe(ctx, req->chunk.response, id->valueint);
 
-        if (chunk.response){
-            #ifdef LOGGING_ENABLED
-                syslog(LOG_INFO, "[Thingsboard HTTP] RPC update received");
-            #endif
-        
-            cJSON* json = cJSON_Parse(chunk.response);
-            if (json == NULL || cJSON_IsInvalid(json)){
-                goto end_free;
-            }
-
-            cJSON* id = cJSON_GetObjectItem(json, "id");
-            if (id == NULL || cJSON_IsInvalid(id)){
-                goto end_json;
-            }
-
-            if (on_rpc)
-                on_rpc(ctx, chunk.response, id->valueint);
-
-            end_json:
-                cJSON_Delete(json);
-            end_free:
-                free(chunk.response);
-                chunk.response = NULL;
-                chunk.size = 0;
-        }
-        sleep(3);
+        cJSON_Delete(json);
     }
 
-    free(url);
-    free(args);
-    free(chunk.response);
-    curl_url_cleanup(curlu);
-    curl_easy_cleanup(http);
-    ctx->rpc_sub_cleaned = true;
-
-    if (res != CURLE_OK){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard HTTP] RPC subscribe failed: %s", curl_easy_strerror(res));
-        #endif
-        return NULL;
-    }
+    if (ctx->rpc_subscribed && thingsboard_HTTP_poll_rearm(req, code, "RPC")) return 1;
+
+    done:
+        ctx->rpc_poll = NULL;
+        ctx->rpc_sub_cleaned = true;
+        thingsboard_ctx_notify(ctx);
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard HTTP] RPC subscribe success");
-    #endif
+        THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_HTTP, "RPC subscription ended");
 
-    return NULL;
+        return 0;
 }
 
-int thingsboard_rpc_reply_HTTP(CURL* ctx, int request_id, char* response, char* host, int port, char* token)
+void thingsboard_rpc_unsubscribe_HTTP(thingsboard_ctx* ctx)
 {
-    if (ctx == NULL) return 2;
-
-    CURL* http = curl_easy_duphandle(ctx);
+    if (ctx == NULL) return;
 
-    size_t size = strlen(host) + strlen(token) + 38;
-    char* url = (char*)malloc(size);
-    snprintf(url, size, "http://%s:%d/api/v1/%s/rpc/%d", host, port, token, request_id);
+    ctx->rpc_subscribed = false;
 
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+    thingsboard_HTTP_io_wakeup(ctx->http_io);
+}
 
-    curl_easy_setopt(http, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(http, CURLOPT_URL, url);
-    curl_easy_setopt(http, CURLOPT_POSTFIELDS, response);
-    #ifdef LOGGING_ENABLED
-        curl_easy_setopt(http, CURLOPT_VERBOSE, 1L);
-    #endif
+int thingsboard_rpc_subscribe_HTTP(thingsboard_ctx* ctx, int timeout)
+{
+    if (ctx == NULL || ctx->url_rpc == NULL) return 2;
 
-    int res = curl_easy_perform(http);
+    if (ctx->rpc_poll != NULL) return 0;
 
-    curl_slist_free_all(headers);
-    free(url);
-    curl_easy_cleanup(http);
+    thingsboard_HTTP_request* req = thingsboard_HTTP_poll(ctx, ctx->url_rpc, timeout, &ctx->url_rpc_poll, &ctx->rpc_subscribed, thingsboard_rpc_polled_HTTP);
+    if (req == NULL) return 3;
 
-    if (res != CURLE_OK){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard HTTP] RPC reply failed: %s", curl_easy_strerror(res));
-        #endif
+    ctx->rpc_poll = req;
+    if (thingsboard_HTTP_io_submit(ctx->http_io, req) != 0){
+        ctx->rpc_poll = NULL;
+        free(req);
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_HTTP, "RPC subscribe failed: too many outstanding requests");
         return 3;
     }
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard HTTP] RPC reply success");
-    #endif
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_HTTP, "Subscribing to RPC updates");
 
     return 0;
 }
 
-char* thingsboard_rpc_send_HTTP(CURL* ctx, int request_id, char* method, char* params, char* host, int port, char* token)
+int thingsboard_rpc_reply_HTTP(thingsboard_ctx* ctx, int request_id, char* response)
 {
-    if (ctx == NULL) return NULL;
+    if (ctx == NULL || ctx->http == NULL || ctx->url_buf == NULL) return 2;
 
-    CURL* http = curl_easy_duphandle(ctx);
+    // url_buf already starts with the RPC endpoint, it is shared like the handle
+    pthread_mutex_lock(&ctx->http_lock);
+    snprintf(ctx->url_buf + ctx->url_rpc_len, 16, "/%d", request_id);
 
-    size_t size = strlen(host) + strlen(token) + 38;
-    char* url = (char*)malloc(size);
-    snprintf(url, size, "http://%s:%d/api/v1/%s/rpc", host, port, token);
+    CURLcode res = thingsboard_HTTP_perform(ctx->http, ctx->url_buf, NULL, response, -1L, NULL);
+    long status = thingsboard_HTTP_status(ctx->http, res);
+    thingsboard_HTTP_count(ctx, ctx->http, res);
+    pthread_mutex_unlock(&ctx->http_lock);
 
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+    thingsboard_code code = thingsboard_HTTP_result("RPC reply", res, status);
+    if (code != THINGSBOARD_SUCCESS) return code;
 
-    cJSON* json = cJSON_CreateObject();
-    cJSON_AddNumberToObject(json, "id", request_id);
-    cJSON_AddStringToObject(json, "method", method);
-    cJSON_AddStringToObject(json, "params", params);
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_HTTP, "RPC reply success");
 
-    char* rpc = cJSON_Print(json);
-    cJSON_Delete(json);
+    return 0;
+}
 
-    struct response chunk = {0};
+char* thingsboard_rpc_send_HTTP(thingsboard_ctx* ctx, int request_id, char* method, char* params)
+{
+    if (ctx == NULL || ctx->http == NULL || ctx->url_rpc == NULL) return NULL;
 
-    curl_easy_setopt(http, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(http, CURLOPT_URL, url);
-    curl_easy_setopt(http, CURLOPT_POSTFIELDS, rpc);
-    curl_easy_setopt(http, CURLOPT_WRITEFUNCTION, on_response);
-    curl_easy_setopt(http, CURLOPT_WRITEDATA, (void*)&chunk);
-    #ifdef LOGGING_ENABLED
-        curl_easy_setopt(http, CURLOPT_VERBOSE, 1L);
-    #endif
+    // The body lives in the shared writer until the request is done
+    pthread_mutex_lock(&ctx->writer_lock);
 
-    int res = curl_easy_perform(http);
+    thingsboard_json* json = thingsboard_json_reuse(&ctx->writer);
+    if (json == NULL){
+        pthread_mutex_unlock(&ctx->writer_lock);
+        return NULL;
+    }
+
+    thingsboard_json_object_begin(json);
+    thingsboard_json_key(json, "id");
+    thingsboard_json_int(json, request_id);
+    thingsboard_json_key(json, "method");
+    thingsboard_json_string(json, method);
+    thingsboard_json_key(json, "params");
+    thingsboard_json_string(json, params);
+    thingsboard_json_object_end(json);
 
-    free(rpc);
-    curl_slist_free_all(headers);
-    free(url);
-    curl_easy_cleanup(http);
+    const char* rpc = thingsboard_json_result(json);
+    struct response chunk = {0};
+
+    thingsboard_code res = rpc ? thingsboard_HTTP_perform_ctx(ctx, "RPC send", ctx->url_rpc, NULL, (char*)rpc, &chunk)
+        : thingsboard_HTTP_result("RPC send", CURLE_OUT_OF_MEMORY, 0);
+    pthread_mutex_unlock(&ctx->writer_lock);
 
-    if (res != CURLE_OK){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard HTTP] RPC send failed: %s", curl_easy_strerror(res));
-        #endif
+    if (res != THINGSBOARD_SUCCESS){
+        free(chunk.response);
         return NULL;
     }
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard HTTP] RPC send success");
-    #endif
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_HTTP, "RPC send success");
 
     return chunk.response;
 }
 
-int thingsboard_provision_device_HTTP(CURL* ctx, char* provisionDeviceKey, char* provisionDeviceSecret, char* host, int port, char* token)
+int thingsboard_provision_device_HTTP(thingsboard_ctx* ctx, char* provisionDeviceKey, char* provisionDeviceSecret)
 {
-    if (ctx == NULL) return 2;
+    if (ctx == NULL || ctx->http == NULL || ctx->url_provision == NULL) return 2;
 
-    CURL* http = curl_easy_duphandle(ctx);
+    pthread_mutex_lock(&ctx->writer_lock);
+    const char* provision = thingsboard_provision_json(&ctx->writer, provisionDeviceKey, provisionDeviceSecret, ctx->token);
+    thingsboard_code res = provision ? thingsboard_HTTP_perform_ctx(ctx, "Provision device", ctx->url_provision, NULL, (char*)provision, NULL)
+        : thingsboard_HTTP_result("Provision device", CURLE_OUT_OF_MEMORY, 0);
+    pthread_mutex_unlock(&ctx->writer_lock);
 
-    size_t size = strlen(host) + strlen(token) + 38;
-    char* url = (char*)malloc(size);
-    snprintf(url, size, "http://%s:%d/api/v1/provision", host, port);
-
-    cJSON* json = cJSON_CreateObject();
-    cJSON_AddStringToObject(json, "provisionDeviceKey", provisionDeviceKey);
-    cJSON_AddStringToObject(json, "provisionDeviceSecret", provisionDeviceSecret);
-    cJSON_AddStringToObject(json, "token", token);
-    cJSON_AddStringToObject(json, "credentialsType", "ACCESS_TOKEN");
-
-    char* provision = cJSON_Print(json);
-    cJSON_Delete(json);
-
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-
-    curl_easy_setopt(http, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(http, CURLOPT_URL, url);
-    curl_easy_setopt(http, CURLOPT_POSTFIELDS, provision);
-    #ifdef LOGGING_ENABLED
-        curl_easy_setopt(http, CURLOPT_VERBOSE, 1L);
-    #endif
-
-    int res = curl_easy_perform(http);
-
-    free(provision);
-    curl_slist_free_all(headers);
-    free(url);
-    curl_easy_cleanup(http);
-
-    if (res != CURLE_OK){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard HTTP] Provision device failed: %s", curl_easy_strerror(res));
-        #endif
-        return 3;
-    }
+    if (res != THINGSBOARD_SUCCESS) return res;
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard HTTP] Provision device success");
-    #endif
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_HTTP, "Provision device success");
 
     return 0;
 }
 
-int thingsboard_device_claim_HTTP(CURL* ctx, char* secret, int duration, char* host, int port, char* token)
+int thingsboard_device_claim_HTTP(thingsboard_ctx* ctx, char* secret, int duration)
 {
-    if (ctx == NULL) return 2;
+    if (ctx == NULL || ctx->http == NULL || ctx->url_claim == NULL) return 2;
 
-    CURL* http = curl_easy_duphandle(ctx);
+    pthread_mutex_lock(&ctx->writer_lock);
+    const char* claim = thingsboard_claim_json(&ctx->writer, secret, duration);
+    thingsboard_code res = claim ? thingsboard_HTTP_perform_ctx(ctx, "Device claim", ctx->url_claim, NULL, (char*)claim, NULL)
+        : thingsboard_HTTP_result("Device claim", CURLE_OUT_OF_MEMORY, 0);
+    pthread_mutex_unlock(&ctx->writer_lock);
 
-    size_t size = strlen(host) + strlen(token) + 38;
-    char* url = (char*)malloc(size);
-    snprintf(url, size, "http://%s:%d/api/v1/%s/claim", host, port, token);
-
-    cJSON* json = cJSON_CreateObject();
-    if (secret) cJSON_AddStringToObject(json, "secretKey", secret);
-    if (duration >=0) cJSON_AddNumberToObject(json, "durationMs", duration);
-
-    char* claim = cJSON_Print(json);
-    cJSON_Delete(json);
-
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-
-    curl_easy_setopt(http, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(http, CURLOPT_URL, url);
-    curl_easy_setopt(http, CURLOPT_POSTFIELDS, claim);
-    #ifdef LOGGING_ENABLED
-        curl_easy_setopt(http, CURLOPT_VERBOSE, 1L);
-    #endif
-    
-    int res = curl_easy_perform(http);
-
-    free(claim);
-    curl_slist_free_all(headers);
-    free(url);
-    curl_easy_cleanup(http);
-
-    if (res != CURLE_OK){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard HTTP] Device claim failed: %s", curl_easy_strerror(res));
-        #endif
-        return 3;
-    }
+    if (res != THINGSBOARD_SUCCESS) return res;
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard HTTP] Device claim success");
-    #endif
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_HTTP, "Device claim success");
 
     return 0;
 }
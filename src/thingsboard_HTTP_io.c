@@ -0,0 +1,463 @@
+#define _DEFAULT_SOURCE
+#include "thingsboard_HTTP_io.h"
+#include "thingsboard_types.h"
+#include "thingsboard_log.h"
+#include "thingsboard_compress.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+struct thingsboard_HTTP_io {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    CURLM* multi;
+    struct curl_slist* headers;
+    struct curl_slist* headers_gzip;
+    // Submitted but not yet handed to curl, guarded by lock
+    thingsboard_HTTP_request* queue_head;
+    thingsboard_HTTP_request* queue_tail;
+    int outstanding;
+    int max_outstanding;
+    // Contexts sharing the engine, the connection limits grow with them
+    int attached;
+    bool stopping;
+    struct timespec deadline;
+    // Signalled whenever a request is released, detach waits on it for a context to drain
+    pthread_cond_t drained;
+    // Owned by the I/O thread only
+    thingsboard_HTTP_request* active;
+    // Re-armed requests waiting for their retry delay
+    thingsboard_HTTP_request* delayed;
+    CURL** idle;
+    int idle_count;
+    int connections;
+    // Reused by every body the I/O thread compresses, created on first use
+    thingsboard_compressor* compressor;
+};
+
+thingsboard_code thingsboard_HTTP_code(CURLcode res, long status)
+{
+    if (res != CURLE_OK) return THINGSBOARD_UNKNOWN_ERROR;
+    if (status >= 200 && status < 300) return THINGSBOARD_SUCCESS;
+    if (status == 401) return THINGSBOARD_UNAUTHORIZED;
+    if (status == 400) return THINGSBOARD_BAD_REQUEST;
+
+    return THINGSBOARD_UNKNOWN_ERROR;
+}
+
+static long long thingsboard_HTTP_io_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Swaps the body for its gzipped form, which is only done once so a re-armed request is not packed twice
+static void thingsboard_HTTP_io_pack(thingsboard_HTTP_io* io, thingsboard_HTTP_request* req)
+{
+    size_t threshold = req->ctx->compress_threshold;
+    size_t len = strlen(req->body);
+    if (threshold == 0 || len < threshold) return;
+
+    if (io->compressor == NULL) io->compressor = thingsboard_compressor_new();
+
+    const char* packed;
+    size_t packed_len;
+    if (io->compressor == NULL || thingsboard_compress(io->compressor, req->ctx->compress_level, req->body, len, &packed, &packed_len) != 0)
+        return;
+
+    char* body = (char*)malloc(packed_len);
+    if (body == NULL) return;
+
+    memcpy(body, packed, packed_len);
+    free(req->body);
+    req->body = body;
+    req->body_len = packed_len;
+}
+
+static void thingsboard_HTTP_io_add(thingsboard_HTTP_io* io, thingsboard_HTTP_request* req)
+{
+    // Pooled handles keep their options and their connection between requests
+    if (req->http == NULL){
+        if (io->idle_count > 0) req->http = io->idle[--io->idle_count];
+        else {
+            req->http = curl_easy_init();
+            thingsboard_HTTP_setup(req->http, io->headers);
+        }
+    }
+
+    if (req->compress && req->body_len == 0 && req->body != NULL) thingsboard_HTTP_io_pack(io, req);
+
+    curl_easy_setopt(req->http, CURLOPT_URL, req->url);
+    curl_easy_setopt(req->http, CURLOPT_HTTPHEADER, req->body_len > 0 ? io->headers_gzip : io->headers);
+    if (req->body != NULL){
+        curl_easy_setopt(req->http, CURLOPT_POSTFIELDSIZE, req->body_len > 0 ? (long)req->body_len : -1L);
+        curl_easy_setopt(req->http, CURLOPT_POSTFIELDS, req->body);
+    }
+    else curl_easy_setopt(req->http, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(req->http, CURLOPT_WRITEFUNCTION, thingsboard_HTTP_on_response);
+    curl_easy_setopt(req->http, CURLOPT_WRITEDATA, (void*)&req->chunk);
+    curl_easy_setopt(req->http, CURLOPT_PRIVATE, (void*)req);
+
+    curl_multi_add_handle(io->multi, req->http);
+
+    req->next = io->active;
+    io->active = req;
+}
+
+static void thingsboard_HTTP_io_unlink(thingsboard_HTTP_io* io, thingsboard_HTTP_request* req)
+{
+    thingsboard_HTTP_request** it = &io->active;
+    while (*it != NULL && *it != req) it = &(*it)->next;
+    if (*it != NULL) *it = req->next;
+    req->next = NULL;
+}
+
+static void thingsboard_HTTP_io_release(thingsboard_HTTP_io* io, thingsboard_HTTP_request* req)
+{
+    thingsboard_ctx* ctx = req->ctx;
+
+    if (req->http != NULL){
+        if (io->idle_count < io->max_outstanding) io->idle[io->idle_count++] = req->http;
+        else curl_easy_cleanup(req->http);
+    }
+
+    free(req->chunk.response);
+    free(req->body);
+    free(req);
+
+    pthread_mutex_lock(&io->lock);
+    io->outstanding--;
+    if (ctx != NULL) atomic_fetch_sub(&ctx->http_io_outstanding, 1);
+    pthread_cond_broadcast(&io->drained);
+    pthread_mutex_unlock(&io->lock);
+}
+
+static void thingsboard_HTTP_io_complete(thingsboard_HTTP_io* io, bool stopping)
+{
+    CURLMsg* msg;
+    int left;
+
+    while ((msg = curl_multi_info_read(io->multi, &left)) != NULL){
+        if (msg->msg != CURLMSG_DONE) continue;
+
+        CURL* http = msg->easy_handle;
+        CURLcode result = msg->data.result;
+        thingsboard_HTTP_request* req = NULL;
+        long status = 0;
+
+        curl_easy_getinfo(http, CURLINFO_PRIVATE, (char**)&req);
+        curl_easy_getinfo(http, CURLINFO_RESPONSE_CODE, &status);
+        curl_multi_remove_handle(io->multi, http);
+        thingsboard_HTTP_io_unlink(io, req);
+
+        req->status = status;
+        if (req->ctx != NULL) thingsboard_HTTP_count(req->ctx, http, result);
+        int again = req->on_done ? req->on_done(req, thingsboard_HTTP_code(result, status)) : 0;
+
+        free(req->chunk.response);
+        req->chunk.response = NULL;
+        req->chunk.size = 0;
+
+        if (again && !stopping){
+            if (req->retry_ms <= 0) thingsboard_HTTP_io_add(io, req);
+            else {
+                // The handle stays with the request so the connection is kept for the retry
+                req->due_ms = thingsboard_HTTP_io_now_ms() + req->retry_ms;
+                req->next = io->delayed;
+                io->delayed = req;
+            }
+        }
+        else thingsboard_HTTP_io_release(io, req);
+    }
+}
+
+// Re-adds delayed requests that are due and returns how long the next one may still wait
+static long thingsboard_HTTP_io_due(thingsboard_HTTP_io* io, long wait_ms)
+{
+    long long now = thingsboard_HTTP_io_now_ms();
+    thingsboard_HTTP_request** it = &io->delayed;
+
+    while (*it != NULL){
+        thingsboard_HTTP_request* req = *it;
+        if (req->due_ms <= now){
+            *it = req->next;
+            thingsboard_HTTP_io_add(io, req);
+            continue;
+        }
+        if (req->due_ms - now < wait_ms) wait_ms = (long)(req->due_ms - now);
+        it = &req->next;
+    }
+
+    return wait_ms;
+}
+
+static bool thingsboard_HTTP_io_unwanted(thingsboard_HTTP_request* req)
+{
+    if (req->ctx != NULL && atomic_load(&req->ctx->http_io_cancelled)) return true;
+
+    return req->wanted != NULL && !atomic_load(req->wanted);
+}
+
+// Every attached context may hold its two long-polls open, so the limits grow by two connections per context
+static void thingsboard_HTTP_io_limits(thingsboard_HTTP_io* io, int attached)
+{
+    int connections = 8 + 2 * (attached > 0 ? attached - 1 : 0);
+    if (connections == io->connections) return;
+
+    curl_multi_setopt(io->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)connections);
+    curl_multi_setopt(io->multi, CURLMOPT_MAXCONNECTS, (long)connections);
+    io->connections = connections;
+}
+
+// Aborts in-flight and delayed requests whose owner no longer wants them
+static void thingsboard_HTTP_io_reap(thingsboard_HTTP_io* io)
+{
+    thingsboard_HTTP_request** lists[] = { &io->active, &io->delayed };
+
+    for (int i = 0; i < 2; i++){
+        thingsboard_HTTP_request** it = lists[i];
+        while (*it != NULL){
+            thingsboard_HTTP_request* req = *it;
+            if (!thingsboard_HTTP_io_unwanted(req)){
+                it = &req->next;
+                continue;
+            }
+
+            *it = req->next;
+            if (i == 0) curl_multi_remove_handle(io->multi, req->http);
+            if (req->on_done) req->on_done(req, THINGSBOARD_UNKNOWN_ERROR);
+            thingsboard_HTTP_io_release(io, req);
+        }
+    }
+}
+
+static void* thingsboard_HTTP_io_run(void* arg)
+{
+    thingsboard_HTTP_io* io = (thingsboard_HTTP_io*)arg;
+    int running = 0;
+
+    while (1){
+        thingsboard_HTTP_io_reap(io);
+
+        pthread_mutex_lock(&io->lock);
+        thingsboard_HTTP_request* req = io->queue_head;
+        io->queue_head = io->queue_tail = NULL;
+        bool stopping = io->stopping;
+        int outstanding = io->outstanding;
+        int attached = io->attached;
+        pthread_mutex_unlock(&io->lock);
+
+        thingsboard_HTTP_io_limits(io, attached);
+
+        while (req != NULL){
+            thingsboard_HTTP_request* next = req->next;
+            thingsboard_HTTP_io_add(io, req);
+            req = next;
+        }
+
+        if (stopping){
+            // A request waiting to be retried is not worth holding the shutdown for
+            while (io->delayed != NULL){
+                thingsboard_HTTP_request* later = io->delayed;
+                io->delayed = later->next;
+                if (later->on_done) later->on_done(later, THINGSBOARD_UNKNOWN_ERROR);
+                thingsboard_HTTP_io_release(io, later);
+                outstanding--;
+            }
+
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (outstanding == 0) break;
+            if (now.tv_sec > io->deadline.tv_sec || (now.tv_sec == io->deadline.tv_sec && now.tv_nsec >= io->deadline.tv_nsec)) break;
+        }
+
+        long wait_ms = thingsboard_HTTP_io_due(io, stopping ? 100 : 1000);
+
+        curl_multi_perform(io->multi, &running);
+        thingsboard_HTTP_io_complete(io, stopping);
+
+        curl_multi_poll(io->multi, NULL, 0, (int)wait_ms, NULL);
+    }
+
+    return NULL;
+}
+
+thingsboard_HTTP_io* thingsboard_HTTP_io_start(int max_outstanding)
+{
+    if (max_outstanding <= 0) max_outstanding = THINGSBOARD_HTTP_IO_MAX_OUTSTANDING;
+
+    thingsboard_HTTP_io* io = (thingsboard_HTTP_io*)calloc(1, sizeof(thingsboard_HTTP_io));
+    if (io == NULL) return NULL;
+
+    io->max_outstanding = max_outstanding;
+    io->idle = (CURL**)calloc(max_outstanding, sizeof(CURL*));
+    io->multi = curl_multi_init();
+    io->headers = curl_slist_append(NULL, "Content-Type: application/json");
+    io->headers_gzip = thingsboard_HTTP_gzip_headers();
+
+    if (io->idle == NULL || io->multi == NULL || io->headers == NULL || io->headers_gzip == NULL) goto fail;
+
+    // Lets the engine pipeline onto a few warm connections instead of opening one per request
+    thingsboard_HTTP_io_limits(io, 0);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&io->drained, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&io->lock, NULL);
+
+    if (pthread_create(&io->thread, NULL, thingsboard_HTTP_io_run, io) != 0){
+        pthread_cond_destroy(&io->drained);
+        pthread_mutex_destroy(&io->lock);
+        goto fail;
+    }
+
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_HTTP, "I/O thread started");
+
+    return io;
+
+    fail:
+        if (io->multi) curl_multi_cleanup(io->multi);
+        curl_slist_free_all(io->headers);
+        curl_slist_free_all(io->headers_gzip);
+        free(io->idle);
+        free(io);
+        return NULL;
+}
+
+void thingsboard_HTTP_io_stop(thingsboard_HTTP_io* io, int drain_ms)
+{
+    if (io == NULL) return;
+
+    pthread_mutex_lock(&io->lock);
+    io->stopping = true;
+    clock_gettime(CLOCK_MONOTONIC, &io->deadline);
+    io->deadline.tv_sec += drain_ms / 1000;
+    io->deadline.tv_nsec += (drain_ms % 1000) * 1000000L;
+    if (io->deadline.tv_nsec >= 1000000000L){
+        io->deadline.tv_sec++;
+        io->deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    curl_multi_wakeup(io->multi);
+    pthread_join(io->thread, NULL);
+
+    // Whatever did not finish in time is aborted
+    while (io->active != NULL){
+        thingsboard_HTTP_request* req = io->active;
+        io->active = req->next;
+        curl_multi_remove_handle(io->multi, req->http);
+        if (req->on_done) req->on_done(req, THINGSBOARD_UNKNOWN_ERROR);
+        thingsboard_HTTP_io_release(io, req);
+    }
+    while (io->delayed != NULL){
+        thingsboard_HTTP_request* req = io->delayed;
+        io->delayed = req->next;
+        if (req->on_done) req->on_done(req, THINGSBOARD_UNKNOWN_ERROR);
+        thingsboard_HTTP_io_release(io, req);
+    }
+    while (io->queue_head != NULL){
+        thingsboard_HTTP_request* req = io->queue_head;
+        io->queue_head = req->next;
+        if (req->on_done) req->on_done(req, THINGSBOARD_UNKNOWN_ERROR);
+        thingsboard_HTTP_io_release(io, req);
+    }
+
+    for (int i = 0; i < io->idle_count; i++) curl_easy_cleanup(io->idle[i]);
+
+    curl_multi_cleanup(io->multi);
+    curl_slist_free_all(io->headers);
+    curl_slist_free_all(io->headers_gzip);
+    thingsboard_compressor_free(io->compressor);
+    pthread_cond_destroy(&io->drained);
+    pthread_mutex_destroy(&io->lock);
+    free(io->idle);
+    free(io);
+
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_HTTP, "I/O thread stopped");
+}
+
+void thingsboard_HTTP_io_wakeup(thingsboard_HTTP_io* io)
+{
+    if (io == NULL) return;
+
+    curl_multi_wakeup(io->multi);
+}
+
+int thingsboard_HTTP_io_submit(thingsboard_HTTP_io* io, thingsboard_HTTP_request* req)
+{
+    if (io == NULL || req == NULL) return -1;
+
+    pthread_mutex_lock(&io->lock);
+    if (io->stopping || io->outstanding >= io->max_outstanding){
+        pthread_mutex_unlock(&io->lock);
+        return -1;
+    }
+    // Contexts sharing the engine are each held to their own limit
+    if (req->ctx != NULL){
+        if (atomic_load(&req->ctx->http_io_outstanding) >= req->ctx->http_io_max){
+            pthread_mutex_unlock(&io->lock);
+            return -1;
+        }
+        atomic_fetch_add(&req->ctx->http_io_outstanding, 1);
+    }
+
+    req->next = NULL;
+    if (io->queue_tail) io->queue_tail->next = req;
+    else io->queue_head = req;
+    io->queue_tail = req;
+    io->outstanding++;
+    pthread_mutex_unlock(&io->lock);
+
+    curl_multi_wakeup(io->multi);
+
+    return 0;
+}
+
+void thingsboard_HTTP_io_attach(thingsboard_HTTP_io* io)
+{
+    pthread_mutex_lock(&io->lock);
+    io->attached++;
+    pthread_mutex_unlock(&io->lock);
+
+    curl_multi_wakeup(io->multi);
+}
+
+void thingsboard_HTTP_io_detach(thingsboard_HTTP_io* io, thingsboard_ctx* ctx, int drain_ms)
+{
+    if (io == NULL || ctx == NULL) return;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += drain_ms / 1000;
+    deadline.tv_nsec += (drain_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    // Long-polls the context no longer wants are reaped while the rest drains
+    curl_multi_wakeup(io->multi);
+
+    pthread_mutex_lock(&io->lock);
+    while (atomic_load(&ctx->http_io_outstanding) > 0)
+        if (pthread_cond_timedwait(&io->drained, &io->lock, &deadline) != 0) break;
+
+    // Whatever did not finish in time is aborted by the I/O thread, the other contexts carry on
+    if (atomic_load(&ctx->http_io_outstanding) > 0){
+        atomic_store(&ctx->http_io_cancelled, true);
+        curl_multi_wakeup(io->multi);
+        while (atomic_load(&ctx->http_io_outstanding) > 0)
+            pthread_cond_wait(&io->drained, &io->lock);
+        atomic_store(&ctx->http_io_cancelled, false);
+    }
+
+    io->attached--;
+    pthread_mutex_unlock(&io->lock);
+}
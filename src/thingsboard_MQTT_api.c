@@ -1,107 +1,447 @@
 #define _DEFAULT_SOURCE
 #include "thingsboard_types.h"
+#include "thingsboard_log.h"
 #include "thingsboard_MQTT_api.h"
+#include "thingsboard_pending.h"
+#include "thingsboard_batch.h"
+#include "thingsboard_json.h"
+#include "thingsboard_gateway.h"
+#include "thingsboard_inflight.h"
+#include "thingsboard_filter.h"
+#include "thingsboard_attrs.h"
+#include "thingsboard_metrics.h"
+#include "thingsboard_MQTT_loop.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-#include <syslog.h>
 #include <stdio.h>
-#include <cjson/cJSON.h>
 
 
+// Writes prefix + request id into the caller's buffer, the prefix length is known at compile time
+#define thingsboard_MQTT_topic(buf, prefix, id) thingsboard_MQTT_topic_id(buf, prefix, sizeof(prefix) - 1, id)
+
+static char* thingsboard_MQTT_topic_id(char* buf, const char* prefix, size_t prefix_len, int id)
+{
+    char digits[12];
+    int n = 0;
+    unsigned int v = id < 0 ? -(unsigned int)id : (unsigned int)id;
+
+    do { digits[n++] = '0' + v % 10; v /= 10; } while (v);
+
+    memcpy(buf, prefix, prefix_len);
+    char* p = buf + prefix_len;
+    if (id < 0) *p++ = '-';
+    while (n) *p++ = digits[--n];
+    *p = '\0';
+
+    return buf;
+}
+
+// Parses the request id that ends a topic, -1 when it is not a plain non-negative number
+static int thingsboard_MQTT_topic_id_parse(const char* p, const char* end)
+{
+    if (p == end || end - p > 10) return -1;
+
+    long long id = 0;
+    for (; p < end; p++){
+        if (*p < '0' || *p > '9') return -1;
+        id = id * 10 + (*p - '0');
+    }
+
+    return id > 2147483647LL ? -1 : (int)id;
+}
+
+static void thingsboard_MQTT_on_attributes(thingsboard_ctx* ctx, int id, const char* payload, size_t len)
+{
+    if (ctx->payload_format == THINGSBOARD_PAYLOAD_PROTOBUF){
+        payload = thingsboard_proto_attributes_json(&ctx->proto_decoded, payload, len, &len);
+        if (payload == NULL){
+            THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_MQTT, "Malformed Protobuf attributes update");
+            return;
+        }
+    }
+
+    if (ctx->attrs != NULL) thingsboard_attrs_update(ctx->attrs, ctx, payload, len);
+
+    if (ctx->on_update)
+        ctx->on_update(ctx, (char*)payload);
+}
+
+static void thingsboard_MQTT_on_attributes_response(thingsboard_ctx* ctx, int id, const char* payload, size_t len)
+{
+    void (*on_response)(thingsboard_ctx* ctx, char* json) = NULL;
+    long long sent_us;
+
+    if (thingsboard_pending_take(ctx->attributes_pending, id, (void**)&on_response, &sent_us) != 0){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_MQTT, "Attributes response %d arrived after its deadline", id);
+        return;
+    }
+    thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_ATTRIBUTES_REQUEST, sent_us, THINGSBOARD_SUCCESS);
+
+    if (ctx->attrs != NULL) thingsboard_attrs_response(ctx->attrs, ctx, payload, len);
+
+    if (on_response)
+        on_response(ctx, (char*)payload);
+}
+
+static void thingsboard_MQTT_on_rpc_request(thingsboard_ctx* ctx, int id, const char* payload, size_t len)
+{
+    if (ctx->payload_format == THINGSBOARD_PAYLOAD_PROTOBUF){
+        payload = thingsboard_proto_rpc_json(&ctx->proto_decoded, payload, len, &len);
+        if (payload == NULL){
+            THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_MQTT, "Malformed Protobuf RPC request %d", id);
+            return;
+        }
+    }
+
+    if (ctx->rpc_on_subscribe)
+        ctx->rpc_on_subscribe(ctx, (char*)payload, id);
+}
+
+static void thingsboard_MQTT_on_rpc_response(thingsboard_ctx* ctx, int id, const char* payload, size_t len)
+{
+    void (*rpc_on_response)(thingsboard_ctx* ctx, char* json) = NULL;
+    long long sent_us;
+
+    if (thingsboard_pending_take(ctx->rpc_pending, id, (void**)&rpc_on_response, &sent_us) != 0){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_MQTT, "RPC response %d arrived after its deadline", id);
+        return;
+    }
+    thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_RPC_SEND, sent_us, THINGSBOARD_SUCCESS);
+
+    if (rpc_on_response)
+        rpc_on_response(ctx, (char*)payload);
+}
+
+#define THINGSBOARD_TOPIC_DEVICE "v1/devices/me/"
+#define THINGSBOARD_TOPIC_GATEWAY "v1/gateway/"
+#define THINGSBOARD_TOPIC_LEN(topic) (sizeof(topic) - 1)
+
+struct thingsboard_MQTT_route {
+    const char* prefix;
+    size_t len;
+    // The prefix is followed by a request id instead of ending the topic
+    bool with_id;
+    void (*handler)(thingsboard_ctx* ctx, int id, const char* payload, size_t len);
+};
+
+enum { ROUTE_ATTRIBUTES, ROUTE_ATTRIBUTES_RESPONSE, ROUTE_RPC_REQUEST, ROUTE_RPC_RESPONSE, ROUTE_GATEWAY_ATTRIBUTES, ROUTE_GATEWAY_RPC };
+
+static const struct thingsboard_MQTT_route thingsboard_MQTT_routes[] = {
+    [ROUTE_ATTRIBUTES]          = { THINGSBOARD_TOPIC_ATTRIBUTES, THINGSBOARD_TOPIC_LEN(THINGSBOARD_TOPIC_ATTRIBUTES), false, thingsboard_MQTT_on_attributes },
+    [ROUTE_ATTRIBUTES_RESPONSE] = { THINGSBOARD_TOPIC_ATTRIBUTES_RESPONSE, THINGSBOARD_TOPIC_LEN(THINGSBOARD_TOPIC_ATTRIBUTES_RESPONSE), true, thingsboard_MQTT_on_attributes_response },
+    [ROUTE_RPC_REQUEST]         = { THINGSBOARD_TOPIC_RPC_REQUEST, THINGSBOARD_TOPIC_LEN(THINGSBOARD_TOPIC_RPC_REQUEST), true, thingsboard_MQTT_on_rpc_request },
+    [ROUTE_RPC_RESPONSE]        = { THINGSBOARD_TOPIC_RPC_RESPONSE, THINGSBOARD_TOPIC_LEN(THINGSBOARD_TOPIC_RPC_RESPONSE), true, thingsboard_MQTT_on_rpc_response },
+    [ROUTE_GATEWAY_ATTRIBUTES]  = { THINGSBOARD_TOPIC_GATEWAY_ATTRIBUTES, THINGSBOARD_TOPIC_LEN(THINGSBOARD_TOPIC_GATEWAY_ATTRIBUTES), false, thingsboard_gateway_on_attributes_MQTT },
+    [ROUTE_GATEWAY_RPC]         = { THINGSBOARD_TOPIC_GATEWAY_RPC, THINGSBOARD_TOPIC_LEN(THINGSBOARD_TOPIC_GATEWAY_RPC), false, thingsboard_gateway_on_rpc_MQTT },
+};
+
+// Picks the only route a topic can match from the characters that tell the prefixes apart
+static const struct thingsboard_MQTT_route* thingsboard_MQTT_route(const char* topic, size_t len)
+{
+    size_t base = THINGSBOARD_TOPIC_LEN(THINGSBOARD_TOPIC_DEVICE);
+    const struct thingsboard_MQTT_route* route = NULL;
+
+    if (len > base && memcmp(topic, THINGSBOARD_TOPIC_DEVICE, base) == 0){
+        switch (topic[base]){
+            case 'a':
+                route = &thingsboard_MQTT_routes[len == thingsboard_MQTT_routes[ROUTE_ATTRIBUTES].len ? ROUTE_ATTRIBUTES : ROUTE_ATTRIBUTES_RESPONSE];
+                break;
+            case 'r':
+                // "rpc/re" is shared, "q" or "s" follows
+                if (len <= base + 6) return NULL;
+                route = &thingsboard_MQTT_routes[topic[base + 6] == 'q' ? ROUTE_RPC_REQUEST : ROUTE_RPC_RESPONSE];
+                break;
+            default:
+                return NULL;
+        }
+    }
+    else {
+        base = THINGSBOARD_TOPIC_LEN(THINGSBOARD_TOPIC_GATEWAY);
+        if (len <= base || memcmp(topic, THINGSBOARD_TOPIC_GATEWAY, base) != 0) return NULL;
+
+        switch (topic[base]){
+            case 'a':
+                route = &thingsboard_MQTT_routes[ROUTE_GATEWAY_ATTRIBUTES];
+                break;
+            case 'r':
+                route = &thingsboard_MQTT_routes[ROUTE_GATEWAY_RPC];
+                break;
+            default:
+                return NULL;
+        }
+    }
+
+    if (len < route->len || memcmp(topic + base, route->prefix + base, route->len - base) != 0) return NULL;
+    if (!route->with_id && len != route->len) return NULL;
+
+    return route;
+}
+
 void on_MQTT_message(struct mosquitto* mqtt, void* obj, const struct mosquitto_message* msg)
 {
     thingsboard_ctx* ctx = (thingsboard_ctx*)obj;
+    size_t len = strlen(msg->topic);
+    thingsboard_metrics_received(ctx->metrics, msg->payloadlen > 0 ? (size_t)msg->payloadlen : 0);
 
-    if (strcmp("v1/devices/me/attributes", msg->topic) == 0)
-    {
-        if (ctx->on_update)
-            ctx->on_update(ctx, msg->payload);
+    const struct thingsboard_MQTT_route* route = thingsboard_MQTT_route(msg->topic, len);
+    if (route == NULL){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_DEBUG, THINGSBOARD_LOG_MQTT, "Ignoring message on %s", msg->topic);
+        return;
     }
-    else if (strstr(msg->topic, "v1/devices/me/attributes/response/") != NULL)
-    {
-        if (ctx->on_response)
-            ctx->on_response(ctx, msg->payload);
+
+    int id = 0;
+    if (route->with_id){
+        id = thingsboard_MQTT_topic_id_parse(msg->topic + route->len, msg->topic + len);
+        if (id < 0){
+            THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_MQTT, "Malformed request id on %s", msg->topic);
+            return;
+        }
     }
-    else if (strstr(msg->topic, "v1/devices/me/rpc/request/") != NULL)
-    {
 
-        char* req_id_str = strrchr(msg->topic, '/');
-        int req_id = atoi(req_id_str + 1);
+    route->handler(ctx, id, (const char*)msg->payload, msg->payloadlen > 0 ? (size_t)msg->payloadlen : 0);
+}
 
-        if (ctx->rpc_on_subscribe)
-            ctx->rpc_on_subscribe(ctx, msg->payload, req_id);
+// Full jitter: a random delay between the minimum and a cap that doubles with every failed attempt
+static long thingsboard_MQTT_on_lost(void* obj, int rc)
+{
+    thingsboard_ctx* ctx = (thingsboard_ctx*)obj;
+    long long min = ctx->backoff_min_ms;
+    long long max = ctx->backoff_max_ms;
+
+    long long cap = min;
+    for (int i = 0; i < ctx->reconnect_attempts && cap < max; i++) cap *= 2;
+    // The two limits are set one after the other, a half applied change must not leave cap below min
+    if (cap > max) cap = max > min ? max : min;
+    ctx->reconnect_attempts++;
+    thingsboard_metrics_reconnect(ctx->metrics);
+    // Shared attribute updates published while the connection is down are lost
+    if (ctx->attrs != NULL) thingsboard_attrs_live(ctx->attrs, false);
+
+    long delay = (long)(min + rand_r(&ctx->backoff_seed) % (cap - min + 1));
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_MQTT, "Reconnect attempt %d in %ld ms", ctx->reconnect_attempts, delay);
+    thingsboard_ctx_state(ctx, THINGSBOARD_RECONNECTING, rc);
+
+    return delay;
+}
+
+static void thingsboard_MQTT_on_retry(void* obj)
+{
+    thingsboard_ctx_state((thingsboard_ctx*)obj, THINGSBOARD_CONNECTING, 0);
+}
+
+const thingsboard_MQTT_hooks thingsboard_MQTT_supervisor = { thingsboard_MQTT_on_lost, thingsboard_MQTT_on_retry };
+
+static void thingsboard_MQTT_resubscribe(struct mosquitto* mqtt, const char* topic)
+{
+    int res = mosquitto_subscribe(mqtt, NULL, topic, 0);
+    if (res != MOSQ_ERR_SUCCESS)
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Subscribing to %s failed: %s", topic, mosquitto_strerror(res));
+}
+
+void on_MQTT_connect(struct mosquitto* mqtt, void* obj, int rc)
+{
+    thingsboard_ctx* ctx = (thingsboard_ctx*)obj;
+
+    if (rc != 0){
+        // The network thread sees the connection close and backs off before the next attempt
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Connection refused: %s", mosquitto_connack_string(rc));
+        return;
     }
-    else if (strstr(msg->topic, "v1/devices/me/rpc/response/") != NULL)
-    {
-        if (ctx->rpc_on_response)
-            ctx->rpc_on_response(ctx, msg->payload);
+
+    // The session is clean, whatever the application subscribed to is asked for again
+    if (ctx->attributes_subscribed){
+        thingsboard_MQTT_resubscribe(mqtt, THINGSBOARD_TOPIC_ATTRIBUTES);
+        if (ctx->attrs != NULL) thingsboard_attrs_live(ctx->attrs, true);
     }
+    if (ctx->rpc_subscribed) thingsboard_MQTT_resubscribe(mqtt, THINGSBOARD_TOPIC_RPC_REQUEST "+");
+
+    // Kept for the life of the connection so responses are never missed between requests
+    int res = mosquitto_subscribe(mqtt, NULL, THINGSBOARD_TOPIC_ATTRIBUTES_RESPONSE "+", 0);
+    if (res != MOSQ_ERR_SUCCESS)
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Subscribing to attributes response failed: %s", mosquitto_strerror(res));
+
+    res = mosquitto_subscribe(mqtt, NULL, THINGSBOARD_TOPIC_RPC_RESPONSE "+", 0);
+    if (res != MOSQ_ERR_SUCCESS)
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Subscribing to RPC response failed: %s", mosquitto_strerror(res));
+
+    thingsboard_gateway_resubscribe_MQTT(ctx);
+
+    // QoS 0 values sent just before the drop may never have arrived
+    if (ctx->filter != NULL) thingsboard_filter_rearm(ctx->filter);
+
+    ctx->reconnect_attempts = 0;
+    thingsboard_ctx_state(ctx, THINGSBOARD_CONNECTED, 0);
 }
 
-int thingsboard_attributes_request_MQTT(struct mosquitto* ctx, int request_id, char* attribute_data)
+// Every device publish goes through here so the statistics see what was written
+static int thingsboard_MQTT_publish(thingsboard_ctx* ctx, int* mid, const char* topic, int len, const void* payload, int qos)
 {
-    if (ctx == NULL) return 2;
+    int res = mosquitto_publish(ctx->mqtt, mid, topic, len, payload, qos, false);
+    if (res == MOSQ_ERR_SUCCESS) thingsboard_metrics_sent(ctx->metrics, (size_t)len);
 
-    int res = mosquitto_subscribe(ctx, NULL, "v1/devices/me/attributes/response/+", 0);
-    if (res != MOSQ_ERR_SUCCESS){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard MQTT] Subscribing to attributes response failed: %s", mosquitto_strerror(res));
-        #endif
-        return 3;
+    return res;
+}
+
+int thingsboard_attributes_request_MQTT(thingsboard_ctx* ctx, int request_id, char* attribute_data, void (*on_response)(thingsboard_ctx* ctx, char* json))
+{
+    if (ctx == NULL || ctx->mqtt == NULL) return 2;
+    if (ctx->payload_format == THINGSBOARD_PAYLOAD_PROTOBUF){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Attribute requests are not supported with Protobuf payloads");
+        return 2;
     }
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard MQTT] Subscribed to attributes response");
-    #endif
 
-    mosquitto_message_callback_set(ctx, on_MQTT_message);
+    if (thingsboard_pending_add(ctx->attributes_pending, request_id, on_response, thingsboard_time_ms() + ctx->request_timeout_ms) != 0){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Attributes request %d is already outstanding", request_id);
+        return 2;
+    }
 
-    char* base_topic = "v1/devices/me/attributes/request/";
-    size_t size = strlen(base_topic) + 8;
-    char* topic = (char*)malloc(size);
-    snprintf(topic, size, "%s%d", base_topic, request_id);
+    char topic[THINGSBOARD_TOPIC_MAX];
+    thingsboard_MQTT_topic(topic, THINGSBOARD_TOPIC_ATTRIBUTES_REQUEST, request_id);
 
-    res = mosquitto_publish(ctx, NULL, topic, strlen(attribute_data), attribute_data, 0, false);
+    // QoS 1 so mosquitto sends it again when the connection drops before it is acknowledged
+    int res = thingsboard_MQTT_publish(ctx, NULL, topic, strlen(attribute_data), attribute_data, 1);
     if (res != MOSQ_ERR_SUCCESS){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard MQTT] Publishing attributes request failed: %s", mosquitto_strerror(res));
-        #endif
-        free(topic);
+        void* cb;
+        thingsboard_pending_take(ctx->attributes_pending, request_id, &cb, NULL);
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Publishing attributes request failed: %s", mosquitto_strerror(res));
         return 3; 
     }
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard MQTT] Attributes request sent");
-    #endif
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_MQTT, "Attributes request sent");
+
+    return 0;
+}
+
+void thingsboard_requests_expire_MQTT(thingsboard_ctx* ctx, long long now_ms)
+{
+    int req_id;
+    long long sent_us;
+    void (*on_response)(thingsboard_ctx* ctx, char* json);
+
+    while (thingsboard_pending_take_expired(ctx->attributes_pending, now_ms, &req_id, (void**)&on_response, &sent_us) == 0){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_MQTT, "Attributes request %d timed out", req_id);
+        thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_ATTRIBUTES_REQUEST, sent_us, THINGSBOARD_UNKNOWN_ERROR);
+        if (on_response)
+            on_response(ctx, NULL);
+    }
 
-    sleep(1);
+    while (thingsboard_pending_take_expired(ctx->rpc_pending, now_ms, &req_id, (void**)&on_response, &sent_us) == 0){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_MQTT, "RPC request %d timed out", req_id);
+        thingsboard_metrics_done(ctx->metrics, THINGSBOARD_OP_RPC_SEND, sent_us, THINGSBOARD_UNKNOWN_ERROR);
+        if (on_response)
+            on_response(ctx, NULL);
+    }
+}
 
-    mosquitto_unsubscribe(ctx, NULL, "v1/devices/me/attributes/response/+");
+long long thingsboard_requests_deadline_MQTT(thingsboard_ctx* ctx)
+{
+    long long attributes = thingsboard_pending_deadline(ctx->attributes_pending);
+    long long rpc = thingsboard_pending_deadline(ctx->rpc_pending);
 
-    free(topic);
+    if (attributes == 0 || (rpc != 0 && rpc < attributes)) return rpc;
 
-    return 0;
+    return attributes;
 }
 
-// v1/devices/me/telemetry
-int thingsboard_telemetry_send_MQTT(struct mosquitto* ctx, char* telemetry_data, char* topic)
+void on_MQTT_publish(struct mosquitto* mqtt, void* obj, int mid)
 {
-    if (ctx == NULL) return 2;
+    thingsboard_ctx* ctx = (thingsboard_ctx*)obj;
+    thingsboard_inflight_fn on_sent;
+
+    if (thingsboard_inflight_ack(ctx->inflight, mid, &on_sent) == 0 && on_sent)
+        on_sent(ctx, THINGSBOARD_SUCCESS);
+}
+
+int thingsboard_publish_MQTT(thingsboard_ctx* ctx, thingsboard_message_class cls, const char* topic, const char* payload, size_t len,
+    void (*on_sent)(thingsboard_ctx* ctx, thingsboard_code code), bool wait)
+{
+    if (ctx == NULL || ctx->mqtt == NULL) return 2;
+
+    int qos = ctx->qos[cls];
+
+    if (qos == 0){
+        int res = thingsboard_MQTT_publish(ctx, NULL, topic, (int)len, payload, 0);
+        if (res != MOSQ_ERR_SUCCESS){
+            THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Publishing to %s failed: %s", topic, mosquitto_strerror(res));
+            return 3;
+        }
+        if (on_sent) on_sent(ctx, THINGSBOARD_SUCCESS);
+        return 0;
+    }
 
-    int res = mosquitto_publish(ctx, NULL, topic, strlen(telemetry_data), telemetry_data, 0, false);
+    // Waiting on the network thread would keep the very acknowledgements that free the window from being read
+    long wait_ms = wait && !thingsboard_MQTT_loop_current() ? ctx->request_timeout_ms : 0;
+    long long ticket;
+    if (thingsboard_inflight_reserve(ctx->inflight, wait_ms, &ticket) != 0){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_MQTT, "In-flight window full, not publishing to %s", topic);
+        return THINGSBOARD_BUSY;
+    }
 
+    int mid;
+    int res = thingsboard_MQTT_publish(ctx, &mid, topic, (int)len, payload, qos);
     if (res != MOSQ_ERR_SUCCESS){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard MQTT] Publishing telemetry failed: %s", mosquitto_strerror(res));
-        #endif
+        thingsboard_inflight_cancel(ctx->inflight, ticket);
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Publishing to %s failed: %s", topic, mosquitto_strerror(res));
         return 3;
     }
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard MQTT] Telemetry sent");
-    #endif
+
+    // The acknowledgement may have been read before mosquitto_publish returned
+    if (thingsboard_inflight_track(ctx->inflight, ticket, mid, on_sent) == 1 && on_sent)
+        on_sent(ctx, THINGSBOARD_SUCCESS);
 
     return 0;
 }
 
+// v1/devices/me/telemetry
+int thingsboard_publish_payload_MQTT(thingsboard_ctx* ctx, thingsboard_message_class cls, const char* topic, const char* json,
+    void (*on_sent)(thingsboard_ctx* ctx, thingsboard_code code), bool wait)
+{
+    if (ctx == NULL || ctx->payload_format != THINGSBOARD_PAYLOAD_PROTOBUF)
+        return thingsboard_publish_MQTT(ctx, cls, topic, json, strlen(json), on_sent, wait);
+
+    // Typical messages are encoded on the stack, larger ones move to the heap
+    unsigned char storage[THINGSBOARD_PROTO_STACK];
+    thingsboard_proto proto;
+    thingsboard_proto_init(&proto, storage, sizeof(storage));
+
+    int res;
+    if (cls == THINGSBOARD_CLASS_RPC){
+        thingsboard_proto_bytes(&proto, THINGSBOARD_PROTO_RPC_RESPONSE, json, strlen(json));
+        res = proto.failed ? 2 : thingsboard_publish_MQTT(ctx, cls, topic, (const char*)proto.buf, proto.len, on_sent, wait);
+        thingsboard_proto_release(&proto);
+        return res;
+    }
+
+    // A batch or a replayed burst is an array of samples, a Protobuf message holds one so each is published on its own
+    int count = thingsboard_proto_from_json(&proto, ctx->proto_schema[cls], json, thingsboard_time_ms());
+    if (count < 0){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Payload for %s does not fit its Protobuf schema", topic);
+        thingsboard_proto_release(&proto);
+        return 2;
+    }
+
+    // Only the last sample reports back, a resend after a failure repeats samples the server stores under the same ts
+    size_t off = 0, len;
+    const char* message;
+    res = 0;
+    while (res == 0 && (message = thingsboard_proto_delimited(&proto, &off, &len)) != NULL)
+        res = thingsboard_publish_MQTT(ctx, cls, topic, message, len, --count == 0 ? on_sent : NULL, wait);
+    if (res == 0 && on_sent && off == 0) on_sent(ctx, THINGSBOARD_SUCCESS);
+
+    thingsboard_proto_release(&proto);
+
+    return res;
+}
+
+int thingsboard_telemetry_send_MQTT(thingsboard_ctx* ctx, char* telemetry_data, char* topic)
+{
+    int res = thingsboard_publish_payload_MQTT(ctx, THINGSBOARD_CLASS_TELEMETRY, topic, telemetry_data, NULL, true);
+    if (res == 0)
+        THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_MQTT, "Telemetry sent");
+
+    return res;
+}
+
 int thingsboard_MQTT_subscribe(struct mosquitto* ctx, char* topic, void* cb)
 {
     if (ctx == NULL) return 2;
@@ -110,14 +450,10 @@ int thingsboard_MQTT_subscribe(struct mosquitto* ctx, char* topic, void* cb)
     int res = mosquitto_subscribe(ctx, NULL, topic, 0);
 
     if (res != MOSQ_ERR_SUCCESS){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard MQTT] Subscribing to %s failed: %s", topic, mosquitto_strerror(res));
-        #endif
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Subscribing to %s failed: %s", topic, mosquitto_strerror(res));
         return 3;
     }
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard MQTT] Subscribed to: %s", topic);
-    #endif
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_MQTT, "Subscribed to: %s", topic);
 
     return 0;
 }
@@ -127,13 +463,17 @@ void thingsboard_attributes_unsubscribe_MQTT(thingsboard_ctx* ctx)
     ctx->attributes_subscribed = false;
     ctx->attributes_sub_cleaned = true;
     mosquitto_unsubscribe(ctx->mqtt, NULL, "v1/devices/me/attributes");
+    if (ctx->attrs != NULL) thingsboard_attrs_live(ctx->attrs, false);
 }
 
 int thingsboard_attributes_subscribe_MQTT(thingsboard_ctx* ctx)
 {
     ctx->attributes_subscribed = true;
     ctx->attributes_sub_cleaned = false;
-    return thingsboard_MQTT_subscribe(ctx->mqtt, "v1/devices/me/attributes", on_MQTT_message);
+    int res = thingsboard_MQTT_subscribe(ctx->mqtt, "v1/devices/me/attributes", on_MQTT_message);
+    // Values cached before the subscription may have changed unnoticed, only later ones are kept current
+    if (res == 0 && ctx->attrs != NULL) thingsboard_attrs_live(ctx->attrs, true);
+    return res;
 }
 
 void thingsboard_rpc_unsubscribe_MQTT(thingsboard_ctx* ctx)
@@ -150,132 +490,101 @@ int thingsboard_rpc_subscribe_MQTT(thingsboard_ctx* ctx)
     return thingsboard_MQTT_subscribe(ctx->mqtt, "v1/devices/me/rpc/request/+", on_MQTT_message);
 }
 
-int thingsboard_rpc_reply_MQTT(struct mosquitto* ctx, int request_id, char* response)
+int thingsboard_rpc_reply_MQTT(thingsboard_ctx* ctx, int request_id, char* response)
 {
     if (ctx == NULL) return 2;
 
-    char* base_topic = "v1/devices/me/rpc/response/";
-    size_t size = strlen(base_topic) + 8;
-    char* topic = (char*)malloc(size);
-    snprintf(topic, size, "%s%d", base_topic, request_id);
+    char topic[THINGSBOARD_TOPIC_MAX];
+    thingsboard_MQTT_topic(topic, THINGSBOARD_TOPIC_RPC_RESPONSE, request_id);
 
-    int res = mosquitto_publish(ctx, NULL, topic, strlen(response), response, 0, false);
-    free(topic);
-
-    if (res != MOSQ_ERR_SUCCESS){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard MQTT] Publishing RPC response failed: %s", mosquitto_strerror(res));
-        #endif
-        return 3;
-    }
+    int res = thingsboard_publish_payload_MQTT(ctx, THINGSBOARD_CLASS_RPC, topic, response, NULL, true);
+    if (res != 0) return res;
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard MQTT] RPC response sent");
-    #endif
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_MQTT, "RPC response sent");
 
     return 0;
 }
 
-int thingsboard_rpc_send_MQTT(struct mosquitto* ctx, int request_id, char* method, char* params)
+int thingsboard_rpc_send_MQTT(thingsboard_ctx* ctx, int request_id, char* method, char* params, void (*rpc_on_response)(thingsboard_ctx* ctx, char* json))
 {
-    if (ctx == NULL) return 2;
-
-    char* base_topic = "v1/devices/me/rpc/request/";
-    size_t size = strlen(base_topic) + 8;
-    char* topic = (char*)malloc(size);
-    snprintf(topic, size, "%s%d", base_topic, request_id);
-
-    cJSON* json = cJSON_CreateObject();
-    cJSON_AddStringToObject(json, "method", method);
-    cJSON_AddStringToObject(json, "params", params);
-
-    char* rpc = cJSON_Print(json);
-    cJSON_Delete(json);
+    if (ctx == NULL || ctx->mqtt == NULL) return 2;
+    if (ctx->payload_format == THINGSBOARD_PAYLOAD_PROTOBUF){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Client-side RPC is not supported with Protobuf payloads");
+        return 2;
+    }
 
-    char* base_resp_topic = "v1/devices/me/rpc/response/";
-    size_t resp_size = strlen(base_resp_topic) + 8;
-    char* resp_topic = (char*)malloc(resp_size);
-    snprintf(resp_topic, resp_size, "%s%d", base_resp_topic, request_id);
+    if (thingsboard_pending_add(ctx->rpc_pending, request_id, rpc_on_response, thingsboard_time_ms() + ctx->request_timeout_ms) != 0){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "RPC request %d is already outstanding", request_id);
+        return 2;
+    }
 
-    mosquitto_message_callback_set(ctx, on_MQTT_message);
-    mosquitto_subscribe(ctx, NULL, resp_topic, 0);
+    char topic[THINGSBOARD_TOPIC_MAX];
+    thingsboard_MQTT_topic(topic, THINGSBOARD_TOPIC_RPC_REQUEST, request_id);
+
+    // mosquitto copies the payload, the shared writer is only held until the publish returns
+    pthread_mutex_lock(&ctx->writer_lock);
+    thingsboard_json* json = thingsboard_json_reuse(&ctx->writer);
+    const char* rpc = NULL;
+    if (json != NULL){
+        thingsboard_json_object_begin(json);
+        thingsboard_json_key(json, "method");
+        thingsboard_json_string(json, method);
+        thingsboard_json_key(json, "params");
+        thingsboard_json_string(json, params);
+        thingsboard_json_object_end(json);
+        rpc = thingsboard_json_result(json);
+    }
 
-    int res = mosquitto_publish(ctx, NULL, topic, strlen(rpc), rpc, 0, false);
-    free(topic);
-    free(rpc);
+    // The response arrives on the rpc/response/+ subscription made when connecting, QoS 1 survives a reconnect
+    int res = rpc ? thingsboard_MQTT_publish(ctx, NULL, topic, json->len, rpc, 1) : MOSQ_ERR_NOMEM;
+    pthread_mutex_unlock(&ctx->writer_lock);
 
     if (res != MOSQ_ERR_SUCCESS){
-        free(resp_topic);
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard MQTT] Publishing RPC request failed: %s", mosquitto_strerror(res));
-        #endif
+        void* cb;
+        thingsboard_pending_take(ctx->rpc_pending, request_id, &cb, NULL);
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Publishing RPC request failed: %s", mosquitto_strerror(res));
         return 3;
     }
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard MQTT] RPC request sent");
-    #endif
-
-    mosquitto_unsubscribe(ctx, NULL, resp_topic);
-    free(resp_topic);
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_MQTT, "RPC request sent");
 
     return 0;
 }
 
-int thingsboard_provision_device_MQTT(struct mosquitto* ctx, char* provisionDeviceKey, char* provisionDeviceSecret, char* token)
+int thingsboard_provision_device_MQTT(thingsboard_ctx* ctx, char* provisionDeviceKey, char* provisionDeviceSecret, char* token)
 {
-    if (ctx == NULL) return 2;
-
-    cJSON* json = cJSON_CreateObject();
-    cJSON_AddStringToObject(json, "provisionDeviceKey", provisionDeviceKey);
-    cJSON_AddStringToObject(json, "provisionDeviceSecret", provisionDeviceSecret);
-    cJSON_AddStringToObject(json, "token", token);
-    cJSON_AddStringToObject(json, "credentialsType", "ACCESS_TOKEN");
+    if (ctx == NULL || ctx->mqtt == NULL) return 2;
 
-    char* rpc = cJSON_Print(json);
-    cJSON_Delete(json);
-
-    int res = mosquitto_publish(ctx, NULL, "/provision", strlen(rpc), rpc, 0, false);
-    free(rpc);
+    pthread_mutex_lock(&ctx->writer_lock);
+    const char* provision = thingsboard_provision_json(&ctx->writer, provisionDeviceKey, provisionDeviceSecret, token);
+    int res = provision ? thingsboard_MQTT_publish(ctx, NULL, "/provision", ctx->writer->len, provision, 0) : MOSQ_ERR_NOMEM;
+    pthread_mutex_unlock(&ctx->writer_lock);
 
     if (res != MOSQ_ERR_SUCCESS){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard MQTT] Provisioning device failed: %s", mosquitto_strerror(res));
-        #endif
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Provisioning device failed: %s", mosquitto_strerror(res));
         return 3;
     }
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard MQTT] Device provisioned");
-    #endif
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_MQTT, "Device provisioned");
 
     return 0;
 }
 
-int thingsboard_device_claim_MQTT(struct mosquitto* ctx, char* secret, int duration)
+int thingsboard_device_claim_MQTT(thingsboard_ctx* ctx, char* secret, int duration)
 {
-    if (ctx == NULL) return 2;
+    if (ctx == NULL || ctx->mqtt == NULL) return 2;
 
-    cJSON* json = cJSON_CreateObject();
-    if (secret) cJSON_AddStringToObject(json, "secretKey", secret);
-    if (duration >= 0) cJSON_AddNumberToObject(json, "durationMs", duration);
-
-    char* rpc = cJSON_Print(json);
-    cJSON_Delete(json);
-
-    int res = mosquitto_publish(ctx, NULL, "v1/devices/me/claim", strlen(rpc), rpc, 0, false);
-    free(rpc);
+    pthread_mutex_lock(&ctx->writer_lock);
+    const char* claim = thingsboard_claim_json(&ctx->writer, secret, duration);
+    int res = claim ? thingsboard_MQTT_publish(ctx, NULL, THINGSBOARD_TOPIC_CLAIM, ctx->writer->len, claim, 0) : MOSQ_ERR_NOMEM;
+    pthread_mutex_unlock(&ctx->writer_lock);
 
     if (res != MOSQ_ERR_SUCCESS){
-        #ifdef LOGGING_ENABLED
-            syslog(LOG_ERR, "[Thingsboard MQTT] Device claiming failed: %s", mosquitto_strerror(res));
-        #endif
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Device claiming failed: %s", mosquitto_strerror(res));
         return 3;
     }
 
-    #ifdef LOGGING_ENABLED
-        syslog(LOG_INFO, "[Thingsboard MQTT] Device claimed");
-    #endif
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_MQTT, "Device claimed");
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,380 @@
+#define _DEFAULT_SOURCE
+#include "thingsboard_MQTT_loop.h"
+#include "thingsboard_log.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+struct loop_client {
+    struct mosquitto* mqtt;
+    const thingsboard_MQTT_hooks* hooks;
+    void* obj;
+    // Set when the connection dropped, the client is left out of poll() until retry_ms
+    bool lost;
+    long long retry_ms;
+    // The events poll() reported for the client this round
+    short revents;
+    // Set while the network thread works on the client without the lock, detach waits for it to clear
+    bool busy;
+    // Detached from a callback of the network thread while busy, the thread frees it once done
+    bool detached;
+};
+
+struct thingsboard_MQTT_loop {
+    pthread_t thread;
+    // Never held while mosquitto runs, so reads, reconnects and callbacks do not hold up attach and detach
+    pthread_mutex_t lock;
+    // Signalled when the network thread is done with the clients it marked busy
+    pthread_cond_t idle;
+    struct loop_client** clients;
+    size_t count;
+    size_t cap;
+    // Bumped by attach and detach, poll() results are only applied to the set they were taken for
+    unsigned long generation;
+    bool stopping;
+    // Set when the loop was stopped from one of its own callbacks, the thread then frees it on the way out
+    bool orphaned;
+    int wake[2];
+    // Owned by the network thread
+    struct pollfd* fds;
+    struct loop_client** polled;
+    size_t fds_cap;
+    struct loop_client** work;
+    size_t work_cap;
+};
+
+// Set on the network threads, whose callbacks must never wait for the network
+static __thread bool network_thread;
+
+static long long thingsboard_MQTT_loop_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void thingsboard_MQTT_loop_wake(thingsboard_MQTT_loop* loop)
+{
+    char byte = 0;
+    if (write(loop->wake[1], &byte, 1) < 0){
+        // The pipe is full, the thread is already due to wake up
+    }
+}
+
+// Runs the on_lost hook, which may detach the client
+static void thingsboard_MQTT_loop_lost(struct loop_client* client, int rc, long long now)
+{
+    if (!client->lost)
+        THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_MQTT, "Connection lost: %s", mosquitto_strerror(rc));
+
+    client->lost = true;
+    client->retry_ms = now + THINGSBOARD_MQTT_RECONNECT_MS;
+
+    if (client->hooks && client->hooks->on_lost)
+        client->retry_ms = now + client->hooks->on_lost(client->obj, rc);
+}
+
+// Fills the poll set under the lock and returns how long poll() may sleep
+static int thingsboard_MQTT_loop_prepare(thingsboard_MQTT_loop* loop, size_t* nfds)
+{
+    long long now = thingsboard_MQTT_loop_now_ms();
+    long long wait_ms = THINGSBOARD_MQTT_LOOP_WAIT_MS;
+
+    if (loop->fds_cap < loop->count + 1){
+        size_t cap = loop->cap + 1;
+        struct pollfd* fds = (struct pollfd*)realloc(loop->fds, cap * sizeof(struct pollfd));
+        if (fds != NULL) loop->fds = fds;
+        struct loop_client** polled = (struct loop_client**)realloc(loop->polled, cap * sizeof(struct loop_client*));
+        if (polled != NULL) loop->polled = polled;
+        if (fds != NULL && polled != NULL) loop->fds_cap = cap;
+    }
+
+    loop->fds[0].fd = loop->wake[0];
+    loop->fds[0].events = POLLIN;
+    *nfds = 1;
+
+    for (size_t i = 0; i < loop->count && *nfds < loop->fds_cap; i++){
+        struct loop_client* client = loop->clients[i];
+
+        // Reconnects run outside the lock, the thread only has to wake up in time for them
+        if (client->lost){
+            long long left = client->retry_ms - now;
+            if (left < wait_ms) wait_ms = left > 0 ? left : 0;
+            continue;
+        }
+
+        // Marked lost by the next round
+        int sock = mosquitto_socket(client->mqtt);
+        if (sock < 0){
+            wait_ms = 0;
+            continue;
+        }
+
+        loop->fds[*nfds].fd = sock;
+        loop->fds[*nfds].events = POLLIN | (mosquitto_want_write(client->mqtt) ? POLLOUT : 0);
+        loop->fds[*nfds].revents = 0;
+        loop->polled[*nfds] = client;
+        (*nfds)++;
+    }
+
+    return (int)wait_ms;
+}
+
+// Marks the clients busy under the lock and hands them their events, returns how many go into the work list
+static size_t thingsboard_MQTT_loop_claim(thingsboard_MQTT_loop* loop, size_t nfds, unsigned long generation)
+{
+    if (loop->work_cap < loop->count){
+        struct loop_client** work = (struct loop_client**)realloc(loop->work, loop->cap * sizeof(struct loop_client*));
+        if (work != NULL){
+            loop->work = work;
+            loop->work_cap = loop->cap;
+        }
+    }
+
+    for (size_t i = 0; i < loop->count; i++) loop->clients[i]->revents = 0;
+    // A client attached or detached during poll() may have freed a polled client, the events are picked up next round
+    if (loop->generation == generation)
+        for (size_t k = 1; k < nfds; k++) loop->polled[k]->revents = loop->fds[k].revents;
+
+    size_t n = 0;
+    for (size_t i = 0; i < loop->count && n < loop->work_cap; i++){
+        loop->clients[i]->busy = true;
+        loop->work[n++] = loop->clients[i];
+    }
+
+    return n;
+}
+
+// Runs without the lock, the client may be detached by any of the callbacks
+static void thingsboard_MQTT_loop_service(struct loop_client* client, long long now)
+{
+    if (client->lost){
+        if (client->retry_ms > now) return;
+
+        if (client->hooks && client->hooks->on_retry){
+            client->hooks->on_retry(client->obj);
+            if (client->detached) return;
+        }
+        // Closes the dead socket and starts a non-blocking connect, CONNACK arrives through poll()
+        int rc = mosquitto_reconnect_async(client->mqtt);
+        if (rc != MOSQ_ERR_SUCCESS) thingsboard_MQTT_loop_lost(client, rc, now);
+        else client->lost = false;
+        return;
+    }
+
+    if (mosquitto_socket(client->mqtt) < 0){
+        thingsboard_MQTT_loop_lost(client, MOSQ_ERR_NO_CONN, now);
+        return;
+    }
+
+    short revents = client->revents;
+    int rc = MOSQ_ERR_SUCCESS;
+
+    if (revents & (POLLIN | POLLHUP | POLLERR)){
+        rc = mosquitto_loop_read(client->mqtt, 1);
+        if (client->detached) return;
+    }
+    // Callbacks queue their subscriptions without writing, they go out right away
+    if (rc == MOSQ_ERR_SUCCESS && revents != 0 && ((revents & POLLOUT) || mosquitto_want_write(client->mqtt)))
+        rc = mosquitto_loop_write(client->mqtt, 1);
+    // Keepalive pings and timed out pings, cheap enough to run for every client each round
+    if (rc == MOSQ_ERR_SUCCESS)
+        rc = mosquitto_loop_misc(client->mqtt);
+    if (rc != MOSQ_ERR_SUCCESS)
+        thingsboard_MQTT_loop_lost(client, rc, now);
+}
+
+static void thingsboard_MQTT_loop_free(thingsboard_MQTT_loop* loop)
+{
+    pthread_cond_destroy(&loop->idle);
+    pthread_mutex_destroy(&loop->lock);
+    close(loop->wake[0]);
+    close(loop->wake[1]);
+    free(loop->clients);
+    free(loop->fds);
+    free(loop->polled);
+    free(loop->work);
+    free(loop);
+
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_MQTT, "Network thread stopped");
+}
+
+static void* thingsboard_MQTT_loop_run(void* arg)
+{
+    thingsboard_MQTT_loop* loop = (thingsboard_MQTT_loop*)arg;
+    network_thread = true;
+
+    while (1){
+        size_t nfds;
+
+        pthread_mutex_lock(&loop->lock);
+        if (loop->stopping){
+            pthread_mutex_unlock(&loop->lock);
+            break;
+        }
+        int wait_ms = thingsboard_MQTT_loop_prepare(loop, &nfds);
+        unsigned long generation = loop->generation;
+        pthread_mutex_unlock(&loop->lock);
+
+        poll(loop->fds, nfds, wait_ms);
+
+        if (loop->fds[0].revents & POLLIN){
+            char drain[64];
+            while (read(loop->wake[0], drain, sizeof(drain)) > 0);
+        }
+
+        pthread_mutex_lock(&loop->lock);
+        size_t nwork = thingsboard_MQTT_loop_claim(loop, nfds, generation);
+        pthread_mutex_unlock(&loop->lock);
+
+        long long now = thingsboard_MQTT_loop_now_ms();
+        for (size_t k = 0; k < nwork; k++)
+            if (!loop->work[k]->detached) thingsboard_MQTT_loop_service(loop->work[k], now);
+
+        pthread_mutex_lock(&loop->lock);
+        for (size_t k = 0; k < nwork; k++){
+            if (loop->work[k]->detached) free(loop->work[k]);
+            else loop->work[k]->busy = false;
+        }
+        pthread_cond_broadcast(&loop->idle);
+        pthread_mutex_unlock(&loop->lock);
+    }
+
+    if (loop->orphaned) thingsboard_MQTT_loop_free(loop);
+
+    return NULL;
+}
+
+thingsboard_MQTT_loop* thingsboard_MQTT_loop_start(void)
+{
+    thingsboard_MQTT_loop* loop = (thingsboard_MQTT_loop*)calloc(1, sizeof(thingsboard_MQTT_loop));
+    if (loop == NULL) return NULL;
+
+    loop->fds = (struct pollfd*)calloc(1, sizeof(struct pollfd));
+    loop->polled = (struct loop_client**)calloc(1, sizeof(struct loop_client*));
+    loop->fds_cap = 1;
+
+    if (loop->fds == NULL || loop->polled == NULL || pipe(loop->wake) != 0){
+        free(loop->fds);
+        free(loop->polled);
+        free(loop);
+        return NULL;
+    }
+
+    for (int i = 0; i < 2; i++){
+        fcntl(loop->wake[i], F_SETFL, fcntl(loop->wake[i], F_GETFL) | O_NONBLOCK);
+        fcntl(loop->wake[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    pthread_mutex_init(&loop->lock, NULL);
+    pthread_cond_init(&loop->idle, NULL);
+
+    if (pthread_create(&loop->thread, NULL, thingsboard_MQTT_loop_run, loop) != 0){
+        pthread_cond_destroy(&loop->idle);
+        pthread_mutex_destroy(&loop->lock);
+        close(loop->wake[0]);
+        close(loop->wake[1]);
+        free(loop->fds);
+        free(loop->polled);
+        free(loop);
+        return NULL;
+    }
+
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_MQTT, "Network thread started");
+
+    return loop;
+}
+
+void thingsboard_MQTT_loop_stop(thingsboard_MQTT_loop* loop)
+{
+    if (loop == NULL) return;
+
+    bool own = pthread_equal(pthread_self(), loop->thread);
+
+    pthread_mutex_lock(&loop->lock);
+    loop->stopping = true;
+    loop->orphaned = own;
+    pthread_mutex_unlock(&loop->lock);
+
+    if (own){
+        pthread_detach(loop->thread);
+        return;
+    }
+
+    thingsboard_MQTT_loop_wake(loop);
+    pthread_join(loop->thread, NULL);
+    thingsboard_MQTT_loop_free(loop);
+}
+
+int thingsboard_MQTT_loop_attach(thingsboard_MQTT_loop* loop, struct mosquitto* mqtt, const thingsboard_MQTT_hooks* hooks, void* obj)
+{
+    if (loop == NULL || mqtt == NULL) return -1;
+
+    struct loop_client* client = (struct loop_client*)calloc(1, sizeof(struct loop_client));
+    if (client == NULL) return -1;
+
+    client->mqtt = mqtt;
+    client->hooks = hooks;
+    client->obj = obj;
+
+    pthread_mutex_lock(&loop->lock);
+
+    if (loop->count == loop->cap){
+        size_t cap = loop->cap ? loop->cap * 2 : 16;
+        struct loop_client** clients = (struct loop_client**)realloc(loop->clients, cap * sizeof(struct loop_client*));
+        if (clients == NULL){
+            pthread_mutex_unlock(&loop->lock);
+            free(client);
+            return -1;
+        }
+        loop->clients = clients;
+        loop->cap = cap;
+    }
+
+    loop->clients[loop->count++] = client;
+    loop->generation++;
+
+    pthread_mutex_unlock(&loop->lock);
+
+    thingsboard_MQTT_loop_wake(loop);
+
+    return 0;
+}
+
+void thingsboard_MQTT_loop_detach(thingsboard_MQTT_loop* loop, struct mosquitto* mqtt)
+{
+    if (loop == NULL || mqtt == NULL) return;
+
+    struct loop_client* client = NULL;
+
+    pthread_mutex_lock(&loop->lock);
+    for (size_t i = 0; i < loop->count; i++){
+        if (loop->clients[i]->mqtt != mqtt) continue;
+
+        client = loop->clients[i];
+        loop->clients[i] = loop->clients[--loop->count];
+        loop->generation++;
+
+        // From its own callbacks the thread is working on the client, it stops touching it once the callback returns
+        if (client->busy && pthread_equal(pthread_self(), loop->thread)){
+            client->detached = true;
+            client = NULL;
+        }
+        while (client != NULL && client->busy) pthread_cond_wait(&loop->idle, &loop->lock);
+        break;
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    free(client);
+    thingsboard_MQTT_loop_wake(loop);
+}
+
+bool thingsboard_MQTT_loop_current(void)
+{
+    return network_thread;
+}
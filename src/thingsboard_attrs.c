@@ -0,0 +1,453 @@
+#define _DEFAULT_SOURCE
+#include "thingsboard_attrs.h"
+#include "thingsboard_hash.h"
+#include "thingsboard_log.h"
+#include <cjson/cJSON.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// A change whose callback runs once the cache is unlocked
+struct thingsboard_attrs_change {
+    thingsboard_attrs_fn on_change;
+    thingsboard_attr_scope scope;
+    char* key;
+    // NULL when the attribute was deleted
+    char* json;
+};
+
+struct thingsboard_attrs_changes {
+    struct thingsboard_attrs_change* items;
+    int count;
+    int cap;
+};
+
+static const char* scope_names[THINGSBOARD_ATTRS_SCOPES] = { "client", "shared" };
+
+static long long thingsboard_attrs_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// The table is kept at most three quarters full
+static int thingsboard_attrs_grow(thingsboard_attrs* attrs)
+{
+    size_t cap = attrs->cap ? attrs->cap * 2 : 32;
+
+    struct thingsboard_attrs_entry* slots = (struct thingsboard_attrs_entry*)calloc(cap, sizeof(*slots));
+    if (slots == NULL) return -1;
+
+    for (size_t i = 0; i < attrs->cap; i++){
+        if (attrs->slots[i].key == NULL) continue;
+
+        size_t j = thingsboard_hash_slot(cap, attrs->slots[i].hash);
+        while (slots[j].key != NULL) j = (j + 1) & (cap - 1);
+        slots[j] = attrs->slots[i];
+    }
+
+    free(attrs->slots);
+    attrs->slots = slots;
+    attrs->cap = cap;
+
+    return 0;
+}
+
+// The caller holds the lock, key need not be NUL terminated; returns NULL when it is not cached or memory ran out
+static struct thingsboard_attrs_entry* thingsboard_attrs_lookup(thingsboard_attrs* attrs, thingsboard_attr_scope scope, const char* key, size_t len, bool create)
+{
+    // Salted by the scope so a client and a shared key of the same name land apart
+    uint64_t hash = thingsboard_hash_bytes(key, len, (uint64_t)scope);
+
+    if (attrs->cap != 0){
+        size_t i = thingsboard_hash_slot(attrs->cap, hash);
+        while (attrs->slots[i].key != NULL){
+            struct thingsboard_attrs_entry* entry = &attrs->slots[i];
+            if (entry->hash == hash && entry->scope == scope && strncmp(entry->key, key, len) == 0 && entry->key[len] == '\0') return entry;
+            i = (i + 1) & (attrs->cap - 1);
+        }
+    }
+
+    if (!create) return NULL;
+    if (((size_t)attrs->count + 1) * 4 > attrs->cap * 3 && thingsboard_attrs_grow(attrs) != 0) return NULL;
+
+    size_t i = thingsboard_hash_slot(attrs->cap, hash);
+    while (attrs->slots[i].key != NULL) i = (i + 1) & (attrs->cap - 1);
+
+    struct thingsboard_attrs_entry* entry = &attrs->slots[i];
+    entry->key = strndup(key, len);
+    if (entry->key == NULL) return NULL;
+
+    entry->hash = hash;
+    entry->scope = (unsigned char)scope;
+    attrs->count++;
+
+    return entry;
+}
+
+// The caller holds the lock, a change that cannot be recorded is logged and its callback skipped
+static void thingsboard_attrs_changed(thingsboard_attrs* attrs, struct thingsboard_attrs_changes* changes, struct thingsboard_attrs_entry* entry)
+{
+    thingsboard_attrs_fn on_change = entry->on_change ? entry->on_change : attrs->on_change[entry->scope];
+    if (on_change == NULL) return;
+
+    if (changes->count == changes->cap){
+        int cap = changes->cap ? changes->cap * 2 : 8;
+        struct thingsboard_attrs_change* items = (struct thingsboard_attrs_change*)realloc(changes->items, cap * sizeof(*items));
+        if (items == NULL) goto failed;
+        changes->items = items;
+        changes->cap = cap;
+    }
+
+    struct thingsboard_attrs_change* change = &changes->items[changes->count];
+    change->on_change = on_change;
+    change->scope = (thingsboard_attr_scope)entry->scope;
+    change->key = strdup(entry->key);
+    change->json = entry->present ? strdup(entry->json) : NULL;
+    if (change->key == NULL || (entry->present && change->json == NULL)){
+        free(change->key);
+        free(change->json);
+        goto failed;
+    }
+
+    changes->count++;
+    return;
+
+    failed:
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_CORE, "Out of memory, change of attribute %s not reported", entry->key);
+}
+
+static void thingsboard_attrs_dispatch(thingsboard_ctx* ctx, struct thingsboard_attrs_changes* changes)
+{
+    for (int i = 0; i < changes->count; i++){
+        struct thingsboard_attrs_change* change = &changes->items[i];
+        change->on_change(ctx, change->scope, change->key, change->json, change->json ? strlen(change->json) : 0);
+        free(change->key);
+        free(change->json);
+    }
+
+    free(changes->items);
+}
+
+// The caller holds the lock, returns 1 when the value differs from the cached one
+static int thingsboard_attrs_store(thingsboard_attrs* attrs, thingsboard_attr_scope scope, const cJSON* item, long long now, struct thingsboard_attrs_changes* changes)
+{
+    struct thingsboard_attrs_entry* entry = thingsboard_attrs_lookup(attrs, scope, item->string, strlen(item->string), true);
+    char* json = cJSON_PrintUnformatted(item);
+    char* text = cJSON_IsString(item) ? strdup(item->valuestring) : NULL;
+
+    if (entry == NULL || json == NULL || (cJSON_IsString(item) && text == NULL)){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_CORE, "Out of memory, attribute %s not cached", item->string);
+        free(json);
+        free(text);
+        return 0;
+    }
+
+    // An unchanged value is still as fresh as the message that repeated it
+    entry->generation = attrs->generation;
+    entry->updated_ms = now;
+
+    if (entry->present && strcmp(entry->json, json) == 0){
+        free(json);
+        free(text);
+        return 0;
+    }
+
+    free(entry->json);
+    free(entry->text);
+    entry->json = json;
+    entry->text = text;
+    entry->kind = item->type & 0xFF;
+    entry->number = item->valuedouble;
+    entry->present = true;
+
+    thingsboard_attrs_changed(attrs, changes, entry);
+
+    return 1;
+}
+
+// The caller holds the lock
+static int thingsboard_attrs_delete(thingsboard_attrs* attrs, thingsboard_attr_scope scope, const char* key, struct thingsboard_attrs_changes* changes)
+{
+    struct thingsboard_attrs_entry* entry = thingsboard_attrs_lookup(attrs, scope, key, strlen(key), false);
+    if (entry == NULL || !entry->present) return 0;
+
+    free(entry->json);
+    free(entry->text);
+    entry->json = NULL;
+    entry->text = NULL;
+    entry->present = false;
+
+    thingsboard_attrs_changed(attrs, changes, entry);
+
+    return 1;
+}
+
+// The caller holds the lock
+static int thingsboard_attrs_merge(thingsboard_attrs* attrs, thingsboard_attr_scope scope, const cJSON* object, long long now, struct thingsboard_attrs_changes* changes)
+{
+    int changed = 0;
+    const cJSON* item;
+
+    cJSON_ArrayForEach(item, object){
+        // Deletions are announced in a key of their own next to the updated values
+        if (scope == THINGSBOARD_ATTR_SHARED && cJSON_IsArray(item) && strcmp(item->string, "deleted") == 0){
+            const cJSON* key;
+            cJSON_ArrayForEach(key, item)
+                if (cJSON_IsString(key)) changed += thingsboard_attrs_delete(attrs, scope, key->valuestring, changes);
+            continue;
+        }
+
+        changed += thingsboard_attrs_store(attrs, scope, item, now, changes);
+    }
+
+    return changed;
+}
+
+thingsboard_attrs* thingsboard_attrs_new(void)
+{
+    thingsboard_attrs* attrs = (thingsboard_attrs*)calloc(1, sizeof(thingsboard_attrs));
+    if (attrs == NULL) return NULL;
+
+    pthread_mutex_init(&attrs->lock, NULL);
+
+    return attrs;
+}
+
+void thingsboard_attrs_free(thingsboard_attrs* attrs)
+{
+    if (attrs == NULL) return;
+
+    for (size_t i = 0; i < attrs->cap; i++){
+        free(attrs->slots[i].key);
+        free(attrs->slots[i].json);
+        free(attrs->slots[i].text);
+    }
+    free(attrs->slots);
+    pthread_mutex_destroy(&attrs->lock);
+    free(attrs);
+}
+
+void thingsboard_attrs_live(thingsboard_attrs* attrs, bool live)
+{
+    pthread_mutex_lock(&attrs->lock);
+    attrs->live = live;
+    attrs->generation++;
+    pthread_mutex_unlock(&attrs->lock);
+}
+
+void thingsboard_attrs_max_age(thingsboard_attrs* attrs, long max_age_ms)
+{
+    pthread_mutex_lock(&attrs->lock);
+    attrs->max_age_ms = max_age_ms;
+    pthread_mutex_unlock(&attrs->lock);
+}
+
+int thingsboard_attrs_callback(thingsboard_attrs* attrs, thingsboard_attr_scope scope, const char* key, thingsboard_attrs_fn on_change)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&attrs->lock);
+    if (key == NULL) attrs->on_change[scope] = on_change;
+    else {
+        struct thingsboard_attrs_entry* entry = thingsboard_attrs_lookup(attrs, scope, key, strlen(key), true);
+        if (entry != NULL) entry->on_change = on_change;
+        else res = -1;
+    }
+    pthread_mutex_unlock(&attrs->lock);
+
+    return res;
+}
+
+int thingsboard_attrs_update(thingsboard_attrs* attrs, thingsboard_ctx* ctx, const char* json, size_t len)
+{
+    cJSON* object = cJSON_ParseWithLength(json, len);
+    if (!cJSON_IsObject(object)){
+        cJSON_Delete(object);
+        return -1;
+    }
+
+    struct thingsboard_attrs_changes changes = {0};
+
+    pthread_mutex_lock(&attrs->lock);
+    int changed = thingsboard_attrs_merge(attrs, THINGSBOARD_ATTR_SHARED, object, thingsboard_attrs_now_ms(), &changes);
+    pthread_mutex_unlock(&attrs->lock);
+
+    cJSON_Delete(object);
+    thingsboard_attrs_dispatch(ctx, &changes);
+
+    return changed;
+}
+
+int thingsboard_attrs_response(thingsboard_attrs* attrs, thingsboard_ctx* ctx, const char* json, size_t len)
+{
+    cJSON* object = cJSON_ParseWithLength(json, len);
+    if (!cJSON_IsObject(object)){
+        cJSON_Delete(object);
+        return -1;
+    }
+
+    struct thingsboard_attrs_changes changes = {0};
+    long long now = thingsboard_attrs_now_ms();
+    int changed = 0;
+
+    pthread_mutex_lock(&attrs->lock);
+    for (int scope = 0; scope < THINGSBOARD_ATTRS_SCOPES; scope++){
+        const cJSON* values = cJSON_GetObjectItemCaseSensitive(object, scope_names[scope]);
+        if (cJSON_IsObject(values)) changed += thingsboard_attrs_merge(attrs, (thingsboard_attr_scope)scope, values, now, &changes);
+    }
+    pthread_mutex_unlock(&attrs->lock);
+
+    cJSON_Delete(object);
+    thingsboard_attrs_dispatch(ctx, &changes);
+
+    return changed;
+}
+
+int thingsboard_attrs_published(thingsboard_attrs* attrs, thingsboard_ctx* ctx, const char* json)
+{
+    cJSON* object = cJSON_Parse(json);
+    if (!cJSON_IsObject(object)){
+        cJSON_Delete(object);
+        return -1;
+    }
+
+    struct thingsboard_attrs_changes changes = {0};
+
+    pthread_mutex_lock(&attrs->lock);
+    int changed = thingsboard_attrs_merge(attrs, THINGSBOARD_ATTR_CLIENT, object, thingsboard_attrs_now_ms(), &changes);
+    pthread_mutex_unlock(&attrs->lock);
+
+    cJSON_Delete(object);
+    thingsboard_attrs_dispatch(ctx, &changes);
+
+    return changed;
+}
+
+// The caller holds the lock; shared values are fresh while every update since they arrived was pushed, any value while younger than max_age_ms
+static bool thingsboard_attrs_fresh(thingsboard_attrs* attrs, const struct thingsboard_attrs_entry* entry, long long now)
+{
+    if (entry->scope == THINGSBOARD_ATTR_SHARED && attrs->live && entry->generation == attrs->generation) return true;
+
+    return attrs->max_age_ms > 0 && now - entry->updated_ms <= attrs->max_age_ms;
+}
+
+// The caller holds the lock, writes the keys of a comma separated list as one scope of the reply
+static bool thingsboard_attrs_serve_scope(thingsboard_attrs* attrs, thingsboard_json* reply, thingsboard_attr_scope scope, const char* keys, long long now)
+{
+    thingsboard_json_key(reply, scope_names[scope]);
+    thingsboard_json_object_begin(reply);
+
+    const char* p = keys;
+    while (*p){
+        while (*p == ' ') p++;
+        const char* end = p;
+        while (*end && *end != ',') end++;
+        const char* last = end;
+        while (last > p && last[-1] == ' ') last--;
+
+        if (last > p){
+            struct thingsboard_attrs_entry* entry = thingsboard_attrs_lookup(attrs, scope, p, (size_t)(last - p), false);
+            if (entry == NULL || !entry->present || !thingsboard_attrs_fresh(attrs, entry, now)) return false;
+
+            thingsboard_json_key(reply, entry->key);
+            thingsboard_json_raw(reply, entry->json, strlen(entry->json));
+        }
+
+        p = *end ? end + 1 : end;
+    }
+
+    thingsboard_json_object_end(reply);
+
+    return true;
+}
+
+const char* thingsboard_attrs_serve(thingsboard_attrs* attrs, const char* request, thingsboard_json** reply)
+{
+    cJSON* object = cJSON_Parse(request);
+    const cJSON* keys[THINGSBOARD_ATTRS_SCOPES] = {
+        cJSON_GetObjectItemCaseSensitive(object, "clientKeys"),
+        cJSON_GetObjectItemCaseSensitive(object, "sharedKeys"),
+    };
+
+    // Without a key list the server answers with every attribute, which only it knows
+    bool servable = cJSON_IsString(keys[0]) || cJSON_IsString(keys[1]);
+    for (int scope = 0; scope < THINGSBOARD_ATTRS_SCOPES; scope++)
+        if (keys[scope] != NULL && !cJSON_IsString(keys[scope])) servable = false;
+
+    const char* res = NULL;
+    thingsboard_json* json = servable ? thingsboard_json_reuse(reply) : NULL;
+
+    if (json != NULL){
+        long long now = thingsboard_attrs_now_ms();
+        bool fresh = true;
+
+        thingsboard_json_object_begin(json);
+        pthread_mutex_lock(&attrs->lock);
+        for (int scope = 0; scope < THINGSBOARD_ATTRS_SCOPES && fresh; scope++)
+            if (keys[scope] != NULL) fresh = thingsboard_attrs_serve_scope(attrs, json, (thingsboard_attr_scope)scope, keys[scope]->valuestring, now);
+        pthread_mutex_unlock(&attrs->lock);
+        thingsboard_json_object_end(json);
+
+        if (fresh) res = thingsboard_json_result(json);
+    }
+
+    cJSON_Delete(object);
+
+    return res;
+}
+
+int thingsboard_attrs_get_double(thingsboard_attrs* attrs, thingsboard_attr_scope scope, const char* key, double* value)
+{
+    int res = -1;
+
+    pthread_mutex_lock(&attrs->lock);
+    struct thingsboard_attrs_entry* entry = thingsboard_attrs_lookup(attrs, scope, key, strlen(key), false);
+    if (entry != NULL && entry->present && entry->kind == cJSON_Number){
+        *value = entry->number;
+        res = 0;
+    }
+    pthread_mutex_unlock(&attrs->lock);
+
+    return res;
+}
+
+int thingsboard_attrs_get_bool(thingsboard_attrs* attrs, thingsboard_attr_scope scope, const char* key, bool* value)
+{
+    int res = -1;
+
+    pthread_mutex_lock(&attrs->lock);
+    struct thingsboard_attrs_entry* entry = thingsboard_attrs_lookup(attrs, scope, key, strlen(key), false);
+    if (entry != NULL && entry->present && (entry->kind == cJSON_True || entry->kind == cJSON_False)){
+        *value = entry->kind == cJSON_True;
+        res = 0;
+    }
+    pthread_mutex_unlock(&attrs->lock);
+
+    return res;
+}
+
+int thingsboard_attrs_get_string(thingsboard_attrs* attrs, thingsboard_attr_scope scope, const char* key, char* buf, size_t size)
+{
+    int res = -1;
+
+    pthread_mutex_lock(&attrs->lock);
+    struct thingsboard_attrs_entry* entry = thingsboard_attrs_lookup(attrs, scope, key, strlen(key), false);
+    // Objects and arrays are handed out as JSON
+    if (entry != NULL && entry->present && (entry->kind == cJSON_String || entry->kind == cJSON_Object || entry->kind == cJSON_Array)){
+        const char* text = entry->text ? entry->text : entry->json;
+        size_t len = strlen(text);
+
+        if (size > 0){
+            size_t n = len < size ? len : size - 1;
+            memcpy(buf, text, n);
+            buf[n] = '\0';
+        }
+        if (len < size) res = 0;
+    }
+    pthread_mutex_unlock(&attrs->lock);
+
+    return res;
+}
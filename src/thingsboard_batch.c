@@ -0,0 +1,124 @@
+#define _DEFAULT_SOURCE
+#include "thingsboard_batch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Room for "[", "]", the NUL and one {"ts":<20 digits>,"values":} wrapper
+#define BATCH_OVERHEAD 48
+
+long long thingsboard_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+thingsboard_batch* thingsboard_batch_new(size_t max_bytes, int max_count, int max_age_ms)
+{
+    thingsboard_batch* batch = (thingsboard_batch*)calloc(1, sizeof(thingsboard_batch));
+    if (batch == NULL) return NULL;
+
+    batch->cap = max_bytes + BATCH_OVERHEAD;
+    batch->buf = (char*)malloc(batch->cap);
+    if (batch->buf == NULL){
+        free(batch);
+        return NULL;
+    }
+
+    batch->max_bytes = max_bytes;
+    batch->max_count = max_count;
+    batch->max_age_ms = max_age_ms;
+    thingsboard_batch_reset(batch);
+
+    return batch;
+}
+
+void thingsboard_batch_free(thingsboard_batch* batch)
+{
+    if (batch == NULL) return;
+
+    free(batch->buf);
+    free(batch);
+}
+
+bool thingsboard_batch_shape(const char** data, size_t* len)
+{
+    const char* p = *data;
+    size_t n = *len;
+
+    while (n > 0 && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')){
+        p++;
+        n--;
+    }
+
+    bool wrap = true;
+    if (n >= 2 && p[0] == '['){
+        const char* end = p + n - 1;
+        while (end > p && *end != ']') end--;
+        p++;
+        n = end > p ? (size_t)(end - p) : 0;
+        wrap = false;
+    }
+    else if (n >= 5 && memcmp(p, "{\"ts\"", 5) == 0) wrap = false;
+
+    *data = p;
+    *len = n;
+
+    return wrap;
+}
+
+int thingsboard_batch_append(thingsboard_batch* batch, long long ts, const char* values, size_t len)
+{
+    bool wrap = thingsboard_batch_shape(&values, &len);
+    if (len == 0) return 0;
+
+    char head[BATCH_OVERHEAD];
+    int head_len = wrap ? snprintf(head, sizeof(head), "%s{\"ts\":%lld,\"values\":", batch->count ? "," : "", ts) : snprintf(head, sizeof(head), "%s", batch->count ? "," : "");
+
+    // +2 for the closing "}" and "]"
+    if (batch->len + head_len + len + 2 > batch->max_bytes) return -1;
+
+    memcpy(batch->buf + batch->len, head, head_len);
+    batch->len += head_len;
+    memcpy(batch->buf + batch->len, values, len);
+    batch->len += len;
+    if (wrap) batch->buf[batch->len++] = '}';
+
+    if (batch->count++ == 0) batch->first_ms = thingsboard_time_ms();
+
+    return 0;
+}
+
+bool thingsboard_batch_due(thingsboard_batch* batch, long long now_ms)
+{
+    if (batch->count == 0) return false;
+    if (batch->max_count > 0 && batch->count >= batch->max_count) return true;
+    if (batch->max_age_ms > 0 && now_ms - batch->first_ms >= batch->max_age_ms) return true;
+
+    return false;
+}
+
+long long thingsboard_batch_deadline(thingsboard_batch* batch)
+{
+    if (batch->count == 0 || batch->max_age_ms <= 0) return 0;
+
+    return batch->first_ms + batch->max_age_ms;
+}
+
+char* thingsboard_batch_payload(thingsboard_batch* batch)
+{
+    batch->buf[batch->len] = ']';
+    batch->buf[batch->len + 1] = '\0';
+
+    return batch->buf;
+}
+
+void thingsboard_batch_reset(thingsboard_batch* batch)
+{
+    batch->buf[0] = '[';
+    batch->len = 1;
+    batch->count = 0;
+    batch->first_ms = 0;
+}
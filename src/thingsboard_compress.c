@@ -0,0 +1,65 @@
+#include "thingsboard_compress.h"
+#include <stdlib.h>
+#include <zlib.h>
+
+struct thingsboard_compressor {
+    z_stream stream;
+    int level;
+    unsigned char* buf;
+    size_t cap;
+};
+
+thingsboard_compressor* thingsboard_compressor_new(void)
+{
+    thingsboard_compressor* comp = (thingsboard_compressor*)calloc(1, sizeof(thingsboard_compressor));
+    if (comp == NULL) return NULL;
+
+    comp->level = THINGSBOARD_COMPRESS_LEVEL;
+    // 15 + 16 asks for the gzip wrapper, which Content-Encoding: gzip means
+    if (deflateInit2(&comp->stream, comp->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+        free(comp);
+        return NULL;
+    }
+
+    return comp;
+}
+
+void thingsboard_compressor_free(thingsboard_compressor* comp)
+{
+    if (comp == NULL) return;
+
+    deflateEnd(&comp->stream);
+    free(comp->buf);
+    free(comp);
+}
+
+int thingsboard_compress(thingsboard_compressor* comp, int level, const char* data, size_t len, const char** out, size_t* out_len)
+{
+    if (deflateReset(&comp->stream) != Z_OK) return -1;
+    // Only valid on a fresh stream, which a reset one is
+    if (level != comp->level){
+        if (deflateParams(&comp->stream, level, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+        comp->level = level;
+    }
+
+    // deflateBound is exact about the worst case, so the body goes out in one call
+    size_t need = deflateBound(&comp->stream, (uLong)len);
+    if (need > comp->cap){
+        unsigned char* buf = (unsigned char*)realloc(comp->buf, need);
+        if (buf == NULL) return -1;
+        comp->buf = buf;
+        comp->cap = need;
+    }
+
+    comp->stream.next_in = (unsigned char*)data;
+    comp->stream.avail_in = (uInt)len;
+    comp->stream.next_out = comp->buf;
+    comp->stream.avail_out = (uInt)comp->cap;
+
+    if (deflate(&comp->stream, Z_FINISH) != Z_STREAM_END) return -1;
+
+    *out = (const char*)comp->buf;
+    *out_len = comp->stream.total_out;
+
+    return 0;
+}
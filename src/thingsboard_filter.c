@@ -0,0 +1,271 @@
+#define _DEFAULT_SOURCE
+#include "thingsboard_filter.h"
+#include "thingsboard_hash.h"
+#include <cjson/cJSON.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum { THINGSBOARD_FILTER_NUMBER, THINGSBOARD_FILTER_BOOL, THINGSBOARD_FILTER_STRING };
+
+static long long thingsboard_filter_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// FNV-1a, for keys and for the string values compared against the last sent one
+static uint64_t thingsboard_filter_hash(const char* s)
+{
+    return thingsboard_hash_bytes(s, strlen(s), 0);
+}
+
+static double thingsboard_filter_abs(double value)
+{
+    return value < 0 ? -value : value;
+}
+
+// The table is kept at most three quarters full
+static int thingsboard_filter_grow(thingsboard_filter* filter)
+{
+    size_t cap = filter->cap ? filter->cap * 2 : 32;
+
+    struct thingsboard_filter_entry* slots = (struct thingsboard_filter_entry*)calloc(cap, sizeof(*slots));
+    if (slots == NULL) return -1;
+
+    for (size_t i = 0; i < filter->cap; i++){
+        if (filter->slots[i].key == NULL) continue;
+
+        size_t j = thingsboard_hash_slot(cap, filter->slots[i].hash);
+        while (slots[j].key != NULL) j = (j + 1) & (cap - 1);
+        slots[j] = filter->slots[i];
+    }
+
+    free(filter->slots);
+    filter->slots = slots;
+    filter->cap = cap;
+
+    return 0;
+}
+
+// The caller holds the lock, returns NULL once the table is full or memory ran out
+static struct thingsboard_filter_entry* thingsboard_filter_entry(thingsboard_filter* filter, const char* key)
+{
+    uint64_t hash = thingsboard_filter_hash(key);
+
+    if (filter->cap != 0){
+        size_t i = thingsboard_hash_slot(filter->cap, hash);
+        while (filter->slots[i].key != NULL){
+            if (filter->slots[i].hash == hash && strcmp(filter->slots[i].key, key) == 0) return &filter->slots[i];
+            i = (i + 1) & (filter->cap - 1);
+        }
+    }
+
+    if (filter->count >= THINGSBOARD_FILTER_KEYS_MAX) return NULL;
+    if (((size_t)filter->count + 1) * 4 > filter->cap * 3 && thingsboard_filter_grow(filter) != 0) return NULL;
+
+    size_t i = thingsboard_hash_slot(filter->cap, hash);
+    while (filter->slots[i].key != NULL) i = (i + 1) & (filter->cap - 1);
+
+    filter->slots[i].key = strdup(key);
+    if (filter->slots[i].key == NULL) return NULL;
+
+    filter->slots[i].hash = hash;
+    filter->count++;
+
+    return &filter->slots[i];
+}
+
+// The caller holds the lock, decides whether item goes out and remembers it if so
+static bool thingsboard_filter_changed(thingsboard_filter* filter, const cJSON* item, long long now)
+{
+    unsigned char kind;
+    double value = 0;
+    uint64_t hash = 0;
+
+    if (cJSON_IsNumber(item)){
+        kind = THINGSBOARD_FILTER_NUMBER;
+        value = item->valuedouble;
+    }
+    else if (cJSON_IsBool(item)){
+        kind = THINGSBOARD_FILTER_BOOL;
+        value = cJSON_IsTrue(item);
+    }
+    else if (cJSON_IsString(item)){
+        kind = THINGSBOARD_FILTER_STRING;
+        hash = thingsboard_filter_hash(item->valuestring);
+    }
+    else return true;
+
+    struct thingsboard_filter_entry* entry = thingsboard_filter_entry(filter, item->string);
+    if (entry == NULL) return true;
+
+    const struct thingsboard_filter_rule* rule = entry->ruled ? &entry->rule : &filter->rule;
+    bool send;
+
+    if (!entry->sent || entry->kind != kind) send = true;
+    else if (rule->max_silence_ms > 0 && now - entry->sent_ms >= rule->max_silence_ms) send = true;
+    else if (kind == THINGSBOARD_FILTER_NUMBER){
+        // The wider of the two bands applies, without either any change is sent
+        double band = rule->percent * thingsboard_filter_abs(entry->last) / 100;
+        if (rule->absolute > band) band = rule->absolute;
+
+        double delta = thingsboard_filter_abs(value - entry->last);
+        send = band > 0 ? delta > band : delta != 0;
+    }
+    else if (kind == THINGSBOARD_FILTER_BOOL) send = value != entry->last;
+    else send = hash != entry->last_hash;
+
+    if (send){
+        entry->sent = true;
+        entry->kind = kind;
+        entry->last = value;
+        entry->last_hash = hash;
+        entry->sent_ms = now;
+    }
+
+    return send;
+}
+
+thingsboard_filter* thingsboard_filter_new(void)
+{
+    thingsboard_filter* filter = (thingsboard_filter*)calloc(1, sizeof(thingsboard_filter));
+    if (filter == NULL) return NULL;
+
+    atomic_init(&filter->enabled, false);
+    pthread_mutex_init(&filter->lock, NULL);
+
+    return filter;
+}
+
+static void thingsboard_filter_clear(thingsboard_filter* filter)
+{
+    for (size_t i = 0; i < filter->cap; i++) free(filter->slots[i].key);
+    free(filter->slots);
+    filter->slots = NULL;
+    filter->cap = 0;
+    filter->count = 0;
+}
+
+void thingsboard_filter_free(thingsboard_filter* filter)
+{
+    if (filter == NULL) return;
+
+    thingsboard_filter_clear(filter);
+    pthread_mutex_destroy(&filter->lock);
+    free(filter);
+}
+
+int thingsboard_filter_rule_set(thingsboard_filter* filter, const char* key, double absolute, double percent, long max_silence_ms)
+{
+    struct thingsboard_filter_rule rule = { absolute, percent, max_silence_ms };
+    int res = 0;
+
+    pthread_mutex_lock(&filter->lock);
+    if (key == NULL) filter->rule = rule;
+    else {
+        struct thingsboard_filter_entry* entry = thingsboard_filter_entry(filter, key);
+        if (entry != NULL){
+            entry->rule = rule;
+            entry->ruled = true;
+        }
+        else res = -1;
+    }
+    if (res == 0) atomic_store(&filter->enabled, true);
+    pthread_mutex_unlock(&filter->lock);
+
+    return res;
+}
+
+void thingsboard_filter_forget(thingsboard_filter* filter)
+{
+    pthread_mutex_lock(&filter->lock);
+    atomic_store(&filter->enabled, false);
+    thingsboard_filter_clear(filter);
+    memset(&filter->rule, 0, sizeof(filter->rule));
+    pthread_mutex_unlock(&filter->lock);
+}
+
+void thingsboard_filter_rearm(thingsboard_filter* filter)
+{
+    if (!atomic_load(&filter->enabled)) return;
+
+    pthread_mutex_lock(&filter->lock);
+    for (size_t i = 0; i < filter->cap; i++) filter->slots[i].sent = false;
+    pthread_mutex_unlock(&filter->lock);
+}
+
+int thingsboard_filter_apply(thingsboard_filter* filter, const char* json, char** out)
+{
+    *out = NULL;
+    if (!atomic_load(&filter->enabled)) return THINGSBOARD_FILTER_PASS;
+
+    cJSON* root = cJSON_Parse(json);
+    if (!cJSON_IsObject(root)){
+        cJSON_Delete(root);
+        return THINGSBOARD_FILTER_PASS;
+    }
+
+    // A timestamped sample is filtered by its values, the timestamp goes along with whatever is left
+    cJSON* values = root;
+    cJSON* ts = cJSON_GetObjectItemCaseSensitive(root, "ts");
+    if (ts != NULL){
+        values = cJSON_GetObjectItemCaseSensitive(root, "values");
+        if (!cJSON_IsNumber(ts) || !cJSON_IsObject(values) || cJSON_GetArraySize(root) != 2){
+            cJSON_Delete(root);
+            return THINGSBOARD_FILTER_PASS;
+        }
+    }
+
+    int total = 0;
+    int dropped = 0;
+    long long now = thingsboard_filter_now_ms();
+
+    pthread_mutex_lock(&filter->lock);
+    cJSON* item = values->child;
+    while (item != NULL){
+        cJSON* next = item->next;
+        total++;
+        if (!thingsboard_filter_changed(filter, item, now)){
+            cJSON_Delete(cJSON_DetachItemViaPointer(values, item));
+            dropped++;
+        }
+        item = next;
+    }
+
+    filter->stats.values += total;
+    filter->stats.values_suppressed += dropped;
+
+    int res = THINGSBOARD_FILTER_PASS;
+    size_t len = strlen(json);
+
+    if (total > 0 && dropped == total){
+        filter->stats.messages_suppressed++;
+        filter->stats.bytes_suppressed += len;
+        res = THINGSBOARD_FILTER_SUPPRESSED;
+    }
+    else if (dropped > 0){
+        *out = cJSON_PrintUnformatted(root);
+        // Without memory for the smaller payload the whole one is sent
+        if (*out != NULL){
+            size_t reduced = strlen(*out);
+            if (reduced < len) filter->stats.bytes_suppressed += len - reduced;
+            res = THINGSBOARD_FILTER_REDUCED;
+        }
+    }
+    pthread_mutex_unlock(&filter->lock);
+
+    cJSON_Delete(root);
+
+    return res;
+}
+
+void thingsboard_filter_counters(thingsboard_filter* filter, thingsboard_filter_stats* stats)
+{
+    pthread_mutex_lock(&filter->lock);
+    *stats = filter->stats;
+    stats->keys = filter->count;
+    pthread_mutex_unlock(&filter->lock);
+}
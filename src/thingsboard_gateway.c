@@ -0,0 +1,511 @@
+#define _DEFAULT_SOURCE
+#include "thingsboard_gateway.h"
+#include "thingsboard_hash.h"
+#include "thingsboard_types.h"
+#include "thingsboard_MQTT_api.h"
+#include "thingsboard_batch.h"
+#include "thingsboard_json.h"
+#include "thingsboard_log.h"
+#include <cjson/cJSON.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Room for one {"ts":<20 digits>,"values":} wrapper and a comma
+#define GATEWAY_WRAP 48
+// Room for the quoted name, ':', '[', ']' and a comma a device adds to the gateway message
+#define GATEWAY_DEVICE_OVERHEAD 6
+
+static uint64_t thingsboard_gateway_hash(const char* name)
+{
+    return thingsboard_hash_bytes(name, strlen(name), 0);
+}
+
+static void thingsboard_gateway_put(struct thingsboard_gateway_device** slots, size_t cap, struct thingsboard_gateway_device* device)
+{
+    size_t i = thingsboard_hash_slot(cap, device->hash);
+    while (slots[i] != NULL) i = (i + 1) & (cap - 1);
+    slots[i] = device;
+}
+
+static int thingsboard_gateway_grow(thingsboard_gateway* gateway)
+{
+    size_t cap = gateway->cap * 2;
+    struct thingsboard_gateway_device** slots = (struct thingsboard_gateway_device**)calloc(cap, sizeof(*slots));
+    if (slots == NULL) return -1;
+
+    for (size_t i = 0; i < gateway->cap; i++)
+        if (gateway->slots[i] != NULL) thingsboard_gateway_put(slots, cap, gateway->slots[i]);
+
+    free(gateway->slots);
+    gateway->slots = slots;
+    gateway->cap = cap;
+
+    return 0;
+}
+
+static long thingsboard_gateway_find(thingsboard_gateway* gateway, const char* name, uint64_t hash)
+{
+    size_t i = thingsboard_hash_slot(gateway->cap, hash);
+
+    while (gateway->slots[i] != NULL){
+        if (gateway->slots[i]->hash == hash && strcmp(gateway->slots[i]->name, name) == 0) return (long)i;
+        i = (i + 1) & (gateway->cap - 1);
+    }
+
+    return -1;
+}
+
+static struct thingsboard_gateway_device* thingsboard_gateway_lookup(thingsboard_gateway* gateway, const char* name)
+{
+    long i = thingsboard_gateway_find(gateway, name, thingsboard_gateway_hash(name));
+
+    return i >= 0 ? gateway->slots[i] : NULL;
+}
+
+// Backward shift deletion keeps every probe chain free of holes
+static void thingsboard_gateway_remove(thingsboard_gateway* gateway, size_t i)
+{
+    size_t mask = gateway->cap - 1;
+    size_t hole = i;
+
+    for (size_t j = (i + 1) & mask; gateway->slots[j] != NULL; j = (j + 1) & mask){
+        size_t home = thingsboard_hash_slot(gateway->cap, gateway->slots[j]->hash);
+        if (((j - home) & mask) >= ((j - hole) & mask)){
+            gateway->slots[hole] = gateway->slots[j];
+            hole = j;
+        }
+    }
+
+    gateway->slots[hole] = NULL;
+    gateway->count--;
+}
+
+static void thingsboard_gateway_device_free(struct thingsboard_gateway_device* device)
+{
+    free(device->name);
+    free(device->samples);
+    free(device);
+}
+
+thingsboard_gateway* thingsboard_gateway_new(void)
+{
+    thingsboard_gateway* gateway = (thingsboard_gateway*)calloc(1, sizeof(thingsboard_gateway));
+    if (gateway == NULL) return NULL;
+
+    gateway->cap = THINGSBOARD_GATEWAY_INITIAL;
+    gateway->slots = (struct thingsboard_gateway_device**)calloc(gateway->cap, sizeof(struct thingsboard_gateway_device*));
+    if (gateway->slots == NULL){
+        free(gateway);
+        return NULL;
+    }
+
+    pthread_mutex_init(&gateway->lock, NULL);
+
+    return gateway;
+}
+
+void thingsboard_gateway_free(thingsboard_gateway* gateway)
+{
+    if (gateway == NULL) return;
+
+    for (size_t i = 0; i < gateway->cap; i++)
+        if (gateway->slots[i] != NULL) thingsboard_gateway_device_free(gateway->slots[i]);
+
+    pthread_mutex_destroy(&gateway->lock);
+    thingsboard_json_free(gateway->writer);
+    free(gateway->dirty);
+    free(gateway->slots);
+    free(gateway);
+}
+
+long long thingsboard_gateway_deadline(thingsboard_gateway* gateway)
+{
+    if (gateway == NULL) return 0;
+
+    pthread_mutex_lock(&gateway->lock);
+    long long deadline = gateway->dirty_count && gateway->max_age_ms > 0 ? gateway->first_ms + gateway->max_age_ms : 0;
+    pthread_mutex_unlock(&gateway->lock);
+
+    return deadline;
+}
+
+// Never waits for the in-flight window, the network thread needs the gateway lock to route requests
+static int thingsboard_gateway_publish(thingsboard_ctx* ctx, thingsboard_message_class cls, const char* topic, thingsboard_json* json)
+{
+    const char* payload = thingsboard_json_result(json);
+    if (payload == NULL) return 3;
+
+    return thingsboard_publish_MQTT(ctx, cls, topic, payload, json->len, NULL, false);
+}
+
+// Writes {"device":<name>...} messages that carry a single device, the caller holds the gateway lock
+static thingsboard_json* thingsboard_gateway_message(thingsboard_gateway* gateway, const char* device)
+{
+    thingsboard_json* json = thingsboard_json_reuse(&gateway->writer);
+    if (json == NULL) return NULL;
+
+    thingsboard_json_object_begin(json);
+    thingsboard_json_key(json, "device");
+    thingsboard_json_string(json, device);
+
+    return json;
+}
+
+static int thingsboard_gateway_flush_locked(thingsboard_ctx* ctx, thingsboard_gateway* gateway)
+{
+    if (gateway->dirty_count == 0) return 0;
+
+    thingsboard_json* json = thingsboard_json_reuse(&gateway->writer);
+    if (json != NULL) thingsboard_json_object_begin(json);
+
+    for (size_t i = 0; i < gateway->dirty_count; i++){
+        struct thingsboard_gateway_device* device = gateway->dirty[i];
+
+        if (json != NULL){
+            // Samples always leave room for the closing bracket
+            device->samples[device->len] = ']';
+            thingsboard_json_key(json, device->name);
+            thingsboard_json_raw(json, device->samples, device->len + 1);
+        }
+
+        device->len = 0;
+        device->dirty = false;
+    }
+
+    THINGSBOARD_LOG(THINGSBOARD_LOG_INFO, THINGSBOARD_LOG_MQTT, "Publishing telemetry of %zu gateway devices", gateway->dirty_count);
+
+    gateway->dirty_count = 0;
+    gateway->pending_bytes = 0;
+
+    if (json == NULL) return 3;
+    thingsboard_json_object_end(json);
+
+    return thingsboard_gateway_publish(ctx, THINGSBOARD_CLASS_TELEMETRY, THINGSBOARD_TOPIC_GATEWAY_TELEMETRY, json);
+}
+
+int thingsboard_gateway_flush_MQTT(thingsboard_ctx* ctx)
+{
+    thingsboard_gateway* gateway = ctx->gateway;
+    if (gateway == NULL || ctx->mqtt == NULL) return 2;
+
+    pthread_mutex_lock(&gateway->lock);
+    int res = thingsboard_gateway_flush_locked(ctx, gateway);
+    pthread_mutex_unlock(&gateway->lock);
+
+    return res;
+}
+
+static void thingsboard_gateway_subscribe(thingsboard_ctx* ctx)
+{
+    int res = mosquitto_subscribe(ctx->mqtt, NULL, THINGSBOARD_TOPIC_GATEWAY_RPC, 0);
+    if (res != MOSQ_ERR_SUCCESS)
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Subscribing to gateway RPC failed: %s", mosquitto_strerror(res));
+
+    res = mosquitto_subscribe(ctx->mqtt, NULL, THINGSBOARD_TOPIC_GATEWAY_ATTRIBUTES, 0);
+    if (res != MOSQ_ERR_SUCCESS)
+        THINGSBOARD_LOG(THINGSBOARD_LOG_ERROR, THINGSBOARD_LOG_MQTT, "Subscribing to gateway attributes failed: %s", mosquitto_strerror(res));
+}
+
+void thingsboard_gateway_resubscribe_MQTT(thingsboard_ctx* ctx)
+{
+    thingsboard_gateway* gateway = ctx->gateway;
+    if (gateway == NULL) return;
+
+    pthread_mutex_lock(&gateway->lock);
+    bool subscribed = gateway->subscribed;
+    pthread_mutex_unlock(&gateway->lock);
+
+    if (subscribed) thingsboard_gateway_subscribe(ctx);
+}
+
+int thingsboard_gateway_connect_MQTT(thingsboard_ctx* ctx, const char* device, const char* type, thingsboard_gateway_rpc_fn on_rpc, thingsboard_gateway_attributes_fn on_attributes)
+{
+    thingsboard_gateway* gateway = ctx->gateway;
+    if (gateway == NULL || ctx->mqtt == NULL) return 2;
+
+    uint64_t hash = thingsboard_gateway_hash(device);
+    int res = 3;
+
+    pthread_mutex_lock(&gateway->lock);
+
+    long i = thingsboard_gateway_find(gateway, device, hash);
+    struct thingsboard_gateway_device* entry = i >= 0 ? gateway->slots[i] : NULL;
+
+    if (entry == NULL){
+        if ((gateway->count + 1) * 2 > gateway->cap && thingsboard_gateway_grow(gateway) != 0) goto end;
+
+        entry = (struct thingsboard_gateway_device*)calloc(1, sizeof(struct thingsboard_gateway_device));
+        if (entry == NULL) goto end;
+
+        entry->name = strdup(device);
+        if (entry->name == NULL){
+            free(entry);
+            goto end;
+        }
+
+        entry->hash = hash;
+        thingsboard_gateway_put(gateway->slots, gateway->cap, entry);
+        gateway->count++;
+    }
+
+    // Reconnecting a device only replaces its handlers
+    entry->on_rpc = on_rpc;
+    entry->on_attributes = on_attributes;
+
+    bool subscribe = !gateway->subscribed;
+    gateway->subscribed = true;
+
+    thingsboard_json* json = thingsboard_gateway_message(gateway, device);
+    if (json != NULL){
+        thingsboard_json_key(json, "type");
+        thingsboard_json_string(json, type ? type : "default");
+        thingsboard_json_object_end(json);
+        // Sent with the telemetry QoS so a device is never announced less reliably than its samples
+        res = thingsboard_gateway_publish(ctx, THINGSBOARD_CLASS_TELEMETRY, THINGSBOARD_TOPIC_GATEWAY_CONNECT, json);
+    }
+
+    pthread_mutex_unlock(&gateway->lock);
+
+    if (subscribe) thingsboard_gateway_subscribe(ctx);
+
+    return res;
+
+end:
+    pthread_mutex_unlock(&gateway->lock);
+    return res;
+}
+
+int thingsboard_gateway_disconnect_MQTT(thingsboard_ctx* ctx, const char* device)
+{
+    thingsboard_gateway* gateway = ctx->gateway;
+    if (gateway == NULL || ctx->mqtt == NULL) return 2;
+
+    pthread_mutex_lock(&gateway->lock);
+
+    long i = thingsboard_gateway_find(gateway, device, thingsboard_gateway_hash(device));
+    if (i < 0){
+        pthread_mutex_unlock(&gateway->lock);
+        return 2;
+    }
+
+    // The device's last samples go out before it is announced as gone
+    struct thingsboard_gateway_device* entry = gateway->slots[i];
+    if (entry->dirty) thingsboard_gateway_flush_locked(ctx, gateway);
+
+    thingsboard_gateway_remove(gateway, (size_t)i);
+    thingsboard_gateway_device_free(entry);
+
+    int res = 3;
+    thingsboard_json* json = thingsboard_gateway_message(gateway, device);
+    if (json != NULL){
+        thingsboard_json_object_end(json);
+        res = thingsboard_gateway_publish(ctx, THINGSBOARD_CLASS_TELEMETRY, THINGSBOARD_TOPIC_GATEWAY_DISCONNECT, json);
+    }
+
+    pthread_mutex_unlock(&gateway->lock);
+
+    return res;
+}
+
+int thingsboard_gateway_telemetry_MQTT(thingsboard_ctx* ctx, const char* device, const char* values)
+{
+    thingsboard_gateway* gateway = ctx->gateway;
+    if (gateway == NULL || ctx->mqtt == NULL) return 2;
+
+    char head[GATEWAY_WRAP];
+    size_t values_len = strlen(values);
+    size_t name_len = strlen(device);
+    int res = 0;
+
+    // A sample that already carries its ts, or an array of them, joins the device's array as is
+    bool wrap = thingsboard_batch_shape(&values, &values_len);
+    if (values_len == 0) return 0;
+    size_t tail = wrap ? 1 : 0;
+
+    pthread_mutex_lock(&gateway->lock);
+
+    struct thingsboard_gateway_device* entry = thingsboard_gateway_lookup(gateway, device);
+    if (entry == NULL){
+        pthread_mutex_unlock(&gateway->lock);
+        THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_MQTT, "Telemetry for unknown gateway device %s", device);
+        return 2;
+    }
+
+    size_t head_len = 1;
+    head[0] = entry->dirty ? ',' : '[';
+    if (wrap) head_len = (size_t)snprintf(head, sizeof(head), "%c{\"ts\":%lld,\"values\":", head[0], thingsboard_time_ms());
+    size_t size = head_len + values_len + tail + (entry->dirty ? 0 : name_len + GATEWAY_DEVICE_OVERHEAD);
+
+    // The message is published before it would grow past max_bytes
+    if (gateway->dirty_count && gateway->pending_bytes + size > gateway->max_bytes){
+        res = thingsboard_gateway_flush_locked(ctx, gateway);
+        head[0] = '[';
+        size = head_len + values_len + tail + name_len + GATEWAY_DEVICE_OVERHEAD;
+    }
+
+    // +1 keeps room for the closing bracket
+    if (entry->len + head_len + values_len + tail + 1 > entry->cap){
+        size_t cap = entry->cap ? entry->cap : 128;
+        while (cap < entry->len + head_len + values_len + tail + 1) cap *= 2;
+
+        char* samples = (char*)realloc(entry->samples, cap);
+        if (samples == NULL){
+            pthread_mutex_unlock(&gateway->lock);
+            return 3;
+        }
+        entry->samples = samples;
+        entry->cap = cap;
+    }
+
+    memcpy(entry->samples + entry->len, head, head_len);
+    entry->len += head_len;
+    memcpy(entry->samples + entry->len, values, values_len);
+    entry->len += values_len;
+    if (wrap) entry->samples[entry->len++] = '}';
+
+    if (!entry->dirty){
+        if (gateway->dirty_count == gateway->dirty_cap){
+            size_t cap = gateway->dirty_cap ? gateway->dirty_cap * 2 : 64;
+            struct thingsboard_gateway_device** dirty = (struct thingsboard_gateway_device**)realloc(gateway->dirty, cap * sizeof(*dirty));
+            if (dirty == NULL){
+                entry->len = 0;
+                pthread_mutex_unlock(&gateway->lock);
+                return 3;
+            }
+            gateway->dirty = dirty;
+            gateway->dirty_cap = cap;
+        }
+
+        if (gateway->dirty_count == 0) gateway->first_ms = thingsboard_time_ms();
+        gateway->dirty[gateway->dirty_count++] = entry;
+        entry->dirty = true;
+    }
+    gateway->pending_bytes += size;
+
+    bool due = gateway->max_bytes == 0 || gateway->pending_bytes >= gateway->max_bytes
+        || (gateway->max_age_ms > 0 && thingsboard_time_ms() - gateway->first_ms >= gateway->max_age_ms);
+    if (due){
+        int flushed = thingsboard_gateway_flush_locked(ctx, gateway);
+        if (res == 0) res = flushed;
+    }
+
+    pthread_mutex_unlock(&gateway->lock);
+
+    return res;
+}
+
+int thingsboard_gateway_attributes_MQTT(thingsboard_ctx* ctx, const char* device, const char* attributes)
+{
+    thingsboard_gateway* gateway = ctx->gateway;
+    if (gateway == NULL || ctx->mqtt == NULL) return 2;
+
+    int res = 3;
+
+    pthread_mutex_lock(&gateway->lock);
+    thingsboard_json* json = thingsboard_json_reuse(&gateway->writer);
+    if (json != NULL){
+        thingsboard_json_object_begin(json);
+        thingsboard_json_key(json, device);
+        thingsboard_json_raw(json, attributes, strlen(attributes));
+        thingsboard_json_object_end(json);
+        res = thingsboard_gateway_publish(ctx, THINGSBOARD_CLASS_ATTRIBUTES, THINGSBOARD_TOPIC_GATEWAY_ATTRIBUTES, json);
+    }
+    pthread_mutex_unlock(&gateway->lock);
+
+    return res;
+}
+
+int thingsboard_gateway_rpc_reply_MQTT(thingsboard_ctx* ctx, const char* device, int request_id, const char* response)
+{
+    thingsboard_gateway* gateway = ctx->gateway;
+    if (gateway == NULL || ctx->mqtt == NULL) return 2;
+
+    int res = 3;
+
+    pthread_mutex_lock(&gateway->lock);
+    thingsboard_json* json = thingsboard_gateway_message(gateway, device);
+    if (json != NULL){
+        thingsboard_json_key(json, "id");
+        thingsboard_json_int(json, request_id);
+        thingsboard_json_key(json, "data");
+        thingsboard_json_raw(json, response, strlen(response));
+        thingsboard_json_object_end(json);
+        res = thingsboard_gateway_publish(ctx, THINGSBOARD_CLASS_RPC, THINGSBOARD_TOPIC_GATEWAY_RPC, json);
+    }
+    pthread_mutex_unlock(&gateway->lock);
+
+    return res;
+}
+
+// Parses {"device":...,"data":{...}}, NULL when the message is malformed
+static cJSON* thingsboard_gateway_parse(const char* payload, size_t len, const char** device, cJSON** data)
+{
+    cJSON* object = cJSON_ParseWithLength(payload, len);
+    cJSON* name = cJSON_GetObjectItem(object, "device");
+    *data = cJSON_GetObjectItem(object, "data");
+
+    if (!cJSON_IsString(name) || *data == NULL){
+        THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_MQTT, "Malformed gateway message");
+        cJSON_Delete(object);
+        return NULL;
+    }
+
+    *device = name->valuestring;
+
+    return object;
+}
+
+void thingsboard_gateway_on_rpc_MQTT(thingsboard_ctx* ctx, int id, const char* payload, size_t len)
+{
+    thingsboard_gateway* gateway = ctx->gateway;
+    if (gateway == NULL) return;
+
+    const char* device;
+    cJSON* data;
+    cJSON* object = thingsboard_gateway_parse(payload, len, &device, &data);
+    if (object == NULL) return;
+
+    pthread_mutex_lock(&gateway->lock);
+    struct thingsboard_gateway_device* entry = thingsboard_gateway_lookup(gateway, device);
+    thingsboard_gateway_rpc_fn on_rpc = entry ? entry->on_rpc : NULL;
+    pthread_mutex_unlock(&gateway->lock);
+
+    cJSON* req_id = cJSON_GetObjectItem(data, "id");
+
+    if (on_rpc == NULL || !cJSON_IsNumber(req_id))
+        THINGSBOARD_LOG(THINGSBOARD_LOG_DEBUG, THINGSBOARD_LOG_MQTT, "Ignoring gateway RPC for %s", device);
+    else {
+        char* json = cJSON_PrintUnformatted(data);
+        if (json != NULL) on_rpc(ctx, device, json, strlen(json), req_id->valueint);
+        free(json);
+    }
+
+    cJSON_Delete(object);
+}
+
+void thingsboard_gateway_on_attributes_MQTT(thingsboard_ctx* ctx, int id, const char* payload, size_t len)
+{
+    thingsboard_gateway* gateway = ctx->gateway;
+    if (gateway == NULL) return;
+
+    const char* device;
+    cJSON* data;
+    cJSON* object = thingsboard_gateway_parse(payload, len, &device, &data);
+    if (object == NULL) return;
+
+    pthread_mutex_lock(&gateway->lock);
+    struct thingsboard_gateway_device* entry = thingsboard_gateway_lookup(gateway, device);
+    thingsboard_gateway_attributes_fn on_attributes = entry ? entry->on_attributes : NULL;
+    pthread_mutex_unlock(&gateway->lock);
+
+    if (on_attributes == NULL)
+        THINGSBOARD_LOG(THINGSBOARD_LOG_DEBUG, THINGSBOARD_LOG_MQTT, "Ignoring gateway attributes for %s", device);
+    else {
+        char* json = cJSON_PrintUnformatted(data);
+        if (json != NULL) on_attributes(ctx, device, json, strlen(json));
+        free(json);
+    }
+
+    cJSON_Delete(object);
+}
@@ -0,0 +1,313 @@
+#define _DEFAULT_SOURCE
+#include "thingsboard_inflight.h"
+#include "thingsboard_hash.h"
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+static long long thingsboard_inflight_now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Sequential ids spread over the whole table
+static size_t thingsboard_inflight_slot(size_t cap, int mid)
+{
+    return thingsboard_hash_slot(cap, (unsigned int)mid);
+}
+
+static void thingsboard_inflight_put(struct thingsboard_inflight_entry* slots, size_t cap, struct thingsboard_inflight_entry* entry)
+{
+    size_t i = thingsboard_inflight_slot(cap, entry->mid);
+    while (slots[i].used) i = (i + 1) & (cap - 1);
+    slots[i] = *entry;
+}
+
+// The table is kept at most half full, the window bounds how many entries it can hold
+static int thingsboard_inflight_resize(thingsboard_inflight* inflight, int window)
+{
+    size_t cap = 16;
+    while (cap < (size_t)window * 2) cap *= 2;
+    if (cap <= inflight->cap) return 0;
+
+    struct thingsboard_inflight_entry* slots = (struct thingsboard_inflight_entry*)calloc(cap, sizeof(*slots));
+    if (slots == NULL) return -1;
+
+    for (size_t i = 0; i < inflight->cap; i++)
+        if (inflight->slots[i].used) thingsboard_inflight_put(slots, cap, &inflight->slots[i]);
+
+    free(inflight->slots);
+    inflight->slots = slots;
+    inflight->cap = cap;
+
+    return 0;
+}
+
+// Backward shift deletion keeps every probe chain free of holes
+static void thingsboard_inflight_remove(thingsboard_inflight* inflight, size_t i)
+{
+    size_t mask = inflight->cap - 1;
+    size_t hole = i;
+
+    for (size_t j = (i + 1) & mask; inflight->slots[j].used; j = (j + 1) & mask){
+        size_t home = thingsboard_inflight_slot(inflight->cap, inflight->slots[j].mid);
+        if (((j - home) & mask) >= ((j - hole) & mask)){
+            inflight->slots[hole] = inflight->slots[j];
+            hole = j;
+        }
+    }
+
+    inflight->slots[hole].used = false;
+    inflight->count--;
+    inflight->stats.inflight--;
+}
+
+static long thingsboard_inflight_find(thingsboard_inflight* inflight, int mid)
+{
+    size_t i = thingsboard_inflight_slot(inflight->cap, mid);
+
+    while (inflight->slots[i].used){
+        if (inflight->slots[i].mid == mid) return (long)i;
+        i = (i + 1) & (inflight->cap - 1);
+    }
+
+    return -1;
+}
+
+// The caller holds the lock
+static void thingsboard_inflight_acked(thingsboard_inflight* inflight, long long sent_us)
+{
+    long long latency = thingsboard_inflight_now_us() - sent_us;
+
+    inflight->stats.acknowledged++;
+    inflight->latency_total_us += latency;
+    if (latency > inflight->stats.ack_latency_max_us) inflight->stats.ack_latency_max_us = latency;
+}
+
+// Closes ticket, early ids that arrived before every call still open began can belong to none of them
+static void thingsboard_inflight_published(thingsboard_inflight* inflight, long long ticket)
+{
+    long long oldest = LLONG_MAX;
+
+    for (int i = 0; i < inflight->publishing; i++){
+        if (inflight->open[i] == ticket) inflight->open[i--] = inflight->open[--inflight->publishing];
+        else if (inflight->open[i] < oldest) oldest = inflight->open[i];
+    }
+
+    for (int i = 0; i < inflight->early_count; i++)
+        if (inflight->early[i].ticket < oldest) inflight->early[i--] = inflight->early[--inflight->early_count];
+}
+
+// Returns items grown to hold one more of count elements of size bytes, NULL when memory ran out
+static void* thingsboard_inflight_room(void* items, int count, int* cap, size_t size)
+{
+    if (count < *cap) return items;
+
+    int grown_cap = *cap ? *cap * 2 : THINGSBOARD_INFLIGHT_WINDOW;
+    void* grown = realloc(items, grown_cap * size);
+    if (grown != NULL) *cap = grown_cap;
+
+    return grown;
+}
+
+thingsboard_inflight* thingsboard_inflight_new(int window)
+{
+    thingsboard_inflight* inflight = (thingsboard_inflight*)calloc(1, sizeof(thingsboard_inflight));
+    if (inflight == NULL) return NULL;
+
+    inflight->window = window;
+    if (thingsboard_inflight_resize(inflight, window) != 0){
+        free(inflight);
+        return NULL;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&inflight->space, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&inflight->lock, NULL);
+
+    return inflight;
+}
+
+void thingsboard_inflight_free(thingsboard_inflight* inflight)
+{
+    if (inflight == NULL) return;
+
+    pthread_cond_destroy(&inflight->space);
+    pthread_mutex_destroy(&inflight->lock);
+    free(inflight->slots);
+    free(inflight->open);
+    free(inflight->early);
+    free(inflight);
+}
+
+int thingsboard_inflight_window(thingsboard_inflight* inflight, int window)
+{
+    pthread_mutex_lock(&inflight->lock);
+    int res = thingsboard_inflight_resize(inflight, window);
+    if (res == 0) inflight->window = window;
+    pthread_cond_broadcast(&inflight->space);
+    pthread_mutex_unlock(&inflight->lock);
+
+    return res;
+}
+
+int thingsboard_inflight_reserve(thingsboard_inflight* inflight, long wait_ms, long long* ticket)
+{
+    pthread_mutex_lock(&inflight->lock);
+
+    if (inflight->count + inflight->publishing >= inflight->window && wait_ms > 0){
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += wait_ms / 1000;
+        deadline.tv_nsec += (wait_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (inflight->count + inflight->publishing >= inflight->window)
+            if (pthread_cond_timedwait(&inflight->space, &inflight->lock, &deadline) != 0) break;
+    }
+
+    if (inflight->count + inflight->publishing >= inflight->window){
+        inflight->stats.window_full++;
+        pthread_mutex_unlock(&inflight->lock);
+        return -1;
+    }
+
+    long long* open = (long long*)thingsboard_inflight_room(inflight->open, inflight->publishing, &inflight->open_cap, sizeof(*open));
+    if (open == NULL){
+        pthread_mutex_unlock(&inflight->lock);
+        return -1;
+    }
+    inflight->open = open;
+
+    *ticket = ++inflight->tickets;
+    inflight->open[inflight->publishing++] = *ticket;
+    pthread_mutex_unlock(&inflight->lock);
+
+    return 0;
+}
+
+void thingsboard_inflight_cancel(thingsboard_inflight* inflight, long long ticket)
+{
+    pthread_mutex_lock(&inflight->lock);
+    thingsboard_inflight_published(inflight, ticket);
+    pthread_cond_signal(&inflight->space);
+    pthread_mutex_unlock(&inflight->lock);
+}
+
+int thingsboard_inflight_track(thingsboard_inflight* inflight, long long ticket, int mid, thingsboard_inflight_fn cb)
+{
+    long long now = thingsboard_inflight_now_us();
+
+    pthread_mutex_lock(&inflight->lock);
+    inflight->stats.published++;
+
+    // Only an acknowledgement that arrived after this call reserved its slot can be its own
+    for (int i = 0; i < inflight->early_count; i++){
+        if (inflight->early[i].mid != mid || inflight->early[i].ticket < ticket) continue;
+
+        inflight->early[i] = inflight->early[--inflight->early_count];
+        thingsboard_inflight_acked(inflight, now);
+        thingsboard_inflight_published(inflight, ticket);
+        pthread_cond_signal(&inflight->space);
+        pthread_mutex_unlock(&inflight->lock);
+        return 1;
+    }
+
+    struct thingsboard_inflight_entry entry = { mid, true, cb, now };
+    thingsboard_inflight_put(inflight->slots, inflight->cap, &entry);
+    inflight->count++;
+    thingsboard_inflight_published(inflight, ticket);
+
+    inflight->stats.inflight++;
+    if (inflight->stats.inflight > inflight->stats.high_water_inflight) inflight->stats.high_water_inflight = inflight->stats.inflight;
+
+    pthread_mutex_unlock(&inflight->lock);
+
+    return 0;
+}
+
+int thingsboard_inflight_ack(thingsboard_inflight* inflight, int mid, thingsboard_inflight_fn* cb)
+{
+    pthread_mutex_lock(&inflight->lock);
+
+    long i = thingsboard_inflight_find(inflight, mid);
+    if (i < 0){
+        // QoS 0 publishes complete here too, an id is only remembered while a publish call may still claim it
+        struct thingsboard_inflight_early* early = inflight->publishing > 0
+            ? (struct thingsboard_inflight_early*)thingsboard_inflight_room(inflight->early, inflight->early_count, &inflight->early_cap, sizeof(*early))
+            : NULL;
+        if (early != NULL){
+            inflight->early = early;
+            early[inflight->early_count++] = (struct thingsboard_inflight_early){ mid, inflight->tickets };
+        }
+        pthread_mutex_unlock(&inflight->lock);
+        return -1;
+    }
+
+    *cb = inflight->slots[i].cb;
+    thingsboard_inflight_acked(inflight, inflight->slots[i].sent_us);
+    thingsboard_inflight_remove(inflight, (size_t)i);
+
+    pthread_cond_broadcast(&inflight->space);
+    pthread_mutex_unlock(&inflight->lock);
+
+    return 0;
+}
+
+int thingsboard_inflight_drain(thingsboard_inflight* inflight, long wait_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += wait_ms / 1000;
+    deadline.tv_nsec += (wait_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&inflight->lock);
+    while (inflight->count > 0)
+        if (pthread_cond_timedwait(&inflight->space, &inflight->lock, &deadline) != 0) break;
+    int left = inflight->count;
+    pthread_mutex_unlock(&inflight->lock);
+
+    return left;
+}
+
+int thingsboard_inflight_abandon(thingsboard_inflight* inflight, thingsboard_inflight_fn* cb)
+{
+    int res = -1;
+
+    pthread_mutex_lock(&inflight->lock);
+    for (size_t i = 0; i < inflight->cap && inflight->count > 0; i++){
+        if (!inflight->slots[i].used) continue;
+
+        *cb = inflight->slots[i].cb;
+        thingsboard_inflight_remove(inflight, i);
+        inflight->stats.abandoned++;
+        res = 0;
+        break;
+    }
+    pthread_cond_broadcast(&inflight->space);
+    pthread_mutex_unlock(&inflight->lock);
+
+    return res;
+}
+
+void thingsboard_inflight_stats(thingsboard_inflight* inflight, thingsboard_publish_stats* stats)
+{
+    pthread_mutex_lock(&inflight->lock);
+    *stats = inflight->stats;
+    stats->ack_latency_avg_us = inflight->stats.acknowledged ? inflight->latency_total_us / (long long)inflight->stats.acknowledged : 0;
+    pthread_mutex_unlock(&inflight->lock);
+}
@@ -0,0 +1,298 @@
+#include "thingsboard_json.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char hex[] = "0123456789abcdef";
+
+static bool thingsboard_json_grow(thingsboard_json* json, size_t extra)
+{
+    if (json->failed) return false;
+
+    size_t cap = json->cap ? json->cap : THINGSBOARD_JSON_INITIAL;
+    while (cap < json->len + extra + 1) cap *= 2;
+
+    char* buf = (char*)realloc(json->buf, cap);
+    if (buf == NULL){
+        json->failed = true;
+        return false;
+    }
+
+    json->buf = buf;
+    json->cap = cap;
+
+    return true;
+}
+
+// Makes room for extra more bytes plus the NUL, returns false once the writer has failed
+static inline bool thingsboard_json_reserve(thingsboard_json* json, size_t extra)
+{
+    if (json->len + extra + 1 <= json->cap) return true;
+
+    return thingsboard_json_grow(json, extra);
+}
+
+static inline void thingsboard_json_put(thingsboard_json* json, const char* data, size_t len)
+{
+    if (!thingsboard_json_reserve(json, len)) return;
+
+    memcpy(json->buf + json->len, data, len);
+    json->len += len;
+}
+
+static inline void thingsboard_json_separate(thingsboard_json* json)
+{
+    if (json->comma) thingsboard_json_put(json, ",", 1);
+    json->comma = true;
+}
+
+static void thingsboard_json_escaped(thingsboard_json* json, const char* value, size_t len)
+{
+    // Room for the worst case, every byte as a \u00XX escape, so nothing below needs a check
+    if (!thingsboard_json_reserve(json, len * 6 + 2)) return;
+
+    const unsigned char* p = (const unsigned char*)value;
+    const unsigned char* end = p + len;
+    char* out = json->buf + json->len;
+
+    *out++ = '"';
+    while (p < end){
+        // Copies runs that need no escaping in one go
+        const unsigned char* run = p;
+        while (p < end && *p >= 0x20 && *p != '"' && *p != '\\') p++;
+        memcpy(out, run, p - run);
+        out += p - run;
+        if (p == end) break;
+
+        *out++ = '\\';
+        switch (*p){
+            case '"':  *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '\n': *out++ = 'n'; break;
+            case '\r': *out++ = 'r'; break;
+            case '\t': *out++ = 't'; break;
+            case '\b': *out++ = 'b'; break;
+            case '\f': *out++ = 'f'; break;
+            default:
+                *out++ = 'u'; *out++ = '0'; *out++ = '0';
+                *out++ = hex[*p >> 4]; *out++ = hex[*p & 0xf];
+        }
+        p++;
+    }
+    *out++ = '"';
+
+    json->len = out - json->buf;
+}
+
+static size_t thingsboard_json_digits(char* end, unsigned long long v)
+{
+    char* p = end;
+    do { *--p = '0' + v % 10; v /= 10; } while (v);
+
+    return end - p;
+}
+
+thingsboard_json* thingsboard_json_new(void)
+{
+    return (thingsboard_json*)calloc(1, sizeof(thingsboard_json));
+}
+
+void thingsboard_json_free(thingsboard_json* json)
+{
+    if (json == NULL) return;
+
+    free(json->buf);
+    free(json);
+}
+
+void thingsboard_json_reset(thingsboard_json* json)
+{
+    json->len = 0;
+    json->comma = false;
+    json->failed = false;
+}
+
+thingsboard_json* thingsboard_json_reuse(thingsboard_json** json)
+{
+    if (*json == NULL) *json = thingsboard_json_new();
+    if (*json != NULL) thingsboard_json_reset(*json);
+
+    return *json;
+}
+
+void thingsboard_json_object_begin(thingsboard_json* json)
+{
+    thingsboard_json_separate(json);
+    thingsboard_json_put(json, "{", 1);
+    json->comma = false;
+}
+
+void thingsboard_json_object_end(thingsboard_json* json)
+{
+    thingsboard_json_put(json, "}", 1);
+    json->comma = true;
+}
+
+void thingsboard_json_array_begin(thingsboard_json* json)
+{
+    thingsboard_json_separate(json);
+    thingsboard_json_put(json, "[", 1);
+    json->comma = false;
+}
+
+void thingsboard_json_array_end(thingsboard_json* json)
+{
+    thingsboard_json_put(json, "]", 1);
+    json->comma = true;
+}
+
+void thingsboard_json_key(thingsboard_json* json, const char* key)
+{
+    thingsboard_json_key_n(json, key, strlen(key));
+}
+
+void thingsboard_json_key_n(thingsboard_json* json, const char* key, size_t len)
+{
+    thingsboard_json_separate(json);
+    thingsboard_json_escaped(json, key, len);
+    thingsboard_json_put(json, ":", 1);
+    json->comma = false;
+}
+
+void thingsboard_json_int(thingsboard_json* json, long long value)
+{
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    unsigned long long v = value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+    size_t n = thingsboard_json_digits(end, v);
+
+    if (value < 0) digits[sizeof(digits) - ++n] = '-';
+
+    thingsboard_json_separate(json);
+    thingsboard_json_put(json, end - n, n);
+}
+
+void thingsboard_json_double(thingsboard_json* json, double value)
+{
+    if (!isfinite(value)){
+        thingsboard_json_separate(json);
+        thingsboard_json_put(json, "null", 4);
+        return;
+    }
+
+    // Most readings have a handful of decimals, those are written without going through printf;
+    // the range check comes first so the scaled value always fits a long long
+    bool exact = false;
+    long long fixed = 0;
+    if (fabs(value) < 1e9){
+        double scaled = value * 1e6;
+        fixed = (long long)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+        exact = (double)fixed / 1e6 == value;
+    }
+
+    if (exact){
+        unsigned long long v = fixed < 0 ? -(unsigned long long)fixed : (unsigned long long)fixed;
+        unsigned long long whole = v / 1000000, frac = v % 1000000;
+
+        char out[32];
+        char* end = out + sizeof(out);
+        char* p = end;
+
+        if (frac){
+            int width = 6;
+            while (frac % 10 == 0){ frac /= 10; width--; }
+            while (width--){ *--p = '0' + frac % 10; frac /= 10; }
+            *--p = '.';
+        }
+        p -= thingsboard_json_digits(p, whole);
+        if (fixed < 0) *--p = '-';
+
+        thingsboard_json_separate(json);
+        thingsboard_json_put(json, p, end - p);
+        return;
+    }
+
+    char out[32];
+    int n = 0;
+    for (int precision = 15; precision <= 17; precision++){
+        n = snprintf(out, sizeof(out), "%.*g", precision, value);
+        if (strtod(out, NULL) == value) break;
+    }
+
+    thingsboard_json_separate(json);
+    thingsboard_json_put(json, out, n);
+}
+
+void thingsboard_json_bool(thingsboard_json* json, bool value)
+{
+    thingsboard_json_separate(json);
+    if (value) thingsboard_json_put(json, "true", 4);
+    else thingsboard_json_put(json, "false", 5);
+}
+
+void thingsboard_json_string(thingsboard_json* json, const char* value)
+{
+    thingsboard_json_separate(json);
+    if (value == NULL) thingsboard_json_put(json, "null", 4);
+    else thingsboard_json_escaped(json, value, strlen(value));
+}
+
+void thingsboard_json_string_n(thingsboard_json* json, const char* value, size_t len)
+{
+    thingsboard_json_separate(json);
+    thingsboard_json_escaped(json, value, len);
+}
+
+void thingsboard_json_raw(thingsboard_json* json, const char* value, size_t len)
+{
+    thingsboard_json_separate(json);
+    thingsboard_json_put(json, value, len);
+}
+
+const char* thingsboard_json_result(thingsboard_json* json)
+{
+    if (json->failed || !thingsboard_json_reserve(json, 0)) return NULL;
+
+    json->buf[json->len] = '\0';
+
+    return json->buf;
+}
+
+const char* thingsboard_provision_json(thingsboard_json** slot, const char* key, const char* secret, const char* token)
+{
+    thingsboard_json* json = thingsboard_json_reuse(slot);
+    if (json == NULL) return NULL;
+
+    thingsboard_json_object_begin(json);
+    thingsboard_json_key(json, "provisionDeviceKey");
+    thingsboard_json_string(json, key);
+    thingsboard_json_key(json, "provisionDeviceSecret");
+    thingsboard_json_string(json, secret);
+    thingsboard_json_key(json, "token");
+    thingsboard_json_string(json, token);
+    thingsboard_json_key(json, "credentialsType");
+    thingsboard_json_string(json, "ACCESS_TOKEN");
+    thingsboard_json_object_end(json);
+
+    return thingsboard_json_result(json);
+}
+
+const char* thingsboard_claim_json(thingsboard_json** slot, const char* secret, int duration)
+{
+    thingsboard_json* json = thingsboard_json_reuse(slot);
+    if (json == NULL) return NULL;
+
+    thingsboard_json_object_begin(json);
+    if (secret){
+        thingsboard_json_key(json, "secretKey");
+        thingsboard_json_string(json, secret);
+    }
+    if (duration >= 0){
+        thingsboard_json_key(json, "durationMs");
+        thingsboard_json_int(json, duration);
+    }
+    thingsboard_json_object_end(json);
+
+    return thingsboard_json_result(json);
+}
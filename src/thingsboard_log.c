@@ -0,0 +1,195 @@
+#define _DEFAULT_SOURCE
+#include "thingsboard_log.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <syslog.h>
+
+// Must be a power of two
+#define LOG_RING_SIZE 1024
+#define LOG_MESSAGE_MAX 256
+
+typedef void (*thingsboard_log_sink_fn)(thingsboard_log_level level, thingsboard_log_module module, const char* message);
+
+// A slot is free for the producer at position pos when seq == pos, readable when seq == pos + 1
+struct log_slot {
+    atomic_size_t seq;
+    thingsboard_log_level level;
+    thingsboard_log_module module;
+    char message[LOG_MESSAGE_MAX];
+};
+
+atomic_int thingsboard_log_levels[THINGSBOARD_LOG_MODULES] = {
+    THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_WARNING
+};
+
+static struct log_slot ring[LOG_RING_SIZE];
+static atomic_size_t ring_tail;
+static size_t ring_head;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static atomic_ulong dropped;
+static _Atomic(thingsboard_log_sink_fn) sink;
+
+static pthread_mutex_t lifecycle = PTHREAD_MUTEX_INITIALIZER;
+static int refs;
+static atomic_bool running;
+static pthread_t thread;
+
+// Set while the logging thread waits for an empty ring to fill, only then do producers take the lock to wake it
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static atomic_bool sleeping;
+
+static const char* prefixes[THINGSBOARD_LOG_MODULES] = { "Thingsboard", "Thingsboard HTTP", "Thingsboard MQTT" };
+
+static void thingsboard_log_syslog(thingsboard_log_level level, thingsboard_log_module module, const char* message)
+{
+    static const int priorities[] = { LOG_DEBUG, LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG };
+
+    syslog(priorities[level], "[%s] %s", prefixes[module], message);
+}
+
+static void thingsboard_log_ring_init(void)
+{
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+        atomic_init(&ring[i].seq, i);
+}
+
+void thingsboard_log_write(thingsboard_log_level level, thingsboard_log_module module, const char* fmt, ...)
+{
+    pthread_once(&ring_once, thingsboard_log_ring_init);
+
+    size_t pos = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    struct log_slot* slot;
+
+    // Claim a slot; when the logging thread has fallen a full ring behind the message is dropped
+    while (1){
+        slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        intptr_t diff = (intptr_t)atomic_load_explicit(&slot->seq, memory_order_acquire) - (intptr_t)pos;
+
+        if (diff == 0){
+            if (atomic_compare_exchange_weak_explicit(&ring_tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0){
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else pos = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(slot->message, LOG_MESSAGE_MAX, fmt, args);
+    va_end(args);
+
+    slot->level = level;
+    slot->module = module;
+    // Sequentially consistent like the flag in thingsboard_log_idle, either the thread sees the message or we see it asleep
+    atomic_store(&slot->seq, pos + 1);
+    if (atomic_load(&sleeping)){
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&wake_lock);
+    }
+}
+
+static int thingsboard_log_drain(void)
+{
+    thingsboard_log_sink_fn out = atomic_load(&sink);
+    if (out == NULL) out = thingsboard_log_syslog;
+
+    int count = 0;
+    while (1){
+        struct log_slot* slot = &ring[ring_head & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != ring_head + 1) break;
+
+        out(slot->level, slot->module, slot->message);
+
+        atomic_store_explicit(&slot->seq, ring_head + LOG_RING_SIZE, memory_order_release);
+        ring_head++;
+        count++;
+    }
+
+    return count;
+}
+
+// Sleeps until a producer or thingsboard_log_stop signals, unless a message came in meanwhile
+static void thingsboard_log_idle(void)
+{
+    pthread_mutex_lock(&wake_lock);
+    atomic_store(&sleeping, true);
+
+    struct log_slot* slot = &ring[ring_head & (LOG_RING_SIZE - 1)];
+    if (atomic_load(&running) && atomic_load(&slot->seq) != ring_head + 1)
+        pthread_cond_wait(&wake, &wake_lock);
+
+    atomic_store(&sleeping, false);
+    pthread_mutex_unlock(&wake_lock);
+}
+
+static void* thingsboard_log_run(void* arg)
+{
+    // Producers stay lock-free while the thread is busy, an idle thread costs nothing until the next message
+    while (atomic_load(&running)){
+        if (thingsboard_log_drain() == 0) thingsboard_log_idle();
+    }
+    thingsboard_log_drain();
+
+    return NULL;
+}
+
+void thingsboard_log_start(void)
+{
+    pthread_once(&ring_once, thingsboard_log_ring_init);
+
+    pthread_mutex_lock(&lifecycle);
+    if (refs++ == 0){
+        openlog("thingsboard", LOG_PID, LOG_USER);
+        atomic_store(&running, true);
+        if (pthread_create(&thread, NULL, thingsboard_log_run, NULL) != 0){
+            atomic_store(&running, false);
+            refs--;
+        }
+    }
+    pthread_mutex_unlock(&lifecycle);
+}
+
+void thingsboard_log_stop(void)
+{
+    pthread_mutex_lock(&lifecycle);
+    if (refs > 0 && --refs == 0){
+        pthread_mutex_lock(&wake_lock);
+        atomic_store(&running, false);
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&wake_lock);
+        pthread_join(thread, NULL);
+        closelog();
+    }
+    pthread_mutex_unlock(&lifecycle);
+}
+
+void thingsboard_log_level_set(thingsboard_log_level level)
+{
+    for (int i = 0; i < THINGSBOARD_LOG_MODULES; i++)
+        atomic_store(&thingsboard_log_levels[i], level);
+}
+
+void thingsboard_log_module_level_set(thingsboard_log_module module, thingsboard_log_level level)
+{
+    if (module < 0 || module >= THINGSBOARD_LOG_MODULES) return;
+
+    atomic_store(&thingsboard_log_levels[module], level);
+}
+
+void thingsboard_log_sink_set(void (*new_sink)(thingsboard_log_level level, thingsboard_log_module module, const char* message))
+{
+    atomic_store(&sink, new_sink);
+}
+
+unsigned long thingsboard_log_dropped(void)
+{
+    return atomic_load(&dropped);
+}
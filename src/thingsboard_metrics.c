@@ -0,0 +1,331 @@
+#include "thingsboard_metrics.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sums of every shard, taken without stopping the writers
+struct thingsboard_metrics_totals {
+    unsigned long long results[THINGSBOARD_OPS][THINGSBOARD_CODES];
+    unsigned long long calls[THINGSBOARD_OPS];
+    unsigned long long sum_us[THINGSBOARD_OPS];
+    long long max_us[THINGSBOARD_OPS];
+    unsigned long long buckets[THINGSBOARD_OPS][THINGSBOARD_METRICS_BUCKETS];
+    unsigned long long bytes_out;
+    unsigned long long bytes_in;
+    unsigned long long messages_out;
+    unsigned long long messages_in;
+    unsigned long reconnects;
+};
+
+static const char* const thingsboard_metrics_ops[THINGSBOARD_OPS] = {
+    "telemetry", "attributes_publish", "attributes_request", "rpc_send", "rpc_reply", "claim", "provision"
+};
+
+static const char* const thingsboard_metrics_codes[THINGSBOARD_CODES] = {
+    "success", "unauthorized", "bad_request", "unknown_error", "busy"
+};
+
+// Hands every new thread the next shard in turn
+static atomic_uint thingsboard_metrics_threads;
+static __thread int thingsboard_metrics_slot = -1;
+
+static struct thingsboard_metrics_shard* thingsboard_metrics_shard(thingsboard_metrics* metrics)
+{
+    if (thingsboard_metrics_slot < 0)
+        thingsboard_metrics_slot = (int)(atomic_fetch_add_explicit(&thingsboard_metrics_threads, 1, memory_order_relaxed) % THINGSBOARD_METRICS_SHARDS);
+
+    struct thingsboard_metrics_shard* shard = atomic_load_explicit(&metrics->shards[thingsboard_metrics_slot], memory_order_acquire);
+    if (shard != NULL) return shard;
+
+    shard = (struct thingsboard_metrics_shard*)calloc(1, sizeof(*shard));
+    if (shard == NULL) return NULL;
+
+    // Another thread of the same slot may have been first
+    struct thingsboard_metrics_shard* expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&metrics->shards[thingsboard_metrics_slot], &expected, shard, memory_order_acq_rel, memory_order_acquire)){
+        free(shard);
+        shard = expected;
+    }
+
+    return shard;
+}
+
+// Values below 2^SUB_BITS get a bucket each, above that every power of two is split into 2^SUB_BITS buckets
+static size_t thingsboard_metrics_bucket(unsigned long long us)
+{
+    if (us < (1ull << THINGSBOARD_METRICS_SUB_BITS)) return (size_t)us;
+    if (us >= (1ull << THINGSBOARD_METRICS_MAX_EXP)) return THINGSBOARD_METRICS_BUCKETS - 1;
+
+    int exp = 63 - __builtin_clzll(us);
+    size_t sub = (size_t)(us >> (exp - THINGSBOARD_METRICS_SUB_BITS)) & ((1u << THINGSBOARD_METRICS_SUB_BITS) - 1);
+
+    return ((size_t)(exp - THINGSBOARD_METRICS_SUB_BITS + 1) << THINGSBOARD_METRICS_SUB_BITS) + sub;
+}
+
+// The highest value a bucket holds
+static long long thingsboard_metrics_bucket_top(size_t i)
+{
+    size_t per = 1u << THINGSBOARD_METRICS_SUB_BITS;
+    if (i < per) return (long long)i;
+
+    int shift = (int)(i >> THINGSBOARD_METRICS_SUB_BITS) - 1;
+    unsigned long long base = per + (i & (per - 1));
+
+    return (long long)(((base + 1) << shift) - 1);
+}
+
+thingsboard_metrics* thingsboard_metrics_new(void)
+{
+    thingsboard_metrics* metrics = (thingsboard_metrics*)malloc(sizeof(thingsboard_metrics));
+    if (metrics == NULL) return NULL;
+
+    for (int i = 0; i < THINGSBOARD_METRICS_SHARDS; i++) atomic_init(&metrics->shards[i], NULL);
+
+    return metrics;
+}
+
+void thingsboard_metrics_free(thingsboard_metrics* metrics)
+{
+    if (metrics == NULL) return;
+
+    for (int i = 0; i < THINGSBOARD_METRICS_SHARDS; i++) free(atomic_load(&metrics->shards[i]));
+    free(metrics);
+}
+
+int thingsboard_metrics_done(thingsboard_metrics* metrics, thingsboard_operation op, long long start_us, int res)
+{
+    if (metrics == NULL || (unsigned)op >= THINGSBOARD_OPS) return res;
+
+    struct thingsboard_metrics_shard* shard = thingsboard_metrics_shard(metrics);
+    if (shard == NULL) return res;
+
+    long long us = thingsboard_metrics_now_us() - start_us;
+    if (us < 0) us = 0;
+
+    struct thingsboard_metrics_op* m = &shard->ops[op];
+    atomic_fetch_add_explicit(&m->results[(unsigned)res < THINGSBOARD_CODES ? res : THINGSBOARD_UNKNOWN_ERROR], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->sum_us, (unsigned long long)us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->buckets[thingsboard_metrics_bucket((unsigned long long)us)], 1, memory_order_relaxed);
+
+    long long max = atomic_load_explicit(&m->max_us, memory_order_relaxed);
+    while (us > max && !atomic_compare_exchange_weak_explicit(&m->max_us, &max, us, memory_order_relaxed, memory_order_relaxed));
+
+    return res;
+}
+
+void thingsboard_metrics_sent(thingsboard_metrics* metrics, size_t bytes)
+{
+    struct thingsboard_metrics_shard* shard = metrics ? thingsboard_metrics_shard(metrics) : NULL;
+    if (shard == NULL) return;
+
+    atomic_fetch_add_explicit(&shard->bytes_out, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->messages_out, 1, memory_order_relaxed);
+}
+
+void thingsboard_metrics_received(thingsboard_metrics* metrics, size_t bytes)
+{
+    struct thingsboard_metrics_shard* shard = metrics ? thingsboard_metrics_shard(metrics) : NULL;
+    if (shard == NULL) return;
+
+    atomic_fetch_add_explicit(&shard->bytes_in, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->messages_in, 1, memory_order_relaxed);
+}
+
+void thingsboard_metrics_reconnect(thingsboard_metrics* metrics)
+{
+    struct thingsboard_metrics_shard* shard = metrics ? thingsboard_metrics_shard(metrics) : NULL;
+    if (shard == NULL) return;
+
+    atomic_fetch_add_explicit(&shard->reconnects, 1, memory_order_relaxed);
+}
+
+static void thingsboard_metrics_merge(thingsboard_metrics* metrics, struct thingsboard_metrics_totals* totals)
+{
+    memset(totals, 0, sizeof(*totals));
+
+    for (int s = 0; s < THINGSBOARD_METRICS_SHARDS; s++){
+        struct thingsboard_metrics_shard* shard = atomic_load_explicit(&metrics->shards[s], memory_order_acquire);
+        if (shard == NULL) continue;
+
+        for (int op = 0; op < THINGSBOARD_OPS; op++){
+            struct thingsboard_metrics_op* m = &shard->ops[op];
+
+            for (int c = 0; c < THINGSBOARD_CODES; c++){
+                unsigned long long n = atomic_load_explicit(&m->results[c], memory_order_relaxed);
+                totals->results[op][c] += n;
+                totals->calls[op] += n;
+            }
+            totals->sum_us[op] += atomic_load_explicit(&m->sum_us, memory_order_relaxed);
+
+            long long max = atomic_load_explicit(&m->max_us, memory_order_relaxed);
+            if (max > totals->max_us[op]) totals->max_us[op] = max;
+
+            for (int b = 0; b < THINGSBOARD_METRICS_BUCKETS; b++)
+                totals->buckets[op][b] += atomic_load_explicit(&m->buckets[b], memory_order_relaxed);
+        }
+
+        totals->bytes_out += atomic_load_explicit(&shard->bytes_out, memory_order_relaxed);
+        totals->bytes_in += atomic_load_explicit(&shard->bytes_in, memory_order_relaxed);
+        totals->messages_out += atomic_load_explicit(&shard->messages_out, memory_order_relaxed);
+        totals->messages_in += atomic_load_explicit(&shard->messages_in, memory_order_relaxed);
+        totals->reconnects += atomic_load_explicit(&shard->reconnects, memory_order_relaxed);
+    }
+}
+
+// The latency below which permille of the calls completed, as the top of its bucket
+static long long thingsboard_metrics_percentile(const struct thingsboard_metrics_totals* totals, int op, int permille)
+{
+    unsigned long long count = 0;
+    for (int b = 0; b < THINGSBOARD_METRICS_BUCKETS; b++) count += totals->buckets[op][b];
+    if (count == 0) return 0;
+
+    unsigned long long rank = (count * permille + 999) / 1000;
+    if (rank == 0) rank = 1;
+
+    unsigned long long seen = 0;
+    for (int b = 0; b < THINGSBOARD_METRICS_BUCKETS; b++){
+        seen += totals->buckets[op][b];
+        if (seen < rank) continue;
+
+        long long top = thingsboard_metrics_bucket_top(b);
+        return top < totals->max_us[op] ? top : totals->max_us[op];
+    }
+
+    return totals->max_us[op];
+}
+
+void thingsboard_metrics_snapshot(thingsboard_metrics* metrics, thingsboard_stats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (metrics == NULL) return;
+
+    struct thingsboard_metrics_totals* totals = (struct thingsboard_metrics_totals*)malloc(sizeof(*totals));
+    if (totals == NULL) return;
+
+    thingsboard_metrics_merge(metrics, totals);
+
+    for (int op = 0; op < THINGSBOARD_OPS; op++){
+        thingsboard_op_stats* s = &stats->ops[op];
+
+        s->calls = totals->calls[op];
+        memcpy(s->results, totals->results[op], sizeof(s->results));
+        if (s->calls == 0) continue;
+
+        s->latency_avg_us = (long long)(totals->sum_us[op] / s->calls);
+        s->latency_p50_us = thingsboard_metrics_percentile(totals, op, 500);
+        s->latency_p90_us = thingsboard_metrics_percentile(totals, op, 900);
+        s->latency_p99_us = thingsboard_metrics_percentile(totals, op, 990);
+        s->latency_p999_us = thingsboard_metrics_percentile(totals, op, 999);
+        s->latency_max_us = totals->max_us[op];
+    }
+
+    stats->bytes_out = totals->bytes_out;
+    stats->bytes_in = totals->bytes_in;
+    stats->messages_out = totals->messages_out;
+    stats->messages_in = totals->messages_in;
+    stats->reconnects = totals->reconnects;
+
+    free(totals);
+}
+
+// Appends like snprintf, len keeps counting once buf is full
+struct thingsboard_metrics_text {
+    char* buf;
+    size_t size;
+    size_t len;
+};
+
+static void thingsboard_metrics_printf(struct thingsboard_metrics_text* text, const char* fmt, ...)
+{
+    size_t left = text->len < text->size ? text->size - text->len : 0;
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(left ? text->buf + text->len : NULL, left, fmt, args);
+    va_end(args);
+
+    if (n > 0) text->len += (size_t)n;
+}
+
+// A series without labels of its own: name{labels} value, or name value
+static void thingsboard_metrics_plain(struct thingsboard_metrics_text* text, const char* labels, const char* name, unsigned long long value)
+{
+    if (labels) thingsboard_metrics_printf(text, "%s{%s} %llu\n", name, labels, value);
+    else thingsboard_metrics_printf(text, "%s %llu\n", name, value);
+}
+
+size_t thingsboard_metrics_prometheus(thingsboard_metrics* metrics, const thingsboard_stats* stats, const char* labels, char* buf, size_t size)
+{
+    struct thingsboard_metrics_text text = { buf, size, 0 };
+    if (buf != NULL && size > 0) buf[0] = '\0';
+    else text.size = 0;
+
+    struct thingsboard_metrics_totals* totals = (struct thingsboard_metrics_totals*)calloc(1, sizeof(*totals));
+    if (totals == NULL) return 0;
+    if (metrics != NULL) thingsboard_metrics_merge(metrics, totals);
+
+    if (labels != NULL && *labels == '\0') labels = NULL;
+    const char* sep = labels ? "," : "";
+    const char* own = labels ? labels : "";
+
+    // Powers of two are bucket boundaries, so the cumulative counts are exact
+    thingsboard_metrics_printf(&text, "# HELP thingsboard_operation_duration_seconds Latency of SDK calls, requests until their response\n");
+    thingsboard_metrics_printf(&text, "# TYPE thingsboard_operation_duration_seconds histogram\n");
+    for (int op = 0; op < THINGSBOARD_OPS; op++){
+        const char* name = thingsboard_metrics_ops[op];
+        unsigned long long cumulative = 0;
+        size_t b = 0;
+
+        for (int exp = 4; exp < THINGSBOARD_METRICS_MAX_EXP; exp++){
+            size_t end = (size_t)(exp - THINGSBOARD_METRICS_SUB_BITS + 1) << THINGSBOARD_METRICS_SUB_BITS;
+            for (; b < end; b++) cumulative += totals->buckets[op][b];
+
+            thingsboard_metrics_printf(&text, "thingsboard_operation_duration_seconds_bucket{%s%sop=\"%s\",le=\"%.6f\"} %llu\n",
+                own, sep, name, (double)(1ull << exp) / 1e6, cumulative);
+        }
+        for (; b < THINGSBOARD_METRICS_BUCKETS; b++) cumulative += totals->buckets[op][b];
+
+        thingsboard_metrics_printf(&text, "thingsboard_operation_duration_seconds_bucket{%s%sop=\"%s\",le=\"+Inf\"} %llu\n", own, sep, name, cumulative);
+        thingsboard_metrics_printf(&text, "thingsboard_operation_duration_seconds_sum{%s%sop=\"%s\"} %.6f\n", own, sep, name, totals->sum_us[op] / 1e6);
+        thingsboard_metrics_printf(&text, "thingsboard_operation_duration_seconds_count{%s%sop=\"%s\"} %llu\n", own, sep, name, cumulative);
+    }
+
+    thingsboard_metrics_printf(&text, "# HELP thingsboard_operation_results_total Completed SDK calls by result\n");
+    thingsboard_metrics_printf(&text, "# TYPE thingsboard_operation_results_total counter\n");
+    for (int op = 0; op < THINGSBOARD_OPS; op++)
+        for (int c = 0; c < THINGSBOARD_CODES; c++)
+            thingsboard_metrics_printf(&text, "thingsboard_operation_results_total{%s%sop=\"%s\",code=\"%s\"} %llu\n",
+                own, sep, thingsboard_metrics_ops[op], thingsboard_metrics_codes[c], totals->results[op][c]);
+
+    thingsboard_metrics_printf(&text, "# HELP thingsboard_transport_bytes_total Payload bytes written and read by the transport\n");
+    thingsboard_metrics_printf(&text, "# TYPE thingsboard_transport_bytes_total counter\n");
+    thingsboard_metrics_printf(&text, "thingsboard_transport_bytes_total{%s%sdirection=\"out\"} %llu\n", own, sep, totals->bytes_out);
+    thingsboard_metrics_printf(&text, "thingsboard_transport_bytes_total{%s%sdirection=\"in\"} %llu\n", own, sep, totals->bytes_in);
+
+    thingsboard_metrics_printf(&text, "# HELP thingsboard_transport_messages_total Messages written and read by the transport\n");
+    thingsboard_metrics_printf(&text, "# TYPE thingsboard_transport_messages_total counter\n");
+    thingsboard_metrics_printf(&text, "thingsboard_transport_messages_total{%s%sdirection=\"out\"} %llu\n", own, sep, totals->messages_out);
+    thingsboard_metrics_printf(&text, "thingsboard_transport_messages_total{%s%sdirection=\"in\"} %llu\n", own, sep, totals->messages_in);
+
+    thingsboard_metrics_printf(&text, "# HELP thingsboard_reconnects_total Reconnect attempts of the MQTT connection\n");
+    thingsboard_metrics_printf(&text, "# TYPE thingsboard_reconnects_total counter\n");
+    thingsboard_metrics_plain(&text, labels, "thingsboard_reconnects_total", totals->reconnects);
+
+    thingsboard_metrics_printf(&text, "# HELP thingsboard_queue_depth Entries waiting in the SDK's queues\n");
+    thingsboard_metrics_printf(&text, "# TYPE thingsboard_queue_depth gauge\n");
+    thingsboard_metrics_printf(&text, "thingsboard_queue_depth{%s%squeue=\"outbound\"} %d\n", own, sep, stats->outbound_messages);
+    thingsboard_metrics_printf(&text, "thingsboard_queue_depth{%s%squeue=\"submission\"} %d\n", own, sep, stats->submitted_messages);
+    thingsboard_metrics_printf(&text, "thingsboard_queue_depth{%s%squeue=\"stored\"} %ld\n", own, sep, stats->stored_records);
+    thingsboard_metrics_printf(&text, "thingsboard_queue_depth{%s%squeue=\"inflight\"} %d\n", own, sep, stats->inflight);
+    thingsboard_metrics_printf(&text, "thingsboard_queue_depth{%s%squeue=\"pending_requests\"} %d\n", own, sep, stats->pending_requests);
+    thingsboard_metrics_printf(&text, "thingsboard_queue_depth{%s%squeue=\"async\"} %d\n", own, sep, stats->async_outstanding);
+
+    thingsboard_metrics_printf(&text, "# HELP thingsboard_outbound_queue_bytes Bytes held by the outbound queue\n");
+    thingsboard_metrics_printf(&text, "# TYPE thingsboard_outbound_queue_bytes gauge\n");
+    thingsboard_metrics_plain(&text, labels, "thingsboard_outbound_queue_bytes", stats->outbound_bytes);
+
+    free(totals);
+
+    return text.len;
+}
@@ -0,0 +1,222 @@
+#define _DEFAULT_SOURCE
+#include "thingsboard_mpsc.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Keeps the producers' and the consumer's position on cache lines of their own
+#define MPSC_LINE 64
+
+struct mpsc_message {
+    int kind;
+    long long ts;
+    size_t len;
+    char data[];
+};
+
+// seq is the position a producer may fill the cell at, one past it once the message is in
+struct mpsc_cell {
+    atomic_size_t seq;
+    struct mpsc_message* msg;
+};
+
+struct thingsboard_mpsc {
+    struct mpsc_cell* cells;
+    size_t mask;
+    // Next position to claim, advanced by the producers with a compare and swap
+    _Alignas(MPSC_LINE) atomic_size_t tail;
+    // Next position to take, written by the consumer only
+    _Alignas(MPSC_LINE) atomic_size_t head;
+    // Set while the consumer waits, producers only lock then
+    atomic_bool sleeping;
+    atomic_bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+};
+
+static void thingsboard_mpsc_deadline(struct timespec* deadline, long wait_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += wait_ms / 1000;
+    deadline->tv_nsec += (wait_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L){
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+thingsboard_mpsc* thingsboard_mpsc_new(int max_messages)
+{
+    if (max_messages <= 0) return NULL;
+
+    size_t slots = 1;
+    while (slots < (size_t)max_messages) slots <<= 1;
+
+    thingsboard_mpsc* queue = (thingsboard_mpsc*)aligned_alloc(MPSC_LINE, sizeof(thingsboard_mpsc));
+    if (queue == NULL) return NULL;
+    memset(queue, 0, sizeof(thingsboard_mpsc));
+
+    queue->cells = (struct mpsc_cell*)malloc(slots * sizeof(struct mpsc_cell));
+    if (queue->cells == NULL){
+        free(queue);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < slots; i++){
+        atomic_init(&queue->cells[i].seq, i);
+        queue->cells[i].msg = NULL;
+    }
+    queue->mask = slots - 1;
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->sleeping, false);
+    atomic_init(&queue->closed, false);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue->not_empty, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&queue->lock, NULL);
+
+    return queue;
+}
+
+void thingsboard_mpsc_free(thingsboard_mpsc* queue)
+{
+    if (queue == NULL) return;
+
+    size_t tail = atomic_load(&queue->tail);
+    for (size_t pos = atomic_load(&queue->head); pos != tail; pos++)
+        free(queue->cells[pos & queue->mask].msg);
+
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->cells);
+    free(queue);
+}
+
+int thingsboard_mpsc_push(thingsboard_mpsc* queue, int kind, long long ts, const char* data, size_t len)
+{
+    // A full queue is turned away before anything is copied
+    if (atomic_load_explicit(&queue->tail, memory_order_relaxed) - atomic_load_explicit(&queue->head, memory_order_relaxed) > queue->mask)
+        return 1;
+
+    struct mpsc_message* msg = (struct mpsc_message*)malloc(sizeof(struct mpsc_message) + len + 1);
+    if (msg == NULL) return -1;
+
+    msg->kind = kind;
+    msg->ts = ts;
+    msg->len = len;
+    memcpy(msg->data, data, len);
+    msg->data[len] = '\0';
+
+    size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    struct mpsc_cell* cell;
+
+    while (1){
+        cell = &queue->cells[pos & queue->mask];
+        intptr_t diff = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)pos;
+
+        if (diff == 0){
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        }
+        // The cell still holds the message from one lap ago
+        else if (diff < 0){
+            free(msg);
+            return 1;
+        }
+        else pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    }
+
+    cell->msg = msg;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    // Pairs with the fence in pop: either the consumer sees the message or this sees it asleep
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->sleeping, memory_order_relaxed)){
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_signal(&queue->not_empty);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return 0;
+}
+
+// The oldest cell is filled, a slower producer holding it back keeps the ones after it waiting
+static bool thingsboard_mpsc_ready(thingsboard_mpsc* queue)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    return atomic_load_explicit(&queue->cells[head & queue->mask].seq, memory_order_acquire) == head + 1;
+}
+
+int thingsboard_mpsc_pop(thingsboard_mpsc* queue, int* kind, long long* ts, char** buf, size_t* cap, long wait_ms)
+{
+    if (!thingsboard_mpsc_ready(queue) && wait_ms > 0){
+        pthread_mutex_lock(&queue->lock);
+        atomic_store_explicit(&queue->sleeping, true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (!thingsboard_mpsc_ready(queue) && !atomic_load(&queue->closed)){
+            struct timespec deadline;
+            thingsboard_mpsc_deadline(&deadline, wait_ms);
+
+            while (!thingsboard_mpsc_ready(queue) && !atomic_load(&queue->closed))
+                if (pthread_cond_timedwait(&queue->not_empty, &queue->lock, &deadline) != 0) break;
+        }
+
+        atomic_store_explicit(&queue->sleeping, false, memory_order_relaxed);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    if (!thingsboard_mpsc_ready(queue)) return atomic_load(&queue->closed) ? -1 : 0;
+
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    struct mpsc_cell* cell = &queue->cells[head & queue->mask];
+    struct mpsc_message* msg = cell->msg;
+
+    if (*cap < msg->len + 1){
+        char* grown = (char*)realloc(*buf, msg->len + 1);
+        if (grown == NULL) return 0;
+        *buf = grown;
+        *cap = msg->len + 1;
+    }
+
+    memcpy(*buf, msg->data, msg->len + 1);
+    *kind = msg->kind;
+    *ts = msg->ts;
+
+    // Hands the cell to the producer one lap ahead
+    cell->msg = NULL;
+    atomic_store_explicit(&cell->seq, head + queue->mask + 1, memory_order_release);
+    atomic_store_explicit(&queue->head, head + 1, memory_order_relaxed);
+    free(msg);
+
+    return 1;
+}
+
+void thingsboard_mpsc_close(thingsboard_mpsc* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    atomic_store(&queue->closed, true);
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void thingsboard_mpsc_open(thingsboard_mpsc* queue)
+{
+    atomic_store(&queue->closed, false);
+}
+
+int thingsboard_mpsc_depth(thingsboard_mpsc* queue)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    return tail > head ? (int)(tail - head) : 0;
+}
@@ -0,0 +1,181 @@
+#include "thingsboard_pending.h"
+#include "thingsboard_hash.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+static long long thingsboard_pending_now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Sequential ids spread over the whole table
+static size_t thingsboard_pending_slot(size_t cap, int id)
+{
+    return thingsboard_hash_slot(cap, (unsigned int)id);
+}
+
+static void thingsboard_pending_put(struct thingsboard_pending_entry* slots, size_t cap, struct thingsboard_pending_entry* entry)
+{
+    size_t i = thingsboard_pending_slot(cap, entry->id);
+    while (slots[i].used) i = (i + 1) & (cap - 1);
+    slots[i] = *entry;
+}
+
+static int thingsboard_pending_grow(thingsboard_pending* pending)
+{
+    size_t cap = pending->cap * 2;
+    struct thingsboard_pending_entry* slots = (struct thingsboard_pending_entry*)calloc(cap, sizeof(*slots));
+    if (slots == NULL) return -1;
+
+    for (size_t i = 0; i < pending->cap; i++)
+        if (pending->slots[i].used) thingsboard_pending_put(slots, cap, &pending->slots[i]);
+
+    free(pending->slots);
+    pending->slots = slots;
+    pending->cap = cap;
+
+    return 0;
+}
+
+// Backward shift deletion keeps every probe chain free of holes
+static void thingsboard_pending_remove(thingsboard_pending* pending, size_t i)
+{
+    size_t mask = pending->cap - 1;
+    size_t hole = i;
+
+    for (size_t j = (i + 1) & mask; pending->slots[j].used; j = (j + 1) & mask){
+        size_t home = thingsboard_pending_slot(pending->cap, pending->slots[j].id);
+        // Move the entry back unless its home lies cyclically in (hole, j]
+        if (((j - home) & mask) >= ((j - hole) & mask)){
+            pending->slots[hole] = pending->slots[j];
+            hole = j;
+        }
+    }
+
+    pending->slots[hole].used = false;
+    pending->count--;
+}
+
+static long thingsboard_pending_find(thingsboard_pending* pending, int id)
+{
+    size_t i = thingsboard_pending_slot(pending->cap, id);
+
+    while (pending->slots[i].used){
+        if (pending->slots[i].id == id) return (long)i;
+        i = (i + 1) & (pending->cap - 1);
+    }
+
+    return -1;
+}
+
+thingsboard_pending* thingsboard_pending_new(void)
+{
+    thingsboard_pending* pending = (thingsboard_pending*)calloc(1, sizeof(thingsboard_pending));
+    if (pending == NULL) return NULL;
+
+    pending->cap = THINGSBOARD_PENDING_INITIAL;
+    pending->slots = (struct thingsboard_pending_entry*)calloc(pending->cap, sizeof(struct thingsboard_pending_entry));
+    if (pending->slots == NULL){
+        free(pending);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pending->lock, NULL);
+
+    return pending;
+}
+
+void thingsboard_pending_free(thingsboard_pending* pending)
+{
+    if (pending == NULL) return;
+
+    pthread_mutex_destroy(&pending->lock);
+    free(pending->slots);
+    free(pending);
+}
+
+int thingsboard_pending_add(thingsboard_pending* pending, int id, void* cb, long long deadline_ms)
+{
+    int res = -1;
+    if (pending == NULL) return -1;
+
+    pthread_mutex_lock(&pending->lock);
+    if (thingsboard_pending_find(pending, id) >= 0) goto end;
+    if ((pending->count + 1) * 2 > pending->cap && thingsboard_pending_grow(pending) != 0) goto end;
+
+    struct thingsboard_pending_entry entry = { .id = id, .used = true, .cb = cb, .deadline_ms = deadline_ms, .sent_us = thingsboard_pending_now_us() };
+    thingsboard_pending_put(pending->slots, pending->cap, &entry);
+    pending->count++;
+    res = 0;
+
+    end:
+        pthread_mutex_unlock(&pending->lock);
+        return res;
+}
+
+int thingsboard_pending_take(thingsboard_pending* pending, int id, void** cb, long long* sent_us)
+{
+    if (pending == NULL) return -1;
+
+    pthread_mutex_lock(&pending->lock);
+    long i = thingsboard_pending_find(pending, id);
+    if (i >= 0){
+        *cb = pending->slots[i].cb;
+        if (sent_us) *sent_us = pending->slots[i].sent_us;
+        thingsboard_pending_remove(pending, (size_t)i);
+    }
+    pthread_mutex_unlock(&pending->lock);
+
+    return i >= 0 ? 0 : -1;
+}
+
+int thingsboard_pending_take_expired(thingsboard_pending* pending, long long now_ms, int* id, void** cb, long long* sent_us)
+{
+    int res = -1;
+    if (pending == NULL) return -1;
+
+    pthread_mutex_lock(&pending->lock);
+    for (size_t i = 0; pending->count > 0 && i < pending->cap; i++){
+        if (!pending->slots[i].used || pending->slots[i].deadline_ms > now_ms) continue;
+
+        *id = pending->slots[i].id;
+        *cb = pending->slots[i].cb;
+        if (sent_us) *sent_us = pending->slots[i].sent_us;
+        thingsboard_pending_remove(pending, i);
+        res = 0;
+        break;
+    }
+    pthread_mutex_unlock(&pending->lock);
+
+    return res;
+}
+
+long long thingsboard_pending_deadline(thingsboard_pending* pending)
+{
+    long long deadline = 0;
+    if (pending == NULL) return 0;
+
+    pthread_mutex_lock(&pending->lock);
+    for (size_t i = 0; pending->count > 0 && i < pending->cap; i++){
+        if (!pending->slots[i].used) continue;
+        if (deadline == 0 || pending->slots[i].deadline_ms < deadline) deadline = pending->slots[i].deadline_ms;
+    }
+    pthread_mutex_unlock(&pending->lock);
+
+    return deadline;
+}
+
+int thingsboard_pending_count(thingsboard_pending* pending)
+{
+    if (pending == NULL) return 0;
+
+    pthread_mutex_lock(&pending->lock);
+    int count = (int)pending->count;
+    pthread_mutex_unlock(&pending->lock);
+
+    return count;
+}
@@ -0,0 +1,556 @@
+#include "thingsboard_proto.h"
+#include <cjson/cJSON.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { WIRE_VARINT = 0, WIRE_FIXED64 = 1, WIRE_BYTES = 2, WIRE_FIXED32 = 5 };
+
+// KeyValueType of ThingsBoard's transport.proto
+enum { KV_BOOLEAN = 0, KV_LONG = 1, KV_DOUBLE = 2, KV_STRING = 3, KV_JSON = 4 };
+
+static bool thingsboard_proto_reserve(thingsboard_proto* proto, size_t extra)
+{
+    if (proto->failed) return false;
+    if (proto->len + extra <= proto->cap) return true;
+
+    size_t cap = proto->cap ? proto->cap : 64;
+    while (cap < proto->len + extra) cap *= 2;
+
+    unsigned char* buf = (unsigned char*)(proto->owned ? realloc(proto->buf, cap) : malloc(cap));
+    if (buf == NULL){
+        proto->failed = true;
+        return false;
+    }
+    if (!proto->owned && proto->len > 0) memcpy(buf, proto->buf, proto->len);
+
+    proto->buf = buf;
+    proto->cap = cap;
+    proto->owned = true;
+
+    return true;
+}
+
+static inline void thingsboard_proto_varint(thingsboard_proto* proto, uint64_t v)
+{
+    if (!thingsboard_proto_reserve(proto, 10)) return;
+
+    unsigned char* out = proto->buf + proto->len;
+    while (v >= 0x80){
+        *out++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *out++ = (unsigned char)v;
+
+    proto->len = out - proto->buf;
+}
+
+static inline void thingsboard_proto_tag(thingsboard_proto* proto, int number, int wire)
+{
+    thingsboard_proto_varint(proto, ((uint64_t)number << 3) | wire);
+}
+
+// Little endian whatever the host is, as the wire format wants
+static void thingsboard_proto_fixed(thingsboard_proto* proto, uint64_t v, int bytes)
+{
+    if (!thingsboard_proto_reserve(proto, bytes)) return;
+
+    for (int i = 0; i < bytes; i++) proto->buf[proto->len++] = (unsigned char)(v >> (8 * i));
+}
+
+void thingsboard_proto_init(thingsboard_proto* proto, void* storage, size_t cap)
+{
+    proto->buf = (unsigned char*)storage;
+    proto->cap = storage ? cap : 0;
+    proto->len = 0;
+    proto->owned = false;
+    proto->failed = false;
+    proto->incomplete = false;
+}
+
+void thingsboard_proto_release(thingsboard_proto* proto)
+{
+    if (proto->owned) free(proto->buf);
+    thingsboard_proto_init(proto, NULL, 0);
+}
+
+void thingsboard_proto_reset(thingsboard_proto* proto)
+{
+    proto->len = 0;
+    proto->failed = false;
+    proto->incomplete = false;
+}
+
+int thingsboard_proto_schema_set(thingsboard_proto_schema** slot, const char* key, int number, thingsboard_proto_type type)
+{
+    if (*slot == NULL){
+        *slot = (thingsboard_proto_schema*)calloc(1, sizeof(thingsboard_proto_schema));
+        if (*slot == NULL) return -1;
+    }
+    thingsboard_proto_schema* schema = *slot;
+
+    struct thingsboard_proto_field* field = (struct thingsboard_proto_field*)thingsboard_proto_schema_find(schema, key);
+    if (field != NULL){
+        field->number = number;
+        field->type = type;
+        return 0;
+    }
+
+    if (schema->count == schema->cap){
+        int cap = schema->cap ? schema->cap * 2 : 8;
+        struct thingsboard_proto_field* fields = (struct thingsboard_proto_field*)realloc(schema->fields, cap * sizeof(*fields));
+        if (fields == NULL) return -1;
+        schema->fields = fields;
+        schema->cap = cap;
+    }
+
+    char* copy = strdup(key);
+    if (copy == NULL) return -1;
+
+    schema->fields[schema->count++] = (struct thingsboard_proto_field){ copy, number, type };
+
+    return 0;
+}
+
+// Schemas hold a handful of fields, a scan beats hashing the key
+const struct thingsboard_proto_field* thingsboard_proto_schema_find(const thingsboard_proto_schema* schema, const char* key)
+{
+    if (schema == NULL) return NULL;
+
+    for (int i = 0; i < schema->count; i++)
+        if (strcmp(schema->fields[i].key, key) == 0) return &schema->fields[i];
+
+    return NULL;
+}
+
+void thingsboard_proto_schema_free(thingsboard_proto_schema* schema)
+{
+    if (schema == NULL) return;
+
+    for (int i = 0; i < schema->count; i++) free(schema->fields[i].key);
+    free(schema->fields);
+    free(schema);
+}
+
+void thingsboard_proto_bytes(thingsboard_proto* proto, int number, const char* data, size_t len)
+{
+    thingsboard_proto_tag(proto, number, WIRE_BYTES);
+    thingsboard_proto_varint(proto, len);
+    if (!thingsboard_proto_reserve(proto, len)) return;
+
+    memcpy(proto->buf + proto->len, data, len);
+    proto->len += len;
+}
+
+// Integers only take values they represent exactly, doubles only when they are whole
+static int thingsboard_proto_integer(const thingsboard_proto_value* value, long long* out)
+{
+    switch (value->kind){
+        case THINGSBOARD_PROTO_VALUE_INT:
+        case THINGSBOARD_PROTO_VALUE_BOOL:
+            *out = value->i;
+            return 0;
+        case THINGSBOARD_PROTO_VALUE_DOUBLE:
+            if (!isfinite(value->d) || value->d != floor(value->d) || fabs(value->d) >= 9223372036854775808.0) return -1;
+            *out = (long long)value->d;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+int thingsboard_proto_put(thingsboard_proto* proto, const struct thingsboard_proto_field* field, const thingsboard_proto_value* value)
+{
+    long long i = 0;
+
+    switch (field->type){
+        case THINGSBOARD_PROTO_DOUBLE:
+        case THINGSBOARD_PROTO_FLOAT: {
+            double d;
+            if (value->kind == THINGSBOARD_PROTO_VALUE_DOUBLE) d = value->d;
+            else if (value->kind == THINGSBOARD_PROTO_VALUE_INT) d = (double)value->i;
+            else return -1;
+
+            if (field->type == THINGSBOARD_PROTO_DOUBLE){
+                uint64_t bits;
+                memcpy(&bits, &d, sizeof(bits));
+                thingsboard_proto_tag(proto, field->number, WIRE_FIXED64);
+                thingsboard_proto_fixed(proto, bits, 8);
+            }
+            else {
+                float f = (float)d;
+                uint32_t bits;
+                memcpy(&bits, &f, sizeof(bits));
+                thingsboard_proto_tag(proto, field->number, WIRE_FIXED32);
+                thingsboard_proto_fixed(proto, bits, 4);
+            }
+            return 0;
+        }
+        case THINGSBOARD_PROTO_INT32:
+            if (thingsboard_proto_integer(value, &i) != 0 || i < INT32_MIN || i > INT32_MAX) return -1;
+            // Negative int32 values are sign extended to ten bytes, as protoc does
+            thingsboard_proto_tag(proto, field->number, WIRE_VARINT);
+            thingsboard_proto_varint(proto, (uint64_t)i);
+            return 0;
+        case THINGSBOARD_PROTO_INT64:
+            if (thingsboard_proto_integer(value, &i) != 0) return -1;
+            thingsboard_proto_tag(proto, field->number, WIRE_VARINT);
+            thingsboard_proto_varint(proto, (uint64_t)i);
+            return 0;
+        case THINGSBOARD_PROTO_UINT32:
+        case THINGSBOARD_PROTO_UINT64:
+            if (thingsboard_proto_integer(value, &i) != 0 || i < 0) return -1;
+            if (field->type == THINGSBOARD_PROTO_UINT32 && i > UINT32_MAX) return -1;
+            thingsboard_proto_tag(proto, field->number, WIRE_VARINT);
+            thingsboard_proto_varint(proto, (uint64_t)i);
+            return 0;
+        case THINGSBOARD_PROTO_SINT32:
+        case THINGSBOARD_PROTO_SINT64:
+            if (thingsboard_proto_integer(value, &i) != 0) return -1;
+            if (field->type == THINGSBOARD_PROTO_SINT32 && (i < INT32_MIN || i > INT32_MAX)) return -1;
+            // Zigzag keeps small negative numbers short
+            thingsboard_proto_tag(proto, field->number, WIRE_VARINT);
+            thingsboard_proto_varint(proto, ((uint64_t)i << 1) ^ (uint64_t)(i >> 63));
+            return 0;
+        case THINGSBOARD_PROTO_BOOL:
+            if (value->kind != THINGSBOARD_PROTO_VALUE_BOOL && value->kind != THINGSBOARD_PROTO_VALUE_INT) return -1;
+            thingsboard_proto_tag(proto, field->number, WIRE_VARINT);
+            thingsboard_proto_varint(proto, value->i != 0);
+            return 0;
+        case THINGSBOARD_PROTO_STRING:
+            if (value->kind != THINGSBOARD_PROTO_VALUE_STRING) return -1;
+            thingsboard_proto_bytes(proto, field->number, value->s, value->len);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+// Encodes the members of a JSON object, an object value goes into the nested message of its THINGSBOARD_PROTO_MESSAGE field
+static int thingsboard_proto_object(thingsboard_proto* proto, const thingsboard_proto_schema* schema, const cJSON* object)
+{
+    const cJSON* item;
+    cJSON_ArrayForEach(item, object){
+        const struct thingsboard_proto_field* field = thingsboard_proto_schema_find(schema, item->string);
+        thingsboard_proto_value value = { 0 };
+
+        if (cJSON_IsNull(item)) continue;
+        if (field == NULL){
+            proto->incomplete = true;
+            return -1;
+        }
+
+        if (field->type == THINGSBOARD_PROTO_MESSAGE){
+            if (!cJSON_IsObject(item)) return -1;
+
+            thingsboard_proto nested;
+            thingsboard_proto_init(&nested, NULL, 0);
+            int res = thingsboard_proto_object(&nested, schema, item);
+            if (res == 0 && !nested.failed) thingsboard_proto_bytes(proto, field->number, (const char*)nested.buf, nested.len);
+            proto->incomplete |= nested.incomplete;
+            proto->failed |= nested.failed;
+            thingsboard_proto_release(&nested);
+            if (res != 0) return -1;
+            continue;
+        }
+
+        if (cJSON_IsBool(item)){
+            value.kind = THINGSBOARD_PROTO_VALUE_BOOL;
+            value.i = cJSON_IsTrue(item);
+        }
+        else if (cJSON_IsNumber(item)){
+            value.kind = THINGSBOARD_PROTO_VALUE_DOUBLE;
+            value.d = item->valuedouble;
+        }
+        else if (cJSON_IsString(item)){
+            value.kind = THINGSBOARD_PROTO_VALUE_STRING;
+            value.s = item->valuestring;
+            value.len = strlen(item->valuestring);
+        }
+        else return -1;
+
+        if (thingsboard_proto_put(proto, field, &value) != 0) return -1;
+    }
+
+    return 0;
+}
+
+const struct thingsboard_proto_field* thingsboard_proto_values_field(const thingsboard_proto_schema* schema)
+{
+    const struct thingsboard_proto_field* field = thingsboard_proto_schema_find(schema, "values");
+
+    return field != NULL && field->type == THINGSBOARD_PROTO_MESSAGE ? field : NULL;
+}
+
+int thingsboard_proto_wrap(thingsboard_proto* proto, const thingsboard_proto_schema* schema, long long ts, const thingsboard_proto* values)
+{
+    const struct thingsboard_proto_field* field = thingsboard_proto_values_field(schema);
+    const struct thingsboard_proto_field* stamp = thingsboard_proto_schema_find(schema, "ts");
+    if (field == NULL) return -1;
+
+    if (stamp != NULL && thingsboard_proto_put(proto, stamp, &(thingsboard_proto_value){ .kind = THINGSBOARD_PROTO_VALUE_INT, .i = ts }) != 0) return -1;
+    thingsboard_proto_bytes(proto, field->number, (const char*)values->buf, values->len);
+
+    return proto->failed ? -1 : 0;
+}
+
+// Encodes one sample as a message of its own, flat objects are wrapped when the schema sends {"ts","values"}
+static int thingsboard_proto_sample(thingsboard_proto* proto, const thingsboard_proto_schema* schema, const cJSON* sample, long long now)
+{
+    if (!cJSON_IsObject(sample)) return -1;
+    if (thingsboard_proto_values_field(schema) == NULL || cJSON_IsObject(cJSON_GetObjectItemCaseSensitive(sample, "values")))
+        return thingsboard_proto_object(proto, schema, sample);
+
+    thingsboard_proto values;
+    thingsboard_proto_init(&values, NULL, 0);
+    int res = thingsboard_proto_object(&values, schema, sample);
+    if (res == 0) res = thingsboard_proto_wrap(proto, schema, now, &values);
+    proto->incomplete |= values.incomplete;
+    thingsboard_proto_release(&values);
+
+    return res;
+}
+
+int thingsboard_proto_from_json(thingsboard_proto* proto, const thingsboard_proto_schema* schema, const char* json, long long now)
+{
+    cJSON* root = cJSON_Parse(json);
+    if (!cJSON_IsObject(root) && !cJSON_IsArray(root)){
+        cJSON_Delete(root);
+        return -1;
+    }
+
+    // Every sample is length-delimited so the caller can publish them one by one
+    thingsboard_proto sample;
+    thingsboard_proto_init(&sample, NULL, 0);
+    int count = 0;
+
+    const cJSON* item = cJSON_IsArray(root) ? root->child : root;
+    for (; item != NULL; item = cJSON_IsArray(root) ? item->next : NULL){
+        thingsboard_proto_reset(&sample);
+        if (thingsboard_proto_sample(&sample, schema, item, now) != 0){
+            proto->incomplete |= sample.incomplete;
+            count = -1;
+            break;
+        }
+
+        thingsboard_proto_varint(proto, sample.len);
+        if (!thingsboard_proto_reserve(proto, sample.len)) break;
+        memcpy(proto->buf + proto->len, sample.buf, sample.len);
+        proto->len += sample.len;
+        count++;
+    }
+
+    thingsboard_proto_release(&sample);
+    cJSON_Delete(root);
+
+    return proto->failed ? -1 : count;
+}
+
+// Walks the fields of one message without copying anything out of it
+typedef struct thingsboard_proto_reader {
+    const unsigned char* p;
+    const unsigned char* end;
+} thingsboard_proto_reader;
+
+typedef struct thingsboard_proto_read {
+    int number;
+    int wire;
+    uint64_t v;
+    const char* data;
+    size_t len;
+} thingsboard_proto_read;
+
+static int thingsboard_proto_read_varint(thingsboard_proto_reader* reader, uint64_t* v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7){
+        if (reader->p == reader->end) return -1;
+        unsigned char b = *reader->p++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return 0;
+    }
+
+    return -1;
+}
+
+// Returns 1 with the next field, 0 at the end of the message and -1 when it is malformed
+static int thingsboard_proto_next(thingsboard_proto_reader* reader, thingsboard_proto_read* field)
+{
+    if (reader->p == reader->end) return 0;
+
+    uint64_t tag;
+    if (thingsboard_proto_read_varint(reader, &tag) != 0) return -1;
+    field->number = (int)(tag >> 3);
+    field->wire = (int)(tag & 7);
+
+    switch (field->wire){
+        case WIRE_VARINT:
+            return thingsboard_proto_read_varint(reader, &field->v) == 0 ? 1 : -1;
+        case WIRE_FIXED64:
+        case WIRE_FIXED32: {
+            int bytes = field->wire == WIRE_FIXED64 ? 8 : 4;
+            if (reader->end - reader->p < bytes) return -1;
+            field->v = 0;
+            for (int i = 0; i < bytes; i++) field->v |= (uint64_t)reader->p[i] << (8 * i);
+            reader->p += bytes;
+            return 1;
+        }
+        case WIRE_BYTES: {
+            uint64_t len;
+            if (thingsboard_proto_read_varint(reader, &len) != 0 || len > (uint64_t)(reader->end - reader->p)) return -1;
+            field->data = (const char*)reader->p;
+            field->len = (size_t)len;
+            reader->p += len;
+            return 1;
+        }
+        default:
+            return -1;
+    }
+}
+
+static thingsboard_proto_reader thingsboard_proto_reader_of(const char* data, size_t len)
+{
+    return (thingsboard_proto_reader){ (const unsigned char*)data, (const unsigned char*)data + len };
+}
+
+const char* thingsboard_proto_delimited(const thingsboard_proto* proto, size_t* off, size_t* len)
+{
+    thingsboard_proto_reader reader = thingsboard_proto_reader_of((const char*)proto->buf + *off, proto->len - *off);
+    uint64_t size;
+
+    if (*off >= proto->len || thingsboard_proto_read_varint(&reader, &size) != 0 || size > (uint64_t)(reader.end - reader.p)) return NULL;
+
+    *len = (size_t)size;
+    *off = (size_t)(reader.p - proto->buf) + *len;
+
+    return (const char*)reader.p;
+}
+
+// Writes one KeyValueProto as "key":value
+static int thingsboard_proto_kv_json(thingsboard_json* json, const char* data, size_t len)
+{
+    thingsboard_proto_reader reader = thingsboard_proto_reader_of(data, len);
+    thingsboard_proto_read field;
+    const char* key = NULL;
+    size_t key_len = 0;
+    int type = KV_BOOLEAN;
+    bool bool_v = false;
+    long long long_v = 0;
+    double double_v = 0;
+    const char* str = "";
+    size_t str_len = 0;
+    int res;
+
+    while ((res = thingsboard_proto_next(&reader, &field)) == 1){
+        switch (field.number){
+            case 1: key = field.data; key_len = field.len; break;
+            case 2: type = (int)field.v; break;
+            case 3: bool_v = field.v != 0; break;
+            case 4: long_v = (long long)field.v; break;
+            case 5: memcpy(&double_v, &field.v, sizeof(double_v)); break;
+            // string_v and json_v, only the one named by type is set
+            case 6: case 7: str = field.data; str_len = field.len; break;
+        }
+    }
+    if (res != 0 || key == NULL) return -1;
+
+    thingsboard_json_key_n(json, key, key_len);
+    switch (type){
+        case KV_BOOLEAN: thingsboard_json_bool(json, bool_v); break;
+        case KV_LONG: thingsboard_json_int(json, long_v); break;
+        case KV_DOUBLE: thingsboard_json_double(json, double_v); break;
+        case KV_JSON: thingsboard_json_raw(json, str, str_len); break;
+        default: thingsboard_json_string_n(json, str, str_len); break;
+    }
+
+    return 0;
+}
+
+// AttributeUpdateNotificationMsg: repeated TsKvProto sharedUpdated = 1, repeated string sharedDeleted = 2
+const char* thingsboard_proto_attributes_json(thingsboard_json** slot, const char* data, size_t len, size_t* out_len)
+{
+    thingsboard_json* json = thingsboard_json_reuse(slot);
+    if (json == NULL) return NULL;
+
+    thingsboard_proto_reader reader = thingsboard_proto_reader_of(data, len);
+    thingsboard_proto_read field;
+    bool deleted = false;
+    int res;
+
+    thingsboard_json_object_begin(json);
+    while ((res = thingsboard_proto_next(&reader, &field)) == 1){
+        if (field.number != 1 || field.wire != WIRE_BYTES) continue;
+
+        // TsKvProto: int64 ts = 1, KeyValueProto kv = 2
+        thingsboard_proto_reader ts_kv = thingsboard_proto_reader_of(field.data, field.len);
+        thingsboard_proto_read kv;
+        int found;
+        while ((found = thingsboard_proto_next(&ts_kv, &kv)) == 1)
+            if (kv.number == 2 && kv.wire == WIRE_BYTES) break;
+        if (found != 1 || thingsboard_proto_kv_json(json, kv.data, kv.len) != 0) return NULL;
+    }
+    if (res != 0) return NULL;
+
+    // Deleted keys come last, under "deleted" as the JSON API sends them
+    reader = thingsboard_proto_reader_of(data, len);
+    while (thingsboard_proto_next(&reader, &field) == 1){
+        if (field.number != 2 || field.wire != WIRE_BYTES) continue;
+
+        if (!deleted){
+            thingsboard_json_key(json, "deleted");
+            thingsboard_json_array_begin(json);
+            deleted = true;
+        }
+        thingsboard_json_string_n(json, field.data, field.len);
+    }
+    if (deleted) thingsboard_json_array_end(json);
+    thingsboard_json_object_end(json);
+
+    const char* result = thingsboard_json_result(json);
+    if (result) *out_len = json->len;
+
+    return result;
+}
+
+// The default RpcRequestMsg of a Protobuf device profile: method, requestId and params holding JSON text
+const char* thingsboard_proto_rpc_json(thingsboard_json** slot, const char* data, size_t len, size_t* out_len)
+{
+    thingsboard_json* json = thingsboard_json_reuse(slot);
+    if (json == NULL) return NULL;
+
+    thingsboard_proto_reader reader = thingsboard_proto_reader_of(data, len);
+    thingsboard_proto_read field;
+    const char* method = "";
+    size_t method_len = 0;
+    const char* params = NULL;
+    size_t params_len = 0;
+    int res;
+
+    while ((res = thingsboard_proto_next(&reader, &field)) == 1){
+        if (field.wire != WIRE_BYTES) continue;
+
+        if (field.number == THINGSBOARD_PROTO_RPC_METHOD){
+            method = field.data;
+            method_len = field.len;
+        }
+        else if (field.number == THINGSBOARD_PROTO_RPC_PARAMS){
+            params = field.data;
+            params_len = field.len;
+        }
+    }
+    if (res != 0) return NULL;
+
+    thingsboard_json_object_begin(json);
+    thingsboard_json_key(json, "method");
+    thingsboard_json_string_n(json, method, method_len);
+    thingsboard_json_key(json, "params");
+    if (params_len > 0) thingsboard_json_raw(json, params, params_len);
+    else thingsboard_json_raw(json, "{}", 2);
+    thingsboard_json_object_end(json);
+
+    const char* result = thingsboard_json_result(json);
+    if (result) *out_len = json->len;
+
+    return result;
+}
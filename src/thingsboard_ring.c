@@ -0,0 +1,263 @@
+#define _DEFAULT_SOURCE
+#include "thingsboard_ring.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RING_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+// Precedes every message, a size of 0 marks the unused end of the buffer before it wraps
+struct ring_record {
+    uint32_t size;
+    uint32_t len;
+    int32_t kind;
+    int64_t ts;
+};
+
+struct thingsboard_ring {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    char* buf;
+    size_t cap;
+    size_t head;
+    size_t tail;
+    int count;
+    int max_messages;
+    thingsboard_overflow policy;
+    int param;
+    // Pushes that found the ring full, every param-th one is let in under THINGSBOARD_OVERFLOW_EVERY_NTH
+    unsigned long overflows;
+    bool closed;
+    thingsboard_outbound_stats stats;
+};
+
+static void thingsboard_ring_deadline(struct timespec* deadline, long wait_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += wait_ms / 1000;
+    deadline->tv_nsec += (wait_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L){
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+thingsboard_ring* thingsboard_ring_new(size_t max_bytes, int max_messages, thingsboard_overflow policy, int param)
+{
+    thingsboard_ring* ring = (thingsboard_ring*)calloc(1, sizeof(thingsboard_ring));
+    if (ring == NULL) return NULL;
+
+    ring->cap = max_bytes & ~(size_t)7;
+    ring->buf = (char*)malloc(ring->cap);
+    if (ring->buf == NULL || ring->cap < sizeof(struct ring_record)){
+        free(ring->buf);
+        free(ring);
+        return NULL;
+    }
+
+    ring->max_messages = max_messages;
+    ring->policy = policy;
+    ring->param = param;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ring->not_empty, &attr);
+    pthread_cond_init(&ring->not_full, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&ring->lock, NULL);
+
+    return ring;
+}
+
+void thingsboard_ring_free(thingsboard_ring* ring)
+{
+    if (ring == NULL) return;
+
+    pthread_cond_destroy(&ring->not_empty);
+    pthread_cond_destroy(&ring->not_full);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->buf);
+    free(ring);
+}
+
+// Where a record of size bytes would go, or -1 while it does not fit, the caller holds the lock
+static long thingsboard_ring_slot(thingsboard_ring* ring, size_t size)
+{
+    if (ring->max_messages > 0 && ring->count >= ring->max_messages) return -1;
+
+    if (ring->count == 0){
+        ring->head = ring->tail = 0;
+        return size <= ring->cap ? 0 : -1;
+    }
+
+    if (ring->tail > ring->head){
+        if (ring->cap - ring->tail >= size) return (long)ring->tail;
+        return ring->head >= size ? 0 : -1;
+    }
+
+    return ring->tail < ring->head && ring->head - ring->tail >= size ? (long)ring->tail : -1;
+}
+
+// Skips the unused end of the buffer, the caller holds the lock and the ring is not empty
+static struct ring_record* thingsboard_ring_front(thingsboard_ring* ring)
+{
+    if (ring->head == ring->cap || ((struct ring_record*)(ring->buf + ring->head))->size == 0)
+        ring->head = 0;
+
+    return (struct ring_record*)(ring->buf + ring->head);
+}
+
+static void thingsboard_ring_advance(thingsboard_ring* ring, struct ring_record* rec)
+{
+    ring->head += rec->size;
+    ring->count--;
+    ring->stats.bytes -= rec->size;
+    ring->stats.messages--;
+}
+
+int thingsboard_ring_push(thingsboard_ring* ring, int kind, long long ts, const char* data, size_t len)
+{
+    size_t size = RING_ALIGN(sizeof(struct ring_record) + len);
+    if (ring == NULL || size > ring->cap || size > UINT32_MAX) return -1;
+
+    pthread_mutex_lock(&ring->lock);
+
+    long at = thingsboard_ring_slot(ring, size);
+
+    if (at < 0){
+        bool evict = false;
+
+        switch (ring->policy){
+            case THINGSBOARD_OVERFLOW_BLOCK:{
+                struct timespec deadline;
+                thingsboard_ring_deadline(&deadline, ring->param);
+
+                while ((at = thingsboard_ring_slot(ring, size)) < 0 && !ring->closed){
+                    if (pthread_cond_timedwait(&ring->not_full, &ring->lock, &deadline) != 0 && (at = thingsboard_ring_slot(ring, size)) < 0)
+                        break;
+                }
+                if (at < 0) ring->stats.timeouts++;
+                break;
+            }
+            case THINGSBOARD_OVERFLOW_DROP_OLDEST:
+                evict = true;
+                break;
+            case THINGSBOARD_OVERFLOW_EVERY_NTH:
+                evict = ring->param <= 1 || ring->overflows % ring->param == 0;
+                ring->overflows++;
+                break;
+            default:
+                break;
+        }
+
+        // Room is made from the front, the consumer only ever holds copies
+        while (evict && at < 0 && ring->count > 0){
+            thingsboard_ring_advance(ring, thingsboard_ring_front(ring));
+            ring->stats.dropped_oldest++;
+            at = thingsboard_ring_slot(ring, size);
+        }
+
+        if (at < 0){
+            if (ring->policy != THINGSBOARD_OVERFLOW_BLOCK) ring->stats.dropped_newest++;
+            pthread_mutex_unlock(&ring->lock);
+            return 1;
+        }
+    }
+    else ring->overflows = 0;
+
+    // The end of the buffer is left unused when the record wraps to the front
+    if (at == 0 && ring->count > 0 && ring->tail < ring->cap)
+        ((struct ring_record*)(ring->buf + ring->tail))->size = 0;
+
+    struct ring_record* rec = (struct ring_record*)(ring->buf + at);
+    rec->size = (uint32_t)size;
+    rec->len = (uint32_t)len;
+    rec->kind = kind;
+    rec->ts = ts;
+    memcpy(rec + 1, data, len);
+
+    ring->tail = at + size;
+    ring->count++;
+
+    ring->stats.accepted++;
+    ring->stats.bytes += size;
+    ring->stats.messages++;
+    if (ring->stats.bytes > ring->stats.high_water_bytes) ring->stats.high_water_bytes = ring->stats.bytes;
+    if (ring->stats.messages > ring->stats.high_water_messages) ring->stats.high_water_messages = ring->stats.messages;
+
+    pthread_cond_signal(&ring->not_empty);
+    pthread_mutex_unlock(&ring->lock);
+
+    return 0;
+}
+
+int thingsboard_ring_pop(thingsboard_ring* ring, int* kind, long long* ts, char** buf, size_t* cap, long wait_ms)
+{
+    pthread_mutex_lock(&ring->lock);
+
+    if (ring->count == 0 && !ring->closed && wait_ms > 0){
+        struct timespec deadline;
+        thingsboard_ring_deadline(&deadline, wait_ms);
+
+        while (ring->count == 0 && !ring->closed)
+            if (pthread_cond_timedwait(&ring->not_empty, &ring->lock, &deadline) != 0) break;
+    }
+
+    if (ring->count == 0){
+        int res = ring->closed ? -1 : 0;
+        pthread_mutex_unlock(&ring->lock);
+        return res;
+    }
+
+    struct ring_record* rec = thingsboard_ring_front(ring);
+
+    if (*cap < (size_t)rec->len + 1){
+        char* grown = (char*)realloc(*buf, rec->len + 1);
+        if (grown == NULL){
+            pthread_mutex_unlock(&ring->lock);
+            return 0;
+        }
+        *buf = grown;
+        *cap = rec->len + 1;
+    }
+
+    memcpy(*buf, rec + 1, rec->len);
+    (*buf)[rec->len] = '\0';
+    *kind = rec->kind;
+    *ts = rec->ts;
+
+    thingsboard_ring_advance(ring, rec);
+    ring->stats.forwarded++;
+
+    pthread_cond_broadcast(&ring->not_full);
+    pthread_mutex_unlock(&ring->lock);
+
+    return 1;
+}
+
+void thingsboard_ring_close(thingsboard_ring* ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->closed = true;
+    pthread_cond_broadcast(&ring->not_empty);
+    pthread_cond_broadcast(&ring->not_full);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void thingsboard_ring_open(thingsboard_ring* ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->closed = false;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void thingsboard_ring_stats(thingsboard_ring* ring, thingsboard_outbound_stats* stats)
+{
+    pthread_mutex_lock(&ring->lock);
+    *stats = ring->stats;
+    pthread_mutex_unlock(&ring->lock);
+}
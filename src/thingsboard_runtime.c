@@ -0,0 +1,192 @@
+#define _DEFAULT_SOURCE
+#include "thingsboard_runtime.h"
+#include "thingsboard_log.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+struct runtime_io {
+    thingsboard_HTTP_io* io;
+    int refs;
+};
+
+struct runtime_loop {
+    thingsboard_MQTT_loop* loop;
+    int refs;
+};
+
+static pthread_mutex_t lifecycle = PTHREAD_MUTEX_INITIALIZER;
+static int mqtt_refs;
+static int http_refs;
+static int threads = THINGSBOARD_RUNTIME_THREADS;
+
+// Read without the lock when handles are set up, which may happen on an I/O thread
+static CURLSH* _Atomic share;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+static struct runtime_io engines[THINGSBOARD_RUNTIME_THREADS_MAX];
+static struct runtime_loop loops[THINGSBOARD_RUNTIME_THREADS_MAX];
+
+static void thingsboard_runtime_share_lock(CURL* http, curl_lock_data data, curl_lock_access access, void* userptr)
+{
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+static void thingsboard_runtime_share_unlock(CURL* http, curl_lock_data data, void* userptr)
+{
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
+int thingsboard_runtime_acquire(int API)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&lifecycle);
+    if (API == USE_MQTT){
+        if (mqtt_refs++ == 0) mosquitto_lib_init();
+    }
+    else if (API == USE_HTTP){
+        if (http_refs++ == 0){
+            curl_global_init(CURL_GLOBAL_DEFAULT);
+
+            // Connections are not shared, handles on one engine already reuse its connection cache
+            CURLSH* created = curl_share_init();
+            if (created != NULL){
+                for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) pthread_mutex_init(&share_locks[i], NULL);
+                curl_share_setopt(created, CURLSHOPT_LOCKFUNC, thingsboard_runtime_share_lock);
+                curl_share_setopt(created, CURLSHOPT_UNLOCKFUNC, thingsboard_runtime_share_unlock);
+                curl_share_setopt(created, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+                curl_share_setopt(created, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+                atomic_store(&share, created);
+            }
+            else THINGSBOARD_LOG(THINGSBOARD_LOG_WARNING, THINGSBOARD_LOG_HTTP, "Failed to create the shared DNS and TLS cache");
+        }
+    }
+    else res = -1;
+    pthread_mutex_unlock(&lifecycle);
+
+    return res;
+}
+
+void thingsboard_runtime_release(int API)
+{
+    pthread_mutex_lock(&lifecycle);
+    if (API == USE_MQTT){
+        if (mqtt_refs > 0 && --mqtt_refs == 0) mosquitto_lib_cleanup();
+    }
+    else if (API == USE_HTTP){
+        if (http_refs > 0 && --http_refs == 0){
+            CURLSH* old = atomic_exchange(&share, NULL);
+            if (old != NULL){
+                curl_share_cleanup(old);
+                for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) pthread_mutex_destroy(&share_locks[i]);
+            }
+            curl_global_cleanup();
+        }
+    }
+    pthread_mutex_unlock(&lifecycle);
+}
+
+CURLSH* thingsboard_runtime_share(void)
+{
+    return atomic_load(&share);
+}
+
+thingsboard_HTTP_io* thingsboard_runtime_io_acquire(void)
+{
+    pthread_mutex_lock(&lifecycle);
+
+    int pick = 0;
+    for (int i = 1; i < threads; i++)
+        if (engines[i].refs < engines[pick].refs) pick = i;
+
+    if (engines[pick].io == NULL)
+        engines[pick].io = thingsboard_HTTP_io_start(THINGSBOARD_RUNTIME_IO_MAX_OUTSTANDING);
+
+    thingsboard_HTTP_io* io = engines[pick].io;
+    if (io != NULL){
+        engines[pick].refs++;
+        thingsboard_HTTP_io_attach(io);
+    }
+
+    pthread_mutex_unlock(&lifecycle);
+
+    return io;
+}
+
+void thingsboard_runtime_io_release(thingsboard_HTTP_io* io, thingsboard_ctx* ctx, int drain_ms)
+{
+    if (io == NULL) return;
+
+    thingsboard_HTTP_io_detach(io, ctx, drain_ms);
+
+    bool last = false;
+
+    pthread_mutex_lock(&lifecycle);
+    for (int i = 0; i < THINGSBOARD_RUNTIME_THREADS_MAX; i++){
+        if (engines[i].io != io) continue;
+
+        if (--engines[i].refs == 0){
+            engines[i].io = NULL;
+            last = true;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&lifecycle);
+
+    // Stopped outside the lock, the I/O thread may still be setting up handles
+    if (last) thingsboard_HTTP_io_stop(io, 0);
+}
+
+thingsboard_MQTT_loop* thingsboard_runtime_mqtt_attach(struct mosquitto* mqtt, const thingsboard_MQTT_hooks* hooks, void* obj)
+{
+    pthread_mutex_lock(&lifecycle);
+
+    int pick = 0;
+    for (int i = 1; i < threads; i++)
+        if (loops[i].refs < loops[pick].refs) pick = i;
+
+    if (loops[pick].loop == NULL)
+        loops[pick].loop = thingsboard_MQTT_loop_start();
+
+    thingsboard_MQTT_loop* loop = loops[pick].loop;
+    if (loop != NULL && thingsboard_MQTT_loop_attach(loop, mqtt, hooks, obj) == 0) loops[pick].refs++;
+    else loop = NULL;
+
+    pthread_mutex_unlock(&lifecycle);
+
+    return loop;
+}
+
+void thingsboard_runtime_mqtt_detach(thingsboard_MQTT_loop* loop, struct mosquitto* mqtt)
+{
+    if (loop == NULL) return;
+
+    thingsboard_MQTT_loop_detach(loop, mqtt);
+
+    bool last = false;
+
+    pthread_mutex_lock(&lifecycle);
+    for (int i = 0; i < THINGSBOARD_RUNTIME_THREADS_MAX; i++){
+        if (loops[i].loop != loop) continue;
+
+        if (--loops[i].refs == 0){
+            loops[i].loop = NULL;
+            last = true;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&lifecycle);
+
+    if (last) thingsboard_MQTT_loop_stop(loop);
+}
+
+thingsboard_code thingsboard_runtime_threads_set(int count)
+{
+    if (count < 1 || count > THINGSBOARD_RUNTIME_THREADS_MAX) return THINGSBOARD_BAD_REQUEST;
+
+    pthread_mutex_lock(&lifecycle);
+    threads = count;
+    pthread_mutex_unlock(&lifecycle);
+
+    return THINGSBOARD_SUCCESS;
+}
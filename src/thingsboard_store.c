@@ -0,0 +1,552 @@
+#define _DEFAULT_SOURCE
+#include "thingsboard_store.h"
+#include "thingsboard_batch.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Marks a complete record, written after everything else so a torn append is never replayed
+#define STORE_MAGIC 0x31514254u
+#define STORE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+// Room for one {"ts":<20 digits>,"values":} wrapper and a comma
+#define STORE_WRAP 48
+
+// On-disk record header, followed by len bytes of payload padded to 8 bytes
+struct store_record {
+    uint32_t magic;
+    uint32_t len;
+    // Covers ts, kind and the payload, sent is flipped in place after the record went out
+    uint32_t crc;
+    uint8_t kind;
+    uint8_t sent;
+    uint16_t reserved;
+    int64_t ts;
+};
+
+struct store_segment {
+    unsigned seq;
+    int fd;
+    char* map;
+    size_t size;
+    size_t write_off;
+    // Offset of the first record not sent yet
+    size_t read_off;
+    long pending;
+};
+
+struct thingsboard_store {
+    pthread_mutex_t lock;
+    char* dir;
+    size_t segment_size;
+    int max_segments;
+    // Oldest first, the last one takes the appends
+    struct store_segment** segments;
+    int count;
+    unsigned next_seq;
+    long depth;
+    unsigned long dropped;
+    // The burst handed out by thingsboard_store_burst, checked again on release
+    char* buf;
+    size_t buf_cap;
+    bool burst_out;
+    int burst_count;
+    unsigned burst_seq;
+    size_t burst_off;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void thingsboard_crc32_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++){
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+uint32_t thingsboard_crc32(const void* data, size_t len, uint32_t crc)
+{
+    pthread_once(&crc_once, thingsboard_crc32_init);
+
+    const unsigned char* p = (const unsigned char*)data;
+    crc = ~crc;
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+static uint32_t thingsboard_store_crc(const struct store_record* rec, const char* payload)
+{
+    uint32_t crc = thingsboard_crc32(&rec->ts, sizeof(rec->ts), 0);
+    crc = thingsboard_crc32(&rec->kind, sizeof(rec->kind), crc);
+
+    return thingsboard_crc32(payload, rec->len, crc);
+}
+
+// Flushes the pages holding [off, off + len) without waiting for the disk
+static void thingsboard_store_sync(struct store_segment* seg, size_t off, size_t len)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = off & ~(page - 1);
+
+    msync(seg->map + start, off + len - start, MS_ASYNC);
+}
+
+static void thingsboard_store_path(thingsboard_store* store, unsigned seq, char* path, size_t size)
+{
+    snprintf(path, size, "%s/%08u.tbq", store->dir, seq);
+}
+
+static void thingsboard_store_segment_free(thingsboard_store* store, struct store_segment* seg, bool remove)
+{
+    if (seg == NULL) return;
+
+    if (seg->map != NULL) munmap(seg->map, seg->size);
+    if (seg->fd >= 0) close(seg->fd);
+
+    if (remove){
+        char path[PATH_MAX];
+        thingsboard_store_path(store, seg->seq, path, sizeof(path));
+        unlink(path);
+    }
+
+    free(seg);
+}
+
+static struct store_segment* thingsboard_store_segment_map(thingsboard_store* store, unsigned seq, bool create)
+{
+    char path[PATH_MAX];
+    thingsboard_store_path(store, seq, path, sizeof(path));
+
+    struct store_segment* seg = (struct store_segment*)calloc(1, sizeof(struct store_segment));
+    if (seg == NULL) return NULL;
+
+    seg->seq = seq;
+    seg->fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0), 0600);
+    if (seg->fd < 0){
+        free(seg);
+        return NULL;
+    }
+
+    struct stat st;
+    if (create){
+        if (ftruncate(seg->fd, (off_t)store->segment_size) != 0) goto fail;
+        seg->size = store->segment_size;
+    }
+    else {
+        // A segment keeps the size it was created with even if the store was resized since
+        if (fstat(seg->fd, &st) != 0 || st.st_size < (off_t)sizeof(struct store_record)) goto fail;
+        seg->size = (size_t)st.st_size & ~(size_t)7;
+    }
+
+    seg->map = (char*)mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED){
+        seg->map = NULL;
+        goto fail;
+    }
+
+    return seg;
+
+fail:
+    thingsboard_store_segment_free(store, seg, create);
+    return NULL;
+}
+
+// Walks the intact records of a recovered segment, the write offset ends up after the last one
+static void thingsboard_store_segment_scan(struct store_segment* seg)
+{
+    size_t off = 0;
+    bool reading = true;
+
+    while (off + sizeof(struct store_record) <= seg->size){
+        struct store_record* rec = (struct store_record*)(seg->map + off);
+        const char* payload = (const char*)(rec + 1);
+
+        if (rec->magic != STORE_MAGIC) break;
+        if (rec->len > seg->size - off - sizeof(struct store_record)) break;
+        if (rec->crc != thingsboard_store_crc(rec, payload)) break;
+
+        // Records are sent in order, so the unsent ones follow every sent one
+        if (rec->sent && reading) seg->read_off = off + STORE_ALIGN(sizeof(struct store_record) + rec->len);
+        else {
+            reading = false;
+            seg->pending++;
+        }
+
+        off += STORE_ALIGN(sizeof(struct store_record) + rec->len);
+    }
+
+    seg->write_off = off;
+    if (seg->read_off > off) seg->read_off = off;
+
+    // A torn record may be followed by older bytes that would parse once new records land on top of it
+    if (off + sizeof(uint32_t) <= seg->size && *(uint32_t*)(seg->map + off) != 0){
+        memset(seg->map + off, 0, seg->size - off);
+        thingsboard_store_sync(seg, off, seg->size - off);
+    }
+}
+
+static int thingsboard_store_seq_cmp(const void* a, const void* b)
+{
+    unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void thingsboard_store_drop_oldest(thingsboard_store* store)
+{
+    struct store_segment* seg = store->segments[0];
+
+    store->depth -= seg->pending;
+    store->dropped += seg->pending;
+
+    thingsboard_store_segment_free(store, seg, true);
+    memmove(store->segments, store->segments + 1, (store->count - 1) * sizeof(struct store_segment*));
+    store->count--;
+}
+
+static int thingsboard_store_recover(thingsboard_store* store)
+{
+    DIR* dir = opendir(store->dir);
+    if (dir == NULL) return -1;
+
+    unsigned* seqs = NULL;
+    int found = 0, cap = 0;
+    struct dirent* entry;
+
+    while ((entry = readdir(dir)) != NULL){
+        unsigned seq;
+        char tail;
+        if (strlen(entry->d_name) != 12 || sscanf(entry->d_name, "%8u.tb%c", &seq, &tail) != 2 || tail != 'q') continue;
+
+        if (found == cap){
+            cap = cap ? cap * 2 : 16;
+            unsigned* grown = (unsigned*)realloc(seqs, cap * sizeof(unsigned));
+            if (grown == NULL) break;
+            seqs = grown;
+        }
+        seqs[found++] = seq;
+    }
+    closedir(dir);
+
+    if (found > 0) qsort(seqs, found, sizeof(unsigned), thingsboard_store_seq_cmp);
+    store->next_seq = found ? seqs[found - 1] + 1 : 1;
+
+    for (int i = 0; i < found; i++){
+        struct store_segment* seg = thingsboard_store_segment_map(store, seqs[i], false);
+        if (seg == NULL) continue;
+
+        thingsboard_store_segment_scan(seg);
+
+        // Fully sent segments are only kept when they could still take appends
+        if (seg->pending == 0 && i != found - 1){
+            thingsboard_store_segment_free(store, seg, true);
+            continue;
+        }
+
+        if (store->count == store->max_segments) thingsboard_store_drop_oldest(store);
+        store->segments[store->count++] = seg;
+        store->depth += seg->pending;
+    }
+
+    free(seqs);
+
+    return 0;
+}
+
+thingsboard_store* thingsboard_store_open(const char* dir, size_t max_bytes)
+{
+    if (dir == NULL || max_bytes == 0) return NULL;
+
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) return NULL;
+
+    thingsboard_store* store = (thingsboard_store*)calloc(1, sizeof(thingsboard_store));
+    if (store == NULL) return NULL;
+
+    size_t segment_size = max_bytes / 4;
+    if (segment_size > THINGSBOARD_STORE_SEGMENT_MAX) segment_size = THINGSBOARD_STORE_SEGMENT_MAX;
+    if (segment_size < THINGSBOARD_STORE_SEGMENT_MIN) segment_size = THINGSBOARD_STORE_SEGMENT_MIN;
+
+    store->segment_size = STORE_ALIGN(segment_size);
+    store->max_segments = max_bytes / store->segment_size;
+    if (store->max_segments < 2) store->max_segments = 2;
+
+    store->dir = strdup(dir);
+    store->segments = (struct store_segment**)calloc(store->max_segments, sizeof(struct store_segment*));
+    store->buf_cap = THINGSBOARD_STORE_BURST_BYTES + STORE_WRAP;
+    store->buf = (char*)malloc(store->buf_cap);
+    pthread_mutex_init(&store->lock, NULL);
+
+    if (store->dir == NULL || store->segments == NULL || store->buf == NULL || thingsboard_store_recover(store) != 0){
+        thingsboard_store_close(store);
+        return NULL;
+    }
+
+    return store;
+}
+
+void thingsboard_store_close(thingsboard_store* store)
+{
+    if (store == NULL) return;
+
+    for (int i = 0; i < store->count; i++)
+        thingsboard_store_segment_free(store, store->segments[i], false);
+
+    pthread_mutex_destroy(&store->lock);
+    free(store->segments);
+    free(store->buf);
+    free(store->dir);
+    free(store);
+}
+
+int thingsboard_store_append(thingsboard_store* store, int kind, long long ts, const char* data, size_t len)
+{
+    size_t size = STORE_ALIGN(sizeof(struct store_record) + len);
+    if (store == NULL || size > store->segment_size || len > UINT32_MAX) return -1;
+
+    pthread_mutex_lock(&store->lock);
+
+    struct store_segment* seg = store->count ? store->segments[store->count - 1] : NULL;
+
+    if (seg == NULL || seg->write_off + size > seg->size){
+        // The segment being replaced has nothing left to send, its space is freed right away
+        if (seg != NULL && seg->pending == 0){
+            thingsboard_store_segment_free(store, seg, true);
+            store->count--;
+        }
+
+        if (store->count == store->max_segments) thingsboard_store_drop_oldest(store);
+
+        seg = thingsboard_store_segment_map(store, store->next_seq, true);
+        if (seg == NULL){
+            pthread_mutex_unlock(&store->lock);
+            return -1;
+        }
+
+        store->next_seq++;
+        store->segments[store->count++] = seg;
+    }
+
+    struct store_record* rec = (struct store_record*)(seg->map + seg->write_off);
+    char* payload = (char*)(rec + 1);
+
+    memcpy(payload, data, len);
+    rec->len = (uint32_t)len;
+    rec->kind = (uint8_t)kind;
+    rec->sent = 0;
+    rec->reserved = 0;
+    rec->ts = ts;
+    rec->crc = thingsboard_store_crc(rec, payload);
+    __atomic_store_n(&rec->magic, STORE_MAGIC, __ATOMIC_RELEASE);
+
+    thingsboard_store_sync(seg, seg->write_off, size);
+
+    seg->write_off += size;
+    seg->pending++;
+    store->depth++;
+
+    pthread_mutex_unlock(&store->lock);
+
+    return 0;
+}
+
+long thingsboard_store_depth(thingsboard_store* store)
+{
+    if (store == NULL) return 0;
+
+    pthread_mutex_lock(&store->lock);
+    long depth = store->depth;
+    pthread_mutex_unlock(&store->lock);
+
+    return depth;
+}
+
+long long thingsboard_store_oldest(thingsboard_store* store)
+{
+    if (store == NULL) return 0;
+
+    long long ts = 0;
+
+    pthread_mutex_lock(&store->lock);
+    for (int i = 0; i < store->count; i++){
+        struct store_segment* seg = store->segments[i];
+        if (seg->pending == 0) continue;
+
+        ts = ((struct store_record*)(seg->map + seg->read_off))->ts;
+        break;
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    return ts;
+}
+
+unsigned long thingsboard_store_dropped(thingsboard_store* store)
+{
+    if (store == NULL) return 0;
+
+    pthread_mutex_lock(&store->lock);
+    unsigned long dropped = store->dropped;
+    pthread_mutex_unlock(&store->lock);
+
+    return dropped;
+}
+
+// Appends one telemetry record to the burst array, returns -1 when it does not fit
+static int thingsboard_store_burst_add(thingsboard_store* store, size_t* len, const struct store_record* rec, bool first)
+{
+    const char* data = (const char*)(rec + 1);
+    size_t data_len = rec->len;
+
+    // A flushed batch is already an array of {"ts":...,"values":...}, its elements join the burst
+    bool wrap = thingsboard_batch_shape(&data, &data_len);
+    if (data_len == 0) return 0;
+
+    // +2 for the comma and the closing "]"
+    if (*len + data_len + STORE_WRAP + 2 > THINGSBOARD_STORE_BURST_BYTES && !first) return -1;
+    if (*len + data_len + STORE_WRAP + 2 > store->buf_cap){
+        char* grown = (char*)realloc(store->buf, *len + data_len + STORE_WRAP + 2);
+        if (grown == NULL) return -1;
+        store->buf = grown;
+        store->buf_cap = *len + data_len + STORE_WRAP + 2;
+    }
+
+    char* out = store->buf + *len;
+    if (*len > 1) *out++ = ',';
+    if (wrap) out += sprintf(out, "{\"ts\":%lld,\"values\":", (long long)rec->ts);
+    memcpy(out, data, data_len);
+    out += data_len;
+    if (wrap) *out++ = '}';
+
+    *len = out - store->buf;
+
+    return 0;
+}
+
+const char* thingsboard_store_burst(thingsboard_store* store, int* kind, int* count)
+{
+    if (store == NULL) return NULL;
+
+    pthread_mutex_lock(&store->lock);
+
+    if (store->burst_out || store->depth == 0){
+        pthread_mutex_unlock(&store->lock);
+        return NULL;
+    }
+
+    size_t len = 0;
+    int records = 0;
+    int burst_kind = -1;
+
+    for (int i = 0; i < store->count && records < THINGSBOARD_STORE_BURST_RECORDS; i++){
+        struct store_segment* seg = store->segments[i];
+        size_t off = seg->read_off;
+
+        if (records == 0){
+            store->burst_seq = seg->seq;
+            store->burst_off = off;
+        }
+
+        while (off < seg->write_off && records < THINGSBOARD_STORE_BURST_RECORDS){
+            const struct store_record* rec = (const struct store_record*)(seg->map + off);
+
+            if (burst_kind == -1){
+                burst_kind = rec->kind;
+                if (burst_kind != THINGSBOARD_STORE_TELEMETRY){
+                    // Attributes are published one record at a time
+                    if (rec->len + 1 > store->buf_cap){
+                        char* grown = (char*)realloc(store->buf, rec->len + 1);
+                        if (grown == NULL) goto done;
+                        store->buf = grown;
+                        store->buf_cap = rec->len + 1;
+                    }
+                    memcpy(store->buf, rec + 1, rec->len);
+                    len = rec->len;
+                    records = 1;
+                    goto done;
+                }
+                store->buf[len++] = '[';
+            }
+
+            if (rec->kind != burst_kind || thingsboard_store_burst_add(store, &len, rec, records == 0) != 0) goto done;
+
+            records++;
+            off += STORE_ALIGN(sizeof(struct store_record) + rec->len);
+        }
+    }
+
+done:
+    if (records == 0){
+        pthread_mutex_unlock(&store->lock);
+        return NULL;
+    }
+
+    if (burst_kind == THINGSBOARD_STORE_TELEMETRY) store->buf[len++] = ']';
+    store->buf[len] = '\0';
+
+    store->burst_out = true;
+    store->burst_count = records;
+    *kind = burst_kind;
+    *count = records;
+
+    pthread_mutex_unlock(&store->lock);
+
+    return store->buf;
+}
+
+void thingsboard_store_release(thingsboard_store* store, int sent)
+{
+    if (store == NULL) return;
+
+    pthread_mutex_lock(&store->lock);
+
+    // Dropping the oldest segment while the burst was out invalidates it, what is left is sent again
+    bool valid = store->burst_out && store->count > 0 && store->segments[0]->seq <= store->burst_seq;
+    for (int i = 0; valid && i < store->count; i++){
+        if (store->segments[i]->seq == store->burst_seq){
+            valid = store->segments[i]->read_off == store->burst_off;
+            break;
+        }
+    }
+
+    if (sent > store->burst_count) sent = store->burst_count;
+
+    while (valid && sent > 0 && store->count > 0){
+        struct store_segment* seg = store->segments[0];
+        size_t start = seg->read_off;
+
+        while (sent > 0 && seg->read_off < seg->write_off){
+            struct store_record* rec = (struct store_record*)(seg->map + seg->read_off);
+            rec->sent = 1;
+
+            seg->read_off += STORE_ALIGN(sizeof(struct store_record) + rec->len);
+            seg->pending--;
+            store->depth--;
+            sent--;
+        }
+        if (seg->read_off > start) thingsboard_store_sync(seg, start, seg->read_off - start);
+
+        // Sent segments are unlinked unless appends still go to them
+        if (seg->pending > 0 || store->count == 1) break;
+
+        thingsboard_store_segment_free(store, seg, true);
+        memmove(store->segments, store->segments + 1, (store->count - 1) * sizeof(struct store_segment*));
+        store->count--;
+    }
+
+    store->burst_out = false;
+    store->burst_count = 0;
+
+    pthread_mutex_unlock(&store->lock);
+}
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "thingsboard_json.h"
+
+static int failures;
+
+// Writes value as the only thing in the document and compares it to expected
+static void check_double(double value, const char* expected)
+{
+    thingsboard_json* json = thingsboard_json_new();
+    thingsboard_json_double(json, value);
+
+    const char* got = thingsboard_json_result(json);
+    if (got == NULL || strcmp(got, expected) != 0){
+        fprintf(stderr, "FAIL double %.17g: got %s, expected %s\n", value, got ? got : "(null)", expected);
+        failures++;
+    }
+
+    thingsboard_json_free(json);
+}
+
+int main(void)
+{
+    // Fixed-point path
+    check_double(0, "0");
+    check_double(1.5, "1.5");
+    check_double(-2.25, "-2.25");
+    check_double(123456789.123456, "123456789.123456");
+
+    // Past the fixed-point range, scaling these by 1e6 would not fit a long long
+    check_double(1e13, "10000000000000");
+    check_double(1e15, "1e+15");
+    check_double(-1e15, "-1e+15");
+    check_double(9.3e18, "9.3e+18");
+    check_double(1e300, "1e+300");
+
+    check_double(0.1, "0.1");
+    check_double(1.0 / 0.0, "null");
+
+    if (failures == 0) printf("test_json: ok\n");
+
+    return failures != 0;
+}
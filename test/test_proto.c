@@ -0,0 +1,227 @@
+#define _DEFAULT_SOURCE
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "thingsboard.h"
+#include "mock_mqtt.h"
+
+#define TEST_HOST       "127.0.0.1"
+#define TEST_MQTT_PORT  11884
+#define TEST_TOKEN      "TEST_TOKEN"
+#define TEST_TIMEOUT_MS 5000
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)){ fprintf(stderr, "FAIL " __VA_ARGS__); fprintf(stderr, "\n"); failures++; } } while (0)
+
+static int read_varint(const unsigned char** p, const unsigned char* end, uint64_t* v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7){
+        unsigned char b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return 0;
+    }
+
+    return -1;
+}
+
+// Decodes message { int64 ts = 1; Values values = 2; } with Values { double temperature = 1; }
+static int decode_sample(const unsigned char* p, size_t len, long long* ts, double* temperature)
+{
+    const unsigned char* end = p + len;
+    uint64_t tag, v;
+    bool has_ts = false, has_values = false;
+
+    while (p < end){
+        if (read_varint(&p, end, &tag) != 0) return -1;
+
+        if (tag == (1 << 3 | 0)){
+            if (read_varint(&p, end, &v) != 0) return -1;
+            *ts = (long long)v;
+            has_ts = true;
+        }
+        else if (tag == (2 << 3 | 2)){
+            if (read_varint(&p, end, &v) != 0 || v != 9 || end - p < 9 || p[0] != (1 << 3 | 1)) return -1;
+            uint64_t bits = 0;
+            for (int i = 0; i < 8; i++) bits |= (uint64_t)p[1 + i] << (8 * i);
+            memcpy(temperature, &bits, sizeof(*temperature));
+            p += 9;
+            has_values = true;
+        }
+        else return -1;
+    }
+
+    return has_ts && has_values ? 0 : -1;
+}
+
+static int wait_connected(thingsboard_ctx* ctx)
+{
+    for (int i = 0; i < TEST_TIMEOUT_MS; i++){
+        if (thingsboard_state_get(ctx) == THINGSBOARD_CONNECTED) return 0;
+        usleep(1000);
+    }
+
+    return -1;
+}
+
+static int wait_telemetry(long count)
+{
+    unsigned char probe;
+    for (int i = 0; i < TEST_TIMEOUT_MS; i++){
+        if (mock_mqtt_telemetry(count - 1, &probe, 0) >= 0) return 0;
+        usleep(1000);
+    }
+
+    return -1;
+}
+
+// Checks that message n of the stand-in is a timestamped sample of temperature
+static void check_sample(long n, double temperature, const char* what)
+{
+    unsigned char buf[256];
+    long len = mock_mqtt_telemetry(n, buf, sizeof(buf));
+    long long ts = 0;
+    double got = 0;
+
+    if (len < 0 || len > (long)sizeof(buf) || decode_sample(buf, (size_t)len, &ts, &got) != 0){
+        CHECK(0, "%s: message %ld is not a {ts, values} sample", what, n);
+        return;
+    }
+    CHECK(ts > 0, "%s: message %ld has no timestamp", what, n);
+    CHECK(got == temperature, "%s: message %ld carries %g, expected %g", what, n, got, temperature);
+}
+
+static thingsboard_ctx* open_ctx(void)
+{
+    thingsboard_ctx* ctx = thingsboard_init(USE_MQTT);
+    if (ctx == NULL) return NULL;
+
+    thingsboard_proto_field_set(ctx, THINGSBOARD_CLASS_TELEMETRY, "ts", 1, THINGSBOARD_PROTO_INT64);
+    thingsboard_proto_field_set(ctx, THINGSBOARD_CLASS_TELEMETRY, "values", 2, THINGSBOARD_PROTO_MESSAGE);
+    thingsboard_proto_field_set(ctx, THINGSBOARD_CLASS_TELEMETRY, "temperature", 1, THINGSBOARD_PROTO_DOUBLE);
+    thingsboard_payload_format_set(ctx, THINGSBOARD_PAYLOAD_PROTOBUF);
+
+    return ctx;
+}
+
+static void close_ctx(thingsboard_ctx* ctx)
+{
+    thingsboard_disconnect(ctx);
+    thingsboard_cleanup(ctx);
+}
+
+// A flushed batch is an array of samples, each has to arrive as a message of its own
+static void test_batch(void)
+{
+    thingsboard_ctx* ctx = open_ctx();
+    CHECK(thingsboard_batch_configure(ctx, 4096, 100, 60000) == THINGSBOARD_SUCCESS, "batch: configure");
+
+    if (thingsboard_connect(ctx, TEST_HOST, TEST_MQTT_PORT, TEST_TOKEN) != THINGSBOARD_SUCCESS || wait_connected(ctx) != 0){
+        CHECK(0, "batch: connect");
+        thingsboard_cleanup(ctx);
+        return;
+    }
+
+    CHECK(thingsboard_telemetry_send(ctx, "{\"temperature\":1.5}", NULL) == THINGSBOARD_SUCCESS, "batch: send 1");
+    CHECK(thingsboard_telemetry_send(ctx, "{\"temperature\":2.5}", NULL) == THINGSBOARD_SUCCESS, "batch: send 2");
+    CHECK(thingsboard_telemetry_send(ctx, "{\"temperature\":3.5}", NULL) == THINGSBOARD_SUCCESS, "batch: send 3");
+    CHECK(thingsboard_batch_flush(ctx) == THINGSBOARD_SUCCESS, "batch: flush");
+
+    CHECK(wait_telemetry(3) == 0, "batch: 3 messages expected");
+    check_sample(0, 1.5, "batch");
+    check_sample(1, 2.5, "batch");
+    check_sample(2, 3.5, "batch");
+
+    close_ctx(ctx);
+}
+
+static void remove_dir(const char* path)
+{
+    DIR* dir = opendir(path);
+    struct dirent* entry;
+    char file[512];
+
+    while (dir && (entry = readdir(dir)) != NULL){
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        unlink(file);
+    }
+    if (dir) closedir(dir);
+    rmdir(path);
+}
+
+// Records queued while disconnected are replayed as one burst array once a send gets through
+static void test_replay(long first)
+{
+    char dir[] = "/tmp/test_proto_XXXXXX";
+    if (mkdtemp(dir) == NULL){
+        CHECK(0, "replay: mkdtemp");
+        return;
+    }
+
+    thingsboard_ctx* ctx = open_ctx();
+    CHECK(thingsboard_queue_configure(ctx, dir, 1 << 20) == THINGSBOARD_SUCCESS, "replay: configure");
+
+    CHECK(thingsboard_telemetry_send(ctx, "{\"temperature\":10.5}", NULL) == THINGSBOARD_SUCCESS, "replay: queue 1");
+    CHECK(thingsboard_telemetry_send(ctx, "{\"temperature\":20.5}", NULL) == THINGSBOARD_SUCCESS, "replay: queue 2");
+    CHECK(thingsboard_queue_depth(ctx) == 2, "replay: %ld queued, expected 2", thingsboard_queue_depth(ctx));
+
+    if (thingsboard_connect(ctx, TEST_HOST, TEST_MQTT_PORT, TEST_TOKEN) != THINGSBOARD_SUCCESS || wait_connected(ctx) != 0){
+        CHECK(0, "replay: connect");
+        thingsboard_cleanup(ctx);
+        remove_dir(dir);
+        return;
+    }
+
+    CHECK(thingsboard_telemetry_send(ctx, "{\"temperature\":30.5}", NULL) == THINGSBOARD_SUCCESS, "replay: send");
+    CHECK(thingsboard_queue_depth(ctx) == 0, "replay: %ld left in the queue", thingsboard_queue_depth(ctx));
+
+    CHECK(wait_telemetry(first + 3) == 0, "replay: 3 messages expected");
+    check_sample(first, 30.5, "replay");
+    check_sample(first + 1, 10.5, "replay");
+    check_sample(first + 2, 20.5, "replay");
+
+    close_ctx(ctx);
+    remove_dir(dir);
+}
+
+// Without the wrapper fields a batch could not be encoded, so it is refused up front
+static void test_refused(void)
+{
+    thingsboard_ctx* ctx = thingsboard_init(USE_MQTT);
+    thingsboard_proto_field_set(ctx, THINGSBOARD_CLASS_TELEMETRY, "temperature", 1, THINGSBOARD_PROTO_DOUBLE);
+
+    CHECK(thingsboard_payload_format_set(ctx, THINGSBOARD_PAYLOAD_PROTOBUF) == THINGSBOARD_SUCCESS, "refused: format");
+    CHECK(thingsboard_batch_configure(ctx, 4096, 100, 60000) == THINGSBOARD_BAD_REQUEST, "refused: batch accepted");
+    CHECK(thingsboard_queue_configure(ctx, "/tmp", 1 << 20) == THINGSBOARD_BAD_REQUEST, "refused: queue accepted");
+
+    thingsboard_payload_format_set(ctx, THINGSBOARD_PAYLOAD_JSON);
+    CHECK(thingsboard_batch_configure(ctx, 4096, 100, 60000) == THINGSBOARD_SUCCESS, "refused: JSON batch");
+    CHECK(thingsboard_payload_format_set(ctx, THINGSBOARD_PAYLOAD_PROTOBUF) == THINGSBOARD_BAD_REQUEST, "refused: format with a batch");
+
+    thingsboard_cleanup(ctx);
+}
+
+int main(void)
+{
+    if (mock_mqtt_start(TEST_MQTT_PORT) != 0){
+        fprintf(stderr, "FAIL cannot start the MQTT stand-in on port %d\n", TEST_MQTT_PORT);
+        return 1;
+    }
+
+    test_batch();
+    test_replay(3);
+    test_refused();
+
+    mock_mqtt_stop();
+
+    if (failures == 0) printf("test_proto: ok\n");
+
+    return failures != 0;
+}
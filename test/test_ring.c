@@ -0,0 +1,204 @@
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "thingsboard_ring.h"
+
+// Record header: size, len, kind and ts, messages are padded to 8 bytes after it
+#define TEST_RECORD_HEADER 24
+// Room for four 8 byte messages
+#define TEST_RING_BYTES (4 * (TEST_RECORD_HEADER + 8))
+// Well above the consumer's 20 ms delay so a loaded machine does not time the push out
+#define TEST_BLOCK_MS 200
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)){ fprintf(stderr, "FAIL " __VA_ARGS__); fprintf(stderr, "\n"); failures++; } } while (0)
+
+static long long now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Pushes an 8 byte message "msg-<n>", padded with dots
+static int push(thingsboard_ring* ring, int n)
+{
+    char data[16];
+    snprintf(data, sizeof(data), "msg-%d....", n);
+
+    return thingsboard_ring_push(ring, 0, n, data, 8);
+}
+
+// Pops one message and checks it is the one pushed as n
+static void expect(thingsboard_ring* ring, int n, const char* what)
+{
+    char* buf = NULL;
+    size_t cap = 0;
+    int kind;
+    long long ts = -1;
+    char data[16];
+
+    int res = thingsboard_ring_pop(ring, &kind, &ts, &buf, &cap, 0);
+    snprintf(data, sizeof(data), "msg-%d....", n);
+
+    CHECK(res == 1, "%s: nothing popped, expected %d", what, n);
+    CHECK(res != 1 || (ts == n && strncmp(buf, data, 8) == 0), "%s: popped %lld '%s', expected %d", what, ts, buf ? buf : "", n);
+
+    free(buf);
+}
+
+static void expect_empty(thingsboard_ring* ring, const char* what)
+{
+    char* buf = NULL;
+    size_t cap = 0;
+    int kind;
+    long long ts;
+
+    CHECK(thingsboard_ring_pop(ring, &kind, &ts, &buf, &cap, 0) == 0, "%s: ring is not empty", what);
+    free(buf);
+}
+
+// A message that does not fit before the end wraps to the front behind a zero size marker
+static void test_wrap(void)
+{
+    thingsboard_ring* ring = thingsboard_ring_new(TEST_RING_BYTES, 0, THINGSBOARD_OVERFLOW_DROP_NEWEST, 0);
+    thingsboard_outbound_stats stats;
+
+    // Leaves stale records all over the buffer, the end marker has to hide the one the wrap skips
+    for (int i = 101; i <= 104; i++) push(ring, i);
+    for (int i = 101; i <= 104; i++) expect(ring, i, "wrap");
+
+    for (int i = 1; i <= 3; i++) CHECK(push(ring, i) == 0, "wrap: push %d", i);
+    expect(ring, 1, "wrap");
+    expect(ring, 2, "wrap");
+
+    // 40 bytes with the header, only the front has room
+    char wide[16] = "wide-message....";
+    CHECK(thingsboard_ring_push(ring, 0, 4, wide, 16) == 0, "wrap: wrapped push");
+
+    expect(ring, 3, "wrap");
+    char* buf = NULL;
+    size_t cap = 0;
+    int kind;
+    long long ts = 0;
+    CHECK(thingsboard_ring_pop(ring, &kind, &ts, &buf, &cap, 0) == 1 && ts == 4 && strncmp(buf, wide, 16) == 0 && buf[16] == '\0',
+        "wrap: the wrapped message did not come back whole");
+    free(buf);
+    expect_empty(ring, "wrap");
+
+    // Full with head == tail: one record behind the front, the others wrapped around to meet it
+    for (int i = 5; i <= 8; i++) CHECK(push(ring, i) == 0, "wrap: push %d", i);
+    expect(ring, 5, "full");
+    CHECK(push(ring, 9) == 0, "full: push into the freed front");
+    CHECK(push(ring, 10) == 1, "full: push into a full ring accepted");
+    for (int i = 6; i <= 9; i++) expect(ring, i, "full");
+    expect_empty(ring, "full");
+
+    thingsboard_ring_stats(ring, &stats);
+    CHECK(stats.accepted == 13, "wrap: %lu accepted, expected 13", stats.accepted);
+    CHECK(stats.forwarded == 13, "wrap: %lu forwarded, expected 13", stats.forwarded);
+    CHECK(stats.dropped_newest == 1, "wrap: %lu dropped_newest, expected 1", stats.dropped_newest);
+    CHECK(stats.messages == 0 && stats.bytes == 0, "wrap: %d messages and %zu bytes left", stats.messages, stats.bytes);
+    CHECK(stats.high_water_messages == 4, "wrap: high water %d messages, expected 4", stats.high_water_messages);
+    CHECK(stats.high_water_bytes == TEST_RING_BYTES, "wrap: high water %zu bytes, expected %d", stats.high_water_bytes, TEST_RING_BYTES);
+
+    thingsboard_ring_free(ring);
+}
+
+// A full ring makes room by dropping from the front
+static void test_drop_oldest(void)
+{
+    thingsboard_ring* ring = thingsboard_ring_new(TEST_RING_BYTES, 0, THINGSBOARD_OVERFLOW_DROP_OLDEST, 0);
+    thingsboard_outbound_stats stats;
+
+    for (int i = 1; i <= 6; i++) CHECK(push(ring, i) == 0, "drop_oldest: push %d", i);
+    for (int i = 3; i <= 6; i++) expect(ring, i, "drop_oldest");
+    expect_empty(ring, "drop_oldest");
+
+    thingsboard_ring_stats(ring, &stats);
+    CHECK(stats.accepted == 6, "drop_oldest: %lu accepted, expected 6", stats.accepted);
+    CHECK(stats.dropped_oldest == 2, "drop_oldest: %lu dropped_oldest, expected 2", stats.dropped_oldest);
+    CHECK(stats.dropped_newest == 0, "drop_oldest: %lu dropped_newest, expected 0", stats.dropped_newest);
+
+    thingsboard_ring_free(ring);
+}
+
+// While full, the first overflow and then every third one gets in at the cost of the oldest
+static void test_every_nth(void)
+{
+    thingsboard_ring* ring = thingsboard_ring_new(TEST_RING_BYTES, 2, THINGSBOARD_OVERFLOW_EVERY_NTH, 3);
+    thingsboard_outbound_stats stats;
+
+    int expected[] = { 0, 0, 0, 1, 1, 0, 1, 1 };
+    for (int i = 1; i <= 8; i++) CHECK(push(ring, i) == expected[i - 1], "every_nth: push %d returned the wrong result", i);
+
+    expect(ring, 3, "every_nth");
+    expect(ring, 6, "every_nth");
+    expect_empty(ring, "every_nth");
+
+    // Once there is room again the count starts over
+    CHECK(push(ring, 9) == 0 && push(ring, 10) == 0 && push(ring, 11) == 0, "every_nth: first overflow after a drain refused");
+
+    thingsboard_ring_stats(ring, &stats);
+    CHECK(stats.accepted == 7, "every_nth: %lu accepted, expected 7", stats.accepted);
+    CHECK(stats.dropped_oldest == 3, "every_nth: %lu dropped_oldest, expected 3", stats.dropped_oldest);
+    CHECK(stats.dropped_newest == 4, "every_nth: %lu dropped_newest, expected 4", stats.dropped_newest);
+    CHECK(stats.high_water_messages == 2, "every_nth: high water %d messages, expected 2", stats.high_water_messages);
+
+    thingsboard_ring_free(ring);
+}
+
+static void* pop_later(void* arg)
+{
+    usleep(20000);
+    expect((thingsboard_ring*)arg, 1, "block");
+
+    return NULL;
+}
+
+// A blocked push gives up after its timeout, or goes through once the consumer makes room
+static void test_block(void)
+{
+    thingsboard_ring* ring = thingsboard_ring_new(TEST_RING_BYTES, 0, THINGSBOARD_OVERFLOW_BLOCK, TEST_BLOCK_MS);
+    thingsboard_outbound_stats stats;
+
+    for (int i = 1; i <= 4; i++) CHECK(push(ring, i) == 0, "block: push %d", i);
+
+    long long start = now_ms();
+    CHECK(push(ring, 5) == 1, "block: push into a full ring accepted");
+    CHECK(now_ms() - start >= TEST_BLOCK_MS - 5, "block: gave up after %lld ms, expected %d", now_ms() - start, TEST_BLOCK_MS);
+
+    pthread_t consumer;
+    pthread_create(&consumer, NULL, pop_later, ring);
+    CHECK(push(ring, 6) == 0, "block: push not let in by the consumer");
+    pthread_join(consumer, NULL);
+
+    thingsboard_ring_stats(ring, &stats);
+    CHECK(stats.timeouts == 1, "block: %lu timeouts, expected 1", stats.timeouts);
+    CHECK(stats.dropped_newest == 0 && stats.dropped_oldest == 0, "block: a blocking ring dropped messages");
+    CHECK(stats.accepted == 5, "block: %lu accepted, expected 5", stats.accepted);
+
+    for (int i = 2; i <= 4; i++) expect(ring, i, "block");
+    expect(ring, 6, "block");
+
+    thingsboard_ring_free(ring);
+}
+
+int main(void)
+{
+    test_wrap();
+    test_drop_oldest();
+    test_every_nth();
+    test_block();
+
+    if (failures == 0) printf("test_ring: ok\n");
+
+    return failures != 0;
+}
@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "thingsboard_store.h"
+
+// On-disk record header: magic, len, crc, kind, sent, reserved, ts
+#define TEST_RECORD_HEADER 24
+// Two segments of THINGSBOARD_STORE_SEGMENT_MIN
+#define TEST_SMALL_STORE (2 * THINGSBOARD_STORE_SEGMENT_MIN)
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)){ fprintf(stderr, "FAIL " __VA_ARGS__); fprintf(stderr, "\n"); failures++; } } while (0)
+
+static void remove_dir(const char* path)
+{
+    DIR* dir = opendir(path);
+    struct dirent* entry;
+    char file[512];
+
+    while (dir && (entry = readdir(dir)) != NULL){
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        unlink(file);
+    }
+    if (dir) closedir(dir);
+    rmdir(path);
+}
+
+static int segment_files(const char* path)
+{
+    DIR* dir = opendir(path);
+    struct dirent* entry;
+    int count = 0;
+
+    while (dir && (entry = readdir(dir)) != NULL)
+        if (strstr(entry->d_name, ".tbq") != NULL) count++;
+    if (dir) closedir(dir);
+
+    return count;
+}
+
+static int append_sample(thingsboard_store* store, long long ts, int value, size_t pad)
+{
+    char data[2048];
+    int len = snprintf(data, sizeof(data), "{\"v\":%d,\"pad\":\"%*s\"}", value, (int)pad, "");
+
+    return thingsboard_store_append(store, THINGSBOARD_STORE_TELEMETRY, ts, data, (size_t)len);
+}
+
+// Finds needle in the only segment file of dir and hands it to edit, which may change the bytes around it
+static bool patch_segment(const char* path, const char* needle, void (*edit)(char* file, char* found))
+{
+    DIR* dir = opendir(path);
+    struct dirent* entry;
+    char file[512] = "";
+
+    while (dir && (entry = readdir(dir)) != NULL)
+        if (strstr(entry->d_name, ".tbq") != NULL) snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+    if (dir) closedir(dir);
+
+    int fd = open(file, O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0){
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    char* bytes = (char*)malloc((size_t)st.st_size);
+    bool done = false;
+    if (bytes != NULL && pread(fd, bytes, (size_t)st.st_size, 0) == st.st_size){
+        char* found = (char*)memmem(bytes, (size_t)st.st_size, needle, strlen(needle));
+        if (found != NULL && found - bytes >= TEST_RECORD_HEADER){
+            edit(bytes, found);
+            done = pwrite(fd, bytes, (size_t)st.st_size, 0) == st.st_size;
+        }
+    }
+
+    free(bytes);
+    close(fd);
+
+    return done;
+}
+
+static void flip_payload(char* file, char* found)
+{
+    (void)file;
+    found[1] ^= 0x01;
+}
+
+static void clear_magic(char* file, char* found)
+{
+    (void)file;
+    memset(found - TEST_RECORD_HEADER, 0, 4);
+}
+
+// Unsent records survive a restart, sent ones are not replayed again
+static void test_reopen(const char* dir)
+{
+    thingsboard_store* store = thingsboard_store_open(dir, 1 << 20);
+    CHECK(store != NULL, "reopen: open");
+    if (store == NULL) return;
+
+    for (int i = 0; i < 3; i++) append_sample(store, 100 + i, i, 0);
+    thingsboard_store_close(store);
+
+    store = thingsboard_store_open(dir, 1 << 20);
+    CHECK(thingsboard_store_depth(store) == 3, "reopen: %ld recovered, expected 3", thingsboard_store_depth(store));
+    CHECK(thingsboard_store_oldest(store) == 100, "reopen: oldest %lld, expected 100", thingsboard_store_oldest(store));
+
+    int kind = -1, count = 0;
+    const char* burst = thingsboard_store_burst(store, &kind, &count);
+    CHECK(burst != NULL && kind == THINGSBOARD_STORE_TELEMETRY && count == 3, "reopen: burst of %d records", count);
+    const char* first = "[{\"ts\":100,\"values\":{\"v\":0,";
+    CHECK(burst != NULL && strncmp(burst, first, strlen(first)) == 0, "reopen: burst %s", burst ? burst : "(null)");
+    thingsboard_store_release(store, 1);
+    thingsboard_store_close(store);
+
+    store = thingsboard_store_open(dir, 1 << 20);
+    CHECK(thingsboard_store_depth(store) == 2, "reopen: %ld left after one was sent, expected 2", thingsboard_store_depth(store));
+    CHECK(thingsboard_store_oldest(store) == 101, "reopen: oldest %lld, expected 101", thingsboard_store_oldest(store));
+    thingsboard_store_close(store);
+}
+
+// Recovery stops at the first record whose CRC does not match
+static void test_bad_crc(const char* dir)
+{
+    thingsboard_store* store = thingsboard_store_open(dir, 1 << 20);
+    CHECK(store != NULL, "crc: open");
+    if (store == NULL) return;
+
+    for (int i = 0; i < 3; i++) append_sample(store, 200 + i, i, 0);
+    thingsboard_store_close(store);
+
+    CHECK(patch_segment(dir, "\"v\":1", flip_payload), "crc: patch");
+
+    store = thingsboard_store_open(dir, 1 << 20);
+    CHECK(thingsboard_store_depth(store) == 1, "crc: %ld recovered, expected 1", thingsboard_store_depth(store));
+    thingsboard_store_close(store);
+}
+
+// A record whose magic never landed is dropped, and appends over it do not bring back the bytes behind it
+static void test_torn_tail(const char* dir)
+{
+    thingsboard_store* store = thingsboard_store_open(dir, 1 << 20);
+    CHECK(store != NULL, "torn: open");
+    if (store == NULL) return;
+
+    for (int i = 0; i < 3; i++) append_sample(store, 300 + i, i, 0);
+    thingsboard_store_close(store);
+
+    CHECK(patch_segment(dir, "\"v\":1", clear_magic), "torn: patch");
+
+    store = thingsboard_store_open(dir, 1 << 20);
+    CHECK(thingsboard_store_depth(store) == 1, "torn: %ld recovered, expected 1", thingsboard_store_depth(store));
+
+    // Exactly as long as the torn record, the intact third one behind it must not resurface
+    append_sample(store, 310, 9, 0);
+    thingsboard_store_close(store);
+
+    store = thingsboard_store_open(dir, 1 << 20);
+    CHECK(thingsboard_store_depth(store) == 2, "torn: %ld after the next append, expected 2", thingsboard_store_depth(store));
+
+    int kind, count = 0;
+    const char* burst = thingsboard_store_burst(store, &kind, &count);
+    CHECK(burst != NULL && strstr(burst, "\"ts\":302") == NULL, "torn: the record behind the torn one came back");
+    CHECK(burst != NULL && strstr(burst, "\"ts\":310") != NULL, "torn: the new record is missing");
+    thingsboard_store_close(store);
+}
+
+// A full store drops its oldest segment and counts the records lost with it
+static void test_full(const char* dir)
+{
+    thingsboard_store* store = thingsboard_store_open(dir, TEST_SMALL_STORE);
+    CHECK(store != NULL, "full: open");
+    if (store == NULL) return;
+
+    // About five segments worth of 1 KB records
+    int appended = 0;
+    for (; appended < 5 * THINGSBOARD_STORE_SEGMENT_MIN / 1024; appended++)
+        CHECK(append_sample(store, 1000 + appended, appended, 1000) == 0, "full: append %d", appended);
+
+    long depth = thingsboard_store_depth(store);
+    unsigned long dropped = thingsboard_store_dropped(store);
+
+    CHECK(dropped > 0, "full: nothing dropped");
+    CHECK(depth + (long)dropped == appended, "full: %ld queued and %lu dropped of %d", depth, dropped, appended);
+    CHECK(thingsboard_store_oldest(store) == 1000 + (long long)dropped, "full: oldest %lld, expected %lld", thingsboard_store_oldest(store), 1000 + (long long)dropped);
+    CHECK(segment_files(dir) <= 2, "full: %d segment files", segment_files(dir));
+
+    thingsboard_store_close(store);
+}
+
+// Releasing a burst whose segment was dropped meanwhile marks nothing, the survivors are sent next
+static void test_release_dropped(const char* dir)
+{
+    thingsboard_store* store = thingsboard_store_open(dir, TEST_SMALL_STORE);
+    CHECK(store != NULL, "release: open");
+    if (store == NULL) return;
+
+    int appended = 0;
+    for (; appended < THINGSBOARD_STORE_SEGMENT_MIN / 1024 + 8; appended++) append_sample(store, 2000 + appended, appended, 1000);
+
+    int kind, count = 0;
+    CHECK(thingsboard_store_burst(store, &kind, &count) != NULL && count > 0, "release: burst");
+
+    // Two more segments push out the one the burst was taken from
+    for (int i = 0; i < 2 * THINGSBOARD_STORE_SEGMENT_MIN / 1024; i++, appended++) append_sample(store, 2000 + appended, appended, 1000);
+    CHECK(thingsboard_store_dropped(store) > 0, "release: nothing dropped");
+
+    long depth = thingsboard_store_depth(store);
+    long long oldest = thingsboard_store_oldest(store);
+    thingsboard_store_release(store, count);
+
+    CHECK(thingsboard_store_depth(store) == depth, "release: depth %ld, expected %ld", thingsboard_store_depth(store), depth);
+    CHECK(thingsboard_store_oldest(store) == oldest, "release: oldest %lld, expected %lld", thingsboard_store_oldest(store), oldest);
+
+    char expected[32];
+    snprintf(expected, sizeof(expected), "[{\"ts\":%lld,", oldest);
+    const char* burst = thingsboard_store_burst(store, &kind, &count);
+    CHECK(burst != NULL && strncmp(burst, expected, strlen(expected)) == 0, "release: next burst does not start at %lld", oldest);
+    thingsboard_store_release(store, count);
+
+    thingsboard_store_close(store);
+}
+
+static void run(void (*test)(const char*))
+{
+    char dir[] = "/tmp/test_store_XXXXXX";
+    if (mkdtemp(dir) == NULL){
+        CHECK(0, "mkdtemp");
+        return;
+    }
+
+    test(dir);
+    remove_dir(dir);
+}
+
+int main(void)
+{
+    run(test_reopen);
+    run(test_bad_crc);
+    run(test_torn_tail);
+    run(test_full);
+    run(test_release_dropped);
+
+    if (failures == 0) printf("test_store: ok\n");
+
+    return failures != 0;
+}